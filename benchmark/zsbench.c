@@ -3,6 +3,7 @@
  */
 
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
@@ -25,10 +26,15 @@ static const char *BENCHMARKS;
 static int NUMRECS = 1000;
 static int new_db = 0;          /* set to 1 if we created a new db */
 static size_t VALLEN = 0;
+static size_t FINALISE = 0;     /* 0 for the library's default */
+static int WRITEMODE = 0;       /* How the active file is written to */
+static enum memtable_type MEMTABLE = MEMTABLE_BTREE;
 
 enum {
         BATCHED,
         NOTBATCHED,
+        GROUPED,                /* BATCHED, with commits sharing a sync */
+        WRITEBATCH,             /* BATCHED, with write batches of 100 */
         SEQUENTIAL,
         RANDOM,
 };
@@ -37,6 +43,9 @@ static struct option long_options[] = {
         {"benchmarks", required_argument, NULL, 'b'},
         {"db", required_argument, NULL, 'd'},
         {"numrecs", optional_argument, NULL, 'n'},
+        {"finalise", required_argument, NULL, 'f'},
+        {"write", required_argument, NULL, 'w'},
+        {"memtable", required_argument, NULL, 'm'},
         {"help", no_argument, NULL, 'h'},
         {NULL, 0, NULL, 0}
 };
@@ -49,19 +58,29 @@ static void usage(const char *progname)
         printf("                       Available benchmarks:\n");
         printf("                       * writeseq       - write values in sequential key order\n");
         printf("                       * writeseqtxn    - write values in sequential key order in separate transactions\n");
+        printf("                       * writeseqgroup  - writeseqtxn, with 64 commits to a sync\n");
+        printf("                       * writeseqbatch  - write values in sequential key order in write batches\n");
         printf("                       * writerandom    - write values in random key order\n");
         printf("                       * writerandomtxn - write values in random key order in separate transactions\n");
         printf("                       * overwriterandom- overwrite values in random key order in separate transactions\n");
         printf("                       * write100k      - write values 100K long in random key order\n");
+        printf("                       * finalisesweep  - writerandom and repack, finalising the active file at 256KB, 2MB, 16MB and 64MB\n");
+        printf("\n");
+        printf("                       * readrandom     - fetch packed records in random key order\n");
+        printf("                       * readrandomeytz - readrandom, with packed file indexes in Eytzinger order\n");
+        printf("                       * readrandomprefix - readrandomeytz, with key prefixes in the indexes\n");
         printf("\n");
         printf("                       * open           - cost of opening a DB\n");
         printf("\n");
         printf("  -d, --db             the db to run the benchmarks on\n");
         printf("  -n, --numrecs        number of records to write[default: 1000]\n");
+        printf("  -f, --finalise       bytes to finalise the active file at[default: 2MB]\n");
+        printf("  -w, --write          how to write to the active file: mmap, pwrite, direct\n                       or uring[default: mmap]\n");
+        printf("  -m, --memtable       what to keep records in memory in: btree or art\n                       [default: btree]\n");
         printf("  -h, --help           display this help and exit\n");
 }
 
-#define ALLBENCHMARKS "writeseq,writeseqtxn,writerandom,writerandomtxn,overwriterandom,write100k,open"
+#define ALLBENCHMARKS "writeseq,writeseqtxn,writeseqgroup,writeseqbatch,writerandom,writerandomtxn,overwriterandom,write100k,finalisesweep,readrandom,readrandomeytz,readrandomprefix,open"
 
 static char *create_tmp_dir_name(void)
 {
@@ -163,13 +182,30 @@ static size_t do_write(int txnmode, int insmode)
         struct zsdb *db = NULL;
         size_t bytes = 0;
         struct zsdb_txn *txn = NULL;
+        struct zsdb_write_batch *batch = NULL;
 
         /* Open Zeroskip DB */
-        ret = zsdb_init(&db, NULL, NULL);
+        ret = zsdb_init_opt(&db, NULL, NULL, MEMTABLE);
         assert(ret == ZS_OK);
-        ret = zsdb_open(db, DBNAME, new_db ? MODE_CREATE : MODE_RDWR);
+        ret = zsdb_open(db, DBNAME,
+                        (new_db ? MODE_CREATE : MODE_RDWR) | WRITEMODE);
         assert(ret == ZS_OK);
 
+        if (FINALISE) {
+                ret = zsdb_finalise_threshold_set(db, FINALISE, 0, 0);
+                assert(ret == ZS_OK);
+        }
+
+        if (txnmode == GROUPED) {
+                ret = zsdb_group_commit_set(db, 0, 0, 64);
+                assert(ret == ZS_OK);
+        }
+
+        if (txnmode == WRITEBATCH) {
+                ret = zsdb_write_batch_new(&batch);
+                assert(ret == ZS_OK);
+        }
+
         zsdb_write_lock_acquire(db, 0);
 
         for (i = 0; i < NUMRECS; i++) {
@@ -185,7 +221,23 @@ static size_t do_write(int txnmode, int insmode)
                 vallen = VALLEN ? VALLEN : keylen * 2;
                 val = random_string(vallen);
 
-                if (txnmode == BATCHED) {
+                if (txnmode == WRITEBATCH) {
+                        ret = zsdb_write_batch_add(batch, (unsigned char *)key,
+                                                   keylen, (unsigned char *)val,
+                                                   vallen);
+                        assert(ret == ZS_OK);
+                        bytes += (keylen + vallen);
+
+                        if (zsdb_write_batch_count(batch) == 100 ||
+                            i == NUMRECS - 1) {
+                                ret = zsdb_write_batch_apply(db, batch);
+                                assert(ret == ZS_OK);
+                                zsdb_write_batch_clear(batch);
+                        }
+                        continue;
+                }
+
+                if (txnmode != NOTBATCHED) {
                         ret = zsdb_transaction_begin(db, &txn);
                         assert(ret == ZS_OK);
                 }
@@ -196,7 +248,7 @@ static size_t do_write(int txnmode, int insmode)
                 assert(ret == ZS_OK);
                 bytes += (keylen + vallen);
 
-                if (txnmode == BATCHED) {
+                if (txnmode != NOTBATCHED) {
                         ret = zsdb_commit(db, &txn);
                         assert(ret == ZS_OK);
                 }
@@ -207,6 +259,8 @@ static size_t do_write(int txnmode, int insmode)
         if (txnmode == NOTBATCHED)
                 zsdb_commit(db, NULL);
 
+        zsdb_write_batch_free(&batch);
+
         /* Close Zeroskip DB */
         ret = zsdb_close(db);
         assert(ret == ZS_OK);
@@ -216,15 +270,195 @@ static size_t do_write(int txnmode, int insmode)
         return bytes;
 }
 
+/* The number of files the DB is made up of */
+static int count_db_files(void)
+{
+        struct dirent *de;
+        int count = 0;
+        DIR *dir;
+
+        dir = opendir(DBNAME);
+        assert(dir != NULL);
+
+        while ((de = readdir(dir)) != NULL) {
+                if (strncmp(de->d_name, "zeroskip-", 9) == 0)
+                        count++;
+        }
+
+        closedir(dir);
+
+        return count;
+}
+
+/* Pack the DB, and return the time it took in μs */
+static uint64_t do_repack(void)
+{
+        struct zsdb *db = NULL;
+        uint64_t start, finish;
+        int ret;
+
+        ret = zsdb_init_opt(&db, NULL, NULL, MEMTABLE);
+        assert(ret == ZS_OK);
+        ret = zsdb_open(db, DBNAME, MODE_RDWR | WRITEMODE);
+        assert(ret == ZS_OK);
+
+        start = get_time_now();
+
+        ret = zsdb_pack_lock_acquire(db, 0);
+        assert(ret == ZS_OK);
+        ret = zsdb_repack(db);
+        assert(ret == ZS_OK);
+        zsdb_pack_lock_release(db);
+
+        finish = get_time_now();
+
+        ret = zsdb_close(db);
+        assert(ret == ZS_OK);
+        zsdb_final(&db);
+
+        return finish - start;
+}
+
+/* writerandom into a new DB, and pack it, for a few finalise thresholds */
+static void do_finalise_sweep(void)
+{
+        static const size_t sizes[] = { 256 << 10, 2 << 20, 16 << 20,
+                                        64 << 20 };
+        size_t saved = FINALISE;
+        size_t i;
+
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+                uint64_t start, finish, packed;
+                size_t bytes;
+                int files;
+
+                cleanup_db_dir();
+                FINALISE = sizes[i];
+
+                start = get_time_now();
+                bytes = do_write(NOTBATCHED, RANDOM);
+                finish = get_time_now();
+
+                files = count_db_files();
+                packed = do_repack();
+
+                fprintf(stderr, "finalisesweep   : %zu bytes written in %" PRIu64 " μs, finalising at %zu bytes, to %d files, packed in %" PRIu64 " μs.\n",
+                        bytes, (finish - start), sizes[i], files, packed);
+        }
+
+        FINALISE = saved;
+}
+
+/* Write NUMRECS records in sequential key order, and pack them */
+static void do_fill_packed(void)
+{
+        int i;
+        int ret;
+        struct zsdb *db = NULL;
+        struct zsdb_txn *txn = NULL;
+
+        ret = zsdb_init_opt(&db, NULL, NULL, MEMTABLE);
+        assert(ret == ZS_OK);
+        ret = zsdb_open(db, DBNAME, MODE_CREATE | WRITEMODE);
+        assert(ret == ZS_OK);
+
+        zsdb_write_lock_acquire(db, 0);
+
+        for (i = 0; i < NUMRECS; i++) {
+                char key[100];
+                size_t keylen, vallen;
+                char *val;
+
+                snprintf(key, sizeof(key), "%016d", i);
+                keylen = strlen(key);
+                vallen = VALLEN ? VALLEN : keylen * 2;
+                val = random_string(vallen);
+
+                ret = zsdb_add(db, (unsigned char *)key, keylen,
+                               (unsigned char *)val, vallen, &txn);
+                assert(ret == ZS_OK);
+                xfree(val);
+
+                /* A single finalised file isn't packed */
+                if (i == NUMRECS / 2 || i == NUMRECS - 1) {
+                        ret = zsdb_commit(db, &txn);
+                        assert(ret == ZS_OK);
+                        ret = zsdb_finalise(db);
+                        assert(ret == ZS_OK);
+                }
+        }
+
+        zsdb_write_lock_release(db);
+
+        ret = zsdb_close(db);
+        assert(ret == ZS_OK);
+        zsdb_final(&db);
+
+        ret = zsdb_init_opt(&db, NULL, NULL, MEMTABLE);
+        assert(ret == ZS_OK);
+        ret = zsdb_open(db, DBNAME, MODE_RDWR | WRITEMODE);
+        assert(ret == ZS_OK);
+
+        ret = zsdb_pack_lock_acquire(db, 0);
+        assert(ret == ZS_OK);
+        ret = zsdb_repack(db);
+        assert(ret == ZS_OK);
+        zsdb_pack_lock_release(db);
+
+        ret = zsdb_close(db);
+        assert(ret == ZS_OK);
+        zsdb_final(&db);
+}
+
+/* Fetch NUMRECS keys in random order, and return the time it took in μs,
+ * not counting the time to open the DB. */
+static uint64_t do_read(int mode, size_t *found)
+{
+        int i;
+        int ret;
+        struct zsdb *db = NULL;
+        uint64_t start, finish;
+
+        ret = zsdb_init_opt(&db, NULL, NULL, MEMTABLE);
+        assert(ret == ZS_OK);
+        ret = zsdb_open(db, DBNAME, mode | WRITEMODE);
+        assert(ret == ZS_OK);
+
+        *found = 0;
+        start = get_time_now();
+
+        for (i = 0; i < NUMRECS; i++) {
+                char key[100];
+                const unsigned char *val;
+                size_t vallen;
+
+                snprintf(key, sizeof(key), "%016d", rand() % NUMRECS);
+
+                ret = zsdb_fetch(db, (unsigned char *)key, strlen(key),
+                                 &val, &vallen, NULL);
+                if (ret == ZS_OK)
+                        (*found)++;
+        }
+
+        finish = get_time_now();
+
+        ret = zsdb_close(db);
+        assert(ret == ZS_OK);
+        zsdb_final(&db);
+
+        return finish - start;
+}
+
 static void do_open(int num_iters)
 {
         struct zsdb *db = NULL;
         int ret, j;
 
         for (j = 0; j < num_iters; j++) {
-                ret = zsdb_init(&db, NULL, NULL);
+                ret = zsdb_init_opt(&db, NULL, NULL, MEMTABLE);
                 assert(ret == ZS_OK);
-                ret = zsdb_open(db, DBNAME, new_db ? MODE_CREATE : MODE_RDWR);
+                ret = zsdb_open(db, DBNAME,
+                        (new_db ? MODE_CREATE : MODE_RDWR) | WRITEMODE);
                 assert(ret == ZS_OK);
                 ret = zsdb_close(db);
                 assert(ret == ZS_OK);
@@ -238,7 +472,7 @@ static int parse_options(int argc, char **argv, const struct option *options)
         int option;
         int option_index;
 
-        while ((option = getopt_long(argc, argv, "d:b:h?",
+        while ((option = getopt_long(argc, argv, "d:b:n:f:w:m:h?",
                                      long_options, &option_index)) != -1) {
                 switch (option) {
                 case 'b':
@@ -250,6 +484,29 @@ static int parse_options(int argc, char **argv, const struct option *options)
                 case 'n':
                         NUMRECS = atoi(optarg);
                         break;
+                case 'f':
+                        FINALISE = strtoul(optarg, NULL, 10);
+                        break;
+                case 'w':
+                        if (strcmp(optarg, "pwrite") == 0) {
+                                WRITEMODE = MODE_PWRITE;
+                        } else if (strcmp(optarg, "direct") == 0) {
+                                WRITEMODE = MODE_DIRECT;
+                        } else if (strcmp(optarg, "uring") == 0) {
+                                WRITEMODE = MODE_URING;
+                        } else if (strcmp(optarg, "mmap") != 0) {
+                                usage(basename(argv[0]));
+                                exit(1);
+                        }
+                        break;
+                case 'm':
+                        if (strcmp(optarg, "art") == 0) {
+                                MEMTABLE = MEMTABLE_ART;
+                        } else if (strcmp(optarg, "btree") != 0) {
+                                usage(basename(argv[0]));
+                                exit(1);
+                        }
+                        break;
                 case 'h':
                 case '?':
                         usage(basename(argv[0]));
@@ -288,6 +545,20 @@ static int run_benchmarks(void)
 
                         fprintf(stderr, "writeseqtxn     : %zu bytes written in %" PRIu64 " μs.\n",
                                 bytes, (finish - start));
+                } else if (strcmp(benchmarks.datav[i], "writeseqbatch") == 0) {
+                        start = get_time_now();
+                        bytes = do_write(WRITEBATCH, SEQUENTIAL);
+                        finish = get_time_now();
+
+                        fprintf(stderr, "writeseqbatch   : %zu bytes written in %" PRIu64 " μs.\n",
+                                bytes, (finish - start));
+                } else if (strcmp(benchmarks.datav[i], "writeseqgroup") == 0) {
+                        start = get_time_now();
+                        bytes = do_write(GROUPED, SEQUENTIAL);
+                        finish = get_time_now();
+
+                        fprintf(stderr, "writeseqgroup   : %zu bytes written in %" PRIu64 " μs.\n",
+                                bytes, (finish - start));
                 } else if (strcmp(benchmarks.datav[i], "writerandom") == 0) {
                         start = get_time_now();
                         bytes = do_write(NOTBATCHED, RANDOM);
@@ -321,6 +592,38 @@ static int run_benchmarks(void)
                         fprintf(stderr, "write100k       : %zu bytes written in %" PRIu64 " μs.\n",
                                 bytes, (finish - start));
                         VALLEN = 0;
+                } else if (strcmp(benchmarks.datav[i], "finalisesweep") == 0) {
+                        if (new_db)
+                                do_finalise_sweep();
+                        else
+                                fprintf(stderr, "finalisesweep   : needs a new DB\n");
+                } else if (strcmp(benchmarks.datav[i], "readrandom") == 0) {
+                        uint64_t elapsed;
+
+                        if (new_db)
+                                do_fill_packed();
+                        elapsed = do_read(MODE_RDWR, &bytes);
+
+                        fprintf(stderr, "readrandom      : %zu of %d records found in %" PRIu64 " μs.\n",
+                                bytes, NUMRECS, elapsed);
+                } else if (strcmp(benchmarks.datav[i], "readrandomeytz") == 0) {
+                        uint64_t elapsed;
+
+                        if (new_db)
+                                do_fill_packed();
+                        elapsed = do_read(MODE_EYTZINGER, &bytes);
+
+                        fprintf(stderr, "readrandomeytz  : %zu of %d records found in %" PRIu64 " μs.\n",
+                                bytes, NUMRECS, elapsed);
+                } else if (strcmp(benchmarks.datav[i], "readrandomprefix") == 0) {
+                        uint64_t elapsed;
+
+                        if (new_db)
+                                do_fill_packed();
+                        elapsed = do_read(MODE_KEYPREFIX, &bytes);
+
+                        fprintf(stderr, "readrandomprefix: %zu of %d records found in %" PRIu64 " μs.\n",
+                                bytes, NUMRECS, elapsed);
                 } else if (strcmp(benchmarks.datav[i], "open") == 0) {
                         int NUM = 1000;
 
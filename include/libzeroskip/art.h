@@ -0,0 +1,105 @@
+/*
+ * art.h
+ *
+ * An adaptive radix tree of records, ordered as memtree_memcmp_raw() orders
+ * them, to hold the in-memory data.
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#ifndef _ART_H_
+#define _ART_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <libzeroskip/macros.h>
+#include <libzeroskip/memtree.h>
+
+CPP_GUARD_START
+
+/* The most nodes an iterator keeps the path to its record through. It
+ * finds its way back from the root, by key, when a path is deeper. */
+#define ART_ITER_DEPTH 32
+
+struct arena;
+
+struct art {
+        void *root;             /* A node, or a record, told apart by the
+                                   lowest bit of the pointer */
+        size_t count;
+        size_t size;            /* Bytes taken up by the records */
+
+        struct arena *arena;    /* The nodes, and the records */
+};
+
+struct art_iter_frame {
+        void *node;
+        uint32_t depth;         /* Of the node's compressed path in keys */
+        int32_t pos;            /* Of the child that is being walked, or
+                                   -1 for the node's own record */
+};
+
+struct art_iter {
+        struct art *tree;
+        struct record *next;    /* What art_next() returns */
+        unsigned int top;       /* Frames in use */
+        int dropped;            /* Frames from the root were let go */
+        struct art_iter_frame frames[ART_ITER_DEPTH];
+
+        struct record *record;
+};
+
+typedef struct art_iter art_iter_t[1];
+
+/* art_new():
+ * Creates an empty tree.
+ */
+struct art *art_new(void);
+
+/* art_free():
+ * Frees the tree, with its records.
+ */
+void art_free(struct art *tree);
+
+/* art_upsert():
+ * Sets the value of a key, adding a record for it if it isn't in the tree.
+ * The value of an existing record is overwritten where it is, when there
+ * is room for it, rather than the record being replaced.
+ * Returns:
+ *   On Success - returns MEMTREE_OK
+ *   On Failure - returns non 0
+ */
+int art_upsert(struct art *tree,
+               const unsigned char *key, size_t keylen,
+               const unsigned char *val, size_t vallen,
+               int deleted);
+
+/* art_find():
+ * The record of `key`, or NULL if it isn't in the tree.
+ */
+struct record *art_find(struct art *tree, const unsigned char *key,
+                        size_t keylen);
+
+/* art_seek():
+ * Positions `iter` at `key`, or at the first key after it, when it isn't
+ * in the tree.
+ * Return value:
+ *  On Success: returns 1 with iter->record containing the match
+ *  On Failure: returns 0, with iter->record the record after `key`, or NULL
+ */
+int art_seek(struct art *tree, const unsigned char *key, size_t keylen,
+             art_iter_t iter);
+
+int art_begin(struct art *tree, art_iter_t iter);
+int art_next(art_iter_t iter);
+int art_walk_forward(struct art *tree, memtree_action_cb_t action,
+                     void *data);
+
+CPP_GUARD_END
+
+#endif  /* _ART_H_ */
@@ -30,6 +30,7 @@
 #define _hidden_          __attribute__((visibility("hidden")))
 #define _likely_(x)       (__builtin_expect(!!(x),1))
 #define _unlikely_(x)     (__builtin_expect(!!(x),0))
+#define _prefetch_(x)     __builtin_prefetch(x)
 
 #if __GNUC__ >= 7
 #define _fallthrough_     __attribute__((fallthrough))
@@ -0,0 +1,152 @@
+/*
+ * memtable.h
+ *
+ * The in-memory data of zeroskip, in one of the trees it can be kept in.
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#ifndef _MEMTABLE_H_
+#define _MEMTABLE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <libzeroskip/macros.h>
+#include <libzeroskip/memtree.h>
+#include <libzeroskip/art.h>
+
+CPP_GUARD_START
+
+/* What a memtable keeps its records in. The adaptive radix tree only
+ * orders keys as memtree_memcmp_raw() does. */
+enum memtable_type {
+        MEMTABLE_BTREE = 0,     /* A memtree */
+        MEMTABLE_ART   = 1,     /* An adaptive radix tree */
+};
+
+struct memtable {
+        enum memtable_type type;
+        union {
+                struct memtree *btree;
+                struct art *art;
+        } u;
+};
+
+struct memtable_iter {
+        enum memtable_type type;
+        union {
+                memtree_iter_t btree;
+                art_iter_t art;
+        } u;
+
+        struct record *record;
+};
+
+typedef struct memtable_iter memtable_iter_t[1];
+
+/* Records on their way into a memtable, from memtable_loader_add() */
+struct memtable_loader {
+        struct memtable *table;
+        struct memtree_loader btree;
+};
+
+/* memtable_new():
+ * Creates an empty memtable of `type`, whose keys are ordered by `search`,
+ * or memtree_memcmp_raw() if it is NULL. MEMTABLE_ART can't be ordered any
+ * other way, and NULL is returned if it is asked to.
+ */
+struct memtable *memtable_new(enum memtable_type type,
+                              memtree_search_cb_t search);
+
+/* memtable_free():
+ * Frees the memtable, with its records.
+ */
+void memtable_free(struct memtable *table);
+
+/* memtable_count():
+ * How many records there are in the memtable.
+ */
+size_t memtable_count(const struct memtable *table);
+
+/* memtable_size():
+ * The bytes the records in the memtable take up.
+ */
+size_t memtable_size(const struct memtable *table);
+
+/* memtable_upsert():
+ * Sets the value of a key, adding a record for it if it isn't in the
+ * memtable.
+ * Returns:
+ *   On Success - returns MEMTREE_OK
+ *   On Failure - returns non 0
+ */
+int memtable_upsert(struct memtable *table,
+                    const unsigned char *key, size_t keylen,
+                    const unsigned char *val, size_t vallen,
+                    int deleted);
+
+/* memtable_find():
+ * The record of `key`, or NULL if it isn't in the memtable.
+ */
+struct record *memtable_find(struct memtable *table, const unsigned char *key,
+                             size_t keylen);
+
+/* memtable_seek():
+ * Positions `iter` at `key`, or at the first key after it.
+ * Return value:
+ *  On Success: returns 1 with iter->record containing the match
+ *  On Failure: returns 0, with iter->record the record after `key`, or NULL
+ */
+int memtable_seek(struct memtable *table, const unsigned char *key,
+                  size_t keylen, memtable_iter_t iter);
+
+/* memtable_begin():
+ * Positions `iter` at the first record, which iter->record is set to.
+ * Returns 0 if the memtable is empty.
+ */
+int memtable_begin(struct memtable *table, memtable_iter_t iter);
+
+/* memtable_next():
+ * Sets iter->record to the record `iter` is at, and moves it on to the next
+ * one. Returns 0 once it is past the last record.
+ */
+int memtable_next(memtable_iter_t iter);
+
+/* memtable_walk_forward():
+ * Calls `action` for each record, in order.
+ */
+int memtable_walk_forward(struct memtable *table, memtree_action_cb_t action,
+                          void *data);
+
+/* memtable_loader_init():
+ * Starts loading the memtable, which has to be empty, with
+ * memtable_loader_add() and memtable_loader_finish(). A memtree is built
+ * with memtree_bulk_load(), and other tables have the records inserted as
+ * they come.
+ */
+void memtable_loader_init(struct memtable_loader *loader,
+                          struct memtable *table);
+
+/* memtable_loader_add():
+ * Adds a record for `key`, which replaces any before it with the same key.
+ */
+int memtable_loader_add(struct memtable_loader *loader,
+                        const unsigned char *key, size_t keylen,
+                        const unsigned char *val, size_t vallen,
+                        int deleted);
+
+/* memtable_loader_finish():
+ * Returns:
+ *   On Success - returns MEMTREE_OK
+ *   On Failure - returns non 0
+ */
+int memtable_loader_finish(struct memtable_loader *loader);
+
+CPP_GUARD_END
+
+#endif  /* _MEMTABLE_H_ */
@@ -20,7 +20,12 @@
 
 CPP_GUARD_START
 
-#define MEMTREE_MAX_ELEMENTS 10
+/* The most records a node has. It is compiled in, and the library and what
+ * uses it have to agree on it. 62 is what fills the arena blocks both leaf
+ * and internal nodes are allocated from. */
+#ifndef MEMTREE_MAX_ELEMENTS
+#define MEMTREE_MAX_ELEMENTS 62
+#endif
 #define MEMTREE_MIN_ELEMENTS (MEMTREE_MAX_ELEMENTS >> 1)
 
 enum NodeType {
@@ -37,12 +42,14 @@ enum {
         MEMTREE_NOT_FOUND      = -4,
 };
 
+/* The key and value of a record follow it, in the same allocation */
 struct record {
         unsigned char *key;
         size_t keylen;
         unsigned char *val;
         size_t vallen;
         int deleted;
+        int inarena;            /* From memtree_record_new() */
 };
 
 struct memtree_node {
@@ -53,6 +60,12 @@ struct memtree_node {
 
         uint32_t pos;
 
+        /* All the keys in the node start with the same `skip` bytes. The
+           8 bytes after those are kept for each key, big endian, to search
+           the node without going to the records. */
+        uint32_t skip;
+        uint64_t prefix[MEMTREE_MAX_ELEMENTS];
+
         struct record *recs[MEMTREE_MAX_ELEMENTS];
 
         struct memtree_node *branches[];
@@ -78,9 +91,16 @@ typedef unsigned int (*memtree_search_cb_t)(const unsigned char *key,
                                             unsigned int count,
                                             int *found);
 
+struct arena;
+
 struct memtree {
         struct memtree_node *root;
         size_t count;
+        size_t size;            /* Bytes taken up by the records */
+
+        struct arena *arena;    /* The nodes, and the records from
+                                   memtree_record_new() */
+        int heaprecs;           /* Records from record_new() were added */
 
         memtree_action_cb_t destroy;
         void *destroy_data;
@@ -88,6 +108,16 @@ struct memtree {
         memtree_search_cb_t search;
 };
 
+/* Records on their way to memtree_bulk_load(), from memtree_loader_add() */
+struct memtree_loader {
+        struct memtree *tree;
+        struct record **recs;
+        size_t count;
+        size_t alloc;
+        size_t runs;            /* Of sorted records, in `recs` */
+        int direct;             /* The records are inserted as they come */
+};
+
 /* memtree_new():
  * Creates a new memtree. Takes two arguments for callbacks.
  * They can be NULL, in which case, it defaults to using the default delete
@@ -95,6 +125,11 @@ struct memtree {
  */
 struct memtree *memtree_new(memtree_action_cb_t destroy, memtree_search_cb_t search);
 
+/* memtree_free():
+ * Frees the tree. Its nodes, and the records allocated from it, go all at
+ * once with its arena, without walking the tree, unless it has records from
+ * record_new() or a `destroy` callback.
+ */
 void memtree_free(struct memtree *tree);
 
 /* memtree_insert_opt():
@@ -123,6 +158,58 @@ static inline int memtree_replace(struct memtree *tree, struct record *record)
         return memtree_insert_opt(tree, record, 1);
 }
 
+/* memtree_upsert():
+ * Sets the value of a key, inserting a record for it if it isn't in the
+ * tree. An existing record has its value overwritten where it is, when
+ * there is room for it, rather than being replaced.
+ * Returns:
+ *   On Success - returns MEMTREE_OK
+ *   On Failure - returns non 0
+ */
+int memtree_upsert(struct memtree *tree,
+                   const unsigned char *key, size_t keylen,
+                   const unsigned char *val, size_t vallen,
+                   int deleted);
+
+/* memtree_bulk_load():
+ * Builds the tree, which has to be empty, from `count` records, much
+ * faster than they would be inserted one by one, when they are in a few
+ * sorted runs: records that are already sorted are gone over once. Records
+ * in more runs than it is worth merging are inserted one by one. Where
+ * records have the same key, the one that comes last in `recs` is kept,
+ * and the others are freed. The tree takes the records, and `recs` is left
+ * in no particular order.
+ * Returns:
+ *   On Success - returns MEMTREE_OK
+ *   On Failure - returns non 0
+ */
+int memtree_bulk_load(struct memtree *tree, struct record **recs,
+                      size_t count);
+
+/* memtree_loader_init():
+ * Starts loading the tree, which has to be empty, with
+ * memtree_loader_add() and memtree_loader_finish().
+ */
+void memtree_loader_init(struct memtree_loader *loader, struct memtree *tree);
+
+/* memtree_loader_add():
+ * Adds a record for `key`, which replaces any before it with the same key.
+ * The records are kept for memtree_bulk_load() while they come in a few
+ * sorted runs, and are inserted as they come once there are too many.
+ */
+int memtree_loader_add(struct memtree_loader *loader,
+                       const unsigned char *key, size_t keylen,
+                       const unsigned char *val, size_t vallen,
+                       int deleted);
+
+/* memtree_loader_finish():
+ * Builds the tree from the records that have been added.
+ * Returns:
+ *   On Success - returns MEMTREE_OK
+ *   On Failure - returns non 0
+ */
+int memtree_loader_finish(struct memtree_loader *loader);
+
 
 /* memtree_insert_at():
  * Insert a record before the one pointed to by iter
@@ -238,6 +325,15 @@ struct record * record_new(const unsigned char *key, size_t keylen,
                            int deleted);
 void record_free(struct record *record);
 
+/* memtree_record_new():
+ * A record allocated from the arena of `tree`, which it can only be added
+ * to. It is freed when it is replaced or removed, or with the tree.
+ */
+struct record *memtree_record_new(struct memtree *tree,
+                                  const unsigned char *key, size_t keylen,
+                                  const unsigned char *val, size_t vallen,
+                                  int deleted);
+
 CPP_GUARD_END
 
 #endif  /* _MEMTREE_H_ */
@@ -20,6 +20,8 @@
 
 CPP_GUARD_START
 
+struct uring;
+
 struct mfile {
         char *filename;
         int fd;
@@ -28,11 +30,23 @@ struct mfile {
         unsigned int compute_crc;
         uint32_t crc32;
         uint64_t crc32_begin_offset;
+        uint64_t crc32_offset;  /* Where what `crc32` covers ends */
         uint64_t crc32_data_len;
         uint64_t size;
         uint64_t offset;
         uint32_t flags;         /* flags passed into the mfile api */
         int mflags;             /* flags parsed into what mmap() understands */
+        uint64_t alloc;         /* The size of the file on disk, which can
+                                   be more than `size` while it is written */
+        uint64_t maplen;        /* The length of the mapping */
+        unsigned char *wbuf;    /* With MFILE_PWRITE, what is written at */
+        uint64_t wbuf_start;    /* `wbuf_start`, before it is written out */
+        uint64_t wbuf_len;
+        uint64_t wbuf_written;  /* How much of `wbuf` is in the file */
+        uint64_t wbuf_alloc;
+        unsigned char *wbuf_spare; /* With MFILE_URING, what is being */
+        uint64_t wbuf_spare_alloc; /* written while `wbuf` is filled */
+        struct uring *ring;
 };
 
 enum {
@@ -43,6 +57,9 @@ enum {
         MFILE_WR_CR  = (MFILE_WR | MFILE_CREATE),
         MFILE_RW_CR  = (MFILE_RW | MFILE_CREATE),
         MFILE_EXCL   = 0x00000040,
+        MFILE_PWRITE = 0x00000100, /* Buffer writes, and pwrite() them */
+        MFILE_DIRECT = 0x00000200, /* MFILE_PWRITE, with O_DIRECT */
+        MFILE_URING  = 0x00000400, /* MFILE_PWRITE, through io_uring */
 };
 
 extern int mfile_open(const char *fname, uint32_t flags,
@@ -62,7 +79,12 @@ extern int mfile_write_iov(struct mfile **mfp,
 extern int mfile_size(struct mfile **mfp, uint64_t *psize);
 extern int mfile_stat(struct mfile **mfp, struct stat *stbuf);
 extern int mfile_truncate(struct mfile **mfp, uint64_t len);
+extern int mfile_trim(struct mfile **mfp);
+extern int mfile_write_out(struct mfile **mfp);
 extern int mfile_flush(struct mfile **mfp);
+extern int mfile_flush_range(struct mfile **mfp, uint64_t offset,
+                             uint64_t len);
+extern int mfile_willneed(struct mfile **mfp);
 extern int mfile_seek(struct mfile **mfp, uint64_t offset,
                            uint64_t *newoffset);
 
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #ifdef LINUX
 #include <endian.h>
@@ -100,10 +101,10 @@ static inline uint64_t bswap64(uint64_t val)
 #define write_be32(p, v)   do { *(uint32_t *)(p) = hton32(v); } while(0)
 #define write_be64(p, v)   do { *(uint64_t *)(p) = hton64(v); } while(0)
 
-#define read_be8(p)        ntoh8(*(uint8_t *)(p))
-#define read_be16(p)       ntoh16(*(uint16_t *)(p))
-#define read_be32(p)       ntoh32(*(uint32_t *)(p))
-#define read_be64(p)       ntoh64(*(uint64_t *)(p))
+#define read_be8(p)        ntoh8(*(const uint8_t *)(p))
+#define read_be16(p)       ntoh16(*(const uint16_t *)(p))
+#define read_be32(p)       ntoh32(*(const uint32_t *)(p))
+#define read_be64(p)       ntoh64(*(const uint64_t *)(p))
 
 /*
  * ARRAY_SIZE - get the number of elements in a visible array
@@ -194,6 +195,17 @@ static inline size_t st_mult(size_t a, size_t b)
         return a * b;
 }
 
+/* iov_set():
+ * Points `iov` at `len` bytes of `buf`. writev() and friends only ever read
+ * what an iovec points at, but struct iovec has no const, so this is where
+ * it is dropped.
+ */
+static inline void iov_set(struct iovec *iov, const void *buf, size_t len)
+{
+        iov->iov_base = (void *)(uintptr_t)buf;
+        iov->iov_len = len;
+}
+
 
 int file_change_mode_rw(const char *path);
 bool_t file_exists(const char *file);
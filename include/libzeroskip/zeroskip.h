@@ -10,7 +10,7 @@
 #define _ZEROSKIP_H_
 
 #include <libzeroskip/macros.h>
-#include <libzeroskip/memtree.h>
+#include <libzeroskip/memtable.h>
 
 #include <stdio.h>
 #include <stdint.h>
@@ -25,6 +25,26 @@ typedef enum {
 #define MODE_RDWR         0           /* Open for reading/writing */
 #define MODE_CREATE       1           /* Mode for creating */
 #define MODE_CUSTOMSEARCH 2           /* Use custom search function */
+#define MODE_FENCEINDEX   4           /* Keep a sparse in-memory index of
+                                         the keys in packed files */
+#define MODE_EYTZINGER    8           /* Search the in-memory index of
+                                         packed files in Eytzinger order */
+#define MODE_KEYPREFIX    16          /* Like MODE_EYTZINGER, with 8 byte
+                                         key prefixes in the index */
+#define MODE_FASTCOMMIT   32          /* Don't rewrite .zsdb on every
+                                         commit */
+#define MODE_SYNC_COMMIT  64          /* Sync only the pages each commit
+                                         wrote to, instead of the whole
+                                         active file */
+#define MODE_SYNC_NONE    128         /* Don't sync on commit */
+#define MODE_PWRITE       256         /* Buffer writes to the active file,
+                                         and pwrite() them on commit,
+                                         instead of writing to its mapping */
+#define MODE_DIRECT       512         /* MODE_PWRITE, with O_DIRECT where
+                                         the filesystem allows it */
+#define MODE_URING        1024        /* MODE_PWRITE, through io_uring
+                                         where the kernel has it, so that
+                                         writes and syncs are queued */
 
 /* Return codes */
 enum {
@@ -56,6 +76,9 @@ enum {
 /* Transactions */
 struct zsdb_txn;
 
+/* Write batches */
+struct zsdb_write_batch;
+
 /* DB Iterator */
 struct zsbd_iter;
 
@@ -82,11 +105,29 @@ struct zsdb {
         void *priv;                 /* Private */
 };
 
+/*
+ * Statistics of the cache of packed file lookups
+ */
+struct zsdb_cache_stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t entries;
+        uint64_t size;              /* Bytes used */
+        uint64_t maxsize;           /* Bytes allowed, 0 if there's no cache */
+};
+
 /*
  * Zeroskip API
  */
 extern int zsdb_init(struct zsdb **pdb, zsdb_cmp_fn dbcmpfn,
                      memtree_search_cb_t btcmpfn);
+/* Like zsdb_init(), with the records in memory kept in a memtable of
+ * `memtable_type`. MEMTABLE_ART adds and finds keys faster, but is slower
+ * to iterate over, and can't be given a `btcmpfn` other than
+ * memtree_memcmp_raw(). */
+extern int zsdb_init_opt(struct zsdb **pdb, zsdb_cmp_fn dbcmpfn,
+                         memtree_search_cb_t btcmpfn,
+                         enum memtable_type memtable_type);
 extern void zsdb_final(struct zsdb **pdb);
 extern int zsdb_open(struct zsdb *db, const char *dbdir, int mode);
 extern int zsdb_close(struct zsdb *db);
@@ -99,6 +140,10 @@ extern int zsdb_commit(struct zsdb *db, struct zsdb_txn **txn);
 extern int zsdb_fetch(struct zsdb *db, const unsigned char *key, size_t keylen,
                       const unsigned char **value, size_t *vallen,
                       struct zsdb_txn **txn);
+extern int zsdb_fetch_multi(struct zsdb *db, const unsigned char **keys,
+                            const size_t *keylens, size_t n,
+                            const unsigned char **values, size_t *vallens,
+                            int *rc, struct zsdb_txn **txn);
 extern int zsdb_fetchnext(struct zsdb *db,
                           const unsigned char *key, size_t keylen,
                           const unsigned char **found, size_t *foundlen,
@@ -118,6 +163,31 @@ extern int zsdb_repack(struct zsdb *db);
 extern int zsdb_info(struct zsdb *db);
 extern int zsdb_finalise(struct zsdb *db);
 
+/* cache of packed file lookups */
+extern int zsdb_cache_set_size(struct zsdb *db, size_t maxsize);
+extern int zsdb_cache_stats(struct zsdb *db, struct zsdb_cache_stats *stats);
+
+/* when zsdb_add() finalises the active file */
+extern int zsdb_finalise_threshold_set(struct zsdb *db, size_t maxbytes,
+                                       size_t maxrecords, size_t maxmemory);
+
+/* write batches */
+extern int zsdb_write_batch_new(struct zsdb_write_batch **pbatch);
+extern void zsdb_write_batch_free(struct zsdb_write_batch **pbatch);
+extern void zsdb_write_batch_clear(struct zsdb_write_batch *batch);
+extern int zsdb_write_batch_add(struct zsdb_write_batch *batch,
+                                const unsigned char *key, size_t keylen,
+                                const unsigned char *value, size_t vallen);
+extern int zsdb_write_batch_remove(struct zsdb_write_batch *batch,
+                                   const unsigned char *key, size_t keylen);
+extern size_t zsdb_write_batch_count(struct zsdb_write_batch *batch);
+extern int zsdb_write_batch_apply(struct zsdb *db,
+                                  struct zsdb_write_batch *batch);
+
+/* group commit */
+extern int zsdb_group_commit_set(struct zsdb *db, long window_ms,
+                                 size_t maxbytes, size_t maxcount);
+
 extern int zsdb_transaction_begin(struct zsdb *db, struct zsdb_txn **txn);
 extern void zsdb_transaction_end(struct zsdb_txn **txn);
 
@@ -0,0 +1,186 @@
+/*
+ * arena.c
+ *
+ * An arena of size classed blocks, which are all freed at once
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include "arena.h"
+#include <libzeroskip/util.h>
+
+#include <assert.h>
+#include <string.h>
+
+/* Chunks, and blocks bigger than ARENA_MAX_BLOCK, start with this, which
+ * keeps what follows it 16 byte aligned */
+struct arena_chunk {
+        struct arena_chunk *next;
+        struct arena_chunk *prev;
+};
+
+/**
+ * Private functions
+ */
+
+/* The size class of `size` bytes, and the size of its blocks. Sizes up to
+ * 128 bytes go up in steps of 16, and there are four classes for every
+ * doubling after that, so that no more than a quarter of a block is
+ * wasted. */
+static unsigned int arena_class(size_t size, size_t *bsize)
+{
+        unsigned int bit;
+        size_t step;
+
+        if (size <= 128) {
+                size = size ? (size + 15) & ~(size_t)15 : 16;
+                *bsize = size;
+                return size / 16 - 1;
+        }
+
+        bit = 63 - __builtin_clzll(size - 1);
+        step = (size_t)1 << (bit - 2);
+        size = (size + step - 1) & ~(step - 1);
+        *bsize = size;
+
+        return 8 + (bit - 7) * 4 + (size - ((size_t)1 << bit)) / step - 1;
+}
+
+static void *arena_alloc_big(struct arena *arena, size_t size)
+{
+        struct arena_chunk *c;
+
+        c = xmalloc(sizeof(struct arena_chunk) + size);
+        c->prev = NULL;
+        c->next = arena->big;
+        if (arena->big)
+                arena->big->prev = c;
+        arena->big = c;
+
+        return c + 1;
+}
+
+static void arena_new_chunk(struct arena *arena)
+{
+        struct arena_chunk *c;
+
+        c = xmalloc(ARENA_CHUNK_SIZE);
+        c->prev = NULL;
+        c->next = arena->chunks;
+        arena->chunks = c;
+
+        arena->ptr = (unsigned char *)(c + 1);
+        arena->left = ARENA_CHUNK_SIZE - sizeof(struct arena_chunk);
+}
+
+/**
+ * Public functions
+ */
+void arena_init(struct arena *arena)
+{
+        memset(arena, 0, sizeof(struct arena));
+}
+
+/* arena_alloc():
+ * A block of at least `size` bytes, aligned to 16 bytes.
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+        unsigned int cls;
+        size_t bsize;
+        void *ptr;
+
+        if (size > ARENA_MAX_BLOCK) {
+                arena->used += size;
+                return arena_alloc_big(arena, size);
+        }
+
+        cls = arena_class(size, &bsize);
+        arena->used += bsize;
+
+        if (arena->free[cls]) {
+                ptr = arena->free[cls];
+                arena->free[cls] = *(void **)ptr;
+                return ptr;
+        }
+
+        if (arena->left < bsize)
+                arena_new_chunk(arena);
+
+        ptr = arena->ptr;
+        arena->ptr += bsize;
+        arena->left -= bsize;
+
+        return ptr;
+}
+
+/* arena_release():
+ * Hands back a block, which was allocated for `size` bytes, for reuse.
+ */
+void arena_release(struct arena *arena, void *ptr, size_t size)
+{
+        unsigned int cls;
+        size_t bsize;
+
+        if (!ptr)
+                return;
+
+        if (size > ARENA_MAX_BLOCK) {
+                struct arena_chunk *c = (struct arena_chunk *)ptr - 1;
+
+                if (c->prev)
+                        c->prev->next = c->next;
+                else
+                        arena->big = c->next;
+                if (c->next)
+                        c->next->prev = c->prev;
+
+                xfree(c);
+                arena->used -= size;
+                return;
+        }
+
+        cls = arena_class(size, &bsize);
+        *(void **)ptr = arena->free[cls];
+        arena->free[cls] = ptr;
+        arena->used -= bsize;
+}
+
+/* arena_block_size():
+ * How many bytes can be used of a block that was allocated for `size`.
+ */
+size_t arena_block_size(size_t size)
+{
+        size_t bsize;
+
+        if (size > ARENA_MAX_BLOCK)
+                return size;
+
+        arena_class(size, &bsize);
+
+        return bsize;
+}
+
+/* arena_free():
+ * Frees all of the arena, which is left empty, to be used again.
+ */
+void arena_free(struct arena *arena)
+{
+        struct arena_chunk *c, *next;
+
+        for (c = arena->chunks; c; c = next) {
+                next = c->next;
+                xfree(c);
+        }
+
+        for (c = arena->big; c; c = next) {
+                next = c->next;
+                xfree(c);
+        }
+
+        arena_init(arena);
+}
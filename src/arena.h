@@ -0,0 +1,46 @@
+/*
+ * arena.h
+ *
+ * An arena of size classed blocks, which are all freed at once
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stdio.h>
+
+#include <libzeroskip/macros.h>
+
+CPP_GUARD_START
+
+/* Blocks of up to ARENA_MAX_BLOCK bytes are carved out of chunks, and a
+ * block that is released goes on a free list for its size class, to be
+ * handed out again. Bigger blocks are allocated on their own. */
+#define ARENA_CHUNK_SIZE  (64 * 1024)
+#define ARENA_MAX_BLOCK   (16 * 1024)
+#define ARENA_NUM_CLASSES 36
+
+struct arena_chunk;
+
+struct arena {
+        struct arena_chunk *chunks;
+        struct arena_chunk *big;
+        unsigned char *ptr;     /* What is left of the current chunk */
+        size_t left;
+        void *free[ARENA_NUM_CLASSES];
+        size_t used;            /* Bytes handed out, and not released */
+};
+
+void arena_init(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_release(struct arena *arena, void *ptr, size_t size);
+size_t arena_block_size(size_t size);
+void arena_free(struct arena *arena);
+
+CPP_GUARD_END
+#endif  /* _ARENA_H_ */
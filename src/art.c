@@ -0,0 +1,909 @@
+/*
+ * art.c
+ *
+ * An adaptive radix tree of records, ordered as memtree_memcmp_raw() orders
+ * them. Inner nodes grow from 4 to 16, 48 and 256 children as they fill,
+ * and the bytes a path has no branches in are compressed into the node at
+ * its end. Keys are never taken out of the tree, since a key that is
+ * removed from zeroskip keeps a record which is marked deleted, so nodes
+ * never shrink.
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/art.h>
+#include <libzeroskip/util.h>
+
+#include "arena.h"
+#include "record.h"
+
+#include <assert.h>
+#include <string.h>
+
+/* The most bytes of its compressed path a node keeps. The rest of a longer
+ * path is compared with a record under the node. */
+#define ART_MAX_PREFIX 9
+
+enum {
+        ART_NODE4 = 1,
+        ART_NODE16,
+        ART_NODE48,
+        ART_NODE256,
+};
+
+struct art_node {
+        struct record *leaf;    /* The key that ends at the node, which
+                                   comes before all of its children */
+        uint32_t prefixlen;
+        uint16_t count;
+        uint8_t type;
+        unsigned char prefix[ART_MAX_PREFIX];
+};
+
+/* Nodes of 4 and 16 keep their keys sorted. A child's position in them
+ * is its index, and in the bigger nodes it is the child's byte. */
+struct art_node4 {
+        struct art_node n;
+        unsigned char keys[4];
+        void *children[4];
+};
+
+struct art_node16 {
+        struct art_node n;
+        unsigned char keys[16];
+        void *children[16];
+};
+
+/* The slot of each byte's child, plus one, or 0 for none */
+struct art_node48 {
+        struct art_node n;
+        unsigned char index[256];
+        void *children[48];
+};
+
+struct art_node256 {
+        struct art_node n;
+        void *children[256];
+};
+
+static const size_t art_node_sizes[] = {
+        0,
+        sizeof(struct art_node4),
+        sizeof(struct art_node16),
+        sizeof(struct art_node48),
+        sizeof(struct art_node256),
+};
+
+static int iter_seek(art_iter_t iter, const unsigned char *key,
+                     size_t keylen);
+
+/**
+ * Private functions
+ */
+
+/* Blocks from the arena are 16 byte aligned, so the lowest bit of a
+ * child tells a record from a node */
+static inline int is_leaf(const void *p)
+{
+        return (uintptr_t)p & 1;
+}
+
+static inline struct record *to_leaf(const void *p)
+{
+        return (struct record *)((uintptr_t)p & ~(uintptr_t)1);
+}
+
+static inline void *leaf_ref(const struct record *rec)
+{
+        return (void *)((uintptr_t)rec | 1);
+}
+
+static struct record *art_record_new(struct art *tree,
+                                     const unsigned char *key, size_t keylen,
+                                     const unsigned char *val, size_t vallen,
+                                     int deleted)
+{
+        struct record *rec;
+
+        rec = arena_alloc(tree->arena, record_alloc_size(keylen, vallen));
+
+        rec->key = (unsigned char *)(rec + 1);
+        memcpy(rec->key, key, keylen);
+        rec->key[keylen] = '\0';
+        rec->keylen = keylen;
+
+        rec->val = rec->key + keylen + 1;
+        if (vallen)
+                memcpy(rec->val, val, vallen);
+        rec->val[vallen] = '\0';
+        rec->vallen = vallen;
+
+        rec->deleted = deleted;
+        rec->inarena = 1;
+
+        tree->size += record_alloc_size(keylen, vallen);
+
+        return rec;
+}
+
+/* art_record_update():
+ * Sets the value of `rec`, where it is, if it fits in the record's block.
+ * Otherwise a new record is returned, for the caller to put in its place.
+ */
+static struct record *art_record_update(struct art *tree, struct record *rec,
+                                        const unsigned char *val,
+                                        size_t vallen, int deleted)
+{
+        size_t oldsize = record_alloc_size(rec->keylen, rec->vallen);
+        struct record *nrec;
+
+        if (record_update_in_place(rec, val, vallen, deleted, &tree->size))
+                return rec;
+
+        nrec = art_record_new(tree, rec->key, rec->keylen, val, vallen,
+                              deleted);
+
+        tree->size -= oldsize;
+        arena_release(tree->arena, rec, oldsize);
+
+        return nrec;
+}
+
+static struct art_node *art_node_new(struct art *tree, uint8_t type)
+{
+        struct art_node *n;
+
+        n = arena_alloc(tree->arena, art_node_sizes[type]);
+        memset(n, 0, art_node_sizes[type]);
+        n->type = type;
+
+        return n;
+}
+
+/* node_find_pos():
+ * The position of the child of `n` for byte `c`, or -1 if it has none.
+ */
+static int node_find_pos(struct art_node *n, unsigned char c)
+{
+        int i;
+
+        switch (n->type) {
+        case ART_NODE4: {
+                struct art_node4 *p = (struct art_node4 *)n;
+                for (i = 0; i < n->count; i++)
+                        if (p->keys[i] == c)
+                                return i;
+                break;
+        }
+        case ART_NODE16: {
+                struct art_node16 *p = (struct art_node16 *)n;
+                for (i = 0; i < n->count && p->keys[i] <= c; i++)
+                        if (p->keys[i] == c)
+                                return i;
+                break;
+        }
+        case ART_NODE48: {
+                struct art_node48 *p = (struct art_node48 *)n;
+                if (p->index[c])
+                        return c;
+                break;
+        }
+        case ART_NODE256: {
+                struct art_node256 *p = (struct art_node256 *)n;
+                if (p->children[c])
+                        return c;
+                break;
+        }
+        }
+
+        return -1;
+}
+
+/* node_pos_before():
+ * The position a child for byte `c`, which `n` has none for, would come
+ * after. It is -1 if it would come first.
+ */
+static int node_pos_before(struct art_node *n, unsigned char c)
+{
+        int i;
+
+        switch (n->type) {
+        case ART_NODE4: {
+                struct art_node4 *p = (struct art_node4 *)n;
+                for (i = 0; i < n->count && p->keys[i] < c; i++)
+                        ;
+                return i - 1;
+        }
+        case ART_NODE16: {
+                struct art_node16 *p = (struct art_node16 *)n;
+                for (i = 0; i < n->count && p->keys[i] < c; i++)
+                        ;
+                return i - 1;
+        }
+        }
+
+        return c;
+}
+
+/* node_next_pos():
+ * The position of the first child of `n` after `pos`, which can be -1, or
+ * -1 if there are none.
+ */
+static int node_next_pos(struct art_node *n, int pos)
+{
+        int i;
+
+        switch (n->type) {
+        case ART_NODE4:
+        case ART_NODE16:
+                return pos + 1 < n->count ? pos + 1 : -1;
+        case ART_NODE48: {
+                struct art_node48 *p = (struct art_node48 *)n;
+                for (i = pos + 1; i < 256; i++)
+                        if (p->index[i])
+                                return i;
+                break;
+        }
+        case ART_NODE256: {
+                struct art_node256 *p = (struct art_node256 *)n;
+                for (i = pos + 1; i < 256; i++)
+                        if (p->children[i])
+                                return i;
+                break;
+        }
+        }
+
+        return -1;
+}
+
+static void **node_slot(struct art_node *n, int pos)
+{
+        switch (n->type) {
+        case ART_NODE4:
+                return &((struct art_node4 *)n)->children[pos];
+        case ART_NODE16:
+                return &((struct art_node16 *)n)->children[pos];
+        case ART_NODE48: {
+                struct art_node48 *p = (struct art_node48 *)n;
+                return &p->children[p->index[pos] - 1];
+        }
+        case ART_NODE256:
+                return &((struct art_node256 *)n)->children[pos];
+        }
+
+        assert(0);
+        return NULL;
+}
+
+/* art_any_record():
+ * A record under `p`, to read the compressed paths down to it from. Every
+ * node has a record of its own, or children, so there always is one. The
+ * slots of a node of 48 fill in order, so its first one is used.
+ */
+static struct record *art_any_record(void *p)
+{
+        while (!is_leaf(p)) {
+                struct art_node *n = p;
+
+                if (n->leaf)
+                        return n->leaf;
+
+                switch (n->type) {
+                case ART_NODE4:
+                        p = ((struct art_node4 *)n)->children[0];
+                        break;
+                case ART_NODE16:
+                        p = ((struct art_node16 *)n)->children[0];
+                        break;
+                case ART_NODE48:
+                        p = ((struct art_node48 *)n)->children[0];
+                        break;
+                default:
+                        p = *node_slot(n, node_next_pos(n, -1));
+                        break;
+                }
+        }
+
+        return to_leaf(p);
+}
+
+/* node_grow():
+ * Replaces the full node `n`, at `ref`, with one of the next size up.
+ */
+static struct art_node *node_grow(struct art *tree, void **ref,
+                                  struct art_node *n)
+{
+        struct art_node *nn;
+        unsigned int i;
+
+        nn = art_node_new(tree, n->type + 1);
+        nn->leaf = n->leaf;
+        nn->prefixlen = n->prefixlen;
+        nn->count = n->count;
+        memcpy(nn->prefix, n->prefix, ART_MAX_PREFIX);
+
+        switch (n->type) {
+        case ART_NODE4: {
+                struct art_node4 *p = (struct art_node4 *)n;
+                struct art_node16 *np = (struct art_node16 *)nn;
+                memcpy(np->keys, p->keys, sizeof(p->keys));
+                memcpy(np->children, p->children, sizeof(p->children));
+                break;
+        }
+        case ART_NODE16: {
+                struct art_node16 *p = (struct art_node16 *)n;
+                struct art_node48 *np = (struct art_node48 *)nn;
+                for (i = 0; i < 16; i++) {
+                        np->index[p->keys[i]] = i + 1;
+                        np->children[i] = p->children[i];
+                }
+                break;
+        }
+        case ART_NODE48: {
+                struct art_node48 *p = (struct art_node48 *)n;
+                struct art_node256 *np = (struct art_node256 *)nn;
+                for (i = 0; i < 256; i++)
+                        if (p->index[i])
+                                np->children[i] = p->children[p->index[i] - 1];
+                break;
+        }
+        default:
+                assert(0);
+        }
+
+        arena_release(tree->arena, n, art_node_sizes[n->type]);
+        *ref = nn;
+
+        return nn;
+}
+
+/* node_add_child():
+ * Adds `child` to `n`, at `ref`, for byte `c`, which it has no child for.
+ */
+static void node_add_child(struct art *tree, void **ref, struct art_node *n,
+                           unsigned char c, void *child)
+{
+        unsigned int i;
+
+        switch (n->type) {
+        case ART_NODE4: {
+                struct art_node4 *p = (struct art_node4 *)n;
+                if (n->count == 4)
+                        break;
+                for (i = n->count; i && p->keys[i - 1] > c; i--) {
+                        p->keys[i] = p->keys[i - 1];
+                        p->children[i] = p->children[i - 1];
+                }
+                p->keys[i] = c;
+                p->children[i] = child;
+                n->count++;
+                return;
+        }
+        case ART_NODE16: {
+                struct art_node16 *p = (struct art_node16 *)n;
+                if (n->count == 16)
+                        break;
+                for (i = n->count; i && p->keys[i - 1] > c; i--) {
+                        p->keys[i] = p->keys[i - 1];
+                        p->children[i] = p->children[i - 1];
+                }
+                p->keys[i] = c;
+                p->children[i] = child;
+                n->count++;
+                return;
+        }
+        case ART_NODE48: {
+                struct art_node48 *p = (struct art_node48 *)n;
+                if (n->count == 48)
+                        break;
+                /* Nothing is removed, so the slots fill in order */
+                p->children[n->count] = child;
+                p->index[c] = ++n->count;
+                return;
+        }
+        case ART_NODE256: {
+                struct art_node256 *p = (struct art_node256 *)n;
+                p->children[c] = child;
+                n->count++;
+                return;
+        }
+        }
+
+        n = node_grow(tree, ref, n);
+        node_add_child(tree, ref, n, c, child);
+}
+
+/* node_prefix_mismatch():
+ * How many bytes of the compressed path of `n`, which is at `depth`, the
+ * key has. It is the length of the path if the key has all of it.
+ */
+static uint32_t node_prefix_mismatch(struct art_node *n,
+                                     const unsigned char *key, size_t keylen,
+                                     size_t depth)
+{
+        uint32_t max = n->prefixlen < ART_MAX_PREFIX ?
+                n->prefixlen : ART_MAX_PREFIX;
+        size_t left = keylen - depth;
+        struct record *rec;
+        uint32_t i;
+
+        for (i = 0; i < max && i < left; i++)
+                if (n->prefix[i] != key[depth + i])
+                        return i;
+
+        if (i < n->prefixlen && i < left) {
+                rec = art_any_record(n);
+                for (; i < n->prefixlen && i < left; i++)
+                        if (rec->key[depth + i] != key[depth + i])
+                                return i;
+        }
+
+        return i;
+}
+
+static inline unsigned char node_prefix_byte(struct art_node *n, uint32_t i,
+                                             size_t depth)
+{
+        if (i < ART_MAX_PREFIX)
+                return n->prefix[i];
+
+        return art_any_record(n)->key[depth + i];
+}
+
+static inline void node_set_prefix(struct art_node *n,
+                                   const unsigned char *path, uint32_t len)
+{
+        n->prefixlen = len;
+        memcpy(n->prefix, path, len < ART_MAX_PREFIX ? len : ART_MAX_PREFIX);
+}
+
+/* art_split_leaf():
+ * Puts a node, with the record at `ref` and a new one for `key` under it,
+ * in place of the record. Both keys have the path to `depth`.
+ */
+static void art_split_leaf(struct art *tree, void **ref, size_t depth,
+                           const unsigned char *key, size_t keylen,
+                           const unsigned char *val, size_t vallen,
+                           int deleted)
+{
+        struct record *old = to_leaf(*ref), *rec;
+        size_t lcp = depth, max;
+        struct art_node *n;
+        void *np;
+
+        max = old->keylen < keylen ? old->keylen : keylen;
+        while (lcp < max && old->key[lcp] == key[lcp])
+                lcp++;
+
+        n = art_node_new(tree, ART_NODE4);
+        node_set_prefix(n, key + depth, lcp - depth);
+        np = n;
+
+        if (old->keylen == lcp)
+                n->leaf = old;
+        else
+                node_add_child(tree, &np, n, old->key[lcp], *ref);
+
+        rec = art_record_new(tree, key, keylen, val, vallen, deleted);
+        if (keylen == lcp)
+                n->leaf = rec;
+        else
+                node_add_child(tree, &np, n, key[lcp], leaf_ref(rec));
+
+        *ref = np;
+}
+
+/* art_split_prefix():
+ * Puts a node, with `n` at `ref` and a new record for `key` under it, in
+ * place of `n`, whose compressed path, from `depth`, the key only has the
+ * first `i` bytes of.
+ */
+static void art_split_prefix(struct art *tree, void **ref,
+                             struct art_node *n, size_t depth, uint32_t i,
+                             const unsigned char *key, size_t keylen,
+                             const unsigned char *val, size_t vallen,
+                             int deleted)
+{
+        struct record *any = art_any_record(n), *rec;
+        struct art_node *nn;
+        void *np;
+
+        nn = art_node_new(tree, ART_NODE4);
+        node_set_prefix(nn, any->key + depth, i);
+        np = nn;
+
+        /* `n` keeps what is left of its path after the byte it goes under */
+        node_set_prefix(n, any->key + depth + i + 1, n->prefixlen - i - 1);
+        node_add_child(tree, &np, nn, any->key[depth + i], n);
+
+        rec = art_record_new(tree, key, keylen, val, vallen, deleted);
+        if (depth + i == keylen)
+                nn->leaf = rec;
+        else
+                node_add_child(tree, &np, nn, key[depth + i], leaf_ref(rec));
+
+        *ref = np;
+}
+
+/* Iterators keep the nodes on the way down to the next record, with the
+ * position in each of where they went */
+static void iter_push(art_iter_t iter, struct art_node *n, size_t depth,
+                      int pos)
+{
+        struct art_iter_frame *f;
+
+        if (iter->top == ART_ITER_DEPTH) {
+                memmove(&iter->frames[0], &iter->frames[1],
+                        (ART_ITER_DEPTH - 1) * sizeof(struct art_iter_frame));
+                iter->top--;
+                iter->dropped = 1;
+        }
+
+        f = &iter->frames[iter->top++];
+        f->node = n;
+        f->depth = depth;
+        f->pos = pos;
+}
+
+/* iter_descend():
+ * Goes down to the first record under `p`, whose compressed path starts
+ * at `depth`.
+ */
+static void iter_descend(art_iter_t iter, void *p, size_t depth)
+{
+        while (!is_leaf(p)) {
+                struct art_node *n = p;
+                int pos;
+
+                if (n->leaf) {
+                        iter_push(iter, n, depth, -1);
+                        iter->next = n->leaf;
+                        return;
+                }
+
+                pos = node_next_pos(n, -1);
+                iter_push(iter, n, depth, pos);
+                depth += n->prefixlen + 1;
+                p = *node_slot(n, pos);
+        }
+
+        iter->next = to_leaf(p);
+}
+
+/* iter_skip():
+ * Seeks the first record after every key with the path of `n`, by going
+ * from the root again, when the iterator no longer has the nodes above
+ * `n`.
+ */
+static void iter_skip(art_iter_t iter, struct art_node *n, size_t depth)
+{
+        size_t len = depth + n->prefixlen;
+        unsigned char *path;
+
+        path = xmalloc(len + 1);
+        memcpy(path, art_any_record(n)->key, len);
+
+        /* The first key after them all is the path with its last byte,
+           that isn't 0xff, one up */
+        while (len && path[len - 1] == 0xff)
+                len--;
+
+        if (len) {
+                path[len - 1]++;
+                iter_seek(iter, path, len);
+        } else {
+                iter->top = 0;
+                iter->dropped = 0;
+                iter->next = NULL;
+        }
+
+        xfree(path);
+}
+
+/* iter_advance():
+ * Moves on to the first record after the position of the last frame.
+ */
+static void iter_advance(art_iter_t iter)
+{
+        while (iter->top) {
+                struct art_iter_frame *f = &iter->frames[iter->top - 1];
+                struct art_node *n = f->node;
+                int pos = node_next_pos(n, f->pos);
+
+                if (pos >= 0) {
+                        f->pos = pos;
+                        iter_descend(iter, *node_slot(n, pos),
+                                     f->depth + n->prefixlen + 1);
+                        return;
+                }
+
+                if (iter->top == 1 && iter->dropped) {
+                        iter_skip(iter, n, f->depth);
+                        return;
+                }
+
+                iter->top--;
+        }
+
+        iter->next = NULL;
+}
+
+/* iter_seek():
+ * Positions `iter` at the record of `key`, or at the one after where it
+ * would be. Returns 1 if `key` was found.
+ */
+static int iter_seek(art_iter_t iter, const unsigned char *key,
+                     size_t keylen)
+{
+        void *p = iter->tree->root;
+        size_t depth = 0;
+
+        iter->top = 0;
+        iter->dropped = 0;
+        iter->next = NULL;
+
+        if (!p)
+                return 0;
+
+        while (1) {
+                struct art_node *n;
+                size_t ndepth;
+                int pos;
+
+                if (is_leaf(p)) {
+                        struct record *rec = to_leaf(p);
+                        int c = memcmp_raw(rec->key, rec->keylen,
+                                           key, keylen);
+                        if (c >= 0) {
+                                iter->next = rec;
+                                return c == 0;
+                        }
+                        iter_advance(iter);
+                        return 0;
+                }
+
+                n = p;
+                ndepth = depth;
+                if (n->prefixlen) {
+                        uint32_t i = node_prefix_mismatch(n, key, keylen,
+                                                          depth);
+                        if (i < n->prefixlen) {
+                                if (depth + i == keylen ||
+                                    key[depth + i] <
+                                    node_prefix_byte(n, i, depth))
+                                        iter_descend(iter, n, depth);
+                                else
+                                        iter_advance(iter);
+                                return 0;
+                        }
+                        depth += n->prefixlen;
+                }
+
+                if (depth == keylen) {
+                        if (n->leaf) {
+                                iter_push(iter, n, ndepth, -1);
+                                iter->next = n->leaf;
+                                return 1;
+                        }
+                        iter_descend(iter, n, ndepth);
+                        return 0;
+                }
+
+                pos = node_find_pos(n, key[depth]);
+                if (pos < 0) {
+                        iter_push(iter, n, ndepth,
+                                  node_pos_before(n, key[depth]));
+                        iter_advance(iter);
+                        return 0;
+                }
+
+                iter_push(iter, n, ndepth, pos);
+                p = *node_slot(n, pos);
+                depth++;
+        }
+}
+
+/**
+ * Public functions
+ */
+struct art *art_new(void)
+{
+        struct art *tree;
+
+        tree = xcalloc(1, sizeof(struct art));
+
+        tree->arena = xmalloc(sizeof(struct arena));
+        arena_init(tree->arena);
+
+        return tree;
+}
+
+void art_free(struct art *tree)
+{
+        arena_free(tree->arena);
+        xfree(tree->arena);
+        xfree(tree);
+}
+
+int art_upsert(struct art *tree,
+               const unsigned char *key, size_t keylen,
+               const unsigned char *val, size_t vallen,
+               int deleted)
+{
+        void **ref = &tree->root;
+        size_t depth = 0;
+        struct record *rec;
+
+        while (*ref) {
+                struct art_node *n;
+                int pos;
+
+                if (is_leaf(*ref)) {
+                        rec = to_leaf(*ref);
+                        if (memcmp_raw(rec->key, rec->keylen,
+                                       key, keylen) == 0) {
+                                rec = art_record_update(tree, rec, val,
+                                                        vallen, deleted);
+                                *ref = leaf_ref(rec);
+                                return MEMTREE_OK;
+                        }
+
+                        art_split_leaf(tree, ref, depth, key, keylen,
+                                       val, vallen, deleted);
+                        tree->count++;
+                        return MEMTREE_OK;
+                }
+
+                n = *ref;
+                if (n->prefixlen) {
+                        uint32_t i = node_prefix_mismatch(n, key, keylen,
+                                                          depth);
+                        if (i < n->prefixlen) {
+                                art_split_prefix(tree, ref, n, depth, i,
+                                                 key, keylen, val, vallen,
+                                                 deleted);
+                                tree->count++;
+                                return MEMTREE_OK;
+                        }
+                        depth += n->prefixlen;
+                }
+
+                if (depth == keylen) {
+                        if (n->leaf) {
+                                n->leaf = art_record_update(tree, n->leaf,
+                                                            val, vallen,
+                                                            deleted);
+                                return MEMTREE_OK;
+                        }
+
+                        n->leaf = art_record_new(tree, key, keylen,
+                                                 val, vallen, deleted);
+                        tree->count++;
+                        return MEMTREE_OK;
+                }
+
+                pos = node_find_pos(n, key[depth]);
+                if (pos >= 0) {
+                        ref = node_slot(n, pos);
+                        depth++;
+                        continue;
+                }
+
+                rec = art_record_new(tree, key, keylen, val, vallen, deleted);
+                node_add_child(tree, ref, n, key[depth], leaf_ref(rec));
+                tree->count++;
+                return MEMTREE_OK;
+        }
+
+        rec = art_record_new(tree, key, keylen, val, vallen, deleted);
+        *ref = leaf_ref(rec);
+        tree->count++;
+
+        return MEMTREE_OK;
+}
+
+/* art_find():
+ * Only checks the bytes of the compressed paths that the nodes keep, on
+ * the way down, and compares the whole key with the record it gets to.
+ */
+struct record *art_find(struct art *tree, const unsigned char *key,
+                        size_t keylen)
+{
+        void *p = tree->root;
+        size_t depth = 0;
+        struct record *rec;
+
+        while (p && !is_leaf(p)) {
+                struct art_node *n = p;
+                int pos;
+
+                if (n->prefixlen) {
+                        if (depth + n->prefixlen > keylen)
+                                return NULL;
+                        if (memcmp(n->prefix, key + depth,
+                                   n->prefixlen < ART_MAX_PREFIX ?
+                                   n->prefixlen : ART_MAX_PREFIX))
+                                return NULL;
+                        depth += n->prefixlen;
+                }
+
+                if (depth == keylen) {
+                        rec = n->leaf;
+                        goto check;
+                }
+
+                pos = node_find_pos(n, key[depth]);
+                if (pos < 0)
+                        return NULL;
+
+                p = *node_slot(n, pos);
+                depth++;
+        }
+
+        if (!p)
+                return NULL;
+        rec = to_leaf(p);
+
+check:
+        if (!rec || rec->keylen != keylen || memcmp(rec->key, key, keylen))
+                return NULL;
+
+        return rec;
+}
+
+int art_seek(struct art *tree, const unsigned char *key, size_t keylen,
+             art_iter_t iter)
+{
+        int found;
+
+        iter->tree = tree;
+        found = iter_seek(iter, key, keylen);
+        iter->record = iter->next;
+
+        return found;
+}
+
+int art_begin(struct art *tree, art_iter_t iter)
+{
+        iter->tree = tree;
+        iter->top = 0;
+        iter->dropped = 0;
+        iter->next = NULL;
+
+        if (tree->root)
+                iter_descend(iter, tree->root, 0);
+        iter->record = iter->next;
+
+        return iter->next != NULL;
+}
+
+/* art_next():
+ * Sets iter->record to the record `iter` is at, and moves it on to the
+ * next one. Returns 0 once it is past the last record.
+ */
+int art_next(art_iter_t iter)
+{
+        if (!iter->next)
+                return 0;
+
+        iter->record = iter->next;
+        iter_advance(iter);
+
+        return 1;
+}
+
+int art_walk_forward(struct art *tree, memtree_action_cb_t action,
+                     void *data)
+{
+        art_iter_t iter;
+
+        art_begin(tree, iter);
+        while (art_next(iter))
+                action(iter->record, data);
+
+        return 1;
+}
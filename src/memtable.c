@@ -0,0 +1,218 @@
+/*
+ * memtable.c
+ *
+ * The in-memory data of zeroskip, in one of the trees it can be kept in.
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/memtable.h>
+#include <libzeroskip/util.h>
+
+/**
+ * Public functions
+ */
+struct memtable *memtable_new(enum memtable_type type,
+                              memtree_search_cb_t search)
+{
+        struct memtable *table;
+
+        if (type == MEMTABLE_ART && search && search != memtree_memcmp_raw)
+                return NULL;
+
+        table = xcalloc(1, sizeof(struct memtable));
+        table->type = type;
+
+        switch (type) {
+        case MEMTABLE_BTREE:
+                table->u.btree = memtree_new(NULL, search);
+                break;
+        case MEMTABLE_ART:
+                table->u.art = art_new();
+                break;
+        }
+
+        return table;
+}
+
+void memtable_free(struct memtable *table)
+{
+        switch (table->type) {
+        case MEMTABLE_BTREE:
+                memtree_free(table->u.btree);
+                break;
+        case MEMTABLE_ART:
+                art_free(table->u.art);
+                break;
+        }
+
+        xfree(table);
+}
+
+size_t memtable_count(const struct memtable *table)
+{
+        switch (table->type) {
+        case MEMTABLE_BTREE:
+                return table->u.btree->count;
+        case MEMTABLE_ART:
+                return table->u.art->count;
+        }
+
+        return 0;
+}
+
+size_t memtable_size(const struct memtable *table)
+{
+        switch (table->type) {
+        case MEMTABLE_BTREE:
+                return table->u.btree->size;
+        case MEMTABLE_ART:
+                return table->u.art->size;
+        }
+
+        return 0;
+}
+
+int memtable_upsert(struct memtable *table,
+                    const unsigned char *key, size_t keylen,
+                    const unsigned char *val, size_t vallen,
+                    int deleted)
+{
+        switch (table->type) {
+        case MEMTABLE_BTREE:
+                return memtree_upsert(table->u.btree, key, keylen,
+                                      val, vallen, deleted);
+        case MEMTABLE_ART:
+                return art_upsert(table->u.art, key, keylen,
+                                  val, vallen, deleted);
+        }
+
+        return MEMTREE_INVALID;
+}
+
+struct record *memtable_find(struct memtable *table, const unsigned char *key,
+                             size_t keylen)
+{
+        memtree_iter_t iter;
+
+        switch (table->type) {
+        case MEMTABLE_BTREE:
+                if (memtree_find(table->u.btree, key, keylen, iter))
+                        return iter->record;
+                break;
+        case MEMTABLE_ART:
+                return art_find(table->u.art, key, keylen);
+        }
+
+        return NULL;
+}
+
+int memtable_seek(struct memtable *table, const unsigned char *key,
+                  size_t keylen, memtable_iter_t iter)
+{
+        int found = 0;
+
+        iter->type = table->type;
+
+        switch (table->type) {
+        case MEMTABLE_BTREE:
+                found = memtree_find(table->u.btree, key, keylen,
+                                     iter->u.btree);
+                iter->record = iter->u.btree->record;
+                break;
+        case MEMTABLE_ART:
+                found = art_seek(table->u.art, key, keylen, iter->u.art);
+                iter->record = iter->u.art->record;
+                break;
+        }
+
+        return found;
+}
+
+int memtable_begin(struct memtable *table, memtable_iter_t iter)
+{
+        int ret = 0;
+
+        iter->type = table->type;
+        iter->record = NULL;
+
+        switch (table->type) {
+        case MEMTABLE_BTREE:
+                ret = memtree_begin(table->u.btree, iter->u.btree);
+                if (ret)
+                        iter->record = iter->u.btree->record;
+                break;
+        case MEMTABLE_ART:
+                ret = art_begin(table->u.art, iter->u.art);
+                iter->record = iter->u.art->record;
+                break;
+        }
+
+        return ret;
+}
+
+int memtable_next(memtable_iter_t iter)
+{
+        int ret = 0;
+
+        switch (iter->type) {
+        case MEMTABLE_BTREE:
+                ret = memtree_next(iter->u.btree);
+                if (ret)
+                        iter->record = iter->u.btree->record;
+                break;
+        case MEMTABLE_ART:
+                ret = art_next(iter->u.art);
+                if (ret)
+                        iter->record = iter->u.art->record;
+                break;
+        }
+
+        return ret;
+}
+
+int memtable_walk_forward(struct memtable *table, memtree_action_cb_t action,
+                          void *data)
+{
+        switch (table->type) {
+        case MEMTABLE_BTREE:
+                return memtree_walk_forward(table->u.btree, action, data);
+        case MEMTABLE_ART:
+                return art_walk_forward(table->u.art, action, data);
+        }
+
+        return 0;
+}
+
+void memtable_loader_init(struct memtable_loader *loader,
+                          struct memtable *table)
+{
+        loader->table = table;
+        if (table->type == MEMTABLE_BTREE)
+                memtree_loader_init(&loader->btree, table->u.btree);
+}
+
+int memtable_loader_add(struct memtable_loader *loader,
+                        const unsigned char *key, size_t keylen,
+                        const unsigned char *val, size_t vallen,
+                        int deleted)
+{
+        if (loader->table->type == MEMTABLE_BTREE)
+                return memtree_loader_add(&loader->btree, key, keylen,
+                                          val, vallen, deleted);
+
+        return memtable_upsert(loader->table, key, keylen, val, vallen,
+                               deleted);
+}
+
+int memtable_loader_finish(struct memtable_loader *loader)
+{
+        if (loader->table->type == MEMTABLE_BTREE)
+                return memtree_loader_finish(&loader->btree);
+
+        return MEMTREE_OK;
+}
@@ -12,6 +12,9 @@
 #include <libzeroskip/memtree.h>
 #include <libzeroskip/util.h>
 
+#include "arena.h"
+#include "record.h"
+
 #include <assert.h>
 #include <string.h>
 
@@ -53,21 +56,182 @@ static inline int memtree_ascend(memtree_iter_t iter)
         return ret;
 }
 
-static struct memtree_node *memtree_node_alloc(enum NodeType type)
+/* The 8 bytes of `key` after `skip`, padded with zeros, as a number that
+ * orders keys the way memcmp_raw() does, as far as it goes */
+static inline uint64_t key_prefix(const unsigned char *key, size_t keylen,
+                                  uint32_t skip)
+{
+        unsigned char buf[sizeof(uint64_t)] = { 0 };
+
+        if (keylen > skip) {
+                keylen -= skip;
+                memcpy(buf, key + skip,
+                       keylen < sizeof(buf) ? keylen : sizeof(buf));
+        }
+
+        return read_be64(buf);
+}
+
+/* node_prefix_update():
+ * Works out what the first `count` keys in `node` start with, and their
+ * prefixes after it.
+ */
+static void node_prefix_update(struct memtree_node *node, uint32_t count)
+{
+        uint32_t i, skip = 0;
+
+        if (count > 1) {
+                /* The keys are sorted, so what the first and last of them
+                   start with, they all do */
+                const struct record *first = node->recs[0];
+                const struct record *last = node->recs[count - 1];
+                size_t len = first->keylen < last->keylen ?
+                        first->keylen : last->keylen;
+
+                while (skip < len && first->key[skip] == last->key[skip])
+                        skip++;
+        }
+
+        node->skip = skip;
+        for (i = 0; i < count; i++)
+                node->prefix[i] = key_prefix(node->recs[i]->key,
+                                             node->recs[i]->keylen, skip);
+}
+
+/* node_prefix_add():
+ * Sets the prefix for the record that was put at `pos`, of the first
+ * `count` in `node`. If the record doesn't start the way the others do,
+ * the prefixes of all of them are worked out again.
+ */
+static void node_prefix_add(struct memtree_node *node, uint32_t pos,
+                            uint32_t count)
+{
+        const struct record *rec = node->recs[pos];
+
+        if (node->skip) {
+                const struct record *other = node->recs[pos ? 0 : 1];
+
+                if (count < 2 || rec->keylen < node->skip ||
+                    memcmp(rec->key, other->key, node->skip)) {
+                        node_prefix_update(node, count);
+                        return;
+                }
+        }
+
+        node->prefix[pos] = key_prefix(rec->key, rec->keylen, node->skip);
+}
+
+/* Moves the record, and its prefix, at `from` to `to` */
+static inline void node_move_rec(struct memtree_node *node, uint32_t to,
+                                 uint32_t from)
+{
+        node->recs[to] = node->recs[from];
+        node->prefix[to] = node->prefix[from];
+}
+
+#if defined(__GNUC__)
+typedef uint64_t prefix_vec_t __attribute__((vector_size(32)));
+#endif
+
+/* node_prefix_search():
+ * Searches the prefixes of `node` for `key`, the way memtree_memcmp_raw()
+ * searches its records. The prefixes are compared four at a time, and
+ * only the records with the same prefix as the key are gone to.
+ */
+static uint32_t node_prefix_search(struct memtree_node *node,
+                                   const unsigned char *key, size_t keylen,
+                                   int *found)
+{
+        uint32_t i = 0, lt = 0, le = 0, count = node->count;
+        uint64_t kp;
+
+        if (!count)
+                return 0;
+
+        if (node->skip) {
+                /* A key that doesn't start the way the keys in the node do
+                   goes before or after all of them */
+                const struct record *first = node->recs[0];
+                size_t len = keylen < node->skip ? keylen : node->skip;
+                int c = memcmp(key, first->key, len);
+
+                if (c < 0 || (c == 0 && keylen < node->skip))
+                        return 0;
+                if (c > 0)
+                        return count;
+        }
+
+        kp = key_prefix(key, keylen, node->skip);
+
+#if defined(__GNUC__)
+        {
+                prefix_vec_t k = { kp, kp, kp, kp };
+                prefix_vec_t vlt = { 0 }, vle = { 0 };
+
+                for (; i + 4 <= count; i += 4) {
+                        prefix_vec_t p;
+
+                        memcpy(&p, &node->prefix[i], sizeof(p));
+                        vlt -= (prefix_vec_t)(p < k);
+                        vle -= (prefix_vec_t)(p <= k);
+                }
+
+                lt = vlt[0] + vlt[1] + vlt[2] + vlt[3];
+                le = vle[0] + vle[1] + vle[2] + vle[3];
+        }
+#endif
+        for (; i < count; i++) {
+                lt += node->prefix[i] < kp;
+                le += node->prefix[i] <= kp;
+        }
+
+        if (lt == le)
+                return lt;
+
+        return lt + memtree_memcmp_raw(key, keylen, node->recs + lt,
+                                       le - lt, found);
+}
+
+/* Where `key` is, or would go, in `node` */
+static inline uint32_t node_search(const struct memtree *memtree,
+                                   struct memtree_node *node,
+                                   const unsigned char *key, size_t keylen,
+                                   int *found)
+{
+        if (memtree->search == memtree_memcmp_raw)
+                return node_prefix_search(node, key, keylen, found);
+
+        return memtree->search(key, keylen, node->recs, node->count, found);
+}
+
+/* Only internal nodes have room for branches */
+static inline size_t memtree_node_size(enum NodeType type)
 {
-        struct memtree_node *node = NULL;
         size_t nsize;
 
         nsize = (type == INTERNAL_NODE) ?
-                sizeof(struct memtree_node) * (MEMTREE_MAX_ELEMENTS + 1) :
+                sizeof(struct memtree_node *) * (MEMTREE_MAX_ELEMENTS + 1) :
                 0;
 
-        node = xmalloc(sizeof(struct memtree_node) + nsize);
+        return sizeof(struct memtree_node) + nsize;
+}
+
+static struct memtree_node *memtree_node_alloc(struct memtree *memtree,
+                                               enum NodeType type)
+{
+        return arena_alloc(memtree->arena, memtree_node_size(type));
+}
 
-        return node;
+static void memtree_node_release(struct memtree *memtree,
+                                 struct memtree_node *node)
+{
+        arena_release(memtree->arena, node,
+                      memtree_node_size(node->depth ? INTERNAL_NODE : LEAF_NODE));
 }
 
-static void memtree_node_free(struct memtree_node *node, struct memtree *memtree)
+/* Destroys the records under `node`. The nodes go with the arena. */
+static void memtree_node_destroy(struct memtree_node *node,
+                                 struct memtree *memtree)
 {
         unsigned int i, count = node->count;
 
@@ -78,14 +242,12 @@ static void memtree_node_free(struct memtree_node *node, struct memtree *memtree
                 }
         } else {
                 for (i = 0; i < count; i++) {
-                        memtree_node_free(node->branches[i], memtree);
+                        memtree_node_destroy(node->branches[i], memtree);
                         memtree->destroy((void *)node->recs[i],
                                        memtree->destroy_data);
                 }
-                memtree_node_free(node->branches[count], memtree);
+                memtree_node_destroy(node->branches[count], memtree);
         }
-
-        xfree(node);
 }
 
 /* branch_begin()
@@ -131,7 +293,7 @@ static void node_insert(struct memtree_node *branch,
         uint32_t i;
 
         for (i = node->count; i-- > pos;) {
-                node->recs[i+1] = node->recs[i];
+                node_move_rec(node, i + 1, i);
         }
 
         node->recs[pos] = rec;
@@ -147,17 +309,20 @@ static void node_insert(struct memtree_node *branch,
                 node->branches[pos] = branch;
                 branch->parent = node;
                 branch->pos = pos;
+                pos--;
         }
 
         node->count++;
+        node_prefix_add(node, pos, node->count);
 }
 
 /* node_split()
  * Inserts `rec` and `branch` into `node` at `pos` splitting
  * it into nodes `node`, `branch` with median element being `key`.
  */
-static void node_split(struct memtree_node **branch, struct memtree_node *node,
-                       struct record **rec, uint32_t pos)
+static void node_split(struct memtree *memtree, struct memtree_node **branch,
+                       struct memtree_node *node, struct record **rec,
+                       uint32_t pos)
 {
         uint32_t i, split;
         struct memtree_node *left = node;
@@ -174,18 +339,20 @@ static void node_split(struct memtree_node **branch, struct memtree_node *node,
         }
 
         if (left->depth)
-                right = memtree_node_alloc(INTERNAL_NODE);
+                right = memtree_node_alloc(memtree, INTERNAL_NODE);
         else
-                right = memtree_node_alloc(LEAF_NODE);
+                right = memtree_node_alloc(memtree, LEAF_NODE);
 
         /* The left and right sumemtrees are siblings, so they will have the
            same parent and depth */
         right->parent = left->parent;
         right->depth = left->depth;
+        right->skip = left->skip;
 
         /* Initialise right side */
         for (i = split; i < MEMTREE_MAX_ELEMENTS; i++) {
                 right->recs[i-split] = left->recs[i];
+                right->prefix[i-split] = left->prefix[i];
         }
 
         if (right->depth) {
@@ -219,6 +386,10 @@ static void node_split(struct memtree_node **branch, struct memtree_node *node,
         --left->count;
         *rec = (void *)left->recs[left->count];
         *branch = right;
+
+        /* Each half can have more of its keys in common */
+        node_prefix_update(left, left->count);
+        node_prefix_update(right, right->count);
 }
 
 static void node_move_left(struct memtree_node *node, uint32_t pos)
@@ -232,7 +403,7 @@ static void node_move_left(struct memtree_node *node, uint32_t pos)
         node->recs[pos] = right->recs[0];
 
         for (i = 1; i < right->count; i++)
-                right->recs[i - 1] = right->recs[i];
+                node_move_rec(right, i - 1, i);
 
         if (right->depth) {
                 tmp = right->branches[0];
@@ -248,6 +419,9 @@ static void node_move_left(struct memtree_node *node, uint32_t pos)
 
         left->count++;
         right->count--;
+
+        node_prefix_add(left, left->count - 1, left->count);
+        node_prefix_add(node, pos, node->count);
 }
 
 static void node_move_right(struct memtree_node *node, uint32_t pos)
@@ -257,7 +431,7 @@ static void node_move_right(struct memtree_node *node, uint32_t pos)
         uint32_t i;
 
         for (i = right->count; i--; ) {
-                right->recs[i + 1] = right->recs[i];
+                node_move_rec(right, i + 1, i);
         }
 
         right->recs[0] = node->recs[pos];
@@ -276,9 +450,13 @@ static void node_move_right(struct memtree_node *node, uint32_t pos)
 
         left->count--;
         right->count++;
+
+        node_prefix_add(right, 0, right->count);
+        node_prefix_add(node, pos, node->count);
 }
 
-static void node_combine(struct memtree_node *node, uint32_t pos)
+static void node_combine(struct memtree *memtree, struct memtree_node *node,
+                         uint32_t pos)
 {
         struct memtree_node *left = node->branches[pos];
         struct memtree_node *right = node->branches[pos + 1];
@@ -289,7 +467,7 @@ static void node_combine(struct memtree_node *node, uint32_t pos)
         *rec++ = node->recs[pos];
 
         for (i = 0; i < right->count; i++) {
-                *rec++ = node->recs[i];
+                *rec++ = right->recs[i];
         }
 
         if (right->depth) {
@@ -302,7 +480,7 @@ static void node_combine(struct memtree_node *node, uint32_t pos)
         }
 
         for (i = pos + 1; i < node->count; i++) {
-                node->recs[i - 1] = node->recs[i];
+                node_move_rec(node, i - 1, i);
 
                 node->branches[i] = node->branches[i + 1];
                 node->branches[i]->pos = i;
@@ -311,42 +489,77 @@ static void node_combine(struct memtree_node *node, uint32_t pos)
         left->count += right->count + 1;
         node->count--;
 
-        xfree(right);
+        node_prefix_update(left, left->count);
+
+        memtree_node_release(memtree, right);
 }
 
 /* node_restore():
  */
-static void node_restore(struct memtree_node *node, uint32_t pos)
+static void node_restore(struct memtree *memtree, struct memtree_node *node,
+                         uint32_t pos)
 {
         if (pos == 0) {
                 if (node->branches[1]->count > MEMTREE_MIN_ELEMENTS)
                         node_move_left(node, 0);
                 else
-                        node_combine(node, 0);
+                        node_combine(memtree, node, 0);
         } else if (pos == node->count) {
                 if (node->branches[pos-1]->count > MEMTREE_MIN_ELEMENTS)
                         node_move_right(node, pos - 1);
                 else
-                        node_combine(node, pos - 1);
+                        node_combine(memtree, node, pos - 1);
         } else if (node->branches[pos-1]->count > MEMTREE_MIN_ELEMENTS) {
                 node_move_right(node, pos - 1);
         } else if (node->branches[pos+1]->count > MEMTREE_MIN_ELEMENTS) {
                 node_move_left(node, pos);
         } else {
-                node_combine(node, pos - 1);
+                node_combine(memtree, node, pos - 1);
         }
 }
 
+static inline size_t record_size(const struct record *record)
+{
+        return record_alloc_size(record->keylen, record->vallen);
+}
+
+static void record_init(struct record *rec,
+                        const unsigned char *key, size_t keylen,
+                        const unsigned char *val, size_t vallen,
+                        int deleted)
+{
+        rec->key = (unsigned char *)(rec + 1);
+        memcpy(rec->key, key, keylen);
+        rec->key[keylen] = '\0';
+        rec->keylen = keylen;
+
+        rec->val = rec->key + keylen + 1;
+        if (vallen)
+                memcpy(rec->val, val, vallen);
+        rec->val[vallen] = '\0';
+        rec->vallen = vallen;
+
+        rec->deleted = deleted;
+        rec->inarena = 0;
+}
+
+/* Frees a record that was in the tree */
+static void memtree_record_free(struct memtree *memtree, struct record *record)
+{
+        if (record->inarena)
+                arena_release(memtree->arena, record, record_size(record));
+        else
+                record_free(record);
+}
+
 /* node_remove_leaf_element():
  */
 static void node_remove_leaf_element(struct memtree_node *node, uint32_t pos)
 {
         uint32_t i;
 
-        record_free(node->recs[pos]);
-
         for (i = pos + 1; i < node->count; i++) {
-                node->recs[i-1] = node->recs[i];
+                node_move_rec(node, i - 1, i);
         }
 
         node->count--;
@@ -398,6 +611,203 @@ static int node_print_data(struct record *record, void *data _unused_)
         return 1;
 }
 
+/* memtree_find_slot():
+ * Looks for `key` the way memtree_find() does, but stops where it is found,
+ * and returns where the record for it is kept, so that it can be changed.
+ * If it isn't found, returns NULL, with `iter` where it would be inserted.
+ */
+static struct record **memtree_find_slot(struct memtree *memtree,
+                                         const unsigned char *key,
+                                         size_t keylen, memtree_iter_t iter)
+{
+        struct memtree_node *node = memtree->root;
+        uint32_t depth = node->depth;
+        uint32_t pos;
+
+        while (1) {
+                int found = 0;
+
+                pos = node_search(memtree, node, key, keylen, &found);
+                if (found)
+                        return &node->recs[pos];
+
+                if (!depth--)
+                        break;
+
+                node = node->branches[pos];
+        }
+
+        iter->tree = memtree;
+        iter->node = node;
+        iter->pos = pos;
+        iter->record = NULL;
+
+        return NULL;
+}
+
+/* Compares the keys of two records, in the order of the tree's search
+ * callback, which is asked where `a` would go in an array of just `b` */
+static int memtree_record_cmp(const struct memtree *memtree,
+                              struct record *a, struct record *b)
+{
+        int found = 0;
+        unsigned int pos;
+
+        if (memtree->search == memtree_memcmp_raw)
+                return memcmp_raw(a->key, a->keylen, b->key, b->keylen);
+
+        pos = memtree->search(a->key, a->keylen, &b, 1, &found);
+        if (found)
+                return 0;
+
+        return pos ? 1 : -1;
+}
+
+/* Records in more sorted runs than this are quicker to insert one by one
+ * than to merge, as every pass of the merge goes to all of them again */
+#define MEMTREE_BULK_MAX_RUNS 128
+
+/* Whether `recs` is in few enough sorted runs to merge them */
+static int memtree_records_in_runs(const struct memtree *memtree,
+                                   struct record **recs, size_t count)
+{
+        size_t i, runs = 1;
+
+        for (i = 1; i < count && runs <= MEMTREE_BULK_MAX_RUNS; i++) {
+                if (memtree_record_cmp(memtree, recs[i - 1], recs[i]) > 0)
+                        runs++;
+        }
+
+        return runs <= MEMTREE_BULK_MAX_RUNS;
+}
+
+/* memtree_sort_records():
+ * A stable merge sort of `recs`, which merges the runs that are already in
+ * order, so that a sorted array is gone over once. Returns whichever of
+ * `recs` and `tmp` has the sorted records.
+ */
+static struct record **memtree_sort_records(const struct memtree *memtree,
+                                            struct record **recs,
+                                            struct record **tmp,
+                                            size_t count)
+{
+        struct record **src = recs, **dst = tmp, **t;
+
+        while (1) {
+                size_t a = 0, runs = 0;
+
+                while (a < count) {
+                        size_t b = a + 1, c, i, j, k = a;
+
+                        while (b < count &&
+                               memtree_record_cmp(memtree, src[b - 1], src[b]) <= 0)
+                                b++;
+                        c = b + 1;
+                        while (c < count &&
+                               memtree_record_cmp(memtree, src[c - 1], src[c]) <= 0)
+                                c++;
+                        if (c > count)
+                                c = count;
+
+                        /* Equal keys are taken from the left run first, so
+                           that they stay in the order they came in */
+                        for (i = a, j = b; i < b && j < c;) {
+                                if (memtree_record_cmp(memtree, src[j], src[i]) < 0)
+                                        dst[k++] = src[j++];
+                                else
+                                        dst[k++] = src[i++];
+                        }
+                        while (i < b)
+                                dst[k++] = src[i++];
+                        while (j < c)
+                                dst[k++] = src[j++];
+
+                        runs++;
+                        a = c;
+                }
+
+                t = src;
+                src = dst;
+                dst = t;
+
+                if (runs <= 1)
+                        break;
+        }
+
+        return src;
+}
+
+/* memtree_build():
+ * Builds the tree of the `count` sorted records in `recs` bottom up, a
+ * level at a time. Each level is split into nodes that are full, but for
+ * the last two, which share what is left between them, and the records
+ * between the nodes go up to make the level above. `nodes` needs room for
+ * as many nodes as there are in the bottom level.
+ */
+static struct memtree_node *memtree_build(struct memtree *memtree,
+                                          struct record **recs, size_t count,
+                                          struct memtree_node **nodes)
+{
+        uint32_t depth = 0;
+
+        while (1) {
+                size_t n = (count + MEMTREE_MAX_ELEMENTS + 1) /
+                        (MEMTREE_MAX_ELEMENTS + 1);
+                size_t last, r = 0, k = 0, seps = 0, j;
+
+                /* What the last node would have, with the others full */
+                last = count - (n - 1) * (MEMTREE_MAX_ELEMENTS + 1);
+
+                for (j = 0; j < n; j++) {
+                        struct memtree_node *node;
+                        uint32_t c = MEMTREE_MAX_ELEMENTS, i;
+
+                        if (j == n - 1)
+                                c = last;
+                        if (last < MEMTREE_MIN_ELEMENTS && n > 1) {
+                                uint32_t both = MEMTREE_MAX_ELEMENTS + last;
+
+                                if (j == n - 2)
+                                        c = both - both / 2;
+                                else if (j == n - 1)
+                                        c = both / 2;
+                        }
+
+                        node = memtree_node_alloc(memtree, depth ?
+                                                  INTERNAL_NODE : LEAF_NODE);
+                        node->parent = NULL;
+                        node->depth = depth;
+                        node->count = c;
+
+                        for (i = 0; i < c; i++)
+                                node->recs[i] = recs[r++];
+
+                        if (depth) {
+                                for (i = 0; i <= c; i++) {
+                                        node->branches[i] = nodes[k++];
+                                        node->branches[i]->parent = node;
+                                        node->branches[i]->pos = i;
+                                }
+                        }
+
+                        node_prefix_update(node, c);
+
+                        /* Only nodes that have been read are written over */
+                        nodes[j] = node;
+                        nodes[j]->pos = j;
+
+                        if (j < n - 1)
+                                recs[seps++] = recs[r++];
+                }
+
+                if (n == 1)
+                        return nodes[0];
+
+                count = seps;
+                depth++;
+        }
+}
+
 /**
  * Public functions
  */
@@ -408,11 +818,15 @@ struct memtree *memtree_new(memtree_action_cb_t destroy, memtree_search_cb_t sea
 
         memtree = xcalloc(1, sizeof(struct memtree));
 
+        memtree->arena = xmalloc(sizeof(struct arena));
+        arena_init(memtree->arena);
+
         /* Root node */
-        node = memtree_node_alloc(LEAF_NODE);
+        node = memtree_node_alloc(memtree, LEAF_NODE);
         node->parent = NULL;
         node->count = 0;
         node->depth = 0;
+        node->skip = 0;
 
         memtree->root = node;
 
@@ -424,7 +838,11 @@ struct memtree *memtree_new(memtree_action_cb_t destroy, memtree_search_cb_t sea
 
 void memtree_free(struct memtree *memtree)
 {
-        memtree_node_free(memtree->root, memtree);
+        if (memtree->heaprecs || memtree->destroy != memtree_default_destroy)
+                memtree_node_destroy(memtree->root, memtree);
+
+        arena_free(memtree->arena);
+        xfree(memtree->arena);
         xfree(memtree);
 }
 
@@ -481,23 +899,25 @@ int memtree_next(memtree_iter_t iter)
 int memtree_insert_opt(struct memtree *memtree, struct record *record, int replace)
 {
         memtree_iter_t iter;
+        struct record **slot;
         int ret = MEMTREE_OK;
 
-        memset(iter, 0, sizeof(iter));
+        slot = memtree_find_slot(memtree, record->key, record->keylen, iter);
+        if (slot) {
+                struct record *rec = *slot;
 
-        if (memtree_find(memtree, record->key, record->keylen, iter)) {
-                if (replace) {
-                        struct record *rec = iter->record;
-                        xfree(rec->val);
-                        rec->val = xmalloc(record->vallen + 1);
-                        memcpy(rec->val, record->val, record->vallen);
-                        rec->vallen = record->vallen;
-                        rec->deleted = record->deleted;
-                        record_free(record);
+                if (!replace) {
+                        ret = MEMTREE_DUPLICATE;
                         goto done;
                 }
 
-                ret = MEMTREE_DUPLICATE;
+                memtree->size += record_size(record);
+                memtree->size -= record_size(rec);
+                if (!record->inarena)
+                        memtree->heaprecs = 1;
+
+                *slot = record;
+                memtree_record_free(memtree, rec);
                 goto done;
         }
 
@@ -507,6 +927,150 @@ done:
         return ret;
 }
 
+/* memtree_upsert():
+ * Sets the value of `key`, overwriting the value of its record where it
+ * is, if it fits in what was allocated for the record. Otherwise a new
+ * record, from the tree's arena, takes its place, or is inserted.
+ */
+int memtree_upsert(struct memtree *memtree,
+                   const unsigned char *key, size_t keylen,
+                   const unsigned char *val, size_t vallen,
+                   int deleted)
+{
+        memtree_iter_t iter;
+        struct record **slot;
+        struct record *rec;
+
+        slot = memtree_find_slot(memtree, key, keylen, iter);
+        if (slot && record_update_in_place(*slot, val, vallen, deleted,
+                                           &memtree->size))
+                return MEMTREE_OK;
+
+        rec = memtree_record_new(memtree, key, keylen, val, vallen, deleted);
+
+        if (slot) {
+                memtree->size += record_size(rec);
+                memtree->size -= record_size(*slot);
+                memtree_record_free(memtree, *slot);
+                *slot = rec;
+                return MEMTREE_OK;
+        }
+
+        memtree_insert_at(iter, rec);
+
+        return MEMTREE_OK;
+}
+
+/* memtree_bulk_load():
+ * Sorts the records, and drops all but the last of those with the same key,
+ * before building the tree from them, which is packed full.
+ */
+int memtree_bulk_load(struct memtree *memtree, struct record **recs,
+                      size_t count)
+{
+        struct record **tmp, **sorted;
+        struct memtree_node **nodes;
+        size_t i, n = 0;
+
+        if (memtree->count)
+                return MEMTREE_INVALID;
+
+        if (!count)
+                return MEMTREE_OK;
+
+        if (!memtree_records_in_runs(memtree, recs, count)) {
+                for (i = 0; i < count; i++)
+                        memtree_replace(memtree, recs[i]);
+                return MEMTREE_OK;
+        }
+
+        ALLOC_ARRAY(tmp, count);
+        sorted = memtree_sort_records(memtree, recs, tmp, count);
+
+        for (i = 0; i < count; i++) {
+                struct record *rec = sorted[i];
+
+                if (i + 1 < count &&
+                    !memtree_record_cmp(memtree, rec, sorted[i + 1])) {
+                        memtree_record_free(memtree, rec);
+                        continue;
+                }
+
+                memtree->size += record_size(rec);
+                if (!rec->inarena)
+                        memtree->heaprecs = 1;
+                sorted[n++] = rec;
+        }
+
+        ALLOC_ARRAY(nodes, (n + MEMTREE_MAX_ELEMENTS + 1) /
+                    (MEMTREE_MAX_ELEMENTS + 1));
+
+        memtree_node_release(memtree, memtree->root);
+        memtree->root = memtree_build(memtree, sorted, n, nodes);
+        memtree->count = n;
+
+        xfree(nodes);
+        xfree(tmp);
+
+        return MEMTREE_OK;
+}
+
+void memtree_loader_init(struct memtree_loader *loader, struct memtree *tree)
+{
+        memset(loader, 0, sizeof(struct memtree_loader));
+        loader->tree = tree;
+}
+
+int memtree_loader_add(struct memtree_loader *loader,
+                       const unsigned char *key, size_t keylen,
+                       const unsigned char *val, size_t vallen,
+                       int deleted)
+{
+        struct memtree *memtree = loader->tree;
+        struct record *rec;
+        size_t i;
+
+        if (loader->direct)
+                return memtree_upsert(memtree, key, keylen, val, vallen,
+                                      deleted);
+
+        rec = memtree_record_new(memtree, key, keylen, val, vallen, deleted);
+        if (!loader->count ||
+            memtree_record_cmp(memtree, loader->recs[loader->count - 1],
+                               rec) > 0)
+                loader->runs++;
+
+        ALLOC_GROW(loader->recs, loader->count + 1, loader->alloc);
+        loader->recs[loader->count++] = rec;
+
+        /* Records that are mostly out of order are inserted while they
+           are still in the cache, rather than all gone back to later */
+        if (loader->runs > MEMTREE_BULK_MAX_RUNS) {
+                for (i = 0; i < loader->count; i++)
+                        memtree_replace(memtree, loader->recs[i]);
+
+                xfree(loader->recs);
+                loader->count = loader->alloc = 0;
+                loader->direct = 1;
+        }
+
+        return MEMTREE_OK;
+}
+
+int memtree_loader_finish(struct memtree_loader *loader)
+{
+        int ret = MEMTREE_OK;
+
+        if (!loader->direct)
+                ret = memtree_bulk_load(loader->tree, loader->recs,
+                                        loader->count);
+
+        xfree(loader->recs);
+        memtree_loader_init(loader, loader->tree);
+
+        return ret;
+}
+
 int memtree_remove(struct memtree *memtree, unsigned char *key, size_t keylen)
 {
         memtree_iter_t iter;
@@ -578,7 +1142,9 @@ memtree_memcmp_fn(
 int memtree_destroy(struct record *record,
                   void *data _unused_)
 {
-        record_free(record);
+        /* Records from the arena are freed with it */
+        if (!record->inarena)
+                record_free(record);
         return 0;
 }
 
@@ -597,7 +1163,7 @@ int memtree_find(struct memtree *memtree, const unsigned char *key, size_t keyle
 
         while (1) {
                 int f = 0;
-                pos = memtree->search(key, keylen, node->recs, node->count, &f);
+                pos = node_search(memtree, node, key, keylen, &f);
                 if (f) {
                         iter->record = node->recs[pos];
                         found = 1;
@@ -611,8 +1177,13 @@ int memtree_find(struct memtree *memtree, const unsigned char *key, size_t keyle
 
         iter->node = node;
         iter->pos = pos;
-        if (!found)
-                iter->record = iter->node->recs[iter->pos];
+        if (!found) {
+                /* The record the key would go before, which is up the tree
+                 * if it would go at the end of the leaf. The iterator is
+                 * left where the key would be inserted. */
+                struct memtree_iter t = *iter;
+                iter->record = memtree_deref(&t) ? t.record : NULL;
+        }
 
         return found;
 }
@@ -626,6 +1197,9 @@ void memtree_insert_at(memtree_iter_t iter, struct record *record)
 
         /* Set the key/val for iter */
         iter->record = record;
+        memtree->size += record_size(record);
+        if (!record->inarena)
+                memtree->heaprecs = 1;
 
         /* If the node is not a leaf, iter through to the end of the left
            branch */
@@ -640,7 +1214,8 @@ void memtree_insert_at(memtree_iter_t iter, struct record *record)
                 /* Split the node, and try inserting the median and right
                    sumemtree into the parent*/
                 for (;;) {
-                        node_split(&branch, iter->node, &rec, iter->pos);
+                        node_split(memtree, &branch, iter->node, &rec,
+                                   iter->pos);
 
                         if (!memtree_ascend(iter))
                                 break;
@@ -653,12 +1228,14 @@ void memtree_insert_at(memtree_iter_t iter, struct record *record)
 
                 /* If we split all the way to the root, we create a new root */
                 assert(iter->node == memtree->root);
-                node = memtree_node_alloc(INTERNAL_NODE);
+                node = memtree_node_alloc(memtree, INTERNAL_NODE);
                 node->parent = NULL;
                 node->count = 1;
                 node->depth = memtree->root->depth + 1;
 
+                node->skip = 0;
                 node->recs[0] = rec;
+                node_prefix_add(node, 0, 1);
 
                 node->branches[0] = memtree->root;
                 memtree->root->parent = node;
@@ -698,11 +1275,13 @@ int memtree_remove_at(memtree_iter_t iter)
 {
         struct memtree *memtree = iter->tree;
         struct memtree_node *root = NULL;
+        struct record *removed;
 
         if (!memtree_deref(iter))
                 return 0;
 
-        /* record_free(iter->record); */
+        removed = iter->record;
+        memtree->size -= record_size(removed);
 
         if (!iter->node->depth) {
                 node_remove_leaf_element(iter->node, iter->pos);
@@ -711,7 +1290,9 @@ int memtree_remove_at(memtree_iter_t iter)
                         goto done;
         } else {
                 /* Save pointers to the data that needs to be removed*/
-                struct record **rec = &iter->node->recs[iter->pos];
+                struct memtree_node *node = iter->node;
+                uint32_t pos = iter->pos;
+                struct record **rec = &node->recs[pos];
 
                 /* Start branching */
                 iter->pos++;
@@ -719,6 +1300,7 @@ int memtree_remove_at(memtree_iter_t iter)
 
                 /* Replace with the successor */
                 *rec = iter->node->recs[0];
+                node_prefix_add(node, pos, node->count);
                 print_rec_entry(iter->node->recs[iter->pos]->key,
                                 iter->node->recs[iter->pos]->keylen);
 
@@ -732,7 +1314,7 @@ int memtree_remove_at(memtree_iter_t iter)
                 if (!memtree_ascend(iter))
                         break;
 
-                node_restore(iter->node, iter->pos);
+                node_restore(memtree, iter->node, iter->pos);
         }
 
         /* We've got to the root after combining */
@@ -742,10 +1324,13 @@ int memtree_remove_at(memtree_iter_t iter)
         if (root->count == 0) {
                 memtree->root = root->branches[0];
                 memtree->root->parent = NULL;
-                xfree(root);
+                memtree_node_release(memtree, root);
         }
 
 done:
+        /* Only now, as it is the successor that is taken out of a leaf,
+           when the record was in an internal node */
+        memtree_record_free(memtree, removed);
         memtree->count--;
         iter->node = NULL;
         return 1;
@@ -767,17 +1352,8 @@ struct record * record_new(const unsigned char *key, size_t keylen,
 {
         struct record *rec = NULL;
 
-        rec = xmalloc(sizeof(struct record));
-
-        rec->key = xmalloc(keylen + 1);
-        memcpy(rec->key, key, keylen);
-        rec->keylen = keylen;
-
-        rec->val = xmalloc(vallen + 1);
-        memcpy(rec->val, val, vallen);
-        rec->vallen = vallen;
-
-        rec->deleted = deleted;
+        rec = xmalloc(record_alloc_size(keylen, vallen));
+        record_init(rec, key, keylen, val, vallen, deleted);
 
         nodecount++;
         return rec;
@@ -786,9 +1362,8 @@ struct record * record_new(const unsigned char *key, size_t keylen,
 void record_free(struct record *record)
 {
         assert(record);
+        assert(!record->inarena);
 
-        xfree(record->key);
-        xfree(record->val);
         record->keylen = 0;
         record->vallen = 0;
         record->deleted = 0;
@@ -797,3 +1372,17 @@ void record_free(struct record *record)
 
         nodecount--;
 }
+
+struct record *memtree_record_new(struct memtree *memtree,
+                                  const unsigned char *key, size_t keylen,
+                                  const unsigned char *val, size_t vallen,
+                                  int deleted)
+{
+        struct record *rec;
+
+        rec = arena_alloc(memtree->arena, record_alloc_size(keylen, vallen));
+        record_init(rec, key, keylen, val, vallen, deleted);
+        rec->inarena = 1;
+
+        return rec;
+}
@@ -10,6 +10,8 @@
 
 #define _XOPEN_SOURCE 500       /* For ftruncate() see `man ftruncate` */
 
+#include <config.h>
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -24,10 +26,361 @@
 #include <libzeroskip/mfile.h>
 #include <libzeroskip/util.h>
 
-static struct mfile mf_init = {NULL, -1, MAP_FAILED, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+#include "uring.h"
+
+static struct mfile mf_init = {NULL, -1, MAP_FAILED, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                               0, 0, 0, NULL, 0, 0, 0, 0, NULL, 0, NULL};
 
 #define OPEN_MODE 0644
 
+/* Files that are written to are mapped with room to grow, so that a write
+ * past the end of the file doesn't mean mapping it all over again.
+ */
+#define MAP_RESERVE (64ULL * 1024 * 1024)
+
+/* A file that is written past its end is grown by as much as it already
+ * is, within these limits, and trimmed to what was written when it is
+ * closed.
+ */
+#define MIN_GROWTH  (64ULL * 1024)
+#define MAX_GROWTH  (64ULL * 1024 * 1024)
+
+/* Files opened with MFILE_PWRITE gather what is written to them in a buffer
+ * of at least this size, aligned for direct I/O.
+ */
+#define WBUF_SIZE     (1024ULL * 1024)
+#define DIRECT_ALIGN  4096
+
+/* The SQEs of a ring, for files opened with MFILE_URING */
+#define URING_ENTRIES 8
+
+#ifndef HAVE_FDATASYNC
+#define fdatasync fsync
+#endif
+
+/* Map at least `len` bytes of the file */
+static int mfile_map_len(struct mfile *mf, uint64_t len)
+{
+        uint64_t maplen = len;
+
+        if (mf->flags & MFILE_WR) {
+                if (maplen < MAP_RESERVE)
+                        maplen = MAP_RESERVE;
+                if (maplen < 2 * mf->maplen)
+                        maplen = 2 * mf->maplen;
+        }
+
+        if (mf->ptr != MAP_FAILED && mf->ptr)
+                munmap(mf->ptr, mf->maplen);
+        mf->maplen = 0;
+
+        if (!maplen) {
+                mf->ptr = NULL;
+                return 0;
+        }
+
+        mf->ptr = mmap(0, maplen, mf->mflags, MAP_SHARED, mf->fd, 0);
+        if (mf->ptr == MAP_FAILED)
+                return errno;
+
+        mf->maplen = maplen;
+
+        return 0;
+}
+
+/* Make the file at least `end` bytes long, for a write that ends there */
+static int mfile_extend(struct mfile *mf, uint64_t end)
+{
+        uint64_t alloc = end;
+        int err;
+
+        if (end <= mf->alloc) {
+                mf->size = end;
+                return 0;
+        }
+
+        /* An empty file is only made as big as it needs to be */
+        if (mf->alloc) {
+                uint64_t growth = mf->alloc;
+
+                if (growth < MIN_GROWTH)
+                        growth = MIN_GROWTH;
+                if (growth > MAX_GROWTH)
+                        growth = MAX_GROWTH;
+                if (alloc < mf->alloc + growth)
+                        alloc = mf->alloc + growth;
+        }
+
+        if (ftruncate(mf->fd, alloc) != 0)
+                return errno;
+
+        mf->alloc = alloc;
+
+        if (alloc > mf->maplen) {
+                err = mfile_map_len(mf, alloc);
+                if (err) {
+                        close(mf->fd);
+                        return err;
+                }
+        }
+
+        mf->size = end;
+
+        return 0;
+}
+
+/* Make the write buffer at least `len` bytes */
+static int mfile_wbuf_grow(struct mfile *mf, uint64_t len)
+{
+        uint64_t alloc = mf->wbuf_alloc ? mf->wbuf_alloc : WBUF_SIZE;
+        void *buf;
+
+        if (len <= mf->wbuf_alloc)
+                return 0;
+
+        while (alloc < len)
+                alloc *= 2;
+
+        if (posix_memalign(&buf, DIRECT_ALIGN, alloc) != 0)
+                return ENOMEM;
+
+        if (mf->wbuf_len)
+                memcpy(buf, mf->wbuf, mf->wbuf_len);
+        free(mf->wbuf);
+
+        mf->wbuf = buf;
+        mf->wbuf_alloc = alloc;
+
+        return 0;
+}
+
+/* Start writing what is buffered to the file. With a ring, the write is
+ * queued, and the buffer swapped for the spare one, so that more can be
+ * buffered while it is written. Otherwise it is written with as few
+ * pwrite()s as it takes.
+ *
+ * With MFILE_DIRECT, whole blocks are written, and the last one is kept in
+ * the buffer, to be written again with what is appended to it. The file is
+ * then zero padded to the block, which is trimmed like the space a mapped
+ * file is grown by.
+ */
+static int mfile_wbuf_start(struct mfile *mf)
+{
+        uint64_t end = mf->wbuf_start + mf->wbuf_len;
+        uint64_t len = mf->wbuf_len, done = 0, keep = 0;
+        unsigned char *from;
+        int err;
+
+        if (mf->wbuf_written == mf->wbuf_len)
+                return 0;
+
+        if (mf->flags & MFILE_DIRECT) {
+                len = (len + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+                memset(mf->wbuf + mf->wbuf_len, 0, len - mf->wbuf_len);
+        }
+
+        if (mf->ring) {
+                /* The spare buffer is free once what was written from it
+                 * is */
+                err = uring_wait(mf->ring);
+                if (!err)
+                        err = uring_queue_write(mf->ring, mf->fd, mf->wbuf,
+                                                len, mf->wbuf_start);
+                if (err)
+                        return err;
+        }
+
+        while (!mf->ring && done < len) {
+                ssize_t n = pwrite(mf->fd, mf->wbuf + done, len - done,
+                                   mf->wbuf_start + done);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+#ifdef O_DIRECT
+                        /* Some filesystems only refuse direct I/O when it
+                         * is done */
+                        if (errno == EINVAL && (mf->flags & MFILE_DIRECT) &&
+                            !done) {
+                                fcntl(mf->fd, F_SETFL,
+                                      fcntl(mf->fd, F_GETFL) & ~O_DIRECT);
+                                mf->flags &= ~MFILE_DIRECT;
+                                len = mf->wbuf_len;
+                                continue;
+                        }
+#endif
+                        return errno;
+                }
+
+                done += n;
+        }
+
+        if (mf->wbuf_start + len > mf->alloc)
+                mf->alloc = mf->wbuf_start + len;
+
+        if (mf->alloc > mf->maplen) {
+                err = mfile_map_len(mf, mf->alloc);
+                if (err)
+                        return err;
+        }
+
+        if (mf->flags & MFILE_DIRECT)
+                keep = end % DIRECT_ALIGN;
+        from = mf->wbuf + mf->wbuf_len - keep;
+
+        if (mf->ring) {
+                unsigned char *buf = mf->wbuf;
+                uint64_t alloc = mf->wbuf_alloc;
+
+                mf->wbuf = mf->wbuf_spare;
+                mf->wbuf_alloc = mf->wbuf_spare_alloc;
+                mf->wbuf_spare = buf;
+                mf->wbuf_spare_alloc = alloc;
+                mf->wbuf_len = 0;
+
+                if (keep) {
+                        err = mfile_wbuf_grow(mf, keep);
+                        if (err)
+                                return err;
+                        memcpy(mf->wbuf, from, keep);
+                }
+        } else {
+                memmove(mf->wbuf, from, keep);
+        }
+
+        mf->wbuf_start = end - keep;
+        mf->wbuf_len = mf->wbuf_written = keep;
+
+        return 0;
+}
+
+/* Write what is buffered to the file, and wait until it is */
+static int mfile_wbuf_write(struct mfile *mf)
+{
+        int err;
+
+        err = mfile_wbuf_start(mf);
+        if (!err && mf->ring)
+                err = uring_wait(mf->ring);
+
+        return err;
+}
+
+/* Add what is written at mf->offset to the write buffer */
+static int mfile_wbuf_add(struct mfile *mf, const struct iovec *iov,
+                          unsigned int iov_cnt, uint64_t total)
+{
+        unsigned int i;
+        int err;
+
+        /* Not appended to what is buffered */
+        if (mf->wbuf_len && mf->offset != mf->wbuf_start + mf->wbuf_len) {
+                err = mfile_wbuf_write(mf);
+                if (err)
+                        return err;
+
+                mf->wbuf_len = mf->wbuf_written = 0;
+        }
+
+        if (!mf->wbuf_len) {
+                /* Direct I/O starts at the block the write is in. All of
+                 * the file is written out, and mapped, by now. */
+                uint64_t head = (mf->flags & MFILE_DIRECT) ?
+                        mf->offset % DIRECT_ALIGN : 0;
+
+                err = mfile_wbuf_grow(mf, head + total);
+                if (!err && head && mf->ring)
+                        err = uring_wait(mf->ring);
+                if (err)
+                        return err;
+
+                mf->wbuf_start = mf->offset - head;
+                if (head)
+                        memcpy(mf->wbuf, mf->ptr + mf->wbuf_start, head);
+                mf->wbuf_len = mf->wbuf_written = head;
+        } else if (mf->wbuf_len + total > mf->wbuf_alloc) {
+                /* Written while the next of it is buffered */
+                err = mfile_wbuf_start(mf);
+                if (!err && mf->ring)
+                        err = uring_submit(mf->ring);
+                if (err)
+                        return err;
+        }
+
+        err = mfile_wbuf_grow(mf, mf->wbuf_len + total);
+        if (err)
+                return err;
+
+        for (i = 0; i < iov_cnt; i++) {
+                memcpy(mf->wbuf + mf->wbuf_len, iov[i].iov_base,
+                       iov[i].iov_len);
+                mf->wbuf_len += iov[i].iov_len;
+        }
+
+        mf->offset += total;
+        if (mf->offset > mf->size)
+                mf->size = mf->offset;
+
+        return 0;
+}
+
+/* Forget what is buffered, once it has been written */
+static void mfile_wbuf_reset(struct mfile *mf)
+{
+        mf->wbuf_len = 0;
+        mf->wbuf_written = 0;
+}
+
+/* The CRC32 of `len` bytes at `offset`, some of which can still be in the
+ * write buffer */
+static uint32_t mfile_crc32(struct mfile *mf, uint32_t crc, uint64_t offset,
+                            uint64_t len)
+{
+        uint64_t end = offset + len, split = end;
+
+        /* What is before the buffer can still be on its way to the file.
+         * If it doesn't get there, the commit fails when it is synced, or
+         * written out. */
+        if (mf->ring)
+                uring_wait(mf->ring);
+
+        if (mf->wbuf_len && end > mf->wbuf_start)
+                split = offset > mf->wbuf_start ? offset : mf->wbuf_start;
+
+        if (split > offset)
+                crc = crc32c_hw(crc, mf->ptr + offset, split - offset);
+
+        if (end > split)
+                crc = crc32c_hw(crc, mf->wbuf + (split - mf->wbuf_start),
+                                end - split);
+
+        return crc;
+}
+
+/* Fold what is written at `offset` into the CRC32 being computed, while the
+ * data is still in the cache. That only works as long as it is written
+ * where the last write ended; otherwise crc32_end() reads it back. */
+static void mfile_crc32_add(struct mfile *mf, uint64_t offset,
+                            const struct iovec *iov, unsigned int iov_cnt,
+                            uint64_t len)
+{
+        unsigned int i;
+
+        mf->crc32_data_len += len;
+
+        if (offset != mf->crc32_offset) {
+                mf->crc32_offset = UINT64_MAX;
+                return;
+        }
+
+        for (i = 0; i < iov_cnt; i++) {
+                if (iov[i].iov_len)
+                        mf->crc32 = crc32c_hw(mf->crc32, iov[i].iov_base,
+                                              iov[i].iov_len);
+        }
+
+        mf->crc32_offset += len;
+}
+
 /*
   mfile_open():
 
@@ -74,6 +427,19 @@ int mfile_open(const char *fname, uint32_t flags, struct mfile **mfp)
                 oflags = O_RDONLY;
         }
 
+        /* Written with pwrite(), and only read through the mapping */
+        if (flags & (MFILE_DIRECT | MFILE_URING))
+                mf->flags |= MFILE_PWRITE;
+        if (mf->flags & MFILE_PWRITE)
+                mflags = PROT_READ;
+
+#ifdef O_DIRECT
+        if (flags & MFILE_DIRECT)
+                oflags |= O_DIRECT;
+#else
+        mf->flags &= ~MFILE_DIRECT;
+#endif
+
         if (flags & MFILE_CREATE)
                 oflags |= O_CREAT;
 
@@ -81,6 +447,13 @@ int mfile_open(const char *fname, uint32_t flags, struct mfile **mfp)
                 oflags |= O_EXCL;
 
         mf->fd = open(fname, oflags, OPEN_MODE);
+#ifdef O_DIRECT
+        /* Not every filesystem can do direct I/O */
+        if (mf->fd < 0 && errno == EINVAL && (flags & MFILE_DIRECT)) {
+                mf->flags &= ~MFILE_DIRECT;
+                mf->fd = open(fname, oflags & ~O_DIRECT, OPEN_MODE);
+        }
+#endif
         if (mf->fd < 0) {
                 perror("mfile_open:open");
                 return errno;
@@ -93,18 +466,20 @@ int mfile_open(const char *fname, uint32_t flags, struct mfile **mfp)
                 return err;
         }
 
+        mf->mflags = mflags;
         mf->size = st.st_size;
-        if (mf->size) {
-                mf->ptr = mmap(0, mf->size, mflags, MAP_SHARED, mf->fd, 0);
-                if (mf->ptr == MAP_FAILED) {
-                        int err = errno;
-                        close(mf->fd);
-                        return err;
-                }
-        } else
-                mf->ptr = NULL;
+        mf->alloc = st.st_size;
 
-        mf->mflags = mflags;
+        /* Or without io_uring, if there is none */
+        if ((flags & MFILE_URING) &&
+            uring_init(&mf->ring, URING_ENTRIES) != 0)
+                mf->flags &= ~MFILE_URING;
+
+        ret = mfile_map_len(mf, mf->size);
+        if (ret) {
+                close(mf->fd);
+                return ret;
+        }
 
         *mfp = mf;
 
@@ -159,8 +534,16 @@ int mfile_close(struct mfile **mfp)
 
                 xfree(mf->filename);
 
+                mfile_trim(mfp);
+                if (mf->ring) {
+                        uring_wait(mf->ring);
+                        uring_free(&mf->ring);
+                }
+                free(mf->wbuf);
+                free(mf->wbuf_spare);
+
                 if (mf->ptr != MAP_FAILED && mf->ptr) {
-                        munmap(mf->ptr, mf->size);
+                        munmap(mf->ptr, mf->maplen);
                         mf->ptr = MAP_FAILED;
                 }
 
@@ -193,6 +576,7 @@ int mfile_read(struct mfile **mfp, void *obuf,
 {
         struct mfile *mf = *mfp;
         uint64_t n = 0;
+        int err;
 
         if (!mf)
             return EINVAL;
@@ -200,6 +584,10 @@ int mfile_read(struct mfile **mfp, void *obuf,
         if (mf == &mf_init || mf->ptr == MAP_FAILED)
                 return EINVAL;
 
+        err = mfile_wbuf_write(mf);
+        if (err)
+                return err;
+
         if (mf->offset < mf->size) {
                 n = ((mf->offset + obufsize) > mf->size) ?
                         mf->size - mf->offset : obufsize;
@@ -230,6 +618,8 @@ int mfile_write(struct mfile **mfp, void *ibuf, uint64_t ibufsize,
                      uint64_t *nbytes)
 {
         struct mfile *mf = *mfp;
+        struct iovec iov;
+        uint64_t start;
 
         if (!mf)
             return EINVAL;
@@ -243,41 +633,33 @@ int mfile_write(struct mfile **mfp, void *ibuf, uint64_t ibufsize,
             !(mf->flags & MFILE_RW_CR))
                 return EACCES;
 
-        if (mf->size < (mf->offset + ibufsize)) {
-                /* If the input buffer's size is bigger, we overwrite. */
-                if (mf->ptr && munmap(mf->ptr, mf->size) != 0) {
-                        int err = errno;
-                        mf->ptr = MAP_FAILED;
-                        close(mf->fd);
-                        return err;
-                }
-
-                if (ftruncate(mf->fd, mf->offset + ibufsize) != 0)
-                        return errno;
+        start = mf->offset;
+        iov.iov_base = ibuf;
+        iov.iov_len = ibufsize;
 
-                mf->ptr = mmap(0, mf->offset + ibufsize, mf->flags,
-                               MAP_SHARED, mf->fd, 0);
-                if (mf->ptr == MAP_FAILED) {
-                        int err = errno;
-                        close(mf->fd);
+        if (mf->flags & MFILE_PWRITE) {
+                int err = mfile_wbuf_add(mf, &iov, 1, ibufsize);
+                if (err)
                         return err;
+        } else {
+                if (mf->size < (mf->offset + ibufsize)) {
+                        int err = mfile_extend(mf, mf->offset + ibufsize);
+                        if (err)
+                                return err;
                 }
 
-                mf->size = mf->offset + ibufsize;
-        }
-
-        if (ibufsize) {
-                memcpy(mf->ptr + mf->offset, ibuf, ibufsize);
-                mf->offset += ibufsize;
+                if (ibufsize) {
+                        memcpy(mf->ptr + mf->offset, ibuf, ibufsize);
+                        mf->offset += ibufsize;
+                }
         }
 
         if (nbytes)
                 *nbytes = ibufsize;
 
         /* compute CRC32 */
-        if (mf->compute_crc) {
-                mf->crc32_data_len += ibufsize;
-        }
+        if (mf->compute_crc)
+                mfile_crc32_add(mf, start, &iov, 1, ibufsize);
 
         return 0;
 }
@@ -295,6 +677,7 @@ int mfile_write_iov(struct mfile **mfp, const struct iovec *iov,
         struct mfile *mf = *mfp;
         unsigned int i;
         uint64_t total_bytes = 0;
+        uint64_t start;
 
         if (!mf)
             return EINVAL;
@@ -312,30 +695,19 @@ int mfile_write_iov(struct mfile **mfp, const struct iovec *iov,
                 total_bytes += iov[i].iov_len;
         }
 
-        if (mf->size < (mf->offset + total_bytes)) {
-                /* If the input buffer's size is bigger, we overwrite. */
-                if (mf->ptr && munmap(mf->ptr, mf->size) != 0) {
-                        int err = errno;
-                        mf->ptr = MAP_FAILED;
-                        close(mf->fd);
-                        return err;
-                }
-
-                if (ftruncate(mf->fd, mf->offset + total_bytes) != 0)
-                        return 0;
+        start = mf->offset;
 
-                mf->ptr = mmap(0, mf->offset + total_bytes, mf->flags,
-                               MAP_SHARED, mf->fd, 0);
-                if (mf->ptr == MAP_FAILED) {
-                        int err = errno;
-                        close(mf->fd);
+        if (mf->flags & MFILE_PWRITE) {
+                int err = mfile_wbuf_add(mf, iov, iov_cnt, total_bytes);
+                if (err)
+                        return err;
+        } else if (mf->size < (mf->offset + total_bytes)) {
+                int err = mfile_extend(mf, mf->offset + total_bytes);
+                if (err)
                         return err;
-                }
-
-                mf->size = mf->offset + total_bytes;
         }
 
-        if (total_bytes) {
+        if (total_bytes && !(mf->flags & MFILE_PWRITE)) {
                 for (i = 0; i < iov_cnt; i++) {
                         memcpy(mf->ptr + mf->offset, iov[i].iov_base,
                                iov[i].iov_len);
@@ -346,9 +718,36 @@ int mfile_write_iov(struct mfile **mfp, const struct iovec *iov,
         if (nbytes)
                 *nbytes = total_bytes;
 
+        /* compute CRC32 */
+        if (mf->compute_crc)
+                mfile_crc32_add(mf, start, iov, iov_cnt, total_bytes);
+
         return 0;
 }
 
+/*
+  mfile_write_out():
+
+  Write what has been buffered for a file opened with MFILE_PWRITE, so that
+  others can read it. It isn't synced.
+
+  * Return:
+    - On Success: returns 0
+    - On Failure: returns non 0
+ */
+int mfile_write_out(struct mfile **mfp)
+{
+        struct mfile *mf = *mfp;
+
+        if (!mf)
+            return EINVAL;
+
+        if (mf == &mf_init || mf->ptr == MAP_FAILED)
+                return EINVAL;
+
+        return mfile_wbuf_write(mf);
+}
+
 /*
   mfile_size():
 
@@ -370,28 +769,21 @@ int mfile_size(struct mfile **mfp, uint64_t *psize)
         if (mf == &mf_init || mf->ptr == MAP_FAILED)
                 return EINVAL;
 
-        if (mf->ptr && (mf->flags & PROT_WRITE))
-                msync(mf->ptr, mf->size, MS_SYNC);
+        err = mfile_wbuf_write(mf);
+        if (err)
+                return err;
 
         if (fstat(mf->fd, &stbuf) != 0)
                 return errno;
 
-        if (mf->size != (uint64_t) stbuf.st_size) {
-                if (mf->ptr)
-                        err = munmap(mf->ptr, mf->size);
-
-                if (err != 0)
-                        err = errno;
-                else {
-                        mf->size = stbuf.st_size;
-                        if (mf->size) {
-                                mf->ptr = mmap(0, mf->size, mf->flags,
-                                               MAP_SHARED, mf->fd, 0);
-                                if (mf->ptr == MAP_FAILED)
-                                        err = errno;
-                        } else
-                                mf->ptr = NULL;
-                }
+        /* Someone else has changed the size of the file. Space we have
+         * grown the file by isn't a change. */
+        if (mf->alloc != (uint64_t) stbuf.st_size) {
+                mfile_wbuf_reset(mf);
+                mf->size = stbuf.st_size;
+                mf->alloc = stbuf.st_size;
+                if (mf->size > mf->maplen)
+                        err = mfile_map_len(mf, mf->size);
         }
 
         if (err != 0) {
@@ -400,7 +792,7 @@ int mfile_size(struct mfile **mfp, uint64_t *psize)
                 mf->fd = -1;
         } else {
                 if (psize)
-                        *psize = stbuf.st_size;
+                        *psize = mf->size;
         }
 
         return err;
@@ -423,9 +815,6 @@ int mfile_stat(struct mfile **mfp, struct stat *stbuf)
         if (mf == &mf_init || mf->ptr == MAP_FAILED)
                 return EINVAL;
 
-        if (mf->ptr && (mf->flags & PROT_WRITE))
-                msync(mf->ptr, mf->size, MS_SYNC);
-
         if (fstat(mf->fd, stbuf) != 0)
                 return errno;
 
@@ -450,24 +839,61 @@ int mfile_truncate(struct mfile **mfp, uint64_t len)
         if (mf == &mf_init || mf->ptr == MAP_FAILED || mf->ptr == NULL)
                 return EINVAL;
 
-        if (munmap(mf->ptr, mf->size) != 0) {
-                err = errno;
-                mf->ptr = MAP_FAILED;
-                close(mf->fd);
+        err = mfile_wbuf_write(mf);
+        if (err)
                 return err;
-        }
+        mfile_wbuf_reset(mf);
 
         if (ftruncate(mf->fd, len) != 0)
                 return errno;
 
-        mf->ptr = len ? mmap(0, len, mf->flags, MAP_SHARED, mf->fd, 0) : NULL;
-        if (mf->ptr == MAP_FAILED) {
-                err = errno;
-                close(mf->fd);
-                return err;
+        mf->size = len;
+        mf->alloc = len;
+
+        if (len > mf->maplen) {
+                err = mfile_map_len(mf, len);
+                if (err) {
+                        close(mf->fd);
+                        return err;
+                }
         }
 
-        mf->size = len;
+        return 0;
+}
+
+/*
+  mfile_trim()
+
+  Give back the space the file has been grown by, past what was written to
+  it. This is done when the file is closed, but a file that others append
+  to needs to be trimmed before they can.
+
+  * Return:
+    - On Success: returns 0
+    - On Failure: returns non 0
+ */
+int mfile_trim(struct mfile **mfp)
+{
+        struct mfile *mf = *mfp;
+        int err;
+
+        if (!mf)
+            return EINVAL;
+
+        if (mf == &mf_init || mf->ptr == MAP_FAILED)
+                return EINVAL;
+
+        err = mfile_wbuf_write(mf);
+        if (err)
+                return err;
+
+        if (mf->alloc <= mf->size)
+                return 0;
+
+        if (ftruncate(mf->fd, mf->size) != 0)
+                return errno;
+
+        mf->alloc = mf->size;
 
         return 0;
 }
@@ -489,12 +915,98 @@ int mfile_flush(struct mfile **mfp)
         if (mf == &mf_init || mf->ptr == MAP_FAILED || mf->ptr == NULL)
                 return EINVAL;
 
+        /* With a ring, the sync is queued after the write, and waited for
+         * with it */
+        if (mf->ring) {
+                int err = mfile_wbuf_start(mf);
+                if (!err)
+                        err = uring_queue_fsync(mf->ring, mf->fd);
+                if (!err)
+                        err = uring_wait(mf->ring);
+
+                return err;
+        }
+
+        if (mf->flags & MFILE_PWRITE) {
+                int err = mfile_wbuf_write(mf);
+                if (err)
+                        return err;
+
+                return fdatasync(mf->fd);
+        }
+
         if (mf->flags & PROT_WRITE)
                 return msync(mf->ptr, mf->size, MS_SYNC);
 
         return 0;
 }
 
+/*
+  mfile_flush_range()
+
+  Like mfile_flush(), for the `len` bytes at `offset` only. The range is
+  widened to whole pages, as msync() needs.
+
+  * Return:
+  - On Success: returns 0
+  - On Failure: returns non 0
+*/
+int mfile_flush_range(struct mfile **mfp, uint64_t offset, uint64_t len)
+{
+        struct mfile *mf = *mfp;
+        uint64_t pagesize, start, end;
+
+        if (!mf)
+            return EINVAL;
+
+        if (mf == &mf_init || mf->ptr == MAP_FAILED || mf->ptr == NULL)
+                return EINVAL;
+
+        if (!(mf->flags & PROT_WRITE))
+                return 0;
+
+        /* Nothing is written through the mapping */
+        if (mf->flags & MFILE_PWRITE)
+                return mfile_flush(mfp);
+
+        end = offset + len;
+        if (end > mf->size)
+                end = mf->size;
+
+        pagesize = sysconf(_SC_PAGESIZE);
+        start = offset - offset % pagesize;
+        if (start >= end)
+                return 0;
+
+        return msync(mf->ptr + start, end - start, MS_SYNC);
+}
+
+/*
+  mfile_willneed()
+
+  Tell the kernel that all of the file is about to be read, so that it is
+  read in ahead, in large chunks, rather than a page fault at a time.
+
+  * Return:
+  - On Success: returns 0
+  - On Failure: returns non 0
+*/
+int mfile_willneed(struct mfile **mfp)
+{
+        struct mfile *mf = *mfp;
+
+        if (!mf)
+            return EINVAL;
+
+        if (mf == &mf_init || mf->ptr == MAP_FAILED || mf->ptr == NULL)
+                return EINVAL;
+
+        if (!mf->size)
+                return 0;
+
+        return posix_madvise(mf->ptr, mf->size, POSIX_MADV_WILLNEED);
+}
+
 /*
   mfile_seek()
 
@@ -528,16 +1040,20 @@ void crc32_begin(struct mfile **mfp)
         (*mfp)->crc32 = crc32c(0, 0, 0);
         (*mfp)->compute_crc = 1;
         (*mfp)->crc32_begin_offset = (*mfp)->offset;
+        (*mfp)->crc32_offset = (*mfp)->offset;
         (*mfp)->crc32_data_len = 0;
 }
 
 uint32_t crc32_end(struct mfile **mfp)
 {
         if ((*mfp)->compute_crc) {
-                (*mfp)->crc32_data_len = (*mfp)->offset - (*mfp)->crc32_begin_offset;
-                (*mfp)->crc32 = crc32c_hw((*mfp)->crc32,
-                                          ((*mfp)->ptr + (*mfp)->crc32_begin_offset),
-                                          (*mfp)->crc32_data_len);
+                /* The file was seeked or truncated under the CRC32, so it
+                   is computed over what is there now */
+                if ((*mfp)->crc32_offset != (*mfp)->offset)
+                        (*mfp)->crc32 = mfile_crc32(*mfp, crc32c(0, 0, 0),
+                                                    (*mfp)->crc32_begin_offset,
+                                                    (*mfp)->offset -
+                                                    (*mfp)->crc32_begin_offset);
                 (*mfp)->compute_crc = 0;
                 (*mfp)->crc32_data_len = 0;
         }
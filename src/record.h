@@ -0,0 +1,63 @@
+/*
+ * record.h
+ *
+ * Records of the in-memory trees, kept in an arena
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <string.h>
+
+#include <libzeroskip/macros.h>
+#include <libzeroskip/memtree.h>
+
+#include "arena.h"
+
+CPP_GUARD_START
+
+/* The memory a record takes up, with its key and value, each of them
+ * followed by a NUL */
+static inline size_t record_alloc_size(size_t keylen, size_t vallen)
+{
+        return sizeof(struct record) + keylen + vallen + 2;
+}
+
+/* record_update_in_place():
+ * Sets the value of `rec` where it is, if its arena block is the same size
+ * with the new value as with the old one, so that the record can still be
+ * released by its size afterwards. `*size`, the size of the tree the record
+ * is in, is adjusted. Returns 1 if the record was updated, and 0 if it
+ * needs replacing with a new one.
+ */
+static inline int record_update_in_place(struct record *rec,
+                                         const unsigned char *val,
+                                         size_t vallen, int deleted,
+                                         size_t *size)
+{
+        size_t oldsize = record_alloc_size(rec->keylen, rec->vallen);
+
+        if (!rec->inarena || oldsize > ARENA_MAX_BLOCK ||
+            arena_block_size(oldsize) !=
+            arena_block_size(record_alloc_size(rec->keylen, vallen)))
+                return 0;
+
+        *size += vallen;
+        *size -= rec->vallen;
+
+        if (vallen)
+                memmove(rec->val, val, vallen);
+        rec->val[vallen] = '\0';
+        rec->vallen = vallen;
+        rec->deleted = deleted;
+
+        return 1;
+}
+
+CPP_GUARD_END
+#endif  /* _RECORD_H_ */
@@ -0,0 +1,406 @@
+/*
+ * uring.c
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <config.h>
+
+#include "uring.h"
+#include <libzeroskip/util.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+/* What a queued write was, to finish it if it comes up short */
+struct uring_op {
+        int fd;
+        struct iovec iov;       /* iov_base is NULL for a sync */
+        uint64_t offset;
+};
+
+struct uring {
+        int fd;
+        unsigned int entries;
+
+        unsigned int *sq_head;
+        unsigned int *sq_tail;
+        unsigned int *sq_mask;
+        unsigned int *sq_array;
+        struct io_uring_sqe *sqes;
+
+        unsigned int *cq_head;
+        unsigned int *cq_tail;
+        unsigned int *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        void *sq_ptr;
+        size_t sq_len;
+        void *cq_ptr;
+        size_t cq_len;
+        size_t sqes_len;
+
+        struct uring_op *ops;   /* By the index of their SQE */
+        unsigned int queued;    /* Not submitted yet */
+        unsigned int inflight;  /* Submitted, and not completed yet */
+        int error;              /* Of the first I/O that failed */
+};
+
+/**
+ * Private functions
+ */
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+        return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags)
+{
+        return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                            flags, NULL, 0);
+}
+
+static int pwrite_all(int fd, const unsigned char *buf, uint64_t len,
+                      uint64_t offset)
+{
+        while (len) {
+                ssize_t n = pwrite(fd, buf, len, offset);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return errno;
+                }
+
+                buf += n;
+                len -= n;
+                offset += n;
+        }
+
+        return 0;
+}
+
+/* The next free SQE, which is submitted once uring_sqe_queue() is called
+ * for it */
+static struct io_uring_sqe *uring_sqe_get(struct uring *ring,
+                                          unsigned int *idx)
+{
+        struct io_uring_sqe *sqe;
+
+        /* Make room, by finishing what is in flight. Whatever fails is
+         * kept in ring->error. */
+        if (ring->queued + ring->inflight >= ring->entries)
+                uring_wait(ring);
+
+        *idx = *ring->sq_tail & *ring->sq_mask;
+
+        sqe = &ring->sqes[*idx];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->user_data = *idx;
+
+        return sqe;
+}
+
+static void uring_sqe_queue(struct uring *ring, unsigned int idx)
+{
+        ring->sq_array[idx] = idx;
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+        ring->queued++;
+}
+
+static void uring_complete(struct uring *ring, const struct io_uring_cqe *cqe)
+{
+        struct uring_op *op = &ring->ops[cqe->user_data];
+        int err = 0;
+
+        if (cqe->res < 0) {
+                err = -cqe->res;
+        } else if (op->iov.iov_base && (uint64_t)cqe->res < op->iov.iov_len) {
+                /* A short write. The rest is written here. */
+                err = pwrite_all(op->fd,
+                                 (unsigned char *)op->iov.iov_base + cqe->res,
+                                 op->iov.iov_len - cqe->res,
+                                 op->offset + cqe->res);
+        }
+
+        if (err && !ring->error)
+                ring->error = err;
+}
+
+/**
+ * Public functions
+ */
+
+/* uring_init():
+ * Sets up a ring of at least `entries` SQEs.
+ *
+ * Return:
+ *   Success : 0
+ *   Failure : the errno, ENOSYS if there is no io_uring
+ */
+int uring_init(struct uring **pring, unsigned int entries)
+{
+        struct io_uring_params p;
+        struct uring *ring;
+        int err;
+
+        memset(&p, 0, sizeof(p));
+
+        ring = xcalloc(1, sizeof(struct uring));
+        ring->sq_ptr = ring->cq_ptr = MAP_FAILED;
+        ring->sqes = MAP_FAILED;
+
+        ring->fd = sys_io_uring_setup(entries, &p);
+        if (ring->fd < 0) {
+                err = errno;
+                xfree(ring);
+                return err;
+        }
+
+        ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+        ring->cq_len = p.cq_off.cqes +
+                p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_len > ring->sq_len)
+                        ring->sq_len = ring->cq_len;
+                ring->cq_len = ring->sq_len;
+        }
+
+        ring->sq_ptr = mmap(0, ring->sq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_SQ_RING);
+        if (ring->sq_ptr == MAP_FAILED)
+                goto fail;
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->cq_ptr = ring->sq_ptr;
+        } else {
+                ring->cq_ptr = mmap(0, ring->cq_len, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, ring->fd,
+                                    IORING_OFF_CQ_RING);
+                if (ring->cq_ptr == MAP_FAILED)
+                        goto fail;
+        }
+
+        ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(0, ring->sqes_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED)
+                goto fail;
+
+        ring->sq_head = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.head);
+        ring->sq_tail = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.tail);
+        ring->sq_mask = (unsigned int *)((char *)ring->sq_ptr +
+                                         p.sq_off.ring_mask);
+        ring->sq_array = (unsigned int *)((char *)ring->sq_ptr +
+                                          p.sq_off.array);
+
+        ring->cq_head = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.head);
+        ring->cq_tail = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.tail);
+        ring->cq_mask = (unsigned int *)((char *)ring->cq_ptr +
+                                         p.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr +
+                                             p.cq_off.cqes);
+
+        ring->entries = p.sq_entries;
+        ring->ops = xcalloc(p.sq_entries, sizeof(struct uring_op));
+
+        *pring = ring;
+
+        return 0;
+
+fail:
+        err = errno;
+        uring_free(&ring);
+        return err;
+}
+
+void uring_free(struct uring **pring)
+{
+        struct uring *ring;
+
+        if (!pring || !*pring)
+                return;
+
+        ring = *pring;
+
+        if (ring->sqes != MAP_FAILED)
+                munmap(ring->sqes, ring->sqes_len);
+        if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+                munmap(ring->cq_ptr, ring->cq_len);
+        if (ring->sq_ptr != MAP_FAILED)
+                munmap(ring->sq_ptr, ring->sq_len);
+
+        close(ring->fd);
+        xfree(ring->ops);
+        xfree(ring);
+
+        *pring = NULL;
+}
+
+/* uring_queue_write():
+ * Queues a write of `len` bytes of `buf`, which has to stay as it is until
+ * the write is waited for.
+ */
+int uring_queue_write(struct uring *ring, int fd, const void *buf,
+                      uint64_t len, uint64_t offset)
+{
+        struct io_uring_sqe *sqe;
+        struct uring_op *op;
+        unsigned int idx;
+
+        sqe = uring_sqe_get(ring, &idx);
+
+        op = &ring->ops[idx];
+        op->fd = fd;
+        iov_set(&op->iov, buf, len);
+        op->offset = offset;
+
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)&op->iov;
+        sqe->len = 1;
+        sqe->off = offset;
+
+        uring_sqe_queue(ring, idx);
+
+        return ring->error;
+}
+
+/* uring_queue_fsync():
+ * Queues an fdatasync() of `fd`, which is done once everything queued
+ * before it has completed.
+ */
+int uring_queue_fsync(struct uring *ring, int fd)
+{
+        struct io_uring_sqe *sqe;
+        unsigned int idx;
+
+        sqe = uring_sqe_get(ring, &idx);
+
+        memset(&ring->ops[idx], 0, sizeof(struct uring_op));
+
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->flags = IOSQE_IO_DRAIN;
+        sqe->fd = fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+
+        uring_sqe_queue(ring, idx);
+
+        return ring->error;
+}
+
+/* uring_submit():
+ * Starts what has been queued, without waiting for it.
+ */
+int uring_submit(struct uring *ring)
+{
+        while (ring->queued) {
+                int n = sys_io_uring_enter(ring->fd, ring->queued, 0, 0);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (!ring->error)
+                                ring->error = errno;
+                        break;
+                }
+
+                ring->queued -= n;
+                ring->inflight += n;
+        }
+
+        return ring->error;
+}
+
+/* uring_wait():
+ * Submits what has been queued, and waits for all of it to complete.
+ *
+ * Return:
+ *   Success : 0
+ *   Failure : the errno of the first I/O that failed, on this or any
+ *             earlier call
+ */
+int uring_wait(struct uring *ring)
+{
+        while (ring->queued || ring->inflight) {
+                unsigned int head = *ring->cq_head;
+                unsigned int tail = __atomic_load_n(ring->cq_tail,
+                                                    __ATOMIC_ACQUIRE);
+
+                if (head == tail) {
+                        int n = sys_io_uring_enter(ring->fd, ring->queued, 1,
+                                                   IORING_ENTER_GETEVENTS);
+                        if (n < 0) {
+                                if (errno == EINTR)
+                                        continue;
+                                if (!ring->error)
+                                        ring->error = errno;
+                                break;
+                        }
+
+                        ring->queued -= n;
+                        ring->inflight += n;
+                        continue;
+                }
+
+                for (; head != tail; head++) {
+                        uring_complete(ring,
+                                       &ring->cqes[head & *ring->cq_mask]);
+                        ring->inflight--;
+                }
+
+                __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        return ring->error;
+}
+
+#else  /* No io_uring */
+
+int uring_init(struct uring **pring _unused_, unsigned int entries _unused_)
+{
+        return ENOSYS;
+}
+
+void uring_free(struct uring **pring _unused_)
+{
+}
+
+int uring_queue_write(struct uring *ring _unused_, int fd _unused_,
+                      const void *buf _unused_, uint64_t len _unused_,
+                      uint64_t offset _unused_)
+{
+        return ENOSYS;
+}
+
+int uring_queue_fsync(struct uring *ring _unused_, int fd _unused_)
+{
+        return ENOSYS;
+}
+
+int uring_submit(struct uring *ring _unused_)
+{
+        return ENOSYS;
+}
+
+int uring_wait(struct uring *ring _unused_)
+{
+        return ENOSYS;
+}
+
+#endif  /* HAVE_LINUX_IO_URING_H */
@@ -0,0 +1,30 @@
+/*
+ * uring.h
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#ifndef _ZS_URING_H_
+#define _ZS_URING_H_
+
+#include <stdint.h>
+
+/* A small io_uring, for queueing writes and syncs of a file without
+ * waiting for them. Without io_uring, uring_init() fails with ENOSYS, and
+ * callers do their I/O themselves.
+ */
+struct uring;
+
+int uring_init(struct uring **pring, unsigned int entries);
+void uring_free(struct uring **pring);
+int uring_queue_write(struct uring *ring, int fd, const void *buf,
+                      uint64_t len, uint64_t offset);
+int uring_queue_fsync(struct uring *ring, int fd);
+int uring_submit(struct uring *ring);
+int uring_wait(struct uring *ring);
+
+#endif  /* _ZS_URING_H_ */
@@ -13,6 +13,7 @@
 #include "zeroskip-priv.h"
 
 #include <libzeroskip/zeroskip.h>
+#include <inttypes.h>
 #include <zlib.h>
 
 /*
@@ -31,6 +32,13 @@ int zs_active_file_open(struct zsdb_priv *priv, uint32_t idx, int create)
         size_t mf_size = 0;
         int mfile_flags = MFILE_RW;
 
+        if (priv->flags & MODE_PWRITE)
+                mfile_flags |= MFILE_PWRITE;
+        if (priv->flags & MODE_DIRECT)
+                mfile_flags |= MFILE_DIRECT;
+        if (priv->flags & MODE_URING)
+                mfile_flags |= MFILE_URING;
+
         zs_filename_generate_active(priv, &priv->dbfiles.factive.fname);
 
         /* Initialise the header fields */
@@ -88,8 +96,11 @@ int zs_active_file_close(struct zsdb_priv *priv)
         if (priv->dbfiles.factive.dirty) {
                 /* XXX: If not committed, just ignore. */
                 ret = zs_active_file_write_commit_record(priv);
-                if (ret == ZS_OK)
+                if (ret == ZS_OK) {
                         priv->dbfiles.factive.dirty = 0;
+                        ret = zs_active_file_sync(priv,
+                                                  priv->dotzsdb.offset);
+                }
         }
 
         mfile_close(&priv->dbfiles.factive.mf);
@@ -150,9 +161,23 @@ int zs_active_file_new(struct zsdb_priv *priv, uint32_t idx)
         size_t mfsize = 0;
         int mfile_flags = MFILE_RW | MFILE_CREATE;
 
+        if (priv->flags & MODE_PWRITE)
+                mfile_flags |= MFILE_PWRITE;
+        if (priv->flags & MODE_DIRECT)
+                mfile_flags |= MFILE_DIRECT;
+        if (priv->flags & MODE_URING)
+                mfile_flags |= MFILE_URING;
+
         /* Update the index and offset in .zsdb */
         zs_dotzsdb_update_index_and_offset(priv, idx, ZS_HDR_SIZE);
 
+        /* The records of finalised files stay in the in-memory tree until
+         * the DB is reloaded */
+        priv->finalise.basecount = priv->memtable ?
+                memtable_count(priv->memtable) : 0;
+        priv->finalise.basesize = priv->memtable ?
+                memtable_size(priv->memtable) : 0;
+
         zs_filename_generate_active(priv, &priv->dbfiles.factive.fname);
 
         /* Initialise the header fields of factive */
@@ -220,6 +245,26 @@ int zs_active_file_write_delete_record(struct zsdb_priv *priv,
                                            key, keylen);
 }
 
+/* zs_active_file_write_batch():
+ * Appends the records of a batch to the active file, with a single write.
+ */
+int zs_active_file_write_batch(struct zsdb_priv *priv,
+                               struct zsdb_write_batch *batch)
+{
+        uint64_t nbytes;
+
+        if (!priv->dbfiles.factive.is_open)
+                return ZS_NOT_OPEN;
+
+        if (mfile_write(&priv->dbfiles.factive.mf, batch->buf.buf,
+                        batch->buf.len, &nbytes)) {
+                zslog(LOGDEBUG, "Error writing batch\n");
+                return ZS_IOERROR;
+        }
+
+        return ZS_OK;
+}
+
 int zs_active_file_record_foreach(struct zsdb_priv *priv,
                                   zsdb_foreach_cb *cb, zsdb_foreach_cb *deleted_cb,
                                   void *cbdata)
@@ -231,20 +276,187 @@ int zs_active_file_record_foreach(struct zsdb_priv *priv,
         if (dbsize == 0 || dbsize < ZS_HDR_SIZE) {
                 zslog(LOGDEBUG, "Not a valid active file.\n");
                 return ZS_INVALID_DB;
-        } else if (dbsize == ZS_HDR_SIZE) {
-                zslog(LOGDEBUG, "No records in active file.\n");
-                return ret;
         }
 
+        /* Anything after the last commit was never committed */
+        if ((priv->flags & MODE_FASTCOMMIT) && priv->dotzsdb.offset < dbsize)
+                dbsize = priv->dotzsdb.offset;
+
         while (offset < dbsize) {
+                size_t start = offset;
+
                 ret = zs_record_read_from_file(&priv->dbfiles.factive, &offset,
                                                cb, deleted_cb, cbdata);
                 if (ret != ZS_OK) {
                         zslog(LOGWARNING, "Cannot read records from active file!\n");
+                        return ret;
+                }
+
+                /* The zeroes of a file that was grown by a writer that
+                 * hasn't trimmed it, or never got to */
+                if (offset <= start) {
+                        offset = start;
                         break;
                 }
         }
 
+        if (offset == ZS_HDR_SIZE)
+                zslog(LOGDEBUG, "No records in active file.\n");
+
+        /* Records are appended to where they end */
+        mfile_seek(&priv->dbfiles.factive.mf, offset, NULL);
+
         return ret;
 }
 
+/* zs_active_file_find_last_commit():
+ * Walks the records of the active file from `from`, which must be the end
+ * of a commit, and sets `offset` to the end of the last commit record whose
+ * checksum is good. Whatever follows it is a transaction that was never
+ * committed, or a torn write.
+ */
+int zs_active_file_find_last_commit(struct zsdb_priv *priv,
+                                    uint64_t from, uint64_t *offset)
+{
+        struct zsdb_file *f = &priv->dbfiles.factive;
+        size_t dbsize = 0;
+        uint64_t pos;
+
+        mfile_size(&f->mf, &dbsize);
+        if (dbsize < ZS_HDR_SIZE) {
+                zslog(LOGDEBUG, "Not a valid active file.\n");
+                return ZS_INVALID_DB;
+        }
+
+        if (from < ZS_HDR_SIZE || from > dbsize)
+                from = ZS_HDR_SIZE;
+
+        *offset = pos = from;
+
+        while (pos + sizeof(uint64_t) <= dbsize) {
+                uint64_t start = pos;
+                enum record_t rectype;
+
+                rectype = read_be64(f->mf->ptr + pos) >> 56;
+
+                if (zs_record_read_from_file(f, &pos, NULL, NULL,
+                                             NULL) != ZS_OK)
+                        break;
+
+                /* Zeroes, or a record that runs past the end of the file */
+                if (pos <= start || pos > dbsize)
+                        break;
+
+                if (rectype == REC_TYPE_COMMIT ||
+                    rectype == REC_TYPE_LONG_COMMIT)
+                        *offset = pos;
+        }
+
+        if (*offset < dbsize)
+                zslog(LOGDEBUG, "Ignoring %zu bytes after the last commit.\n",
+                      dbsize - *offset);
+
+        return ZS_OK;
+}
+
+/* zs_active_file_drop_uncommitted():
+ * Truncates the active file to its last commit, before a new transaction
+ * is written, so that nothing a crashed writer left behind ends up in the
+ * middle of it. Without MODE_FASTCOMMIT, the records that were loaded are
+ * kept, and only what follows them, such as the zeroes of a file that was
+ * grown and never trimmed, is dropped. This isn't done when the file is
+ * loaded, as without the write lock those zeroes may belong to a writer
+ * that is still at it. Needs the write lock.
+ */
+int zs_active_file_drop_uncommitted(struct zsdb_priv *priv)
+{
+        struct zsdb_file *f = &priv->dbfiles.factive;
+        uint64_t end;
+
+        if (f->dirty)
+                return ZS_OK;
+
+        end = (priv->flags & MODE_FASTCOMMIT) ?
+                priv->dotzsdb.offset : f->mf->offset;
+        if (f->mf->size <= end)
+                return ZS_OK;
+
+        zslog(LOGDEBUG, "Dropping %zu uncommitted bytes from %s\n",
+              f->mf->size - end, f->fname.buf);
+
+        if (mfile_truncate(&f->mf, end) != 0)
+                return ZS_IOERROR;
+
+        mfile_seek(&f->mf, end, NULL);
+
+        return ZS_OK;
+}
+
+/* zs_active_file_sync():
+ * Sync a commit that begins at `from` in the active file, as much as the
+ * durability the DB was opened with asks for: nothing with MODE_SYNC_NONE,
+ * the pages the commit wrote to with MODE_SYNC_COMMIT, and the whole file
+ * otherwise. Either way, it is written out for others to read.
+ */
+int zs_active_file_sync(struct zsdb_priv *priv, uint64_t from)
+{
+        struct mfile *mf = priv->dbfiles.factive.mf;
+        int ret = 0;
+
+        if (priv->flags & MODE_SYNC_NONE) {
+                ret = mfile_write_out(&mf);
+        } else if (priv->flags & MODE_SYNC_COMMIT) {
+                /* The active file is new since the last commit */
+                if (from < ZS_HDR_SIZE || from > mf->offset)
+                        from = ZS_HDR_SIZE;
+
+                ret = mfile_flush_range(&mf, from, mf->offset - from);
+        } else {
+                ret = mfile_flush(&mf);
+        }
+
+        if (ret) {
+                zslog(LOGWARNING, "Could not sync %s!\n",
+                      priv->dbfiles.factive.fname.buf);
+                return ZS_IOERROR;
+        }
+
+        return ZS_OK;
+}
+
+/* zs_active_file_needs_finalise():
+ * Whether the active file has reached any of the thresholds in
+ * priv->finalise.
+ */
+int zs_active_file_needs_finalise(struct zsdb_priv *priv)
+{
+        struct zsdb_finalise_threshold *t = &priv->finalise;
+        uint64_t count = 0, size = 0;
+
+        /* Keys of finalised files can be replaced with smaller values */
+        if (memtable_count(priv->memtable) > t->basecount)
+                count = memtable_count(priv->memtable) - t->basecount;
+        if (memtable_size(priv->memtable) > t->basesize)
+                size = memtable_size(priv->memtable) - t->basesize;
+
+        if (t->bytes && priv->dbfiles.factive.mf->size >= t->bytes) {
+                zslog(LOGDEBUG, "File %s is %" PRIu64 " bytes, finalising.\n",
+                      priv->dbfiles.factive.fname.buf,
+                      priv->dbfiles.factive.mf->size);
+                return 1;
+        }
+
+        if (t->records && count >= t->records) {
+                zslog(LOGDEBUG, "File %s has %" PRIu64 " keys, finalising.\n",
+                      priv->dbfiles.factive.fname.buf, count);
+                return 1;
+        }
+
+        if (t->memory && size >= t->memory) {
+                zslog(LOGDEBUG, "File %s takes up %" PRIu64 " bytes in memory, finalising.\n",
+                      priv->dbfiles.factive.fname.buf, size);
+                return 1;
+        }
+
+        return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * zeroskip-batch.c : Write batches
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <config.h>
+
+#include <libzeroskip/cstring.h>
+#include <libzeroskip/log.h>
+#include <libzeroskip/util.h>
+#include <libzeroskip/zeroskip.h>
+#include "zeroskip-priv.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+/*
+ * A batch keeps its records encoded the way they are written to the active
+ * file, one after the other, so that applying it is a single write. Where
+ * the key and value of each record are in the buffer is kept alongside, for
+ * adding the records to the in-memory tree.
+ */
+
+/**
+ * Private functions
+ */
+static struct zs_batch_entry *batch_entry_new(struct zsdb_write_batch *batch)
+{
+        struct zs_batch_entry *e;
+
+        ALLOC_GROW(batch->entries, batch->count + 1, batch->alloc);
+
+        e = &batch->entries[batch->count];
+        e->seq = batch->count++;
+
+        return e;
+}
+
+static int batch_key_cmp(const struct zs_batch_entry *e1,
+                         const struct zs_batch_entry *e2)
+{
+        if (e1->cmpfn)
+                return e1->cmpfn(e1->key, e1->keylen, e2->key, e2->keylen);
+
+        return memcmp_raw(e1->key, e1->keylen, e2->key, e2->keylen);
+}
+
+static int batch_entry_cmp(const void *a, const void *b)
+{
+        const struct zs_batch_entry *e1 = a;
+        const struct zs_batch_entry *e2 = b;
+        int ret;
+
+        ret = batch_key_cmp(e1, e2);
+        if (ret)
+                return ret;
+
+        return (e1->seq > e2->seq) - (e1->seq < e2->seq);
+}
+
+/**
+ * Public functions
+ */
+
+/* zs_write_batch_sort():
+ * Sorts the entries of the batch by key with `cmpfn`, the DB's comparator,
+ * and then by the order they were added in. If a key is in the batch more
+ * than once, all but the last of its entries are marked shadowed, so that
+ * the last of them wins. Keys are the same if `cmpfn` says so, which needn't
+ * mean they are byte for byte.
+ */
+void zs_write_batch_sort(struct zsdb_write_batch *batch, zsdb_cmp_fn cmpfn)
+{
+        size_t i;
+
+        for (i = 0; i < batch->count; i++) {
+                struct zs_batch_entry *e = &batch->entries[i];
+
+                e->key = (unsigned char *)batch->buf.buf + e->keyoff;
+                e->val = (unsigned char *)batch->buf.buf + e->valoff;
+                e->cmpfn = cmpfn;
+        }
+
+        qsort(batch->entries, batch->count, sizeof(struct zs_batch_entry),
+              batch_entry_cmp);
+
+        for (i = 0; i < batch->count; i++) {
+                struct zs_batch_entry *e = &batch->entries[i];
+
+                e->shadowed = i + 1 < batch->count &&
+                        !batch_key_cmp(e, &batch->entries[i + 1]);
+        }
+}
+
+int zsdb_write_batch_new(struct zsdb_write_batch **pbatch)
+{
+        struct zsdb_write_batch *batch;
+
+        assert(pbatch);
+
+        batch = xcalloc(1, sizeof(struct zsdb_write_batch));
+        cstring_init(&batch->buf, 0);
+
+        *pbatch = batch;
+
+        return ZS_OK;
+}
+
+void zsdb_write_batch_free(struct zsdb_write_batch **pbatch)
+{
+        if (pbatch && *pbatch) {
+                struct zsdb_write_batch *batch = *pbatch;
+
+                cstring_release(&batch->buf);
+                xfree(batch->entries);
+                xfree(batch);
+
+                *pbatch = NULL;
+        }
+}
+
+/* zsdb_write_batch_clear():
+ * Empties the batch, keeping its memory for reuse.
+ */
+void zsdb_write_batch_clear(struct zsdb_write_batch *batch)
+{
+        assert(batch);
+
+        cstring_setlen(&batch->buf, 0);
+        batch->count = 0;
+}
+
+int zsdb_write_batch_add(struct zsdb_write_batch *batch,
+                         const unsigned char *key, size_t keylen,
+                         const unsigned char *value, size_t vallen)
+{
+        static const unsigned char empty[1];
+        struct zs_batch_entry *e;
+        uint64_t start;
+
+        assert(batch);
+        assert(key);
+        assert(keylen);
+
+        if (!batch || !key || !keylen)
+                return ZS_ERROR;
+
+        if (!value)
+                vallen = 0;
+
+        start = batch->buf.len;
+        zs_file_encode_keyval_record(&batch->buf, key, keylen,
+                                     value ? value : empty, vallen);
+
+        e = batch_entry_new(batch);
+        e->keyoff = start + ZS_KEY_BASE_REC_SIZE;
+        e->keylen = keylen;
+        e->valoff = e->keyoff + roundup64bits(keylen) + ZS_VAL_BASE_REC_SIZE;
+        e->vallen = vallen;
+        e->deleted = 0;
+
+        return ZS_OK;
+}
+
+int zsdb_write_batch_remove(struct zsdb_write_batch *batch,
+                            const unsigned char *key, size_t keylen)
+{
+        struct zs_batch_entry *e;
+        uint64_t start;
+
+        assert(batch);
+        assert(key);
+        assert(keylen);
+
+        if (!batch || !key || !keylen)
+                return ZS_ERROR;
+
+        start = batch->buf.len;
+        zs_file_encode_delete_record(&batch->buf, key, keylen);
+
+        e = batch_entry_new(batch);
+        e->keyoff = start + ZS_KEY_BASE_REC_SIZE;
+        e->keylen = keylen;
+        e->valoff = e->keyoff;
+        e->vallen = 0;
+        e->deleted = 1;
+
+        return ZS_OK;
+}
+
+size_t zsdb_write_batch_count(struct zsdb_write_batch *batch)
+{
+        assert(batch);
+
+        return batch->count;
+}
@@ -0,0 +1,602 @@
+/*
+ * zeroskip-block.c : block structured packed files
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/cstring.h>
+#include <libzeroskip/log.h>
+#include <libzeroskip/mfile.h>
+#include <libzeroskip/util.h>
+#include <libzeroskip/vecu64.h>
+#include <libzeroskip/zeroskip.h>
+#include "zeroskip-priv.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * In version 2 packed files, the sorted records are grouped into blocks of
+ * about ZS_BLOCK_SIZE bytes. Within a block, each key only stores the bytes
+ * that differ from the previous key, except at every
+ * ZS_BLOCK_RESTART_INTERVAL'th record (a restart point) where the whole key
+ * is stored. The block index at the end of the file has the offset, the
+ * number of the first record and the first key of each block.
+ */
+
+struct zs_block_writer {
+        cstring block;          /* The block being built */
+        struct vecu64 *restarts; /* Offsets of the restart points in it */
+        cstring lastkey;        /* The last key added to the block */
+        uint64_t nblockrecs;    /* Number of records in the block */
+        cstring entries;        /* The block index entries */
+        cstring keys;           /* The first key of each block */
+        uint64_t nblocks;
+        uint64_t nrecords;
+        struct vecu64 *hashes;  /* Hashes of all the keys, for the bloom
+                                   filter */
+};
+
+/**
+ * Private functions
+ */
+static inline void varint_add(cstring *cstr, uint64_t n)
+{
+        unsigned char buf[10];
+        size_t len = 0;
+
+        while (n >= 0x80) {
+                buf[len++] = (n & 0x7F) | 0x80;
+                n >>= 7;
+        }
+        buf[len++] = n;
+
+        cstring_add(cstr, buf, len);
+}
+
+static inline const unsigned char *varint_read(const unsigned char *p,
+                                               uint64_t *n)
+{
+        uint64_t v = 0;
+        int shift = 0;
+
+        while (*p & 0x80) {
+                v |= (uint64_t)(*p++ & 0x7F) << shift;
+                shift += 7;
+        }
+        v |= (uint64_t)(*p++) << shift;
+
+        *n = v;
+        return p;
+}
+
+static inline void be64_add(cstring *cstr, uint64_t n)
+{
+        unsigned char buf[8];
+
+        write_be64(buf, n);
+        cstring_add(cstr, buf, sizeof(buf));
+}
+
+static inline void pad64_add(cstring *cstr)
+{
+        static const unsigned char zeros[8];
+
+        cstring_add(cstr, zeros, roundup64bits(cstr->len) - cstr->len);
+}
+
+static int block_writer_flush(struct zsdb_file *f)
+{
+        struct zs_block_writer *bw = f->bw;
+        unsigned char buf[4];
+        uint64_t i, length, offset;
+        size_t nbytes;
+
+        if (!bw->nblockrecs)
+                return ZS_OK;
+
+        /* The restart points and their count end the block */
+        for (i = 0; i < bw->restarts->count; i++) {
+                write_be32(buf, bw->restarts->data[i]);
+                cstring_add(&bw->block, buf, sizeof(buf));
+        }
+        write_be32(buf, bw->restarts->count);
+        cstring_add(&bw->block, buf, sizeof(buf));
+
+        length = bw->block.len;
+        pad64_add(&bw->block);
+
+        offset = f->mf->offset;
+        if (mfile_write(&f->mf, bw->block.buf, bw->block.len, &nbytes)) {
+                zslog(LOGDEBUG, "Error writing block\n");
+                return ZS_IOERROR;
+        }
+
+        /* The first key was added to bw->keys when the block was begun */
+        be64_add(&bw->entries, offset);
+        be64_add(&bw->entries, length);
+
+        cstring_setlen(&bw->block, 0);
+        bw->restarts->count = 0;
+        bw->nblockrecs = 0;
+        bw->nblocks++;
+
+        return ZS_OK;
+}
+
+/* Decode the record at `off`, in block `b`, with cursor `c`. The cursor
+ * needs to have the key of the previous record in the block.
+ */
+static void block_read_at(const struct zsdb_file *f, struct zs_block_cursor *c,
+                          uint64_t b, uint64_t off, uint64_t idx)
+{
+        const unsigned char *p = f->mf->ptr + off;
+        uint64_t shared, unshared, vlen;
+
+        p = varint_read(p, &shared);
+        p = varint_read(p, &unshared);
+        p = varint_read(p, &vlen);
+
+        ALLOC_GROW(c->key, shared + unshared, c->keyalloc);
+        memcpy(c->key + shared, p, unshared);
+        c->keylen = shared + unshared;
+        p += unshared;
+
+        c->deleted = (vlen == 0);
+        c->val = c->deleted ? NULL : p;
+        c->vallen = c->deleted ? 0 : vlen - 1;
+        p += c->vallen;
+
+        c->idx = idx;
+        c->block = b;
+        c->next = p - f->mf->ptr;
+        c->valid = 1;
+}
+
+/* Fields of the block index entry of block `b` */
+static inline uint64_t block_entry(const struct zsdb_blocks *blk, uint64_t b,
+                                   int field)
+{
+        return read_be64(blk->index + (b * ZS_BLOCK_INDEX_ENTRY_SIZE) +
+                         (field * sizeof(uint64_t)));
+}
+
+enum {
+        BLOCK_FIRSTREC = 0,
+        BLOCK_KEYOFF   = 1,
+        BLOCK_KEYLEN   = 2,
+        BLOCK_OFFSET   = 3,
+        BLOCK_LENGTH   = 4,
+};
+
+/* The number of the record after the last one in block `b` */
+static inline uint64_t block_end_record(const struct zsdb_file *f, uint64_t b)
+{
+        if (b + 1 < f->blocks.count)
+                return block_entry(&f->blocks, b + 1, BLOCK_FIRSTREC);
+
+        return f->nrecords;
+}
+
+/* The restart points of block `b` */
+static inline const unsigned char *block_restarts(const struct zsdb_file *f,
+                                                  uint64_t b,
+                                                  uint64_t *nrestarts)
+{
+        const unsigned char *end;
+
+        end = f->mf->ptr + block_entry(&f->blocks, b, BLOCK_OFFSET) +
+                block_entry(&f->blocks, b, BLOCK_LENGTH);
+        *nrestarts = read_be32(end - sizeof(uint32_t));
+
+        return end - sizeof(uint32_t) * (*nrestarts + 1);
+}
+
+static inline uint64_t block_restart_offset(const struct zsdb_file *f,
+                                            uint64_t b,
+                                            const unsigned char *restarts,
+                                            uint64_t r)
+{
+        return block_entry(&f->blocks, b, BLOCK_OFFSET) +
+                read_be32(restarts + r * sizeof(uint32_t));
+}
+
+/* Position the cursor `c` on the `r`th restart point of block `b` */
+static void block_seek_restart(const struct zsdb_file *f,
+                               struct zs_block_cursor *c, uint64_t b,
+                               const unsigned char *restarts, uint64_t r)
+{
+        c->keylen = 0;
+        block_read_at(f, c, b, block_restart_offset(f, b, restarts, r),
+                      block_entry(&f->blocks, b, BLOCK_FIRSTREC) +
+                      r * ZS_BLOCK_RESTART_INTERVAL);
+}
+
+static inline int block_cmp(const unsigned char *k1, uint64_t l1,
+                            const unsigned char *k2, uint64_t l2,
+                            zsdb_cmp_fn cmpfn)
+{
+        return cmpfn ? cmpfn(k1, l1, k2, l2) : memcmp_raw(k1, l1, k2, l2);
+}
+
+/**
+ * Public functions
+ */
+
+/* zs_block_writer_new():
+ * Start writing records in blocks to the packed file `f`.
+ */
+void zs_block_writer_new(struct zsdb_file *f)
+{
+        struct zs_block_writer *bw;
+
+        bw = xcalloc(1, sizeof(struct zs_block_writer));
+        cstring_init(&bw->block, ZS_BLOCK_SIZE);
+        cstring_init(&bw->lastkey, 0);
+        cstring_init(&bw->entries, 0);
+        cstring_init(&bw->keys, 0);
+        bw->restarts = vecu64_new();
+        bw->hashes = vecu64_new();
+
+        f->bw = bw;
+}
+
+void zs_block_writer_free(struct zsdb_file *f)
+{
+        struct zs_block_writer *bw = f->bw;
+
+        if (!bw)
+                return;
+
+        cstring_release(&bw->block);
+        cstring_release(&bw->lastkey);
+        cstring_release(&bw->entries);
+        cstring_release(&bw->keys);
+        vecu64_free(&bw->restarts);
+        vecu64_free(&bw->hashes);
+        xfree(bw);
+
+        f->bw = NULL;
+}
+
+/* zs_block_writer_add():
+ * Add a record to the packed file. Records must be added in key order.
+ */
+int zs_block_writer_add(struct zsdb_file *f,
+                        const unsigned char *key, uint64_t keylen,
+                        const unsigned char *val, uint64_t vallen,
+                        int deleted)
+{
+        struct zs_block_writer *bw = f->bw;
+        uint64_t shared = 0;
+
+        if (!bw->nblockrecs) {
+                /* A new block, remember its first key */
+                be64_add(&bw->entries, bw->nrecords);
+                be64_add(&bw->entries, bw->keys.len);
+                be64_add(&bw->entries, keylen);
+                cstring_add(&bw->keys, key, keylen);
+        }
+
+        if (bw->nblockrecs % ZS_BLOCK_RESTART_INTERVAL == 0) {
+                vecu64_append(bw->restarts, bw->block.len);
+        } else {
+                uint64_t max = keylen < bw->lastkey.len ?
+                        keylen : bw->lastkey.len;
+                while (shared < max &&
+                       key[shared] == (unsigned char)bw->lastkey.buf[shared])
+                        shared++;
+        }
+
+        varint_add(&bw->block, shared);
+        varint_add(&bw->block, keylen - shared);
+        varint_add(&bw->block, deleted ? 0 : vallen + 1);
+        cstring_add(&bw->block, key + shared, keylen - shared);
+        if (!deleted && vallen)
+                cstring_add(&bw->block, val, vallen);
+
+        cstring_setlen(&bw->lastkey, 0);
+        cstring_add(&bw->lastkey, key, keylen);
+
+        vecu64_append(bw->hashes, zs_bloom_hash(key, keylen));
+
+        bw->nblockrecs++;
+        bw->nrecords++;
+
+        if (bw->block.len >= ZS_BLOCK_SIZE)
+                return block_writer_flush(f);
+
+        return ZS_OK;
+}
+
+/* zs_block_writer_finish():
+ * Write out the last block. This needs to be done before the commit record
+ * that marks the end of the records.
+ */
+int zs_block_writer_finish(struct zsdb_file *f)
+{
+        return block_writer_flush(f);
+}
+
+/* zs_block_writer_write_index():
+ * Write the block index and the bloom filter. This is the part of the file
+ * that is covered by the final commit record.
+ */
+int zs_block_writer_write_index(struct zsdb_file *f)
+{
+        struct zs_block_writer *bw = f->bw;
+        cstring hdr = CSTRING_INIT;
+        uint64_t i;
+        size_t nbytes;
+        int ret = ZS_OK;
+
+        pad64_add(&bw->keys);
+
+        be64_add(&hdr, bw->nrecords);
+        be64_add(&hdr, bw->nblocks);
+        be64_add(&hdr, bw->keys.len);
+
+        if (mfile_write(&f->mf, hdr.buf, hdr.len, &nbytes) ||
+            mfile_write(&f->mf, bw->entries.buf, bw->entries.len, &nbytes) ||
+            mfile_write(&f->mf, bw->keys.buf, bw->keys.len, &nbytes)) {
+                zslog(LOGDEBUG, "Error writing block index\n");
+                ret = ZS_IOERROR;
+                goto done;
+        }
+
+        zs_bloom_new(&f->bloom, bw->nrecords);
+        for (i = 0; i < bw->hashes->count; i++)
+                zs_bloom_add(&f->bloom, bw->hashes->data[i]);
+
+        ret = zs_bloom_write(f, &f->bloom);
+
+done:
+        cstring_release(&hdr);
+        return ret;
+}
+
+/* zs_block_index_read():
+ * Read the block index of a version 2 packed file, that begins at
+ * `offset` and is at most `len` bytes long. On success, `offset` is
+ * set to the end of the block index.
+ */
+int zs_block_index_read(struct zsdb_file *f, uint64_t *offset, uint64_t len)
+{
+        struct zsdb_blocks *blk = &f->blocks;
+        unsigned char *p = f->mf->ptr + *offset;
+        uint64_t nrecords, nblocks, keyslen, size;
+
+        if (len < ZS_BLOCK_INDEX_HDR_SIZE)
+                return ZS_INVALID_FILE;
+
+        nrecords = read_be64(p);
+        nblocks = read_be64(p + 8);
+        keyslen = read_be64(p + 16);
+
+        size = ZS_BLOCK_INDEX_HDR_SIZE +
+                (nblocks * ZS_BLOCK_INDEX_ENTRY_SIZE) + keyslen;
+        if (size > len || (nrecords && !nblocks)) {
+                zslog(LOGDEBUG, "Invalid block index\n");
+                return ZS_INVALID_FILE;
+        }
+
+        f->nrecords = nrecords;
+        blk->count = nblocks;
+        blk->index = p + ZS_BLOCK_INDEX_HDR_SIZE;
+        blk->keys = blk->index + (nblocks * ZS_BLOCK_INDEX_ENTRY_SIZE);
+        blk->cur.valid = 0;
+        blk->search.valid = 0;
+
+        *offset += size;
+
+        return ZS_OK;
+}
+
+static void block_first_key(void *data, uint64_t b,
+                            const unsigned char **key, uint64_t *keylen)
+{
+        const struct zsdb_blocks *blk = data;
+
+        *key = blk->keys + block_entry(blk, b, BLOCK_KEYOFF);
+        *keylen = block_entry(blk, b, BLOCK_KEYLEN);
+}
+
+/* zs_block_eytzinger_new():
+ * Lay out the first keys of the blocks in Eytzinger order, for
+ * zs_block_search() to find the block a key is in.
+ */
+void zs_block_eytzinger_new(struct zsdb_file *f, int prefixed)
+{
+        zs_eytzinger_new(&f->layout, f->blocks.count, prefixed,
+                         block_first_key, &f->blocks);
+}
+
+void zs_block_index_free(struct zsdb_file *f)
+{
+        xfree(f->blocks.cur.key);
+        xfree(f->blocks.search.key);
+        memset(&f->blocks, 0, sizeof(struct zsdb_blocks));
+}
+
+/* zs_block_read_record():
+ * Read the `idx`th record of a version 2 packed file. The key is only
+ * valid until the next record is read from the file, the value points into
+ * the mapped file.
+ */
+int zs_block_read_record(struct zsdb_file *f, uint64_t idx,
+                         const unsigned char **key, uint64_t *keylen,
+                         const unsigned char **val, uint64_t *vallen,
+                         int *deleted)
+{
+        struct zsdb_blocks *blk = &f->blocks;
+        struct zs_block_cursor *c = &blk->cur;
+
+        if (idx >= f->nrecords)
+                return ZS_NOTFOUND;
+
+        if (c->valid && idx == c->idx) {
+                /* Already there */
+        } else if (c->valid && idx == c->idx + 1 &&
+                   idx < block_end_record(f, c->block)) {
+                /* The next record, in the same block */
+                block_read_at(f, c, c->block, c->next, idx);
+        } else {
+                const unsigned char *restarts;
+                uint64_t lo = 0, hi = blk->count, b, first, nrestarts;
+
+                /* Find the block with the record */
+                while (lo < hi) {
+                        uint64_t mi = lo + (hi - lo) / 2;
+
+                        if (block_entry(blk, mi, BLOCK_FIRSTREC) <= idx)
+                                lo = mi + 1;
+                        else
+                                hi = mi;
+                }
+                b = lo - 1;
+                first = block_entry(blk, b, BLOCK_FIRSTREC);
+
+                /* And then, the restart point before it */
+                restarts = block_restarts(f, b, &nrestarts);
+                block_seek_restart(f, c, b, restarts,
+                                   (idx - first) / ZS_BLOCK_RESTART_INTERVAL);
+                while (c->idx < idx)
+                        block_read_at(f, c, b, c->next, c->idx + 1);
+        }
+
+        if (key) *key = c->key;
+        if (keylen) *keylen = c->keylen;
+        if (val) *val = c->val;
+        if (vallen) *vallen = c->vallen;
+        if (deleted) *deleted = c->deleted;
+
+        return ZS_OK;
+}
+
+/* zs_block_search():
+ * Search for `key` in a version 2 packed file. Returns 1 if the key is
+ * found, in which case `location` is the number of the record. Otherwise
+ * returns 0, and `location` is the number of the first record with a key
+ * bigger than `key`. The search starts at record `from`: all the records
+ * before it must have keys smaller than `key`. Lookups have a cursor of
+ * their own, and don't disturb the records being read with
+ * zs_block_read_record().
+ */
+int zs_block_search(struct zsdb_file *f,
+                    const unsigned char *key, uint64_t keylen,
+                    uint64_t from, uint64_t *location,
+                    const unsigned char **value, uint64_t *vallen,
+                    zsdb_cmp_fn cmpfn)
+{
+        struct zsdb_blocks *blk = &f->blocks;
+        struct zs_block_cursor *c = &blk->search;
+        const unsigned char *restarts;
+        uint64_t lo, hi, b, b0, r, nrestarts, end;
+
+        /* The block that `from` is in. The blocks before it all start with
+         * keys smaller than `key`, and don't need to be looked at */
+        b0 = 0;
+        if (from) {
+                lo = 0;
+                hi = blk->count;
+                while (lo < hi) {
+                        uint64_t mi = lo + (hi - lo) / 2;
+
+                        if (block_entry(blk, mi, BLOCK_FIRSTREC) > from)
+                                hi = mi;
+                        else
+                                lo = mi + 1;
+                }
+                b0 = lo ? lo - 1 : 0;
+        }
+
+        /* Find the last block with a first key that isn't bigger than
+         * `key` */
+        lo = b0;
+        hi = blk->count;
+        if (f->layout.slots)
+                lo = hi = zs_eytzinger_upper_bound(&f->layout, key, keylen,
+                                                   cmpfn);
+        while (lo < hi) {
+                uint64_t mi = lo + (hi - lo) / 2;
+
+                if (block_cmp(key, keylen,
+                              blk->keys + block_entry(blk, mi, BLOCK_KEYOFF),
+                              block_entry(blk, mi, BLOCK_KEYLEN), cmpfn) < 0)
+                        hi = mi;
+                else
+                        lo = mi + 1;
+        }
+
+        if (lo == 0) {
+                if (location)
+                        *location = 0;
+                return 0;
+        }
+        b = lo - 1;
+
+        /* Then the last restart point in the block, with a key that isn't
+         * bigger than `key`. The keys at restart points are whole, and can
+         * be compared in place.
+         */
+        restarts = block_restarts(f, b, &nrestarts);
+        lo = 0;
+        if (b == b0 && from > block_entry(blk, b, BLOCK_FIRSTREC))
+                lo = (from - block_entry(blk, b, BLOCK_FIRSTREC)) /
+                        ZS_BLOCK_RESTART_INTERVAL;
+        hi = nrestarts;
+        while (lo < hi) {
+                uint64_t mi = lo + (hi - lo) / 2;
+                const unsigned char *p;
+                uint64_t shared, unshared, vlen;
+
+                p = f->mf->ptr + block_restart_offset(f, b, restarts, mi);
+                p = varint_read(p, &shared);
+                p = varint_read(p, &unshared);
+                p = varint_read(p, &vlen);
+
+                if (block_cmp(key, keylen, p, unshared, cmpfn) < 0)
+                        hi = mi;
+                else
+                        lo = mi + 1;
+        }
+        r = lo ? lo - 1 : 0;
+
+        /* And finally scan the records from there */
+        end = block_end_record(f, b);
+        block_seek_restart(f, c, b, restarts, r);
+        while (1) {
+                int res;
+
+                res = block_cmp(key, keylen, c->key, c->keylen, cmpfn);
+                if (res == 0) {
+                        if (location)
+                                *location = c->idx;
+                        if (value)
+                                *value = c->val;
+                        if (vallen)
+                                *vallen = c->vallen;
+                        return 1;
+                }
+
+                if (res < 0) {
+                        if (location)
+                                *location = c->idx;
+                        return 0;
+                }
+
+                if (c->idx + 1 >= end)
+                        break;
+
+                block_read_at(f, c, b, c->next, c->idx + 1);
+        }
+
+        if (location)
+                *location = end;
+
+        return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * zeroskip-bloom.c : Bloom filters for packed files
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/log.h>
+#include <libzeroskip/mfile.h>
+#include <libzeroskip/util.h>
+#include <libzeroskip/zeroskip.h>
+#include "zeroskip-priv.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Private functions
+ */
+static inline uint64_t bloom_bit(const struct zsdb_bloom *b,
+                                 uint64_t hash, uint64_t i)
+{
+        uint32_t h1 = hash & 0xFFFFFFFF;
+        uint32_t h2 = (hash >> 32) | 1;
+
+        return (h1 + i * h2) % b->nbits;
+}
+
+/**
+ * Public functions
+ */
+
+/* zs_bloom_hash():
+ * A 64-bit FNV-1a hash of the key, with a final avalanche so that both
+ * halves can be used for double hashing.
+ */
+uint64_t zs_bloom_hash(const unsigned char *key, uint64_t keylen)
+{
+        uint64_t hash = 0xcbf29ce484222325ULL;
+
+        while (keylen--) {
+                hash ^= *key++;
+                hash *= 0x100000001b3ULL;
+        }
+
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+
+        return hash;
+}
+
+/* zs_bloom_new():
+ * Allocate the bits for a filter holding `nkeys` keys.
+ */
+void zs_bloom_new(struct zsdb_bloom *b, uint64_t nkeys)
+{
+        uint64_t nbits;
+
+        nbits = nkeys * ZS_BLOOM_BITS_PER_KEY;
+        /* A whole number of 64-bit words */
+        nbits = (nbits + 63) & ~63ULL;
+        if (nbits < 64)
+                nbits = 64;
+
+        b->nbits = nbits;
+        b->nhashes = ZS_BLOOM_NUM_HASHES;
+        b->bits = xcalloc(1, nbits / 8);
+        b->alloced = 1;
+}
+
+void zs_bloom_free(struct zsdb_bloom *b)
+{
+        if (b->alloced)
+                xfree(b->bits);
+
+        memset(b, 0, sizeof(struct zsdb_bloom));
+}
+
+void zs_bloom_add(struct zsdb_bloom *b, uint64_t hash)
+{
+        uint64_t i;
+
+        for (i = 0; i < b->nhashes; i++) {
+                uint64_t bit = bloom_bit(b, hash, i);
+                b->bits[bit >> 3] |= (1 << (bit & 7));
+        }
+}
+
+/* zs_bloom_check():
+ * Returns 0 if the key with the given hash is definitely not in the
+ * filter, 1 if it may be. A file without a filter always returns 1.
+ */
+int zs_bloom_check(const struct zsdb_bloom *b, uint64_t hash)
+{
+        uint64_t i;
+
+        if (!b->nbits)
+                return 1;
+
+        for (i = 0; i < b->nhashes; i++) {
+                uint64_t bit = bloom_bit(b, hash, i);
+                if (!(b->bits[bit >> 3] & (1 << (bit & 7))))
+                        return 0;
+        }
+
+        return 1;
+}
+
+/* zs_bloom_write():
+ * Write the bloom filter section at the current offset of the file.
+ */
+int zs_bloom_write(struct zsdb_file *f, const struct zsdb_bloom *b)
+{
+        unsigned char buf[ZS_BLOOM_HDR_SIZE];
+        size_t nbytes;
+
+        write_be64(buf, ZS_BLOOM_SIGNATURE);
+        write_be64(buf + 8, b->nbits);
+        write_be64(buf + 16, b->nhashes);
+
+        if (mfile_write(&f->mf, (void *)buf, ZS_BLOOM_HDR_SIZE, &nbytes) ||
+            mfile_write(&f->mf, (void *)b->bits, b->nbits / 8, &nbytes)) {
+                zslog(LOGDEBUG, "Error writing bloom filter\n");
+                return ZS_IOERROR;
+        }
+
+        return ZS_OK;
+}
+
+/* zs_bloom_read():
+ * Point `b` at a bloom filter section of `len` bytes, that is part of the
+ * mapped file at `ptr`. The bits are not copied, so `b` is only valid as
+ * long as the file stays mapped.
+ */
+int zs_bloom_read(struct zsdb_bloom *b, unsigned char *ptr, uint64_t len)
+{
+        uint64_t nbits, nhashes;
+
+        memset(b, 0, sizeof(struct zsdb_bloom));
+
+        if (len < ZS_BLOOM_HDR_SIZE)
+                return ZS_NOTFOUND;
+
+        if (read_be64(ptr) != ZS_BLOOM_SIGNATURE)
+                return ZS_NOTFOUND;
+
+        nbits = read_be64(ptr + 8);
+        nhashes = read_be64(ptr + 16);
+
+        if (!nbits || (nbits % 64) || !nhashes ||
+            (nbits / 8) > (len - ZS_BLOOM_HDR_SIZE)) {
+                zslog(LOGDEBUG, "Invalid bloom filter section\n");
+                return ZS_INVALID_FILE;
+        }
+
+        b->nbits = nbits;
+        b->nhashes = nhashes;
+        b->bits = ptr + ZS_BLOOM_HDR_SIZE;
+        b->alloced = 0;
+
+        return ZS_OK;
+}
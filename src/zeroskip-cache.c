@@ -0,0 +1,231 @@
+/*
+ * zeroskip-cache.c : A cache of packed file lookups
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/log.h>
+#include <libzeroskip/util.h>
+#include <libzeroskip/zeroskip.h>
+#include "zeroskip-priv.h"
+
+#include <string.h>
+
+/*
+ * The cache remembers the result of looking up a key in the packed files,
+ * whether it was found or not. Packed files don't change once they are
+ * written, so the value of a key that was found is not copied: the entry
+ * points at it in the mapped file. All the entries are dropped when the
+ * packed files are closed.
+ */
+struct zs_cache_entry {
+        struct htable_entry hentry;     /* Needs to be the first member */
+        struct list_head lru;
+        const unsigned char *val;       /* In a mapped packed file */
+        uint64_t vallen;
+        int found;
+        uint64_t keylen;
+        unsigned char key[];
+};
+
+/**
+ * Private functions
+ */
+static inline uint64_t cache_entry_size(uint64_t keylen)
+{
+        return sizeof(struct zs_cache_entry) + keylen;
+}
+
+struct cache_key {
+        const unsigned char *key;
+        uint64_t keylen;
+};
+
+/* Entries are compared with the key in `kdata` when looking one up, and
+ * with each other otherwise.
+ */
+static int cache_entry_cmpfn(const void *unused _unused_,
+                             const void *entry1,
+                             const void *entry2,
+                             const void *kdata)
+{
+        const struct zs_cache_entry *e1 = entry1;
+        const struct zs_cache_entry *e2 = entry2;
+        const struct cache_key *k = kdata;
+
+        if (k)
+                return memcmp_raw(e1->key, e1->keylen, k->key, k->keylen);
+
+        return memcmp_raw(e1->key, e1->keylen, e2->key, e2->keylen);
+}
+
+static struct zs_cache_entry *cache_find(struct zsdb_cache *cache,
+                                         const unsigned char *key,
+                                         uint64_t keylen)
+{
+        struct zs_cache_entry e;
+        struct cache_key k = { key, keylen };
+
+        htable_entry_init(&e, bufhash(key, keylen));
+
+        return htable_get(&cache->table, &e, &k);
+}
+
+static void cache_entry_remove(struct zsdb_cache *cache,
+                               struct zs_cache_entry *e)
+{
+        htable_remove(&cache->table, e, NULL);
+        list_del(&e->lru);
+        cache->size -= cache_entry_size(e->keylen);
+        xfree(e);
+}
+
+/**
+ * Public functions
+ */
+
+void zs_cache_init(struct zsdb_cache *cache)
+{
+        memset(cache, 0, sizeof(struct zsdb_cache));
+        htable_init(&cache->table, cache_entry_cmpfn, NULL, 0);
+        list_head_init(&cache->lru);
+}
+
+void zs_cache_free(struct zsdb_cache *cache)
+{
+        zs_cache_clear(cache);
+        htable_free(&cache->table, 0);
+}
+
+/* zs_cache_clear():
+ * Drop all the entries in the cache. This needs to be done whenever packed
+ * files are closed, since entries point into them.
+ */
+void zs_cache_clear(struct zsdb_cache *cache)
+{
+        struct list_head *pos, *p;
+
+        list_for_each_forward_safe(pos, p, &cache->lru) {
+                struct zs_cache_entry *e;
+                e = list_entry(pos, struct zs_cache_entry, lru);
+                cache_entry_remove(cache, e);
+        }
+}
+
+/* zs_cache_set_size():
+ * Set the maximum size of the cache in bytes, dropping the least recently
+ * used entries that don't fit anymore. A size of 0 turns the cache off.
+ */
+void zs_cache_set_size(struct zsdb_cache *cache, uint64_t maxsize)
+{
+        cache->maxsize = maxsize;
+
+        while (cache->size > cache->maxsize) {
+                struct zs_cache_entry *e;
+                e = list_entry(cache->lru.prev, struct zs_cache_entry, lru);
+                cache_entry_remove(cache, e);
+        }
+}
+
+/* zs_cache_lookup():
+ * Returns 1 if the result of looking up `key` in the packed files is in
+ * the cache, with `found` set to whether the key was there, and `value` and
+ * `vallen` set to its value. Returns 0 otherwise.
+ */
+int zs_cache_lookup(struct zsdb_cache *cache,
+                    const unsigned char *key, uint64_t keylen,
+                    const unsigned char **value, uint64_t *vallen,
+                    int *found)
+{
+        struct zs_cache_entry *e;
+
+        if (!cache->maxsize)
+                return 0;
+
+        e = cache_find(cache, key, keylen);
+        if (!e) {
+                cache->misses++;
+                return 0;
+        }
+
+        cache->hits++;
+
+        /* Most recently used */
+        list_del(&e->lru);
+        list_add_head(&e->lru, &cache->lru);
+
+        *found = e->found;
+        if (e->found) {
+                *value = e->val;
+                *vallen = e->vallen;
+        }
+
+        return 1;
+}
+
+/* zs_cache_insert():
+ * Add the result of looking up `key` in the packed files to the cache.
+ * `value` has to stay valid until the cache is cleared.
+ */
+void zs_cache_insert(struct zsdb_cache *cache,
+                     const unsigned char *key, uint64_t keylen,
+                     const unsigned char *value, uint64_t vallen,
+                     int found)
+{
+        struct zs_cache_entry *e;
+        uint64_t size = cache_entry_size(keylen);
+
+        if (size > cache->maxsize)
+                return;
+
+        zs_cache_invalidate(cache, key, keylen);
+
+        /* Make room */
+        while (cache->size + size > cache->maxsize) {
+                struct zs_cache_entry *old;
+                old = list_entry(cache->lru.prev, struct zs_cache_entry, lru);
+                cache_entry_remove(cache, old);
+        }
+
+        e = xmalloc(size);
+        htable_entry_init(e, bufhash(key, keylen));
+        memcpy(e->key, key, keylen);
+        e->keylen = keylen;
+        e->val = found ? value : NULL;
+        e->vallen = found ? vallen : 0;
+        e->found = found;
+
+        htable_put(&cache->table, e);
+        list_add_head(&e->lru, &cache->lru);
+        cache->size += size;
+}
+
+/* zs_cache_invalidate():
+ * Drop the entry for `key`, if there is one.
+ */
+void zs_cache_invalidate(struct zsdb_cache *cache,
+                         const unsigned char *key, uint64_t keylen)
+{
+        struct zs_cache_entry *e;
+
+        if (!cache->size)
+                return;
+
+        e = cache_find(cache, key, keylen);
+        if (e)
+                cache_entry_remove(cache, e);
+}
+
+void zs_cache_get_stats(const struct zsdb_cache *cache,
+                        struct zsdb_cache_stats *stats)
+{
+        stats->hits = cache->hits;
+        stats->misses = cache->misses;
+        stats->entries = cache->table.count;
+        stats->size = cache->size;
+        stats->maxsize = cache->maxsize;
+}
@@ -0,0 +1,152 @@
+/*
+ * zeroskip-commit.c : Group commit
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <config.h>
+
+#include <libzeroskip/log.h>
+#include <libzeroskip/mfile.h>
+#include <libzeroskip/util.h>
+#include <libzeroskip/zeroskip.h>
+#include "zeroskip-priv.h"
+
+#include <unistd.h>
+
+#ifndef HAVE_FDATASYNC
+#define fdatasync fsync
+#endif
+
+/*
+ * With group commit, a commit that has been written waits a while for
+ * another process to sync it, and only syncs it itself if nobody has. It
+ * gives up the write lock while it waits, so that other processes can add
+ * their commits to the group, and whoever syncs first syncs them all.
+ * zsdb_commit() still only returns once its commit is on disk. The commits
+ * are numbered in .zsdb.gen for this, and without it each commit is synced
+ * on its own.
+ *
+ * Every commit is either in the active file, or in a file that was
+ * finalised, and so flushed, after it. So syncing the active file syncs all
+ * the commits that came before it.
+ */
+
+/**
+ * Public functions
+ */
+
+int zs_group_commit_enabled(struct zsdb_priv *priv)
+{
+        return priv->group.window || priv->group.maxbytes ||
+                priv->group.maxcount;
+}
+
+/* zs_group_commit_add():
+ * Adds the commit that was just written to the group. The group is synced
+ * straight away if it is big enough, or if there is no one to wait for.
+ * Otherwise, zs_group_commit_wait() needs to be called, without the write
+ * lock. Needs the write lock.
+ */
+int zs_group_commit_add(struct zsdb_priv *priv)
+{
+        struct zsdb_group_commit *g = &priv->group;
+        uint64_t offset = priv->dbfiles.factive.mf->offset;
+
+        /* For the others to read */
+        if (mfile_write_out(&priv->dbfiles.factive.mf)) {
+                zslog(LOGWARNING, "Could not write %s!\n",
+                      priv->dbfiles.factive.fname.buf);
+                return ZS_IOERROR;
+        }
+
+        /* The active file is new since the last sync */
+        if (offset < g->start)
+                g->start = ZS_HDR_SIZE;
+
+        g->count++;
+
+        /* Without .zsdb.gen, nobody else can sync it */
+        if (!priv->gen) {
+                priv->dotzsdb.offset = offset;
+                return zs_group_commit_sync(priv);
+        }
+
+        /* Let the others know, without syncing .zsdb */
+        zs_dotzsdb_commit(priv, offset);
+        g->seq = zs_dotzsdb_commit_seq_next(priv);
+
+        if (!g->window ||
+            (g->maxcount &&
+             g->seq - zs_dotzsdb_synced_seq(priv) >= g->maxcount) ||
+            (g->maxbytes && offset - g->start >= g->maxbytes))
+                return zs_group_commit_sync(priv);
+
+        return ZS_OK;
+}
+
+/* zs_group_commit_sync():
+ * Sync the commits of the group, and whatever else has been committed to
+ * the active file by other processes.
+ */
+int zs_group_commit_sync(struct zsdb_priv *priv)
+{
+        struct zsdb_group_commit *g = &priv->group;
+        struct mfile *mf = priv->dbfiles.factive.mf;
+        uint64_t seq = g->seq;
+
+        if (!g->count)
+                return ZS_OK;
+
+        /* Read before syncing, so that the commits are all in the file.
+         * Once the active file has been finalised, the later ones aren't. */
+        if (priv->gen) {
+                uint64_t last = zs_dotzsdb_commit_seq(priv);
+
+                if (zs_dotzsdb_is_active_idx(priv))
+                        seq = last;
+        }
+
+        if (fdatasync(mf->fd) != 0) {
+                zslog(LOGWARNING, "Could not sync %s!\n",
+                      priv->dbfiles.factive.fname.buf);
+                return ZS_IOERROR;
+        }
+
+        zs_dotzsdb_set_synced_seq(priv, seq);
+
+        if (!priv->gen &&
+            zs_dotzsdb_update_index_and_offset(priv, priv->dotzsdb.curidx,
+                                               priv->dotzsdb.offset))
+                return ZS_IOERROR;
+
+        g->count = 0;
+        g->start = mf->offset;
+
+        return ZS_OK;
+}
+
+/* zs_group_commit_wait():
+ * Return once the commits of the group are on disk: wait for someone else
+ * to sync them, and sync them if nobody has by the end of the window. Is
+ * called without the write lock, so that others can commit meanwhile.
+ */
+int zs_group_commit_wait(struct zsdb_priv *priv)
+{
+        struct zsdb_group_commit *g = &priv->group;
+
+        if (!g->count)
+                return ZS_OK;
+
+        if (!zs_dotzsdb_wait_synced(priv, g->seq, g->window))
+                return zs_group_commit_sync(priv);
+
+        g->count = 0;
+        g->start = priv->dbfiles.factive.mf->offset;
+
+        return ZS_OK;
+}
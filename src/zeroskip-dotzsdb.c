@@ -8,18 +8,31 @@
  *
  */
 
+#include <config.h>
+
 #include <libzeroskip/crc32c.h>
 #include <libzeroskip/log.h>
 #include <libzeroskip/mfile.h>
+#include <libzeroskip/util.h>
 #include <libzeroskip/zeroskip.h>
 #include "zeroskip-priv.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 typedef void (*sigfunc)(int);
 
 static struct file_lock dblock;
@@ -50,6 +63,106 @@ static void cleanup_lockfile_on_signal(int signum)
         raise(signum);
 }
 
+static inline uint64_t gen_load(const struct dotzsdb_gen *gen)
+{
+        return __atomic_load_n(&gen->generation, __ATOMIC_ACQUIRE);
+}
+
+static inline uint64_t gen_bump(struct dotzsdb_gen *gen)
+{
+        return __atomic_add_fetch(&gen->generation, 1, __ATOMIC_RELEASE);
+}
+
+/* Sleeps until `*addr` is no longer `val`, or for `timeout_ms`. Without
+ * futexes, it just sleeps for a millisecond. The control block is shared
+ * between processes, so these aren't private futexes.
+ */
+static void gen_futex_wait(uint32_t *addr, uint32_t val, long timeout_ms)
+{
+#ifdef HAVE_LINUX_FUTEX_H
+        struct timespec ts;
+
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+        (void)addr;
+        (void)val;
+        (void)timeout_ms;
+        sleep_ms(1);
+#endif
+}
+
+/* Wakes everyone sleeping on `addr` */
+static void gen_futex_wake(uint32_t *addr)
+{
+#ifdef HAVE_LINUX_FUTEX_H
+        syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+        (void)addr;
+#endif
+}
+
+/* Compares the stat() info of .zsdb with `prev`, if given, and records it.
+ * Returns the ZSDB_FILE_*_CHANGED flags, or -1 if .zsdb couldn't be
+ * stat()ed.
+ */
+static int dotzsdb_stat(struct zsdb_priv *priv, const struct stat *prev)
+{
+        cstring dotzsdbfname = CSTRING_INIT;
+        struct stat st;
+        int status = 0;
+
+        memset(&st, 0, sizeof(struct stat));
+
+        /* The filename */
+        cstring_dup(&priv->dbdir, &dotzsdbfname);
+        cstring_addch(&dotzsdbfname, '/');
+        cstring_addstr(&dotzsdbfname, DOTZSDB_FNAME);
+
+        /* stat() the .zsdb file. The .zsdb file is
+         * used for synchronisation among various processes.
+         */
+        if (stat(dotzsdbfname.buf, &st) != 0) {
+                status = -1;
+                goto done;
+        }
+
+        if (!prev)
+                goto update;
+
+        if (st.st_ino != prev->st_ino)
+                status |= ZSDB_FILE_INO_CHANGED;
+        if (st.st_mode != prev->st_mode)
+                status |= ZSDB_FILE_MODE_CHANGED;
+        if (st.st_uid != prev->st_uid)
+                status |= ZSDB_FILE_UID_CHANGED;
+        if (st.st_gid != prev->st_gid)
+                status |= ZSDB_FILE_GID_CHANGED;
+        if (st.st_size != prev->st_size)
+                status |= ZSDB_FILE_SIZE_CHANGED;
+#ifdef MACOSX
+        if (st.st_mtimensec != prev->st_mtimensec)
+                status |= ZSDB_FILE_MTIM_CHANGED;
+        if (st.st_ctimensec != prev->st_ctimensec)
+                status |= ZSDB_FILE_CTIM_CHANGED;
+#else  /* Linux */
+        if (st.st_mtim.tv_nsec != prev->st_mtim.tv_nsec)
+                status |= ZSDB_FILE_MTIM_CHANGED;
+        if (st.st_ctim.tv_nsec != prev->st_ctim.tv_nsec)
+                status |= ZSDB_FILE_CTIM_CHANGED;
+#endif
+
+        if (!status)
+                goto done;
+
+update:
+        priv->dotzsdb_st = st;
+done:
+        cstring_release(&dotzsdbfname);
+        return status;
+}
+
 /**
  * Public functions
  */
@@ -269,6 +382,29 @@ done:
         return ret;
 }
 
+/*
+ * zs_dotzsdb_commit():
+ * Records a commit that ends at `offset` in the active file. The commit
+ * record in the active file is what makes it stick, so .zsdb isn't
+ * rewritten: bumping the generation is enough to let other processes know.
+ * Without a generation, .zsdb is updated as before.
+ */
+int zs_dotzsdb_commit(struct zsdb_priv *priv, uint64_t offset)
+{
+        if (!priv->gen)
+                return zs_dotzsdb_update_index_and_offset(priv,
+                                                          priv->dotzsdb.curidx,
+                                                          offset);
+
+        priv->dotzsdb.offset = offset;
+
+        /* Don't skip over a change someone else has made in the meantime */
+        if (gen_bump(priv->gen) == priv->generation + 1)
+                priv->generation++;
+
+        return 0;
+}
+
 ino_t zs_dotzsdb_get_ino(struct zsdb_priv *priv)
 {
         cstring dotzsdbfname = CSTRING_INIT;
@@ -293,80 +429,45 @@ ino_t zs_dotzsdb_get_ino(struct zsdb_priv *priv)
 
 int zs_dotzsdb_update_stat(struct zsdb_priv *priv)
 {
-        cstring dotzsdbfname = CSTRING_INIT;
-        struct stat st;
-        int status = 0;
-
-        memset(&st, 0, sizeof(struct stat));
-
-        /* The filename */
-        cstring_dup(&priv->dbdir, &dotzsdbfname);
-        cstring_addch(&dotzsdbfname, '/');
-        cstring_addstr(&dotzsdbfname, DOTZSDB_FNAME);
-
-        /* stat() the .zsdb file. The .zsdb file is
-         * used for synchronisation among various processes.
-         */
-        if (stat(dotzsdbfname.buf, &st) != 0) {
-                status = -1;
-                goto done;
-        }
+        if (priv->gen)
+                priv->generation = gen_load(priv->gen);
 
-        priv->dotzsdb_st = st;
-done:
-        cstring_release(&dotzsdbfname);
-        return status;
+        return dotzsdb_stat(priv, NULL) < 0 ? -1 : 0;
 }
 
+/* zs_dotzsdb_check_stat():
+ * Returns a positive value if .zsdb has changed since the last check, 0 if
+ * it hasn't, and -1 if it couldn't be checked. When .zsdb.gen is mapped,
+ * the generation number is compared, and .zsdb is only stat()ed every
+ * DOTZSDB_STAT_INTERVAL checks, or when holding the write or pack lock.
+ * Processes that can't map .zsdb.gen, or don't know about it, rewrite .zsdb
+ * without bumping the generation, and that's how their changes are noticed.
+ */
 int zs_dotzsdb_check_stat(struct zsdb_priv *priv)
 {
-        cstring dotzsdbfname = CSTRING_INIT;
-        struct stat st;
-        int status = 0;
+        int status = 0, changed;
 
-        memset(&st, 0, sizeof(struct stat));
+        if (priv->gen) {
+                uint64_t generation = gen_load(priv->gen);
 
-        /* The filename */
-        cstring_dup(&priv->dbdir, &dotzsdbfname);
-        cstring_addch(&dotzsdbfname, '/');
-        cstring_addstr(&dotzsdbfname, DOTZSDB_FNAME);
+                if (generation != priv->generation) {
+                        priv->generation = generation;
+                        status = ZSDB_FILE_GEN_CHANGED;
+                }
 
-        /* stat() the .zsdb file. The .zsdb file is
-         * used for synchronisation among various processes.
-         */
-        if (stat(dotzsdbfname.buf, &st) != 0) {
-                status = -1;
-                goto done;
+                if (!file_lock_is_locked(&priv->wlk) &&
+                    !file_lock_is_locked(&priv->plk) &&
+                    ++priv->genchecks < DOTZSDB_STAT_INTERVAL)
+                        return status;
         }
 
-        if (st.st_ino != priv->dotzsdb_st.st_ino)
-                status |= ZSDB_FILE_INO_CHANGED;
-        if (st.st_mode != priv->dotzsdb_st.st_mode)
-                status |= ZSDB_FILE_MODE_CHANGED;
-        if (st.st_uid != priv->dotzsdb_st.st_uid)
-                status |= ZSDB_FILE_UID_CHANGED;
-        if (st.st_gid != priv->dotzsdb_st.st_gid)
-                status |= ZSDB_FILE_GID_CHANGED;
-        if (st.st_size != priv->dotzsdb_st.st_size)
-                status |= ZSDB_FILE_SIZE_CHANGED;
-#ifdef MACOSX
-        if (st.st_mtimensec != priv->dotzsdb_st.st_mtimensec)
-                status |= ZSDB_FILE_MTIM_CHANGED;
-        if (st.st_ctimensec != priv->dotzsdb_st.st_ctimensec)
-                status |= ZSDB_FILE_CTIM_CHANGED;
-#else  /* Linux */
-        if (st.st_mtim.tv_nsec != priv->dotzsdb_st.st_mtim.tv_nsec)
-                status |= ZSDB_FILE_MTIM_CHANGED;
-        if (st.st_ctim.tv_nsec != priv->dotzsdb_st.st_ctim.tv_nsec)
-                status |= ZSDB_FILE_CTIM_CHANGED;
-#endif
+        priv->genchecks = 0;
+        changed = dotzsdb_stat(priv, &priv->dotzsdb_st);
 
-        if (status) {
-                priv->dotzsdb_st = st;
-        }
-done:
-        cstring_release(&dotzsdbfname);
-        return status;
+        if (changed < 0)
+                return status ? status : -1;
+
+        return changed | status;
 }
 
 /*
@@ -549,9 +650,240 @@ int zs_dotzsdb_update_end(struct zsdb_priv *priv)
                 goto done;
         }
 
+        /* Let everyone else know */
+        if (priv->gen) {
+                __atomic_store_n(&priv->gen->curidx, priv->dotzsdb.curidx,
+                                 __ATOMIC_RELEASE);
+                gen_bump(priv->gen);
+        }
+
 done:
         /* close both .zsdb and .zsdb.lock files */
         cleanup_lockfile();
 
         return ret;
 }
+
+/* Creates .zsdb.gen at `fname`, unless it exists already. The control block
+ * is written to a temporary file first and linked into place, so that no
+ * one ever maps a short file, or zeroes a generation someone else has
+ * bumped.
+ */
+static int gen_create(struct zsdb_priv *priv, const char *fname)
+{
+        cstring tmpfname = CSTRING_INIT;
+        struct dotzsdb_gen gen;
+        int fd, ret = 0;
+
+        cstring_dup(&priv->dbdir, &tmpfname);
+        cstring_addch(&tmpfname, '/');
+        cstring_addstr(&tmpfname, DOTZSDB_GEN_FNAME ".XXXXXX");
+
+        fd = mkstemp(tmpfname.buf);
+        if (fd < 0) {
+                ret = errno;
+                goto done;
+        }
+
+        memset(&gen, 0, sizeof(struct dotzsdb_gen));
+        gen.signature = ZS_SIGNATURE;
+        gen.curidx = priv->dotzsdb.curidx;
+
+        /* mkstemp() creates it 0600, and every process needs to map it */
+        if (fchmod(fd, 0644) != 0)
+                ret = errno;
+        else if (write(fd, &gen, sizeof(gen)) != (ssize_t)sizeof(gen))
+                ret = EIO;
+        close(fd);
+
+        if (!ret && link(tmpfname.buf, fname) != 0 && errno != EEXIST)
+                ret = errno;
+
+        unlink(tmpfname.buf);
+done:
+        cstring_release(&tmpfname);
+        return ret;
+}
+
+/*
+ * zs_dotzsdb_gen_open():
+ * Maps the .zsdb.gen control block of the DB, creating it if it doesn't
+ * exist yet. If that fails, changes to the DB are detected by stat()ing
+ * .zsdb, as before.
+ *
+ * Returns 1 if the control block is mapped and 0 otherwise.
+ */
+int zs_dotzsdb_gen_open(struct zsdb_priv *priv)
+{
+        cstring fname = CSTRING_INIT;
+        struct dotzsdb_gen *gen;
+        struct stat st;
+        int fd = -1, ret = 0;
+
+        priv->gen = NULL;
+        priv->generation = 0;
+        priv->genchecks = 0;
+
+        cstring_dup(&priv->dbdir, &fname);
+        cstring_addch(&fname, '/');
+        cstring_addstr(&fname, DOTZSDB_GEN_FNAME);
+
+        fd = open(fname.buf, O_RDWR);
+        if (fd < 0 && errno == ENOENT && gen_create(priv, fname.buf) == 0)
+                fd = open(fname.buf, O_RDWR);
+        if (fd < 0) {
+                zslog(LOGDEBUG, "Could not open %s!\n", fname.buf);
+                goto done;
+        }
+
+        /* It is only ever as big as the control block, and is mapped
+         * directly: a writable mfile would reserve room for it to grow. */
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)DOTZSDB_GEN_SIZE) {
+                zslog(LOGWARNING, "Invalid %s, checking .zsdb instead\n",
+                      fname.buf);
+                goto done;
+        }
+
+        gen = mmap(NULL, DOTZSDB_GEN_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+        if (gen == MAP_FAILED) {
+                zslog(LOGDEBUG, "Could not map %s!\n", fname.buf);
+                goto done;
+        }
+
+        if (gen->signature != ZS_SIGNATURE) {
+                zslog(LOGWARNING, "Invalid %s, checking .zsdb instead\n",
+                      fname.buf);
+                munmap(gen, DOTZSDB_GEN_SIZE);
+                goto done;
+        }
+
+        priv->gen = gen;
+        priv->generation = gen_load(gen);
+        ret = 1;
+
+done:
+        if (fd >= 0)
+                close(fd);
+        cstring_release(&fname);
+        return ret;
+}
+
+/*
+ * zs_dotzsdb_gen_close():
+ * Unmaps the .zsdb.gen control block.
+ */
+void zs_dotzsdb_gen_close(struct zsdb_priv *priv)
+{
+        if (priv->gen) {
+                munmap(priv->gen, DOTZSDB_GEN_SIZE);
+                priv->gen = NULL;
+        }
+}
+
+/*
+ * zs_dotzsdb_commit_seq_next():
+ * Numbers a group commit. It needs to be called with the write lock held,
+ * so that the numbers are in the order the commits are in the files.
+ * Without .zsdb.gen, the numbers are only good within this process.
+ */
+uint64_t zs_dotzsdb_commit_seq_next(struct zsdb_priv *priv)
+{
+        if (!priv->gen)
+                return priv->group.seq + 1;
+
+        return __atomic_add_fetch(&priv->gen->commits, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * zs_dotzsdb_commit_seq():
+ * The number of the last group commit, by any process.
+ */
+uint64_t zs_dotzsdb_commit_seq(struct zsdb_priv *priv)
+{
+        if (!priv->gen)
+                return priv->group.seq;
+
+        return __atomic_load_n(&priv->gen->commits, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * zs_dotzsdb_synced_seq():
+ * The number of the last group commit known to be on disk.
+ */
+uint64_t zs_dotzsdb_synced_seq(struct zsdb_priv *priv)
+{
+        /* Without .zsdb.gen, the group is synced before the write lock
+         * is released */
+        if (!priv->gen)
+                return priv->group.seq;
+
+        return __atomic_load_n(&priv->gen->synced, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * zs_dotzsdb_set_synced_seq():
+ * Records that the group commits up to `seq` are on disk, unless someone
+ * has already synced past it.
+ */
+void zs_dotzsdb_set_synced_seq(struct zsdb_priv *priv, uint64_t seq)
+{
+        uint64_t synced;
+
+        if (!priv->gen)
+                return;
+
+        synced = __atomic_load_n(&priv->gen->synced, __ATOMIC_ACQUIRE);
+        while (synced < seq &&
+               !__atomic_compare_exchange_n(&priv->gen->synced, &synced, seq,
+                                            0, __ATOMIC_RELEASE,
+                                            __ATOMIC_ACQUIRE))
+                ;
+
+        __atomic_add_fetch(&priv->gen->syncs, 1, __ATOMIC_RELEASE);
+        gen_futex_wake(&priv->gen->syncs);
+}
+
+/*
+ * zs_dotzsdb_wait_synced():
+ * Waits up to `timeout_ms` for someone to sync the group commits up to
+ * `seq`. Returns 1 if they are on disk, and 0 if they may not be.
+ */
+int zs_dotzsdb_wait_synced(struct zsdb_priv *priv, uint64_t seq,
+                           long timeout_ms)
+{
+        long long deadline = time_in_ms() + timeout_ms;
+
+        if (!priv->gen)
+                return zs_dotzsdb_synced_seq(priv) >= seq;
+
+        while (1) {
+                /* Read before checking, so that a sync in between wakes us */
+                uint32_t syncs = __atomic_load_n(&priv->gen->syncs,
+                                                 __ATOMIC_ACQUIRE);
+                long long now;
+
+                if (zs_dotzsdb_synced_seq(priv) >= seq)
+                        return 1;
+
+                now = time_in_ms();
+                if (now >= deadline)
+                        return 0;
+
+                gen_futex_wait(&priv->gen->syncs, syncs, deadline - now);
+        }
+}
+
+/*
+ * zs_dotzsdb_is_active_idx():
+ * Whether the active file this process has open is still the one everyone
+ * is committing to, and hasn't been finalised by another process.
+ */
+int zs_dotzsdb_is_active_idx(struct zsdb_priv *priv)
+{
+        if (!priv->gen)
+                return 1;
+
+        return __atomic_load_n(&priv->gen->curidx, __ATOMIC_ACQUIRE) ==
+                priv->dotzsdb.curidx;
+}
@@ -0,0 +1,166 @@
+/*
+ * zeroskip-eytzinger.c : Cache friendly search of in-memory indexes
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/log.h>
+#include <libzeroskip/macros.h>
+#include <libzeroskip/util.h>
+#include <libzeroskip/zeroskip.h>
+#include "zeroskip-priv.h"
+
+#include <string.h>
+
+/*
+ * The slots are numbered from 1, the root. The children of slot k are
+ * slots 2k and 2k + 1, so the slots a search can get to in the next two
+ * levels, 4k to 4k + 3, are next to each other and can be prefetched
+ * together.
+ *
+ * With prefixes, every slot also has the first 8 bytes of its key, padded
+ * with zeros, as a big-endian number. Comparing those numbers orders keys
+ * the same way memcmp_raw() does, unless they are equal, so the key itself
+ * only needs to be looked at on a tie. The bytes that all the keys begin
+ * with are skipped, since they would only ever tie.
+ */
+
+/**
+ * Private functions
+ */
+static inline uint64_t key_prefix(const unsigned char *key, uint64_t keylen)
+{
+        unsigned char buf[sizeof(uint64_t)];
+
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, key, keylen < sizeof(buf) ? keylen : sizeof(buf));
+
+        return read_be64(buf);
+}
+
+/* Fill the subtree at slot `k` with the keys from `idx` onwards, in order.
+ * Returns the index of the next key.
+ */
+static uint64_t eytzinger_fill(struct zsdb_eytzinger *e, uint64_t idx,
+                               uint64_t k, zs_eytzinger_key_fn keyfn,
+                               void *data)
+{
+        if (k <= e->count) {
+                struct zs_eytzinger_slot *slot = &e->slots[k];
+
+                idx = eytzinger_fill(e, idx, 2 * k, keyfn, data);
+
+                keyfn(data, idx, &slot->key, &slot->keylen);
+                slot->idx = idx++;
+                if (e->prefixed)
+                        slot->prefix = key_prefix(slot->key + e->skip,
+                                                  slot->keylen - e->skip);
+
+                idx = eytzinger_fill(e, idx, 2 * k + 1, keyfn, data);
+        }
+
+        return idx;
+}
+
+/**
+ * Public functions
+ */
+
+/* zs_eytzinger_new():
+ * Lay out the `count` keys of a sorted index, which `keyfn` gets by their
+ * position. The keys aren't copied, and must outlive the layout. Key
+ * prefixes are only of use if the keys are in memcmp_raw() order.
+ */
+void zs_eytzinger_new(struct zsdb_eytzinger *e, uint64_t count,
+                      int prefixed, zs_eytzinger_key_fn keyfn, void *data)
+{
+        e->count = count;
+        e->prefixed = prefixed;
+        e->slots = xcalloc(count + 1, sizeof(struct zs_eytzinger_slot));
+        e->common = NULL;
+        e->skip = 0;
+
+        /* The keys are sorted, so what the first and last keys begin with,
+         * they all begin with */
+        if (prefixed && count) {
+                const unsigned char *last;
+                uint64_t lastlen;
+
+                keyfn(data, 0, &e->common, &e->skip);
+                keyfn(data, count - 1, &last, &lastlen);
+                if (lastlen < e->skip)
+                        e->skip = lastlen;
+                while (e->skip && memcmp(e->common, last, e->skip))
+                        e->skip--;
+        }
+
+        eytzinger_fill(e, 0, 1, keyfn, data);
+}
+
+void zs_eytzinger_free(struct zsdb_eytzinger *e)
+{
+        xfree(e->slots);
+        e->count = 0;
+}
+
+/* zs_eytzinger_upper_bound():
+ * Returns the number of keys in the index that aren't bigger than `key`,
+ * which is the position of the first key that is. The prefixes are ignored
+ * if there is a custom comparator.
+ */
+uint64_t zs_eytzinger_upper_bound(const struct zsdb_eytzinger *e,
+                                  const unsigned char *key, uint64_t keylen,
+                                  zsdb_cmp_fn cmpfn)
+{
+        const struct zs_eytzinger_slot *slots = e->slots;
+        int prefixed = e->prefixed && !cmpfn;
+        uint64_t prefix = 0;
+        uint64_t k = 1;
+
+        /* A key that doesn't begin like all the others is compared in
+         * full */
+        if (prefixed && e->skip &&
+            (keylen < e->skip || memcmp(key, e->common, e->skip)))
+                prefixed = 0;
+
+        if (prefixed)
+                prefix = key_prefix(key + e->skip, keylen - e->skip);
+
+        while (k <= e->count) {
+                int res;
+
+                /* Two slots to a cache line */
+                _prefetch_(&slots[4 * k]);
+                _prefetch_(&slots[4 * k + 2]);
+
+                if (prefixed) {
+                        if (prefix != slots[k].prefix) {
+                                k = 2 * k + (prefix > slots[k].prefix);
+                                continue;
+                        }
+                } else if (2 * k + 1 <= e->count) {
+                        _prefetch_(slots[2 * k].key);
+                        _prefetch_(slots[2 * k + 1].key);
+                }
+
+                if (cmpfn)
+                        res = cmpfn(key, keylen, slots[k].key, slots[k].keylen);
+                else
+                        res = memcmp_raw(key, keylen, slots[k].key,
+                                         slots[k].keylen);
+
+                k = 2 * k + (res >= 0);
+        }
+
+        /* Go back up past the right turns, to where the search last went
+         * left: that key is the first one bigger than `key`. If it never
+         * went left, all the keys are smaller.
+         */
+        k >>= __builtin_ffsll(~k);
+
+        return k ? slots[k].idx : e->count;
+}
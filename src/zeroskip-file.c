@@ -18,232 +18,143 @@
 /**
  * Private functions
  */
-/* Caller should free buf
- */
-static int zs_prepare_key_buf(const unsigned char *key, uint64_t keylen,
-                              unsigned char **buf, uint64_t *buflen,
-                              int *alloced)
-{
-        int ret = ZS_OK;
-        unsigned char *kbuf;
-        uint64_t kbuflen, finalkeylen, pos = 0;
-        enum record_t type;
-
-        kbuflen = ZS_KEY_BASE_REC_SIZE;
-        type = REC_TYPE_KEY;
 
-        if (keylen > MAX_SHORT_KEY_LEN)
-                type |= REC_TYPE_LONG;
+/* Records are padded to 64 bits with these */
+static const unsigned char zeros[8];
 
-        /* Minimum buf size */
-        finalkeylen = roundup64bits(keylen);
-        kbuflen += finalkeylen;
-
-        kbuf = xcalloc(1, kbuflen);
-        *alloced = 1;
-
-        if (type == REC_TYPE_KEY) {
+/* Fill `buf` with the ZS_KEY_BASE_REC_SIZE bytes a key record begins
+ * with. The value record follows it, at `valoffset`.
+ */
+static void zs_key_header(unsigned char *buf, uint64_t keylen,
+                          uint64_t valoffset)
+{
+        if (keylen <= MAX_SHORT_KEY_LEN) {
                 /* If it is a short key, the first 3 fields make up 64 bits */
-                uint64_t val = 0;
-
-                val = ((uint64_t)type << 56);       /* Type */
-                val |= ((uint64_t)keylen << 40);    /* Key length */
-                val |= ((uint64_t)kbuflen);         /* Val offset */
-                write_be64(kbuf + pos, val);
-                pos += sizeof(uint64_t);
-                write_be64(kbuf + pos, 0ULL);     /* Extended length */
-                pos += sizeof(uint64_t);
-                write_be64(kbuf + pos, 0ULL);     /* Extended Value offset */
-                pos += sizeof(uint64_t);
-
+                write_be64(buf, ((uint64_t)REC_TYPE_KEY << 56) | /* Type */
+                           ((uint64_t)keylen << 40) |  /* Key length */
+                           valoffset);                 /* Val offset */
+                write_be64(buf + 8, 0ULL);      /* Extended length */
+                write_be64(buf + 16, 0ULL);     /* Extended Value offset */
         } else {
                 /* A long key has the type followed by 56 bits of nothing */
-                uint64_t val = 0;
-                val = ((uint64_t)type << 56);       /* Type */
-                write_be64(kbuf + pos, val);
-                pos += sizeof(uint64_t);
-                write_be64(kbuf + pos, keylen);     /* Extended length */
-                pos += sizeof(uint64_t);
-                write_be64(kbuf + pos, kbuflen);    /* Extended Value offset */
-                pos += sizeof(uint64_t);
+                write_be64(buf, (uint64_t)REC_TYPE_LONG_KEY << 56);
+                write_be64(buf + 8, keylen);    /* Extended length */
+                write_be64(buf + 16, valoffset); /* Extended Value offset */
         }
-
-        /* the key */
-        memcpy(kbuf + pos, key, keylen);
-        pos += keylen;
-
-        *buflen = kbuflen;
-        *buf = kbuf;
-
-        return ret;
 }
 
-/* Caller should free buf
+/* Fill `buf` with the ZS_VAL_BASE_REC_SIZE bytes a value record begins
+ * with.
  */
-static int zs_prepare_val_buf(const unsigned char *val, uint64_t vallen,
-                              unsigned char **buf, uint64_t *buflen,
-                              int *alloced)
+static void zs_val_header(unsigned char *buf, uint64_t vallen)
 {
-        int ret = ZS_OK;
-        unsigned char *vbuf;
-        uint64_t vbuflen, finalvallen, pos = 0;
-        enum record_t type;
-
-        vbuflen = ZS_VAL_BASE_REC_SIZE;
-        type = REC_TYPE_VALUE;
-
-        if (vallen > MAX_SHORT_VAL_LEN)
-                type |= REC_TYPE_LONG;
-
-        /* Minimum buf size */
-        finalvallen = roundup64bits(vallen);
-
-        vbuflen += finalvallen;
-
-        vbuf = xcalloc(1, vbuflen);
-        *alloced = 1;
-
-        if (type == REC_TYPE_VALUE) {
-                /* The first 3 fields in a short key make up 64 bits */
-                uint64_t value = 0;
-
-                value = ((uint64_t)type << 56);     /* Type */
-                value |= ((uint64_t)vallen << 32);  /* Val length */
-                write_be64(vbuf + pos, value);
-                pos += sizeof(uint64_t);
-                write_be64(vbuf + pos, 0ULL);     /* Extended length */
-                pos += sizeof(uint64_t);
+        if (vallen <= MAX_SHORT_VAL_LEN) {
+                /* The first 3 fields in a short value make up 64 bits */
+                write_be64(buf, ((uint64_t)REC_TYPE_VALUE << 56) | /* Type */
+                           ((uint64_t)vallen << 32));  /* Val length */
+                write_be64(buf + 8, 0ULL);      /* Extended length */
         } else {
                 /* A long val has the type followed by 56 bits of nothing */
-                uint64_t value;
-                value = ((uint64_t)type << 56);   /* Type */
-                write_be64(vbuf + pos, value);
-                pos += sizeof(uint64_t);
-                write_be64(vbuf + pos, vallen); /* Extended length */
-                pos += sizeof(uint64_t);
+                write_be64(buf, (uint64_t)REC_TYPE_LONG_VALUE << 56);
+                write_be64(buf + 8, vallen);    /* Extended length */
         }
-
-        /* the value */
-        memcpy(vbuf + pos, val, vallen);
-
-        *buflen = vbuflen;
-        *buf = vbuf;
-
-        return ret;
 }
 
-/* Caller should free buf
+/* Fill `buf` with the ZS_KEY_BASE_REC_SIZE bytes a delete record begins
+ * with.
  */
-static int zs_prepare_delete_key_buf(const unsigned char *key, uint64_t keylen,
-                                     unsigned char **buf, uint64_t *buflen,
-                                     int *alloced)
+static void zs_delete_header(unsigned char *buf, uint64_t keylen)
 {
-        int ret = ZS_OK;
-        unsigned char *kbuf;
-        uint64_t kbuflen, finalkeylen, pos = 0;
-        uint64_t val;
-        enum record_t type = REC_TYPE_DELETED;
-
-        kbuflen = ZS_KEY_BASE_REC_SIZE;
-
-        /* Minimum buf size */
-        finalkeylen = roundup64bits(keylen);
-        kbuflen += finalkeylen;
-
-        kbuf = xcalloc(1, kbuflen);
-        *alloced = 1;
-
         if (keylen <= MAX_SHORT_KEY_LEN) {
-                val = ((uint64_t)type << 56);     /* Type */
-                val |= ((uint64_t)keylen << 40);  /* Key length */
-                write_be64(kbuf + pos, val);
-                pos += sizeof(uint64_t);
-                write_be64(kbuf + pos, 0ULL);     /* Extended length */
-                pos += sizeof(uint64_t);
-                write_be64(kbuf + pos, 0ULL);     /* Extended Value offset */
-                pos += sizeof(uint64_t);
+                write_be64(buf, ((uint64_t)REC_TYPE_DELETED << 56) | /* Type */
+                           ((uint64_t)keylen << 40));  /* Key length */
+                write_be64(buf + 8, 0ULL);      /* Extended length */
         } else {
-                type = REC_TYPE_LONG_DELETED;
-                val = ((uint64_t)type << 56);
-                pos += sizeof(uint64_t);
-                write_be64(kbuf + pos, keylen);     /* Extended length */
-                pos += sizeof(uint64_t);
-                write_be64(kbuf + pos, 0ULL);       /* Extended Value offset */
-                pos += sizeof(uint64_t);
+                /* The first 64 bits of a long delete record have always
+                 * been left as zeroes */
+                write_be64(buf, 0ULL);
+                write_be64(buf + 8, keylen);    /* Extended length */
         }
-
-        /* the key */
-        memcpy(kbuf + pos, key, keylen);
-        pos += keylen;
-
-        *buflen = kbuflen;
-        *buf = kbuf;
-
-        return ret;
+        write_be64(buf + 16, 0ULL);             /* Extended Value offset */
 }
 
 /**
  * Public functions
  */
+
+/* zs_file_write_keyval_record():
+ * Writes a key record and its value record. The headers are built on the
+ * stack, and the key and value are copied to the file from where they are,
+ * with a single write.
+ */
 int zs_file_write_keyval_record(struct zsdb_file *f,
                                 const unsigned char *key, uint64_t keylen,
                                 const unsigned char *val, uint64_t vallen)
 {
-        int ret = ZS_OK;
-        uint64_t keybuflen, valbuflen;
-        unsigned char *keybuf, *valbuf;
-        uint64_t mfsize = 0, nbytes;
-        int kalloced = 0, valloced = 0;
+        unsigned char keyhdr[ZS_KEY_BASE_REC_SIZE];
+        unsigned char valhdr[ZS_VAL_BASE_REC_SIZE];
+        uint64_t keypad, valpad, nbytes;
+        struct iovec iov[6];
 
         if (!f->is_open)
                 return ZS_NOT_OPEN;
 
-        ret = zs_prepare_key_buf(key, keylen, &keybuf, &keybuflen, &kalloced);
-        if (ret != ZS_OK) {
-                return ZS_IOERROR;
-        }
+        keypad = roundup64bits(keylen) - keylen;
+        valpad = roundup64bits(vallen) - vallen;
 
-        ret = zs_prepare_val_buf(val, vallen, &valbuf, &valbuflen, &valloced);
-        if (ret != ZS_OK) {
-                return ZS_IOERROR;
-        }
+        zs_key_header(keyhdr, keylen, ZS_KEY_BASE_REC_SIZE + keylen + keypad);
+        zs_val_header(valhdr, vallen);
 
-        /* Get the current mfile size */
-        mfsize = f->mf->size;
+        iov_set(&iov[0], keyhdr, sizeof(keyhdr));
+        iov_set(&iov[1], key, keylen);
+        iov_set(&iov[2], zeros, keypad);
+        iov_set(&iov[3], valhdr, sizeof(valhdr));
+        iov_set(&iov[4], val, vallen);
+        iov_set(&iov[5], zeros, valpad);
 
-        /* write key buffer */
-        ret = mfile_write(&f->mf, (void *)keybuf,
-                               keybuflen, &nbytes);
-        if (ret) {
+        if (mfile_write_iov(&f->mf, iov, 6, &nbytes)) {
                 zslog(LOGDEBUG, "Error writing key\n");
-                ret = ZS_IOERROR;
-                goto done;
-        }
-
-        /* assert(nbytes == keybuflen); */
-
-        /* write value buffer */
-        ret = mfile_write(&f->mf, (void *)valbuf,
-                               valbuflen, &nbytes);
-        if (ret) {
-                zslog(LOGDEBUG, "Error writing key\n");
-                ret = ZS_IOERROR;
-                goto done;
+                return ZS_IOERROR;
         }
 
-        /* assert(nbytes == valbuflen); */
+        return ZS_OK;
+}
 
-        /* If we failed writing the value buffer, then restore the db file to
-         * the original size we had before updating */
-        if (ret != ZS_OK) {
-                mfile_truncate(&f->mf, mfsize);
-        }
+/* zs_file_encode_keyval_record():
+ * Appends a key record and its value record to `cstr`, as
+ * zs_file_write_keyval_record() would write them.
+ */
+void zs_file_encode_keyval_record(cstring *cstr,
+                                  const unsigned char *key, uint64_t keylen,
+                                  const unsigned char *val, uint64_t vallen)
+{
+        unsigned char hdr[ZS_KEY_BASE_REC_SIZE];
+        uint64_t keypad = roundup64bits(keylen) - keylen;
+
+        zs_key_header(hdr, keylen, ZS_KEY_BASE_REC_SIZE + keylen + keypad);
+        cstring_add(cstr, hdr, ZS_KEY_BASE_REC_SIZE);
+        cstring_add(cstr, key, keylen);
+        cstring_add(cstr, zeros, keypad);
+
+        zs_val_header(hdr, vallen);
+        cstring_add(cstr, hdr, ZS_VAL_BASE_REC_SIZE);
+        cstring_add(cstr, val, vallen);
+        cstring_add(cstr, zeros, roundup64bits(vallen) - vallen);
+}
 
-done:
-        if (kalloced) xfree(keybuf);
-        if (valloced) xfree(valbuf);
+/* zs_file_encode_delete_record():
+ * Appends a delete record to `cstr`, as zs_file_write_delete_record()
+ * would write it.
+ */
+void zs_file_encode_delete_record(cstring *cstr,
+                                  const unsigned char *key, uint64_t keylen)
+{
+        unsigned char hdr[ZS_KEY_BASE_REC_SIZE];
 
-        return ret;
+        zs_delete_header(hdr, keylen);
+        cstring_add(cstr, hdr, ZS_KEY_BASE_REC_SIZE);
+        cstring_add(cstr, key, keylen);
+        cstring_add(cstr, zeros, roundup64bits(keylen) - keylen);
 }
 
 /* zs_file_write_commit_record()
@@ -337,13 +248,8 @@ int zs_file_write_commit_record(struct zsdb_file *f, int final)
 
         /* assert(nbytes == buflen); */
 
-        /* Flush the change to disk */
-        ret = mfile_flush(&f->mf);
-        if (ret) {
-                zslog(LOGDEBUG, "Error flushing commit record to disk.\n");
-                ret = ZS_IOERROR;
-                goto done;
-        }
+        /* How much is synced is up to the caller. So is writing it out, for
+           others to read, with MODE_PWRITE, which syncing does as well */
 
 done:
         return ret;
@@ -352,44 +258,25 @@ done:
 int zs_file_write_delete_record(struct zsdb_file *f,
                                 const unsigned char *key, uint64_t keylen)
 {
-        int ret = ZS_OK;
-        unsigned char *dbuf;
-        uint64_t dbuflen, mfsize = 0, nbytes;
-        int alloced = 0;
-
+        unsigned char hdr[ZS_KEY_BASE_REC_SIZE];
+        uint64_t nbytes;
+        struct iovec iov[3];
 
         if (!f->is_open)
                 return ZS_NOT_OPEN;
 
-        ret = zs_prepare_delete_key_buf(key, keylen, &dbuf, &dbuflen, &alloced);
-        if (ret != ZS_OK) {
-                return ZS_IOERROR;
-        }
+        zs_delete_header(hdr, keylen);
 
-        /* Get the current mfile size */
-        mfsize = f->mf->size;
+        iov_set(&iov[0], hdr, sizeof(hdr));
+        iov_set(&iov[1], key, keylen);
+        iov_set(&iov[2], zeros, roundup64bits(keylen) - keylen);
 
-        /* write delete buffer */
-        ret = mfile_write(&f->mf, (void *)dbuf,
-                               dbuflen, &nbytes);
-        if (ret) {
+        if (mfile_write_iov(&f->mf, iov, 3, &nbytes)) {
                 zslog(LOGDEBUG, "Error writing delete key\n");
-                ret = ZS_IOERROR;
-                goto done;
-        }
-
-        /* assert(nbytes == keybuflen); */
-
-        /* If we failed writing the delete buffer, then restore the db file to
-         * the original size we had before updating */
-        if (ret != ZS_OK) {
-                mfile_truncate(&f->mf, mfsize);
+                return ZS_IOERROR;
         }
 
-done:
-        if (alloced)
-                xfree(dbuf);
-        return ret;
+        return ZS_OK;
 }
 
 /* zs_file_update_stat():
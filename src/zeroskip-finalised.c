@@ -114,6 +114,8 @@ int zs_finalised_file_record_foreach(struct zsdb_file *f,
         }
 
         while (offset < mfsize) {
+                size_t start = offset;
+
                 ret = zs_record_read_from_file(f, &offset,
                                                cb, deleted_cb,
                                                cbdata);
@@ -121,6 +123,14 @@ int zs_finalised_file_record_foreach(struct zsdb_file *f,
                         zslog(LOGWARNING, "Cannot read records from finalised file.\n!");
                         break;
                 }
+
+                /* Zeroes, or a record we don't know how to skip */
+                if (offset <= start) {
+                        zslog(LOGWARNING, "Invalid record at %zu in %s!\n",
+                              start, f->fname.buf);
+                        ret = ZS_INVALID_DB;
+                        break;
+                }
         }
 
         return ret;
@@ -13,6 +13,8 @@
 
 #include "zeroskip-priv.h"
 
+#include <inttypes.h>
+
 /**
  * Private functions
  */
@@ -161,7 +163,7 @@ static int iter_pq_cmp(const void *d1, const void *d2, void *cbdata)
 /* struct zsdb_iter_data handling */
 static struct zsdb_iter_data *zsdb_iter_data_alloc(zsdb_be_t type, int prio,
                                                    void *data,
-                                                   memtree_iter_t *iter)
+                                                   memtable_iter_t *iter)
 {
         struct zsdb_iter_data *d;
 
@@ -175,17 +177,13 @@ static struct zsdb_iter_data *zsdb_iter_data_alloc(zsdb_be_t type, int prio,
                 /* data is in files */
                 d->data.f = data;
         } else {
-                /* data is an in-memory memtree for finalised and active */
-                struct memtree *tree = data;
-                if (!iter) {
-                        memtree_begin(tree, d->data.iter);
-                } else {
-                        d->data.iter->tree = (*iter)->tree;
-                        d->data.iter->node = (*iter)->node;
-                        d->data.iter->pos  = (*iter)->pos;
-                        d->data.iter->record = (*iter)->record;
-                }
-                memtree_next(d->data.iter);
+                /* data is an in-memory memtable for finalised and active */
+                struct memtable *table = data;
+                if (!iter)
+                        memtable_begin(table, d->data.iter);
+                else
+                        *d->data.iter = **iter;
+                memtable_next(d->data.iter);
         }
 
         return d;
@@ -241,7 +239,7 @@ static int zsdb_iter_data_next(struct zsdb_iter *iter,
         switch (iterdata->type) {
         case ZSDB_BE_ACTIVE:
         case ZSDB_BE_FINALISED:
-                if (memtree_next(iterdata->data.iter)) {
+                if (memtable_next(iterdata->data.iter)) {
                         key = iterdata->data.iter->record->key;
                         keylen = iterdata->data.iter->record->keylen;
                         iterdata->deleted = iterdata->data.iter->record->deleted;
@@ -252,7 +250,7 @@ static int zsdb_iter_data_next(struct zsdb_iter *iter,
                 struct zsdb_file *f = iterdata->data.f;
                 enum record_t rectype = REC_TYPE_UNUSED;
                 f->indexpos++;
-                if (f->indexpos < f->index->count)
+                if (f->indexpos < f->nrecords)
                         zs_packed_file_get_key_from_offset(f, &key,
                                                            &keylen, &rectype);
                 if (rectype == REC_TYPE_DELETED || rectype == REC_TYPE_LONG_DELETED)
@@ -406,7 +404,7 @@ int zs_iterator_begin(struct zsdb_iter **iter)
         if (priv->dbfiles.ffcount) {
                 prio++;
                 fiterd = zsdb_iter_data_alloc(ZSDB_BE_FINALISED, prio,
-                                              priv->fmemtree, NULL);
+                                              priv->fmemtable, NULL);
                 fiterd->deleted = fiterd->data.iter->record->deleted;
                 zsdb_iter_datav_add_iter(*iter, fiterd);
                 zsdb_iter_data_process(*iter, fiterd->data.iter->record->key,
@@ -415,10 +413,10 @@ int zs_iterator_begin(struct zsdb_iter **iter)
         }
 
         /* Add active file to the iterator */
-        if (priv->memtree->count) {
+        if (memtable_count(priv->memtable)) {
                 prio++;
                 aiterd = zsdb_iter_data_alloc(ZSDB_BE_ACTIVE, prio,
-                                              priv->memtree, NULL);
+                                              priv->memtable, NULL);
                 aiterd->deleted = aiterd->data.iter->record->deleted;
                 zsdb_iter_datav_add_iter(*iter, aiterd);
                 zsdb_iter_data_process(*iter, aiterd->data.iter->record->key,
@@ -429,20 +427,21 @@ int zs_iterator_begin(struct zsdb_iter **iter)
         return ZS_OK;
 }
 
-/* zs_iterator_begin_at_key():
- *  sets up the iterator to start from the 'key'.
- *  If 'key' is not found, then the transaction is points to the 'next' closest
- *  key in that iterator for that back-end.
+/* iterator_begin_at_key():
+ *  sets up the iterator to start from the 'key'. If 'prefix' is set, then
+ *  the iterator is only going to be used for keys that begin with 'key',
+ *  and packed files that cannot have any of those are left out.
  */
-int zs_iterator_begin_at_key(struct zsdb_iter **iter,
-                             const unsigned char *key,
-                             uint64_t keylen,
-                             int *found)
+static int iterator_begin_at_key(struct zsdb_iter **iter,
+                                 const unsigned char *key,
+                                 uint64_t keylen,
+                                 int prefix,
+                                 int *found)
 {
         struct zsdb_priv *priv;
         struct list_head *pos;
         int prio = 0;
-        memtree_iter_t aiter, fiter;
+        memtable_iter_t aiter, fiter;
         struct zsdb_iter_data *fiterd, *aiterd;
 
         if (!iter || !*iter) {
@@ -465,18 +464,36 @@ int zs_iterator_begin_at_key(struct zsdb_iter **iter,
                 uint64_t location = 0;
                 unsigned char *nextkey = NULL;
                 uint64_t nextkeylen = 0;
+                int cmp_ret;
 
                 f = list_entry(pos, struct zsdb_file, list);
                 prio = f->priority;
 
                 zslog(LOGDEBUG, "Looking in packed file %s\n",
                       f->fname.buf);
-                zslog(LOGDEBUG, "\tTotal records: %d\n",
-                      f->index->count);
+                zslog(LOGDEBUG, "\tTotal records: %" PRIu64 "\n",
+                      f->nrecords);
 
-                if (zs_packed_file_bsearch_index(key, keylen, f,
-                                                 &location, NULL, 0,
-                                                 priv->dbcompare)) {
+                /* Leave out files with nothing at or after the key, or
+                 * with nothing that begins with the prefix.
+                 */
+                cmp_ret = zs_packed_file_cmp_fence_keys(f, key, keylen,
+                                                        priv->dbcompare);
+                if (cmp_ret > 0)
+                        continue;
+
+                if (prefix && !zs_packed_file_has_prefix(f, key, keylen,
+                                                         priv->dbcompare))
+                        continue;
+
+                /* The key is smaller than every key in the file, so start
+                 * from the beginning, without searching.
+                 */
+                if (cmp_ret < 0) {
+                        location = 0;
+                } else if (zs_packed_file_bsearch_index(key, keylen, f,
+                                                        &location, NULL, 0,
+                                                        priv->dbcompare)) {
                         zslog(LOGDEBUG, "Record found at location %ld\n",
                               location);
                         *found = 1;
@@ -496,29 +513,29 @@ int zs_iterator_begin_at_key(struct zsdb_iter **iter,
 
         /* Look for the key in the finalised records and add the iterator */
         prio++;
-        if (memtree_find(priv->fmemtree, key, keylen, fiter)) {
+        if (memtable_seek(priv->fmemtable, key, keylen, fiter)) {
                 /* We found the key in finalised records */
                 *found = 1;
         }
 
-        if (priv->fmemtree->count && fiter->record) {
+        if (memtable_count(priv->fmemtable) && fiter->record) {
                 fiterd = zsdb_iter_data_alloc(ZSDB_BE_FINALISED, prio,
-                                              priv->fmemtree, &fiter);
+                                              priv->fmemtable, &fiter);
                 zsdb_iter_datav_add_iter(*iter, fiterd);
                 zsdb_iter_data_process(*iter, fiterd->data.iter->record->key,
                                        fiterd->data.iter->record->keylen, fiterd);
         }
 
-        /* Look for the key in the active in-memory memtree and add the iterator */
+        /* Look for the key in the active in-memory memtable and add the iterator */
         prio++;
-        if (memtree_find(priv->memtree, key, keylen, aiter)) {
+        if (memtable_seek(priv->memtable, key, keylen, aiter)) {
                 /* We found the key in active records */
                 *found = 1;
         }
 
-        if (priv->memtree->count && aiter->record) {
+        if (memtable_count(priv->memtable) && aiter->record) {
                 aiterd = zsdb_iter_data_alloc(ZSDB_BE_ACTIVE, prio,
-                                              priv->memtree, &aiter);
+                                              priv->memtable, &aiter);
                 zsdb_iter_datav_add_iter(*iter, aiterd);
                 zsdb_iter_data_process(*iter, aiterd->data.iter->record->key,
                                        aiterd->data.iter->record->keylen, aiterd);
@@ -527,6 +544,31 @@ int zs_iterator_begin_at_key(struct zsdb_iter **iter,
         return ZS_OK;
 }
 
+/* zs_iterator_begin_at_key():
+ *  sets up the iterator to start from the 'key'.
+ *  If 'key' is not found, then the transaction is points to the 'next' closest
+ *  key in that iterator for that back-end.
+ */
+int zs_iterator_begin_at_key(struct zsdb_iter **iter,
+                             const unsigned char *key,
+                             uint64_t keylen,
+                             int *found)
+{
+        return iterator_begin_at_key(iter, key, keylen, 0, found);
+}
+
+/* zs_iterator_begin_at_prefix():
+ *  sets up the iterator to start from the first key that begins with
+ *  'prefix'.
+ */
+int zs_iterator_begin_at_prefix(struct zsdb_iter **iter,
+                                const unsigned char *prefix,
+                                uint64_t prefixlen,
+                                int *found)
+{
+        return iterator_begin_at_key(iter, prefix, prefixlen, 1, found);
+}
+
 /* zs_iterator_begin_for_packed_flist():
  * A function to begin an iterator on a set of packed files listed in
  * `pflist`, in a DB and to iterate over it.
@@ -11,12 +11,11 @@
 #include "pqueue.h"
 
 #include <libzeroskip/crc32c.h>
-#include <libzeroskip/memtree.h>
+#include <libzeroskip/memtable.h>
 #include <libzeroskip/log.h>
 #include <libzeroskip/macros.h>
 #include <libzeroskip/mfile.h>
 #include <libzeroskip/util.h>
-#include <libzeroskip/vecu64.h>
 #include <libzeroskip/zeroskip.h>
 #include "zeroskip-priv.h"
 
@@ -24,43 +23,6 @@
 /**
  * Private functions
  */
-static int zs_packed_file_write_index_count(struct zsdb_file *f,
-                                            uint64_t count)
-{
-        unsigned char buf[8];
-        size_t nbytes;
-        int ret;
-
-        memset(buf, 0, sizeof(buf));
-
-        write_be64(buf, count);
-        ret = mfile_write(&f->mf, (void *)buf, sizeof(uint64_t), &nbytes);
-        if (ret) {
-                zslog(LOGDEBUG, "Error writing index count\n");
-                ret = ZS_IOERROR;
-        }
-
-        return ret;
-}
-
-static int zs_packed_file_write_index(void *data, uint64_t offset)
-{
-        unsigned char buf[8];
-        struct zsdb_file *f = (struct zsdb_file *)data;
-        size_t nbytes;
-        int ret;
-
-        write_be64(buf, offset);
-
-        ret = mfile_write(&f->mf, (void *)buf, sizeof(uint64_t), &nbytes);
-        if (ret) {
-                zslog(LOGDEBUG, "Error writing index\n");
-                ret = ZS_IOERROR;
-        }
-
-        return ret;
-}
-
 /* get_offset_to_pointers():
  * Given a struct zsdb_file pointer and an offset to the final commit
  * record, this function returns the offset to the beginning of the pointers
@@ -130,32 +92,86 @@ static int get_offset_to_pointers(struct zsdb_file *f, uint64_t *offset,
         }
 }
 
-static int read_pointers(struct zsdb_file *f, uint64_t offset)
+/* read_key_at_index():
+ * Get the key of the `idx`th record of a packed file.
+ */
+static int read_key_at_index(struct zsdb_file *f, uint64_t idx,
+                             const unsigned char **key, uint64_t *keylen)
+{
+        return zs_packed_file_read_record(f, idx, key, keylen,
+                                          NULL, NULL, NULL);
+}
+
+/* copy_fence_key():
+ * Keys of version 2 packed files are decoded into a buffer that is reused,
+ * so the fence keys are kept in copies of their own.
+ */
+static int copy_fence_key(struct zsdb_file *f, uint64_t idx,
+                          unsigned char **key, uint64_t *keylen)
 {
-        uint64_t count, i;
-        unsigned char *bptr, *fptr;
+        const unsigned char *k;
+        int ret;
+
+        ret = read_key_at_index(f, idx, &k, keylen);
+        if (ret != ZS_OK)
+                return ret;
+
+        *key = xmalloc(*keylen + 1);
+        memcpy(*key, k, *keylen);
+
+        return ZS_OK;
+}
+
+/* read_pointers():
+ * Point f->pointers at the pointers section of a version 1 packed file, at
+ * `offset`, which is at most `len` bytes long. The offsets are left in the
+ * mapped file, and decoded when they are used. On success, `offset` is set
+ * to the end of the pointers section.
+ */
+static int read_pointers(struct zsdb_file *f, uint64_t *offset, uint64_t len)
+{
+        uint64_t count;
+        unsigned char *fptr;
 
         if (!f->is_open)
                 return ZS_IOERROR;
 
-        bptr = f->mf->ptr;
-        fptr = bptr + offset;
+        if (len < sizeof(uint64_t))
+                return ZS_INVALID_FILE;
+
+        fptr = f->mf->ptr + *offset;
 
         /* Get the number of records */
         count = read_be64(fptr);
-        fptr += sizeof(uint64_t);
+        if (count > (len / sizeof(uint64_t)) - 1)
+                return ZS_INVALID_FILE;
 
-        for (i = 0; i < count; i++) {
-                uint64_t n;
-                n = read_be64(fptr);
-                vecu64_append(f->index, n);
+        f->pointers = fptr + sizeof(uint64_t);
+        f->nrecords = count;
 
-                fptr += sizeof(uint64_t);
-        }
+        *offset += sizeof(uint64_t) * (count + 1);
 
         return ZS_OK;
 }
 
+/* The offset of the `idx`th record, in a version 1 packed file */
+static inline uint64_t packed_pointer(const struct zsdb_file *f, uint64_t idx)
+{
+        return read_be64(f->pointers + (idx * sizeof(uint64_t)));
+}
+
+/* The length of the key `k` read, and whether it is deleted */
+static void key_info(const struct zs_key *k, uint64_t *keylen, int *deleted)
+{
+        if (keylen)
+                *keylen = (k->base.type == REC_TYPE_KEY ||
+                           k->base.type == REC_TYPE_DELETED) ?
+                        k->base.slen : k->base.llen;
+        if (deleted)
+                *deleted = (k->base.type == REC_TYPE_DELETED ||
+                            k->base.type == REC_TYPE_LONG_DELETED);
+}
+
 /**
  * Public functions
  */
@@ -165,13 +181,10 @@ int zs_packed_file_write_memtree_record(struct record *record, void *data)
         struct zsdb_file *f = (struct zsdb_file *)data;
         int ret = ZS_OK;
 
-        vecu64_append(f->index, f->mf->offset);
+        ret = zs_block_writer_add(f, record->key, record->keylen,
+                                  record->val, record->vallen,
+                                  record->deleted);
 
-        if (record->deleted)
-                ret = zs_file_write_delete_record(f, record->key, record->keylen);
-        else
-                ret = zs_file_write_keyval_record(f, record->key, record->keylen,
-                                                  record->val, record->vallen);
         return (ret == ZS_OK) ? 1 : 0;
 }
 
@@ -182,8 +195,7 @@ int zs_packed_file_write_record(void *data,
         struct zsdb_file *f = (struct zsdb_file *)data;
         int ret = ZS_OK;
 
-        vecu64_append(f->index, f->mf->offset);
-        ret = zs_file_write_keyval_record(f, key, keylen, value, vallen);
+        ret = zs_block_writer_add(f, key, keylen, value, vallen, 0);
 
         return (ret == ZS_OK) ? 1 : 0;
 }
@@ -196,8 +208,7 @@ int zs_packed_file_write_delete_record(void *data,
         struct zsdb_file *f = (struct zsdb_file *)data;
         int ret = ZS_OK;
 
-        vecu64_append(f->index, f->mf->offset);
-        ret = zs_file_write_delete_record(f, key, keylen);
+        ret = zs_block_writer_add(f, key, keylen, NULL, 0, 1);
 
         return (ret == ZS_OK) ? 1 : 0;
 }
@@ -209,7 +220,19 @@ int zs_packed_file_write_commit_record(struct zsdb_file *f)
 
 int zs_packed_file_write_final_commit_record(struct zsdb_file *f)
 {
-        return zs_file_write_commit_record(f, 1);
+        int ret;
+
+        ret = zs_file_write_commit_record(f, 1);
+        if (ret != ZS_OK)
+                return ret;
+
+        /* The file is complete */
+        if (mfile_flush(&f->mf)) {
+                zslog(LOGDEBUG, "Error flushing %s to disk.\n", f->fname.buf);
+                return ZS_IOERROR;
+        }
+
+        return ZS_OK;
 }
 
 /* zs_packed_file_open():
@@ -258,8 +281,7 @@ int zs_packed_file_open(const char *path,
                 goto fail;
         }
 
-        /*  Initialise f->index;
-         *  Seek to the end of file
+        /*  Seek to the end of file
          *   - go back 8 bytes, and check if there is a commit record,
          *     if there is one, then it is a short commit
          *   - if it is not a short commit, go back 24 bytes from the end of file
@@ -271,10 +293,9 @@ int zs_packed_file_open(const char *path,
          *          + verify commit
          *          + read commit record and get length of commit
          *          + go back to 'length' bytes to get the beginning of index
-         *          + Read index into f->index
+         *          + Map the pointers section, or the block index for
+         *            version 2 files
          */
-        f->index = vecu64_new();
-
         /* Verify CRC of the pointers section */
         /* Read the commit record and get to the pointers */
         offset = mf_size - ZS_SHORT_COMMIT_REC_SIZE;
@@ -338,13 +359,50 @@ int zs_packed_file_open(const char *path,
                 goto fail;
         }
 
-        /* Read the pointers section and get all the offsets */
-        ret = read_pointers(f, offset);
-        if (ret != ZS_OK) {
-                zslog(LOGDEBUG, "Could not get pointers from pointer block.\n");
+        if (f->header.version == ZS_PACKED_VERSION) {
+                /* Read the block index */
+                ret = zs_block_index_read(f, &offset, end_offset - offset);
+                if (ret != ZS_OK) {
+                        zslog(LOGDEBUG, "Could not read block index.\n");
+                        goto fail;
+                }
+        } else if (f->header.version == ZS_VERSION) {
+                /* Map the pointers section */
+                ret = read_pointers(f, &offset, end_offset - offset);
+                if (ret != ZS_OK) {
+                        zslog(LOGDEBUG, "Could not get pointers from pointer block.\n");
+                        goto fail;
+                }
+        } else {
+                zslog(LOGDEBUG, "Unknown packed file version %" PRIu32 ".\n",
+                      f->header.version);
+                ret = ZS_INVALID_FILE;
                 goto fail;
         }
 
+        /* Cache the smallest and the largest keys in the file, so that
+         * lookups can rule out the file without touching the index.
+         */
+        if (f->nrecords) {
+                ret = copy_fence_key(f, 0, &f->minkey, &f->minkeylen);
+                if (ret == ZS_OK)
+                        ret = copy_fence_key(f, f->nrecords - 1,
+                                             &f->maxkey, &f->maxkeylen);
+                if (ret != ZS_OK) {
+                        zslog(LOGDEBUG, "Could not read fence keys.\n");
+                        ret = ZS_INVALID_DB;
+                        goto fail;
+                }
+        }
+
+        /* The bloom filter, if there is one, follows the pointers or the
+         * block index. Packed files written by older versions don't have
+         * one, in which case every lookup goes to the index.
+         */
+        if (zs_bloom_read(&f->bloom, f->mf->ptr + offset,
+                          end_offset - offset) != ZS_OK)
+                zslog(LOGDEBUG, "No bloom filter in %s.\n", f->fname.buf);
+
         f->indexpos = 0;
         f->priority = -1;
 
@@ -369,9 +427,16 @@ int zs_packed_file_close(struct zsdb_file **fptr)
         f = *fptr;
         fptr = NULL;
 
+        zs_bloom_free(&f->bloom);
+        zs_block_index_free(f);
+        zs_block_writer_free(f);
+        xfree(f->fence.fences);
+        xfree(f->fence.keys);
+        zs_eytzinger_free(&f->layout);
+        xfree(f->minkey);
+        xfree(f->maxkey);
         mfile_close(&f->mf);
         cstring_release(&f->fname);
-        vecu64_free(&f->index);
         xfree(f);
 
         return ret;
@@ -394,11 +459,10 @@ int zs_packed_file_new_from_memtree(const char *path,
         f->type = DB_FTYPE_PACKED;
         cstring_init(&f->fname, 0);
         cstring_addstr(&f->fname, path);
-        f->index = vecu64_new();
 
         /* Initialise header fields */
         f->header.signature = ZS_SIGNATURE;
-        f->header.version = ZS_VERSION;
+        f->header.version = ZS_PACKED_VERSION;
         memcpy(f->header.uuid, priv->uuid, sizeof(uuid_t));
         f->header.startidx = startidx;
         f->header.endidx = endidx;
@@ -426,10 +490,19 @@ int zs_packed_file_new_from_memtree(const char *path,
         /* Seek to location after header */
         mfile_seek(&f->mf, ZS_HDR_SIZE, NULL);
 
+        zs_block_writer_new(f);
+
         /* Write records into packed files */
-        memtree_walk_forward(priv->fmemtree,
-                           zs_packed_file_write_memtree_record,
-                           (void *)f);
+        memtable_walk_forward(priv->fmemtable,
+                              zs_packed_file_write_memtree_record,
+                              (void *)f);
+
+        /* And the last block */
+        ret = zs_block_writer_finish(f);
+        if (ret != ZS_OK) {
+                zslog(LOGDEBUG, "Error writing records.\n");
+                goto fail;
+        }
 
         ret = mfile_flush(&f->mf);
         if (ret) {
@@ -445,12 +518,15 @@ int zs_packed_file_new_from_memtree(const char *path,
                 goto fail;
         }
 
-        /* Write the pointer/index section */
+        /* Write the block index section */
         crc32_begin(&f->mf);    /* The crc32 for index of the file */
 
-        zs_packed_file_write_index_count(f, f->index->count); /* count */
-
-        vecu64_foreach(f->index, zs_packed_file_write_index, f);
+        /* The block index and the bloom filter, covered by the same CRC */
+        ret = zs_block_writer_write_index(f);
+        if (ret != ZS_OK) {
+                zslog(LOGDEBUG, "Could not write block index.\n");
+                goto fail;
+        }
 
         /* The commit record for pointer section */
         if (zs_packed_file_write_final_commit_record(f) != ZS_OK) {
@@ -464,6 +540,8 @@ int zs_packed_file_new_from_memtree(const char *path,
         goto done;
 fail:
         xunlink(f->fname.buf);
+        zs_block_writer_free(f);
+        zs_bloom_free(&f->bloom);
         mfile_close(&f->mf);
         cstring_release(&f->fname);
         xfree(f);
@@ -472,85 +550,306 @@ done:
         return ret;
 }
 
+/* zs_packed_file_fence_index_new():
+ * Build the sparse in-memory index for a packed file that is open. The
+ * first record, and the first record that begins in every
+ * ZS_FENCE_INDEX_SPACING bytes after that, are fences. If it fails, the
+ * file is left with no fences, and is searched without them.
+ */
+int zs_packed_file_fence_index_new(struct zsdb_file *f)
+{
+        struct zsdb_fence_index *fi = &f->fence;
+        uint64_t i, next = 0;
+
+        /* The block index of version 2 files already does this */
+        if (f->header.version != ZS_VERSION)
+                return ZS_OK;
+
+        for (i = 0; i < f->nrecords; i++) {
+                struct zsdb_fence *fence;
+                const unsigned char *key;
+                uint64_t keylen;
+                int ret;
+
+                if (packed_pointer(f, i) < next)
+                        continue;
+
+                ret = read_key_at_index(f, i, &key, &keylen);
+                if (ret != ZS_OK) {
+                        zslog(LOGDEBUG, "Could not read key for fence index\n");
+                        /* Leave the file without one, rather than with
+                           some of one */
+                        xfree(fi->fences);
+                        xfree(fi->keys);
+                        memset(fi, 0, sizeof(struct zsdb_fence_index));
+                        return ret;
+                }
+
+                ALLOC_GROW(fi->fences, fi->count + 1, fi->alloc);
+                ALLOC_GROW(fi->keys, fi->keyslen + keylen, fi->keysalloc);
+
+                fence = &fi->fences[fi->count++];
+                fence->pos = i;
+                fence->keyoff = fi->keyslen;
+                fence->keylen = keylen;
+
+                memcpy(fi->keys + fi->keyslen, key, keylen);
+                fi->keyslen += keylen;
+
+                next = packed_pointer(f, i) + ZS_FENCE_INDEX_SPACING;
+        }
+
+        zslog(LOGDEBUG, "%" PRIu64 " fences for %s\n", fi->count,
+              f->fname.buf);
+
+        return ZS_OK;
+}
+
+static void fence_key(void *data, uint64_t idx,
+                      const unsigned char **key, uint64_t *keylen)
+{
+        const struct zsdb_fence_index *fi = data;
+
+        *key = fi->keys + fi->fences[idx].keyoff;
+        *keylen = fi->fences[idx].keylen;
+}
+
+/* zs_packed_file_eytzinger_new():
+ * Lay out the in-memory index of a packed file that is open in Eytzinger
+ * order: the block index of a version 2 file, or the fence index of a
+ * version 1 file, which is built if there isn't one yet. With `prefixed`,
+ * the index also has the first 8 bytes of each key.
+ */
+int zs_packed_file_eytzinger_new(struct zsdb_file *f, int prefixed)
+{
+        int ret;
+
+        if (f->header.version != ZS_VERSION) {
+                zs_block_eytzinger_new(f, prefixed);
+                return ZS_OK;
+        }
+
+        if (!f->fence.count) {
+                ret = zs_packed_file_fence_index_new(f);
+                if (ret != ZS_OK)
+                        return ret;
+        }
+
+        zs_eytzinger_new(&f->layout, f->fence.count, prefixed, fence_key,
+                         &f->fence);
+
+        return ZS_OK;
+}
+
+/* fence_index_range():
+ * Narrow the range [lo, hi) of the index to be searched for `key`, to the
+ * records between the fences that it falls between.
+ */
+static void fence_index_range(const struct zsdb_file *f,
+                              const unsigned char *key, uint64_t keylen,
+                              zsdb_cmp_fn cmpfn, uint64_t *lo, uint64_t *hi)
+{
+        const struct zsdb_fence_index *fi = &f->fence;
+        uint64_t flo = 0, fhi = fi->count;
+
+        /* Find the first fence that is bigger than `key` */
+        if (f->layout.slots)
+                flo = fhi = zs_eytzinger_upper_bound(&f->layout, key, keylen,
+                                                     cmpfn);
+        while (flo < fhi) {
+                uint64_t mi = flo + (fhi - flo) / 2;
+                const struct zsdb_fence *fence = &fi->fences[mi];
+                int res;
+
+                if (cmpfn)
+                        res = cmpfn(key, keylen, fi->keys + fence->keyoff,
+                                    fence->keylen);
+                else
+                        res = memcmp_raw(key, keylen, fi->keys + fence->keyoff,
+                                         fence->keylen);
+
+                if (res < 0)
+                        fhi = mi;
+                else
+                        flo = mi + 1;
+        }
+
+        /* `key` is smaller than the first record */
+        if (flo == 0) {
+                *lo = *hi = 0;
+                return;
+        }
+
+        *lo = fi->fences[flo - 1].pos;
+        *hi = (flo < fi->count) ? fi->fences[flo].pos : f->nrecords;
+}
+
+/* zs_packed_file_cmp_fence_keys():
+ * Compare `key` with the range of keys in the packed file. Returns a
+ * negative value if `key` is smaller than the smallest key in the file, a
+ * positive value if it is bigger than the largest key, and 0 if it falls
+ * within the range. An empty file has no range, and `key` is always
+ * considered to be bigger.
+ */
+int zs_packed_file_cmp_fence_keys(const struct zsdb_file *f,
+                                  const unsigned char *key, uint64_t keylen,
+                                  zsdb_cmp_fn cmpfn)
+{
+        if (!f->nrecords)
+                return 1;
+
+        if (cmpfn) {
+                if (cmpfn(key, keylen, f->minkey, f->minkeylen) < 0)
+                        return -1;
+                if (cmpfn(key, keylen, f->maxkey, f->maxkeylen) > 0)
+                        return 1;
+        } else {
+                if (memcmp_raw(key, keylen, f->minkey, f->minkeylen) < 0)
+                        return -1;
+                if (memcmp_raw(key, keylen, f->maxkey, f->maxkeylen) > 0)
+                        return 1;
+        }
+
+        return 0;
+}
+
+/* zs_packed_file_has_prefix():
+ * Returns 0 if none of the keys in the packed file can begin with
+ * `prefix`, 1 otherwise.
+ */
+int zs_packed_file_has_prefix(const struct zsdb_file *f,
+                              const unsigned char *prefix, uint64_t prefixlen,
+                              zsdb_cmp_fn cmpfn)
+{
+        uint64_t minlen;
+
+        /* All the keys are smaller than the prefix */
+        if (zs_packed_file_cmp_fence_keys(f, prefix, prefixlen, cmpfn) > 0)
+                return 0;
+
+        /* All the keys are past the keys that begin with the prefix */
+        minlen = f->minkeylen < prefixlen ? f->minkeylen : prefixlen;
+        if (cmpfn) {
+                if (cmpfn(prefix, prefixlen, f->minkey, minlen) < 0)
+                        return 0;
+        } else {
+                if (memcmp_raw(prefix, prefixlen, f->minkey, minlen) < 0)
+                        return 0;
+        }
+
+        return 1;
+}
+
+/* zs_packed_file_read_record():
+ * Read the `idx`th record of a packed file. The value, and in version 1
+ * files the key, point into the mapped file. In version 2 files the key is
+ * decoded into a buffer that is only valid until the next record is read
+ * from the same file. A deleted record has no value.
+ */
+int zs_packed_file_read_record(struct zsdb_file *f, uint64_t idx,
+                               const unsigned char **key, uint64_t *keylen,
+                               const unsigned char **val, uint64_t *vallen,
+                               int *deleted)
+{
+        struct zs_key k;
+        uint64_t offset;
+        int ret;
+
+        if (f->header.version != ZS_VERSION)
+                return zs_block_read_record(f, idx, key, keylen,
+                                            val, vallen, deleted);
+
+        if (idx >= f->nrecords)
+                return ZS_NOTFOUND;
+
+        offset = packed_pointer(f, idx);
+
+        ret = zs_record_read_key_from_file_offset(f, offset, &k);
+        if (ret != ZS_OK)
+                return ret;
+
+        if (key)
+                *key = k.data;
+        key_info(&k, keylen, deleted);
+
+        if (k.base.type == REC_TYPE_DELETED ||
+            k.base.type == REC_TYPE_LONG_DELETED) {
+                if (val)
+                        *val = NULL;
+                if (vallen)
+                        *vallen = 0;
+        } else if (val) {
+                const unsigned char *tk;
+                uint64_t tklen;
+
+                zs_record_read_key_val_from_offset(f, &offset, &tk, &tklen,
+                                                   val, vallen);
+        }
+
+        return ZS_OK;
+}
+
 int zs_packed_file_get_key_from_offset(struct zsdb_file *f,
                                        unsigned char **key,
                                        uint64_t *len,
                                        enum record_t *type)
 {
-        uint64_t off;
-        int ret;
         struct zs_key k;
+        int deleted = 0;
+        int ret;
 
-        assert(f->indexpos <= f->index->count);
-
-        off = f->index->data[f->indexpos];
-
-        ret = zs_record_read_key_from_file_offset(f, off, &k);
-        assert(ret == ZS_OK);   /* This should not be anything otherwise */
+        /* Not zs_packed_file_read_record(), which hands keys out as const,
+           since the iterators keep them as they are */
+        if (f->header.version != ZS_VERSION) {
+                ret = zs_block_read_record(f, f->indexpos, NULL, len,
+                                           NULL, NULL, &deleted);
+                k.data = f->blocks.cur.key;
+        } else if (f->indexpos < f->nrecords) {
+                ret = zs_record_read_key_from_file_offset(f,
+                                        packed_pointer(f, f->indexpos), &k);
+                if (ret == ZS_OK)
+                        key_info(&k, len, &deleted);
+        } else {
+                ret = ZS_NOTFOUND;
+        }
 
-        if (k.base.type == REC_TYPE_KEY ||
-            k.base.type == REC_TYPE_DELETED)
-                *len = k.base.slen;
-        else if (k.base.type == REC_TYPE_LONG_KEY ||
-                 k.base.type == REC_TYPE_DELETED)
-                *len = k.base.llen;
+        if (ret != ZS_OK) {
+                *key = NULL;
+                *len = 0;
+                return ret;
+        }
 
         *key = k.data;
 
         if (type)
-                *type = k.base.type;
+                *type = deleted ? REC_TYPE_DELETED : REC_TYPE_KEY;
 
         return ZS_OK;
 }
 
-int zs_pq_cmp_key_frm_offset(const void *d1, const void *d2,
+int zs_pq_cmp_key_frm_offset(void *d1, void *d2,
                              zsdb_cmp_fn cmpfn, void *cbdata _unused_)
 {
-        const struct zsdb_file *f1, *f2;
-        uint64_t off1, off2;
-        struct zs_key key1, key2;
-        int ret;
+        struct zsdb_file *f1 = d1, *f2 = d2;
+        const unsigned char *key1, *key2;
         uint64_t len1 = 0, len2 = 0;
+        int ret;
 
-        f1 = (const struct zsdb_file *)d1;
-        f2 = (const struct zsdb_file *)d2;
-
-        assert(f1->indexpos <= f1->index->count);
-        assert(f2->indexpos <= f2->index->count);
-
-        off1 = f1->index->data[f1->indexpos];
-        off2 = f2->index->data[f2->indexpos];
-
-        /* asserts() should be ok here, since we should *not* have anything
-         * apart from:
-         * REC_TYPE_KEY|REC_TYPE_LONG_KEY|REC_TYPE_DELETED|REC_TYPE_LONG_DELE
-         *
-         * If the assertion fails, the DB is corrupted, and we have bigger
-         * problems.
+        /* asserts() should be ok here, since the files in the queue
+         * always point at a record. If the assertion fails, the DB is
+         * corrupted, and we have bigger problems.
          */
-        ret = zs_record_read_key_from_file_offset(f1, off1, &key1);
+        ret = zs_packed_file_read_record(f1, f1->indexpos, &key1, &len1,
+                                         NULL, NULL, NULL);
         assert(ret == ZS_OK);
-        ret = zs_record_read_key_from_file_offset(f2, off2, &key2);
+        ret = zs_packed_file_read_record(f2, f2->indexpos, &key2, &len2,
+                                         NULL, NULL, NULL);
         assert(ret == ZS_OK);
 
-        if (key1.base.type == REC_TYPE_KEY ||
-            key1.base.type == REC_TYPE_DELETED)
-                len1 = key1.base.slen;
-        else if (key1.base.type == REC_TYPE_LONG_KEY ||
-                 key1.base.type == REC_TYPE_DELETED)
-                len1 = key1.base.llen;
-
-        if (key2.base.type == REC_TYPE_KEY ||
-            key2.base.type == REC_TYPE_DELETED)
-                len2 = key2.base.slen;
-        else if (key2.base.type == REC_TYPE_LONG_KEY ||
-                 key2.base.type == REC_TYPE_DELETED)
-                len2 = key2.base.llen;
-
         if (cmpfn)
-                ret = cmpfn(key1.data, len1, key2.data, len2);
+                ret = cmpfn(key1, len1, key2, len2);
         else
-                ret = memcmp_raw(key1.data, len1, key2.data, len2);
+                ret = memcmp_raw(key1, len1, key2, len2);
 
         return ret;
 }
@@ -559,11 +858,38 @@ int zs_packed_file_bsearch_index(const unsigned char *key, const uint64_t keylen
                                  struct zsdb_file *f, uint64_t *location,
                                  const unsigned char **value, uint64_t *vallen,
                                  zsdb_cmp_fn cmpfn)
+{
+        return zs_packed_file_bsearch_index_from(key, keylen, f, 0, location,
+                                                 value, vallen, cmpfn);
+}
+
+/* zs_packed_file_bsearch_index_from():
+ * Like zs_packed_file_bsearch_index(), but only searches from record
+ * `from` onwards. When looking up keys in ascending order, the `location`
+ * returned for one key can be passed as `from` for the next.
+ */
+int zs_packed_file_bsearch_index_from(const unsigned char *key,
+                                      const uint64_t keylen,
+                                      struct zsdb_file *f, uint64_t from,
+                                      uint64_t *location,
+                                      const unsigned char **value,
+                                      uint64_t *vallen,
+                                      zsdb_cmp_fn cmpfn)
 {
         uint64_t hi, lo;
 
+        if (f->header.version != ZS_VERSION)
+                return zs_block_search(f, key, keylen, from, location,
+                                       value, vallen, cmpfn);
+
         lo = 0;
-        hi = f->index->count;
+        hi = f->nrecords;
+
+        if (f->fence.count)
+                fence_index_range(f, key, keylen, cmpfn, &lo, &hi);
+
+        if (from > lo)
+                lo = from < hi ? from : hi;
 
         while (lo < hi) {
                 uint64_t mi;
@@ -576,7 +902,7 @@ int zs_packed_file_bsearch_index(const unsigned char *key, const uint64_t keylen
                 mi = lo + (hi - lo) / 2;
 
                 /* Get key from file */
-                offset = f->index->data[mi];
+                offset = packed_pointer(f, mi);
 
                 res = zs_record_read_key_val_from_offset(f, &offset,
                                                          &k, &klen,
@@ -636,11 +962,10 @@ int zs_packed_file_new_from_packed_files(const char *path,
         f->type = DB_FTYPE_PACKED;
         cstring_init(&f->fname, 0);
         cstring_addstr(&f->fname, path);
-        f->index = vecu64_new();
 
         /* Initialise header fields */
         f->header.signature = ZS_SIGNATURE;
-        f->header.version = ZS_VERSION;
+        f->header.version = ZS_PACKED_VERSION;
         memcpy(f->header.uuid, priv->uuid, sizeof(uuid_t));
         f->header.startidx = startidx;
         f->header.endidx = endidx;
@@ -668,6 +993,8 @@ int zs_packed_file_new_from_packed_files(const char *path,
         /* Seek to location after header */
         mfile_seek(&f->mf, ZS_HDR_SIZE, NULL);
 
+        zs_block_writer_new(f);
+
         ret = zs_iterator_begin_for_packed_files(iter, flist);
         if (ret != ZS_OK) {
                 zslog(LOGWARNING, "Failed to begin transaction!\n");
@@ -683,11 +1010,23 @@ int zs_packed_file_new_from_packed_files(const char *path,
                 case ZSDB_BE_PACKED:
                 {
                         struct zsdb_file *tempf = data->data.f;
-                        uint64_t offset = tempf->index->data[tempf->indexpos];
-                        zs_record_read_from_file(tempf, &offset,
-                                                 zs_packed_file_write_record,
-                                                 zs_packed_file_write_delete_record,
-                                                 (void *)f);
+                        const unsigned char *key, *val;
+                        uint64_t keylen, vallen;
+                        int deleted;
+
+                        ret = zs_packed_file_read_record(tempf,
+                                                         tempf->indexpos,
+                                                         &key, &keylen,
+                                                         &val, &vallen,
+                                                         &deleted);
+                        if (ret == ZS_OK)
+                                ret = zs_block_writer_add(f, key, keylen,
+                                                          val, vallen,
+                                                          deleted);
+                        if (ret != ZS_OK) {
+                                zslog(LOGDEBUG, "Error writing records.\n");
+                                goto fail;
+                        }
                         break;
                 }
                 case ZSDB_BE_ACTIVE:
@@ -700,6 +1039,13 @@ int zs_packed_file_new_from_packed_files(const char *path,
                 count++;
         } while (zs_iterator_next(*iter, data));
 
+        /* And the last block */
+        ret = zs_block_writer_finish(f);
+        if (ret != ZS_OK) {
+                zslog(LOGDEBUG, "Error writing records.\n");
+                goto fail;
+        }
+
         ret = mfile_flush(&f->mf);
         if (ret) {
                 zslog(LOGDEBUG, "Error flushing data to disk.\n");
@@ -714,12 +1060,15 @@ int zs_packed_file_new_from_packed_files(const char *path,
                 goto fail;
         }
 
-        /* Write the pointer/index section */
+        /* Write the block index section */
         crc32_begin(&f->mf);    /* The crc32 for index of the file */
 
-        zs_packed_file_write_index_count(f, f->index->count); /* count */
-
-        vecu64_foreach(f->index, zs_packed_file_write_index, f);
+        /* The block index and the bloom filter, covered by the same CRC */
+        ret = zs_block_writer_write_index(f);
+        if (ret != ZS_OK) {
+                zslog(LOGDEBUG, "Could not write block index.\n");
+                goto fail;
+        }
 
         /* The commit record for pointer section */
         if (zs_packed_file_write_final_commit_record(f) != ZS_OK) {
@@ -733,6 +1082,8 @@ int zs_packed_file_new_from_packed_files(const char *path,
         goto done;
 fail:
         xunlink(f->fname.buf);
+        zs_block_writer_free(f);
+        zs_bloom_free(&f->bloom);
         mfile_close(&f->mf);
         cstring_release(&f->fname);
         xfree(f);
@@ -16,7 +16,7 @@
 #include "list.h"
 #include "pqueue.h"
 
-#include <libzeroskip/memtree.h>
+#include <libzeroskip/memtable.h>
 #include <libzeroskip/cstring.h>
 #include <libzeroskip/macros.h>
 #include <libzeroskip/mfile.h>
@@ -48,6 +48,7 @@ CPP_GUARD_START
 #define ZS_FNAME_PREFIX_LEN   9
 #define ZS_SIGNATURE          0x5a45524f534b4950 /* "ZEROSKIP" */
 #define ZS_VERSION            1
+#define ZS_PACKED_VERSION     2  /* Packed files with blocks of records */
 
 /* This is the size of the unparssed uuid string */
 #define UUID_STRLEN  37
@@ -90,6 +91,32 @@ struct _packed_ dotzsdb{
 #define DOTZSDB_FNAME ".zsdb"
 #define DOTZSDB_SIZE  sizeof(struct dotzsdb)
 
+/**
+ * Zeroskip .zsdb.gen
+ *
+ * A control block that every process with the DB open maps shared. The
+ * generation is bumped each time .zsdb is rewritten, so that changes to the
+ * DB can be noticed with a load from memory, instead of a stat() of .zsdb.
+ * Group commits are numbered in the order they are written, and `synced` is
+ * the last of them known to be on disk, so that processes can sync for each
+ * other. `curidx` tells them whether those commits are all in the active
+ * file they have open. It is in host byte order, since it is never read on
+ * another machine.
+ */
+struct dotzsdb_gen {
+        uint64_t signature;
+        uint64_t generation;
+        uint64_t commits;
+        uint64_t synced;
+        uint32_t curidx;        /* The index of the active file */
+        uint32_t syncs;         /* Bumped after each sync, for the processes
+                                 * waiting on one to sleep on */
+};
+#define DOTZSDB_GEN_FNAME ".zsdb.gen"
+#define DOTZSDB_GEN_SIZE  sizeof(struct dotzsdb_gen)
+/* How many generation checks go by between stat()s of .zsdb */
+#define DOTZSDB_STAT_INTERVAL 64
+
 
 
 /* Types of files in the DB */
@@ -179,6 +206,127 @@ struct zs_long_commit {
 #define ZSDB_FILE_SIZE_CHANGED   0x0010
 #define ZSDB_FILE_MTIM_CHANGED   0x0020
 #define ZSDB_FILE_CTIM_CHANGED   0x0040
+#define ZSDB_FILE_GEN_CHANGED    0x0080
+
+/** Bloom filter **/
+/*
+ * Every packed file carries a bloom filter of its keys, in a section that
+ * follows the pointers, so that lookups for keys that aren't in the file
+ * can skip the binary search entirely.
+ */
+#define ZS_BLOOM_SIGNATURE     0x5a53424c4f4f4d31 /* "ZSBLOOM1" */
+#define ZS_BLOOM_HDR_SIZE      24
+#define ZS_BLOOM_BITS_PER_KEY  10
+#define ZS_BLOOM_NUM_HASHES    7
+
+struct zsdb_bloom {
+        uint64_t nbits;         /* Number of bits, a multiple of 64 */
+        uint64_t nhashes;       /* Number of probes per key */
+        unsigned char *bits;
+        int alloced;            /* bits were allocated, and not mapped */
+};
+
+/** Fence index **/
+/*
+ * A sparse in-memory index of a packed file, with a copy of the key of
+ * the first record in every ZS_FENCE_INDEX_SPACING bytes of records. A
+ * binary search in the file is then limited to the records between two
+ * fences, which are usually in the same page.
+ */
+#define ZS_FENCE_INDEX_SPACING 4096
+
+struct zsdb_fence {
+        uint64_t pos;           /* Position of the record in the index */
+        uint64_t keyoff;        /* Offset of the key in `keys` */
+        uint64_t keylen;
+};
+
+struct zsdb_fence_index {
+        struct zsdb_fence *fences;
+        uint64_t count;
+        uint64_t alloc;
+        unsigned char *keys;
+        uint64_t keyslen;
+        uint64_t keysalloc;
+};
+
+/** Eytzinger layout **/
+/*
+ * The keys of a sorted in-memory index, such as the block index of a
+ * packed file, in the order of a breadth first walk of the balanced binary
+ * search tree over them. The top levels of the tree, which every search
+ * goes through, share a few cache lines, and the slots that a search goes
+ * to next can be prefetched before it gets there.
+ */
+struct zs_eytzinger_slot {
+        uint64_t prefix;        /* First 8 bytes of the key, big-endian */
+        const unsigned char *key;
+        uint64_t keylen;
+        uint64_t idx;           /* Position of the key in the index */
+};
+
+struct zsdb_eytzinger {
+        struct zs_eytzinger_slot *slots; /* slots[1] is the root */
+        uint64_t count;
+        int prefixed;           /* Compare the prefixes first */
+        const unsigned char *common; /* What all the keys begin with */
+        uint64_t skip;          /* The length of that, skipped in prefixes */
+};
+
+typedef void (*zs_eytzinger_key_fn)(void *data, uint64_t idx,
+                                    const unsigned char **key,
+                                    uint64_t *keylen);
+
+/** Blocks **/
+/*
+ * Version 2 packed files store the records in blocks of about
+ * ZS_BLOCK_SIZE bytes, with the keys prefix compressed. Every
+ * ZS_BLOCK_RESTART_INTERVAL'th key is stored in full, which is where
+ * decoding can start from. The block index, which replaces the pointers
+ * section, has the location, the number of the first record and the first
+ * key of each block.
+ */
+#define ZS_BLOCK_SIZE               4096
+#define ZS_BLOCK_RESTART_INTERVAL   16
+#define ZS_BLOCK_INDEX_HDR_SIZE     24
+#define ZS_BLOCK_INDEX_ENTRY_SIZE   40
+
+struct zs_block_writer;
+
+struct zs_block_cursor {
+        int valid;
+        uint64_t idx;               /* The record that was decoded last */
+        uint64_t block;             /* The block it is in */
+        uint64_t next;              /* Offset of the record after it */
+        unsigned char *key;
+        uint64_t keylen;
+        uint64_t keyalloc;
+        const unsigned char *val;
+        uint64_t vallen;
+        int deleted;
+};
+
+struct zsdb_blocks {
+        const unsigned char *index; /* The block index entries, mapped */
+        const unsigned char *keys;  /* The first keys of the blocks, mapped */
+        uint64_t count;             /* Number of blocks */
+        struct zs_block_cursor cur; /* For reading records in order */
+        struct zs_block_cursor search; /* For lookups */
+};
+
+/** Cache **/
+/*
+ * The results of looking up keys in the packed files, with the least
+ * recently used entries dropped to keep it within `maxsize` bytes.
+ */
+struct zsdb_cache {
+        struct htable table;
+        struct list_head lru;   /* Most recently used first */
+        uint64_t maxsize;       /* In bytes, 0 when the cache is off */
+        uint64_t size;
+        uint64_t hits;
+        uint64_t misses;
+};
 
 /** File Data **/
 struct zsdb_file {
@@ -187,10 +335,21 @@ struct zsdb_file {
         struct zs_header header;
         cstring fname;
         struct mfile *mf;
-        struct vecu64 *index;
+        const unsigned char *pointers; /* Record offsets, in a version 1
+                                        * packed file, mapped */
+        struct zsdb_blocks blocks; /* Only in a version 2 packed file */
+        struct zs_block_writer *bw; /* When writing a packed file */
+        uint64_t nrecords;        /* Number of records, in a packed file */
+        struct zsdb_bloom bloom;  /* Only for packed files */
+        unsigned char *minkey;    /* Smallest key, in a packed file */
+        uint64_t minkeylen;
+        unsigned char *maxkey;    /* Largest key, in a packed file */
+        uint64_t maxkeylen;
+        struct zsdb_fence_index fence; /* Only with MODE_FENCEINDEX */
+        struct zsdb_eytzinger layout; /* Only with MODE_EYTZINGER */
         struct stat st;
         int is_open;
-        uint64_t indexpos;      /* Position in the index vec */
+        uint64_t indexpos;      /* Position of the current record */
         uint64_t priority;      /* Higher the number, higher the priority */
         int dirty;
 };
@@ -235,7 +394,7 @@ struct zsdb_iter_data {
         int done;
         int deleted;
         union {
-                memtree_iter_t iter;
+                memtable_iter_t iter;
                 struct zsdb_file *f;
         } data;
 };
@@ -253,6 +412,50 @@ struct zsdb_iter {
         int foreach_iter;
 };
 
+/** Group commit **/
+struct zsdb_group_commit {
+        long window;                /* How long a commit waits, in
+                                     * milliseconds, for another process to
+                                     * sync it */
+        uint64_t maxbytes;          /* Sync once this much is committed */
+        uint64_t maxcount;          /* Sync after this many commits */
+        uint64_t count;             /* Commits that haven't been synced */
+        uint64_t start;             /* Where they begin in the active file */
+        uint64_t seq;               /* The number of the last of them */
+};
+
+/** Finalising the active file **/
+struct zsdb_finalise_threshold {
+        uint64_t bytes;             /* Size of the active file */
+        uint64_t records;           /* Keys in the in-memory tree */
+        uint64_t memory;            /* Bytes the in-memory tree takes up */
+        uint64_t basecount;         /* What the in-memory tree held when the */
+        uint64_t basesize;          /* active file was begun */
+};
+
+/** Write batches **/
+struct zs_batch_entry {
+        uint64_t keyoff;            /* Where the key and value are in the */
+        uint64_t valoff;            /* batch's buffer */
+        const unsigned char *key;   /* And in memory, once the batch is */
+        const unsigned char *val;   /* sorted */
+        uint64_t keylen;
+        uint64_t vallen;
+        uint64_t seq;               /* The order it was added in */
+        zsdb_cmp_fn cmpfn;          /* What it's sorted with, memcmp_raw()
+                                     * if NULL */
+        int deleted;
+        int shadowed;               /* A later entry has the same key */
+};
+
+struct zsdb_write_batch {
+        cstring buf;                /* The records, as they are written to
+                                     * the active file */
+        struct zs_batch_entry *entries;
+        size_t count;
+        size_t alloc;
+};
+
 /** Transactions **/
 enum TxnType {
         TXN_ALL,
@@ -275,6 +478,11 @@ struct zsdb_priv {
         struct dotzsdb dotzsdb;     /* .zsdb contents */
         struct stat dotzsdb_st;     /* The stat() info of the file .zsdb file
                                      * when it was opened.*/
+        struct dotzsdb_gen *gen;    /* The mapped .zsdb.gen, or NULL to
+                                     * stat() .zsdb instead */
+        uint64_t generation;        /* The generation last seen */
+        unsigned int genchecks;     /* Generation checks since .zsdb was
+                                     * last stat()ed */
 
         cstring dbdir;              /* The directory path */
 
@@ -284,8 +492,9 @@ struct zsdb_priv {
         struct file_lock wlk;       /* Lock when writing */
         struct file_lock plk;       /* Lock when packing */
 
-        struct memtree *memtree;      /* in-memory B-Tree */
-        struct memtree *fmemtree;     /* in-memory B-Tree of finalised records */
+        struct memtable *memtable;    /* in-memory records */
+        struct memtable *fmemtable;   /* in-memory finalised records */
+        enum memtable_type memtable_type;
 
         zsdb_cmp_fn dbcompare;       /* The db comparator */
         memtree_search_cb_t btcompare; /* Th memtree comparator */
@@ -294,6 +503,15 @@ struct zsdb_priv {
         int flags;                   /* The flags passed during call to open */
         int dbdirty;                 /* Marked dirty when there are changes
                                       * (add/remove/pack) to the db */
+
+        cstring fetchnextkey;        /* The key returned by zsdb_fetchnext() */
+
+        struct zsdb_cache cache;     /* Packed file lookups */
+
+        struct zsdb_group_commit group; /* Commits that share a sync */
+
+        struct zsdb_finalise_threshold finalise; /* When zsdb_add() finalises
+                                                  * the active file */
 };
 
 
@@ -312,23 +530,111 @@ extern int zs_active_file_write_commit_record(struct zsdb_priv *priv);
 extern int zs_active_file_write_delete_record(struct zsdb_priv *priv,
                                               const unsigned char *key,
                                               uint64_t keylen);
+extern int zs_active_file_write_batch(struct zsdb_priv *priv,
+                                      struct zsdb_write_batch *batch);
 extern int zs_active_file_record_foreach(struct zsdb_priv *priv,
                                          zsdb_foreach_cb *cb,
                                          zsdb_foreach_cb *deleted_cb,
                                          void *cbdata);
+extern int zs_active_file_find_last_commit(struct zsdb_priv *priv,
+                                           uint64_t from, uint64_t *offset);
+extern int zs_active_file_drop_uncommitted(struct zsdb_priv *priv);
+extern int zs_active_file_sync(struct zsdb_priv *priv, uint64_t from);
+extern int zs_active_file_needs_finalise(struct zsdb_priv *priv);
 extern int zs_active_file_new(struct zsdb_priv *priv, uint32_t idx);
 
+/* zeroskip-batch.c */
+extern void zs_write_batch_sort(struct zsdb_write_batch *batch,
+                                zsdb_cmp_fn cmpfn);
+
+/* zeroskip-block.c */
+extern void zs_block_writer_new(struct zsdb_file *f);
+extern void zs_block_writer_free(struct zsdb_file *f);
+extern int zs_block_writer_add(struct zsdb_file *f,
+                               const unsigned char *key, uint64_t keylen,
+                               const unsigned char *val, uint64_t vallen,
+                               int deleted);
+extern int zs_block_writer_finish(struct zsdb_file *f);
+extern int zs_block_writer_write_index(struct zsdb_file *f);
+extern int zs_block_index_read(struct zsdb_file *f, uint64_t *offset,
+                               uint64_t len);
+extern void zs_block_eytzinger_new(struct zsdb_file *f, int prefixed);
+extern void zs_block_index_free(struct zsdb_file *f);
+extern int zs_block_read_record(struct zsdb_file *f, uint64_t idx,
+                                const unsigned char **key, uint64_t *keylen,
+                                const unsigned char **val, uint64_t *vallen,
+                                int *deleted);
+extern int zs_block_search(struct zsdb_file *f,
+                           const unsigned char *key, uint64_t keylen,
+                           uint64_t from, uint64_t *location,
+                           const unsigned char **value, uint64_t *vallen,
+                           zsdb_cmp_fn cmpfn);
+
+/* zeroskip-bloom.c */
+extern uint64_t zs_bloom_hash(const unsigned char *key, uint64_t keylen);
+extern void zs_bloom_new(struct zsdb_bloom *b, uint64_t nkeys);
+extern void zs_bloom_free(struct zsdb_bloom *b);
+extern void zs_bloom_add(struct zsdb_bloom *b, uint64_t hash);
+extern int zs_bloom_check(const struct zsdb_bloom *b, uint64_t hash);
+extern int zs_bloom_write(struct zsdb_file *f, const struct zsdb_bloom *b);
+extern int zs_bloom_read(struct zsdb_bloom *b, unsigned char *ptr,
+                         uint64_t len);
+
+/* zeroskip-cache.c */
+extern void zs_cache_init(struct zsdb_cache *cache);
+extern void zs_cache_free(struct zsdb_cache *cache);
+extern void zs_cache_clear(struct zsdb_cache *cache);
+extern void zs_cache_set_size(struct zsdb_cache *cache, uint64_t maxsize);
+extern int zs_cache_lookup(struct zsdb_cache *cache,
+                           const unsigned char *key, uint64_t keylen,
+                           const unsigned char **value, uint64_t *vallen,
+                           int *found);
+extern void zs_cache_insert(struct zsdb_cache *cache,
+                            const unsigned char *key, uint64_t keylen,
+                            const unsigned char *value, uint64_t vallen,
+                            int found);
+extern void zs_cache_invalidate(struct zsdb_cache *cache,
+                                const unsigned char *key, uint64_t keylen);
+extern void zs_cache_get_stats(const struct zsdb_cache *cache,
+                               struct zsdb_cache_stats *stats);
+
+/* zeroskip-commit.c */
+extern int zs_group_commit_enabled(struct zsdb_priv *priv);
+extern int zs_group_commit_add(struct zsdb_priv *priv);
+extern int zs_group_commit_sync(struct zsdb_priv *priv);
+extern int zs_group_commit_wait(struct zsdb_priv *priv);
+
 /* zeroskip-dotzsdb.c */
 extern int zs_dotzsdb_create(struct zsdb_priv *priv);
 extern int zs_dotzsdb_validate(struct zsdb_priv *priv);
 extern int zs_dotzsdb_update_index_and_offset(struct zsdb_priv *priv,
                                               uint32_t idx,
                                               uint64_t offset);
+extern int zs_dotzsdb_commit(struct zsdb_priv *priv, uint64_t offset);
 extern ino_t zs_dotzsdb_get_ino(struct zsdb_priv *priv);
 extern int zs_dotzsdb_update_stat(struct zsdb_priv *priv);
 extern int zs_dotzsdb_check_stat(struct zsdb_priv *priv);
 extern int zs_dotzsdb_update_begin(struct zsdb_priv *priv);
 extern int zs_dotzsdb_update_end(struct zsdb_priv *priv);
+extern int zs_dotzsdb_gen_open(struct zsdb_priv *priv);
+extern void zs_dotzsdb_gen_close(struct zsdb_priv *priv);
+extern uint64_t zs_dotzsdb_commit_seq_next(struct zsdb_priv *priv);
+extern uint64_t zs_dotzsdb_commit_seq(struct zsdb_priv *priv);
+extern uint64_t zs_dotzsdb_synced_seq(struct zsdb_priv *priv);
+extern void zs_dotzsdb_set_synced_seq(struct zsdb_priv *priv, uint64_t seq);
+extern int zs_dotzsdb_wait_synced(struct zsdb_priv *priv, uint64_t seq,
+                                  long timeout_ms);
+extern int zs_dotzsdb_is_active_idx(struct zsdb_priv *priv);
+
+/* zeroskip-eytzinger.c */
+extern void zs_eytzinger_new(struct zsdb_eytzinger *e, uint64_t count,
+                             int prefixed, zs_eytzinger_key_fn keyfn,
+                             void *data);
+extern void zs_eytzinger_free(struct zsdb_eytzinger *e);
+extern uint64_t zs_eytzinger_upper_bound(const struct zsdb_eytzinger *e,
+                                         const unsigned char *key,
+                                         uint64_t keylen,
+                                         zsdb_cmp_fn cmpfn);
 
 /* zeroskip-file.c */
 extern int zs_file_write_keyval_record(struct zsdb_file *f,
@@ -337,6 +643,14 @@ extern int zs_file_write_keyval_record(struct zsdb_file *f,
 extern int zs_file_write_commit_record(struct zsdb_file *f, int final);
 extern int zs_file_write_delete_record(struct zsdb_file *f,
                                        const unsigned char *key, uint64_t keylen);
+extern void zs_file_encode_keyval_record(cstring *cstr,
+                                         const unsigned char *key,
+                                         uint64_t keylen,
+                                         const unsigned char *val,
+                                         uint64_t vallen);
+extern void zs_file_encode_delete_record(cstring *cstr,
+                                         const unsigned char *key,
+                                         uint64_t keylen);
 extern int zs_file_update_stat(struct zsdb_file *f);
 extern int zs_file_check_stat(struct zsdb_file *f);
 
@@ -363,6 +677,10 @@ extern int zs_iterator_begin_at_key(struct zsdb_iter **iter,
                                     const unsigned char *key,
                                     uint64_t keylen,
                                     int *found);
+extern int zs_iterator_begin_at_prefix(struct zsdb_iter **iter,
+                                       const unsigned char *prefix,
+                                       uint64_t prefixlen,
+                                       int *found);
 extern int zs_iterator_begin_for_packed_files(struct zsdb_iter **iter,
                                               struct list_head *pflist);
 extern struct zsdb_iter_data *zs_iterator_get(struct zsdb_iter *iter);
@@ -396,12 +714,30 @@ extern int zs_packed_file_write_delete_record(void *data,
                                               uint64_t vallen _unused_);
 extern int zs_packed_file_write_commit_record(struct zsdb_file *f);
 extern int zs_packed_file_write_final_commit_record(struct zsdb_file *f);
-extern int zs_pq_cmp_key_frm_offset(const void *d1, const void *d2,
+/* The files are not const, since reading a key from a version 2 file moves
+ * its block cursor */
+extern int zs_pq_cmp_key_frm_offset(void *d1, void *d2,
                                     zsdb_cmp_fn cmpfn, void *cbdata);
+extern int zs_packed_file_read_record(struct zsdb_file *f, uint64_t idx,
+                                      const unsigned char **key,
+                                      uint64_t *keylen,
+                                      const unsigned char **val,
+                                      uint64_t *vallen,
+                                      int *deleted);
 extern int zs_packed_file_get_key_from_offset(struct zsdb_file *f,
                                               unsigned char **key,
                                               uint64_t *len,
                                               enum record_t *type);
+extern int zs_packed_file_fence_index_new(struct zsdb_file *f);
+extern int zs_packed_file_eytzinger_new(struct zsdb_file *f, int prefixed);
+extern int zs_packed_file_cmp_fence_keys(const struct zsdb_file *f,
+                                         const unsigned char *key,
+                                         uint64_t keylen,
+                                         zsdb_cmp_fn cmpfn);
+extern int zs_packed_file_has_prefix(const struct zsdb_file *f,
+                                     const unsigned char *prefix,
+                                     uint64_t prefixlen,
+                                     zsdb_cmp_fn cmpfn);
 extern int zs_packed_file_bsearch_index(const unsigned char *key,
                                         const uint64_t keylen,
                                         struct zsdb_file *f,
@@ -409,6 +745,14 @@ extern int zs_packed_file_bsearch_index(const unsigned char *key,
                                         const unsigned char **value,
                                         uint64_t *vallen,
                                         zsdb_cmp_fn cmpfn);
+extern int zs_packed_file_bsearch_index_from(const unsigned char *key,
+                                             const uint64_t keylen,
+                                             struct zsdb_file *f,
+                                             uint64_t from,
+                                             uint64_t *location,
+                                             const unsigned char **value,
+                                             uint64_t *vallen,
+                                             zsdb_cmp_fn cmpfn);
 
 /* zeroskip-record.c */
 extern int zs_record_read_from_file(struct zsdb_file *f, uint64_t *offset,
@@ -252,10 +252,13 @@ static int zs_read_and_verify_commit_record(struct zsdb_file *f,
                 /* Data begins at `rptr` */
                 rptr = fptr - lc.length;
 
-                val = 0;        /* 0 used to compute CRC */
+                /* The CRC is of the data, and then of the commit record's
+                 * three words without the CRC, as they are in memory */
                 crc = crc32c_hw(crc, (void *)rptr, lc.length);
                 crc = crc32c_hw(crc, (void *)&data, sizeof(uint64_t));
-                crc = crc32c_hw(crc, (void *)lc.length, sizeof(uint64_t));
+                val = lc.length;
+                crc = crc32c_hw(crc, (void *)&val, sizeof(uint64_t));
+                val = (uint64_t)REC_TYPE_2ND_HALF_COMMIT << 56;
                 crc = crc32c_hw(crc, (void *)&val, sizeof(uint64_t));
 
                 if (lc.crc32 != crc) {
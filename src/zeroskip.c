@@ -13,7 +13,7 @@
 
 #include "htable.h"
 #include "pqueue.h"
-#include <libzeroskip/memtree.h>
+#include <libzeroskip/memtable.h>
 #include <libzeroskip/cstring.h>
 #include <libzeroskip/log.h>
 #include <libzeroskip/macros.h>
@@ -69,32 +69,79 @@ static int dbfname_cmp(const void *d1, const void *d2, void *cbdata _unused_)
         return natural_strcasecmp(f1->fname.buf, f2->fname.buf);
 }
 
-static int load_memtree_record_cb(void *data,
-                                  const unsigned char *key, size_t keylen,
-                                  const unsigned char *value, size_t vallen)
+static int load_memtable_record_cb(void *data,
+                                   const unsigned char *key, size_t keylen,
+                                   const unsigned char *value, size_t vallen)
 {
-        struct memtree *memtree = (struct memtree *)data;
-        struct record *rec;
+        struct memtable *memtable = (struct memtable *)data;
 
-        rec = record_new(key, keylen, value, vallen, 0);
-        memtree_replace(memtree, rec);
+        memtable_upsert(memtable, key, keylen, value, vallen, 0);
 
         return 0;
 }
 
-static int load_deleted_memtree_record_cb(void *data,
-                                          const unsigned char *key, size_t keylen,
-                                          const unsigned char *value, size_t vallen)
+static int load_deleted_memtable_record_cb(void *data,
+                                           const unsigned char *key, size_t keylen,
+                                           const unsigned char *value, size_t vallen)
 {
-        struct memtree *memtree = (struct memtree *)data;
-        struct record *rec;
+        struct memtable *memtable = (struct memtable *)data;
 
-        rec = record_new(key, keylen, value, vallen, 1);
-        memtree_replace(memtree, rec);
+        memtable_upsert(memtable, key, keylen, value, vallen, 1);
 
         return 0;
 }
 
+static int load_bulk_record_cb(void *data,
+                               const unsigned char *key, size_t keylen,
+                               const unsigned char *value, size_t vallen)
+{
+        struct memtable_loader *loader = (struct memtable_loader *)data;
+
+        memtable_loader_add(loader, key, keylen, value, vallen, 0);
+
+        return 0;
+}
+
+static int load_deleted_bulk_record_cb(void *data,
+                                       const unsigned char *key, size_t keylen,
+                                       const unsigned char *value, size_t vallen)
+{
+        struct memtable_loader *loader = (struct memtable_loader *)data;
+
+        memtable_loader_add(loader, key, keylen, value, vallen, 1);
+
+        return 0;
+}
+
+/* load_finalised_files():
+ * Loads the records of the finalised files, from the oldest to the newest,
+ * into `priv->fmemtable`, and sets the priority of each file. When the
+ * records come in sorted runs, a memtree is built from them once they have
+ * all been read, rather than inserted into record by record.
+ */
+static void load_finalised_files(struct zsdb_priv *priv)
+{
+        struct memtable_loader loader;
+        struct list_head *pos;
+        uint64_t priority = 0;
+
+        memtable_loader_init(&loader, priv->fmemtable);
+
+        zslog(LOGDEBUG, "Loading data from finalised files\n");
+        list_for_each_reverse(pos, &priv->dbfiles.fflist) {
+                struct zsdb_file *f;
+                f = list_entry(pos, struct zsdb_file, list);
+                zslog(LOGDEBUG, "Loading %s\n", f->fname.buf);
+                zs_finalised_file_record_foreach(f,
+                                                 load_bulk_record_cb,
+                                                 load_deleted_bulk_record_cb,
+                                                 &loader);
+                f->priority = ++priority;
+        }
+
+        memtable_loader_finish(&loader);
+}
+
 static int print_record_cb(void *data _unused_,
                            const unsigned char *key, size_t keylen,
                            const unsigned char *value, size_t vallen)
@@ -175,6 +222,7 @@ static int process_packed_file(const char *path, void *data)
 {
         int ret = ZS_OK;
         struct zsdb_file *f _unused_;
+        struct zsdb_priv *priv;
 
         if (!data) {
                 zslog(LOGDEBUG, "Internal error when preocessing active file.\n");
@@ -184,12 +232,44 @@ static int process_packed_file(const char *path, void *data)
 
         zslog(LOGDEBUG, "processing packed file: %s\n", path);
 
+        priv = (struct zsdb_priv *)data;
+
         ret = zs_packed_file_open(path, &f);
         if (ret != ZS_OK) {
                 zslog(LOGDEBUG, "skipping file %s\n", path);
                 goto done;
         }
 
+        if (priv->flags & MODE_FENCEINDEX) {
+                /* The fence index only speeds up searches, so the file
+                   is still used without one */
+                ret = zs_packed_file_fence_index_new(f);
+                if (ret != ZS_OK) {
+                        zslog(LOGWARNING,
+                              "no fence index for %s, searching it without\n",
+                              path);
+                        ret = ZS_OK;
+                }
+        }
+
+        /* Key prefixes are compared as memcmp_raw() would compare the
+         * keys, so a custom comparator can't use them */
+        if (priv->flags & (MODE_EYTZINGER | MODE_KEYPREFIX)) {
+                int prefixed = (priv->flags & MODE_KEYPREFIX) &&
+                        !priv->dbcompare;
+
+                /* The layout only speeds up searches too. It fails when
+                   the fence index can't be built, and the file is then
+                   searched without either */
+                ret = zs_packed_file_eytzinger_new(f, prefixed);
+                if (ret != ZS_OK) {
+                        zslog(LOGWARNING,
+                              "no index layout for %s, searching it without\n",
+                              path);
+                        ret = ZS_OK;
+                }
+        }
+
         pqueue_put(&packedpq, f);
 
 done:
@@ -428,8 +508,8 @@ static int zsdb_reload(struct zsdb_priv *priv)
 {
         int ret = ZS_OK;
         struct list_head *pos, *p;
-        size_t mfsize;
         uint64_t priority = 0;
+        uint64_t offset;
 
         if (!priv->open) {
                 zslog(LOGWARNING, "DB not open!\n");
@@ -457,15 +537,16 @@ static int zsdb_reload(struct zsdb_priv *priv)
                 zs_packed_file_close(&f);
                 priv->dbfiles.pfcount--;
         }
+        zs_cache_clear(&priv->cache);
 
-        if (priv->memtree) {
-                memtree_free(priv->memtree);
-                priv->memtree = NULL;
+        if (priv->memtable) {
+                memtable_free(priv->memtable);
+                priv->memtable = NULL;
         }
 
-        if (priv->fmemtree) {
-                memtree_free(priv->fmemtree);
-                priv->fmemtree = NULL;
+        if (priv->fmemtable) {
+                memtable_free(priv->fmemtable);
+                priv->fmemtable = NULL;
         }
 
         /** Reopen/Reload all files */
@@ -475,13 +556,24 @@ static int zsdb_reload(struct zsdb_priv *priv)
                 goto done;
 
         /* Allocate In-memory tree */
-        priv->memtree = memtree_new(NULL, priv->btcompare);
-        priv->fmemtree = memtree_new(NULL, priv->btcompare);
+        priv->memtable = memtable_new(priv->memtable_type, priv->btcompare);
+        priv->fmemtable = memtable_new(priv->memtable_type, priv->btcompare);
+        priv->finalise.basecount = 0;
+        priv->finalise.basesize = 0;
+
+        /* Other processes may have committed since .zsdb was read */
+        if (priv->flags & MODE_FASTCOMMIT) {
+                ret = zs_active_file_find_last_commit(priv, ZS_HDR_SIZE,
+                                                      &offset);
+                if (ret != ZS_OK)
+                        goto done;
+                priv->dotzsdb.offset = offset;
+        }
 
         /* Load records from active file to in-memory tree */
-        ret = zs_active_file_record_foreach(priv, load_memtree_record_cb,
-                                            load_deleted_memtree_record_cb,
-                                            priv->memtree);
+        ret = zs_active_file_record_foreach(priv, load_memtable_record_cb,
+                                            load_deleted_memtable_record_cb,
+                                            priv->memtable);
         if (ret != ZS_OK)
                 goto done;
 
@@ -493,20 +585,8 @@ static int zsdb_reload(struct zsdb_priv *priv)
         }
         pqueue_free(&finalisedpq);
 
-        if (priv->dbfiles.ffcount) {
-                priority = 0;
-                zslog(LOGDEBUG, "Loading data from finalised files\n");
-                list_for_each_reverse(pos, &priv->dbfiles.fflist) {
-                        struct zsdb_file *f;
-                        f = list_entry(pos, struct zsdb_file, list);
-                        zslog(LOGDEBUG, "Loading %s\n", f->fname.buf);
-                        zs_finalised_file_record_foreach(f,
-                                                         load_memtree_record_cb,
-                                                         load_deleted_memtree_record_cb,
-                                                         priv->fmemtree);
-                        f->priority = ++priority;
-                }
-        }
+        if (priv->dbfiles.ffcount)
+                load_finalised_files(priv);
 
 
         while (packedpq.count) {
@@ -525,28 +605,92 @@ static int zsdb_reload(struct zsdb_priv *priv)
                 f->priority = ++priority;
         }
 
-        /* Seek to the end of the file, that's where the
-           records need to appended to.
-        */
-        mfile_size(&priv->dbfiles.factive.mf, &mfsize);
-        if (mfsize)
-                mfile_seek(&priv->dbfiles.factive.mf, mfsize, NULL);
-
         priv->dbdirty = 1;
 done:
         return ret;
 }
 
+/* A key being looked up by zsdb_fetch_multi() */
+struct multi_key {
+        const unsigned char *key;
+        size_t keylen;
+        size_t idx;             /* Position in the caller's arrays */
+        uint64_t hash;
+        zsdb_cmp_fn cmpfn;
+};
+
+static int multi_key_cmp(const void *d1, const void *d2)
+{
+        const struct multi_key *k1 = d1;
+        const struct multi_key *k2 = d2;
+        int ret;
+
+        if (k1->cmpfn)
+                ret = k1->cmpfn(k1->key, k1->keylen, k2->key, k2->keylen);
+        else
+                ret = memcmp_raw(k1->key, k1->keylen, k2->key, k2->keylen);
+
+        /* Keep duplicates in the order they were given */
+        if (!ret)
+                ret = (k1->idx > k2->idx) - (k1->idx < k2->idx);
+
+        return ret;
+}
+
+/* Wait for the commits of the group to be synced. The write lock, if held,
+ * is given up meanwhile, so that others can join the group, and taken back
+ * before returning, with whatever they have committed reloaded.
+ */
+static int group_commit_wait(struct zsdb *db)
+{
+        struct zsdb_priv *priv = db->priv;
+        int locked = file_lock_is_locked(&priv->wlk);
+        int ret;
+
+        if (locked && zsdb_write_lock_release(db) != ZS_OK)
+                return ZS_ERROR;
+
+        ret = zs_group_commit_wait(priv);
+
+        if (locked) {
+                if (zsdb_write_lock_acquire(db, 0) != ZS_OK)
+                        return ZS_ERROR;
+
+                if (zs_dotzsdb_check_stat(priv) > 0 &&
+                    zsdb_reload(priv) != ZS_OK) {
+                        zslog(LOGWARNING, "Failed reloading DB!\n");
+                        return ZS_ERROR;
+                }
+        }
+
+        return ret;
+}
+
 /**
  * Public functions
  */
 int zsdb_init(struct zsdb **pdb, zsdb_cmp_fn dbcmpfn,
               memtree_search_cb_t btcmpfn)
+{
+        return zsdb_init_opt(pdb, dbcmpfn, btcmpfn, MEMTABLE_BTREE);
+}
+
+int zsdb_init_opt(struct zsdb **pdb, zsdb_cmp_fn dbcmpfn,
+                  memtree_search_cb_t btcmpfn,
+                  enum memtable_type memtable_type)
 {
         struct zsdb *db;
         struct zsdb_priv *priv;
         int ret = ZS_OK;
 
+        /* The radix tree only has the order of memtree_memcmp_raw() */
+        if (memtable_type == MEMTABLE_ART && btcmpfn &&
+            btcmpfn != memtree_memcmp_raw) {
+                *pdb = NULL;
+                ret = ZS_INVALID_MODE;
+                goto done;
+        }
+
         db = xcalloc(1, sizeof(struct zsdb));
         if (!db) {
                 *pdb = NULL;
@@ -561,6 +705,10 @@ int zsdb_init(struct zsdb **pdb, zsdb_cmp_fn dbcmpfn,
                 goto done;
         }
         priv->dbdirty = 0;
+        cstring_init(&priv->fetchnextkey, 0);
+        zs_cache_init(&priv->cache);
+        priv->finalise.bytes = TWOMB;
+        priv->memtable_type = memtable_type;
         db->priv = priv;
 
         if (dbcmpfn)
@@ -586,6 +734,8 @@ void zsdb_final(struct zsdb **pdb)
 
                 cstring_release(&priv->dbdir);
                 cstring_release(&priv->dotzsdbfname);
+                cstring_release(&priv->fetchnextkey);
+                zs_cache_free(&priv->cache);
 
                 xfree(priv);
                 xfree(db);
@@ -667,6 +817,8 @@ int zsdb_open(struct zsdb *db, const char *dbdir, int mode)
                 assert(priv->btcompare);
         }
 
+        priv->flags = mode;
+
         /* Compare functions for the pq for finalised and packed files */
         finalisedpq.cmp = dbfname_cmp;
         packedpq.cmp = dbfname_cmp;
@@ -703,9 +855,18 @@ int zsdb_open(struct zsdb *db, const char *dbdir, int mode)
                 goto done;
         }
 
+        /* The generation number is how we find out that other processes
+         * have changed the DB. Without it, we fall back to stat()ing .zsdb.
+         */
+        if (!zs_dotzsdb_gen_open(priv))
+                zslog(LOGDEBUG, "Checking for changes to `%s` with stat()\n",
+                      priv->dbdir.buf);
+
         /* In-memory tree */
-        priv->memtree = memtree_new(NULL, priv->btcompare);
-        priv->fmemtree = memtree_new(NULL, priv->btcompare);
+        priv->memtable = memtable_new(priv->memtable_type, priv->btcompare);
+        priv->fmemtable = memtable_new(priv->memtable_type, priv->btcompare);
+        priv->finalise.basecount = 0;
+        priv->finalise.basesize = 0;
 
         if (newdb) {
                 if (zsdb_write_lock_acquire(db, 0 /*timeout*/) < 0) {
@@ -730,19 +891,29 @@ int zsdb_open(struct zsdb *db, const char *dbdir, int mode)
                 /* If it is an existing DB, scan the directory for
                  * db files.
                  */
-                size_t mfsize = 0;
                 struct list_head *pos;
                 uint64_t priority;
+                uint64_t offset;
 
                 ret = process_files_in_dbdir(&priv->dbdir.buf,
                                              DB_ABS_PATH, priv);
                 if (ret != ZS_OK)
                         goto done;
 
+                /* The commits after the one .zsdb knows about */
+                if (mode & MODE_FASTCOMMIT) {
+                        ret = zs_active_file_find_last_commit(priv,
+                                                              priv->dotzsdb.offset,
+                                                              &offset);
+                        if (ret != ZS_OK)
+                                goto done;
+                        priv->dotzsdb.offset = offset;
+                }
+
                 /* Load records from active file to in-memory tree */
-                ret = zs_active_file_record_foreach(priv, load_memtree_record_cb,
-                                                    load_deleted_memtree_record_cb,
-                                                    priv->memtree);
+                ret = zs_active_file_record_foreach(priv, load_memtable_record_cb,
+                                                    load_deleted_memtable_record_cb,
+                                                    priv->memtable);
                 if (ret != ZS_OK)
                         goto done;
 
@@ -754,20 +925,8 @@ int zsdb_open(struct zsdb *db, const char *dbdir, int mode)
                 }
                 pqueue_free(&finalisedpq);
 
-                if (priv->dbfiles.ffcount) {
-                        priority = 0;
-                        zslog(LOGDEBUG, "Loading data from finalised files\n");
-                        list_for_each_reverse(pos, &priv->dbfiles.fflist) {
-                                struct zsdb_file *f;
-                                f = list_entry(pos, struct zsdb_file, list);
-                                zslog(LOGDEBUG, "Loading %s\n", f->fname.buf);
-                                zs_finalised_file_record_foreach(f,
-                                                                 load_memtree_record_cb,
-                                                                 load_deleted_memtree_record_cb,
-                                                                 priv->fmemtree);
-                                f->priority = ++priority;
-                        }
-                }
+                if (priv->dbfiles.ffcount)
+                        load_finalised_files(priv);
 
 
                 while (packedpq.count) {
@@ -786,13 +945,6 @@ int zsdb_open(struct zsdb *db, const char *dbdir, int mode)
                         f->priority = ++priority;
                 }
 
-                /* Seek to the end of the file, that's where the
-                   records need to appended to.
-                */
-                mfile_size(&priv->dbfiles.factive.mf, &mfsize);
-                if (mfsize)
-                        mfile_seek(&priv->dbfiles.factive.mf, mfsize, NULL);
-
                 zslog(LOGDEBUG, "Found %d files in %s.\n",
                       priv->dbfiles.afcount +
                       priv->dbfiles.ffcount +
@@ -831,6 +983,7 @@ int zsdb_close(struct zsdb *db)
         file_lock_release(&priv->wlk);
 
         zs_active_file_close(priv);
+        zs_dotzsdb_gen_close(priv);
 
         list_for_each_forward_safe(pos, p, &priv->dbfiles.fflist) {
                 struct zsdb_file *f;
@@ -847,12 +1000,13 @@ int zsdb_close(struct zsdb *db)
                 zs_packed_file_close(&f);
                 priv->dbfiles.pfcount--;
         }
+        zs_cache_clear(&priv->cache);
 
-        if (priv->memtree)
-                memtree_free(priv->memtree);
+        if (priv->memtable)
+                memtable_free(priv->memtable);
 
-        if (priv->fmemtree)
-                memtree_free(priv->fmemtree);
+        if (priv->fmemtable)
+                memtable_free(priv->fmemtable);
 
         if (db->iter || db->numtrans)
                 ret = zsdb_break(ZS_INTERNAL);
@@ -869,8 +1023,6 @@ int zsdb_add(struct zsdb *db,
 {
         int ret = ZS_OK;
         struct zsdb_priv *priv;
-        size_t mfsize = 0;
-        struct record *rec;
         const unsigned char *empty = (const unsigned char *)"";
 
         assert(db);
@@ -911,10 +1063,11 @@ int zsdb_add(struct zsdb *db,
                 zslog(LOGDEBUG, "zsdb_add: Reloaded DB!\n");
         }
 
-        mfsize = priv->dbfiles.factive.mf->size;
-        if (mfsize >= TWOMB) {
-                zslog(LOGDEBUG, "File %s is > 2MB, finalising.\n",
-                        priv->dbfiles.factive.fname.buf);
+        ret = zs_active_file_drop_uncommitted(priv);
+        if (ret != ZS_OK)
+                goto done;
+
+        if (zs_active_file_needs_finalise(priv)) {
                 ret = zs_active_file_finalise(priv);
                 if (ret != ZS_OK) goto done;
 
@@ -941,8 +1094,8 @@ int zsdb_add(struct zsdb *db,
         priv->dbfiles.factive.dirty = 1;
         priv->dbdirty = 1;
 
-        rec = record_new(key, keylen, value, vallen, 0);
-        memtree_replace(priv->memtree, rec);
+        memtable_upsert(priv->memtable, key, keylen, value, vallen, 0);
+        zs_cache_invalidate(&priv->cache, key, keylen);
 
         zslog(LOGDEBUG, "Inserted record into the DB. %s\n",
                 priv->dbfiles.factive.fname.buf);
@@ -956,7 +1109,6 @@ int zsdb_remove(struct zsdb *db,
 {
         int ret = ZS_OK;
         struct zsdb_priv *priv;
-        struct record *rec;
 
         assert(db);
         assert(db->priv);
@@ -980,6 +1132,10 @@ int zsdb_remove(struct zsdb *db,
                 goto done;
         }
 
+        ret = zs_active_file_drop_uncommitted(priv);
+        if (ret != ZS_OK)
+                goto done;
+
         /* Start computing the crc32. Will end when the transaction is
            committed */
         crc32_begin(&priv->dbfiles.factive.mf);
@@ -995,14 +1151,108 @@ int zsdb_remove(struct zsdb *db,
         priv->dbdirty = 1;
 
         /* Add the entry to the in-memory tree */
-        rec = record_new(key, keylen, NULL, 0, 1);
-        memtree_replace(priv->memtree, rec);
+        memtable_upsert(priv->memtable, key, keylen, NULL, 0, 1);
+        zs_cache_invalidate(&priv->cache, key, keylen);
 
         zslog(LOGDEBUG, "Removed key from DB `%s`\n", priv->dbdir.buf);
 done:
         return ret;
 }
 
+/* zsdb_write_batch_apply():
+ * Adds the records of a batch to the DB, and commits them. The records are
+ * written with a single write and checksummed by a single commit record.
+ * Needs the write lock.
+ */
+int zsdb_write_batch_apply(struct zsdb *db, struct zsdb_write_batch *batch)
+{
+        int ret = ZS_OK;
+        struct zsdb_priv *priv;
+        size_t i;
+
+        assert(db);
+        assert(db->priv);
+        assert(batch);
+
+        if (!db || !db->priv)
+                return ZS_NOT_OPEN;
+
+        if (!batch)
+                return ZS_ERROR;
+
+        priv = db->priv;
+
+        if (!priv->open || !priv->dbfiles.factive.is_open) {
+                return ZS_NOT_OPEN;
+        }
+
+        if (!zsdb_write_lock_is_locked(db)) {
+                zslog(LOGDEBUG, "Need a write lock to add records.\n");
+                ret = ZS_ERROR;
+                goto done;
+        }
+
+        if (!batch->count)
+                goto done;
+
+        if (zs_dotzsdb_check_stat(priv) > 0) {
+                ret = zsdb_reload(priv);
+                if (ret != ZS_OK) {
+                        zslog(LOGWARNING, "Failed reloading DB!\n");
+                        goto done;
+                }
+
+                zslog(LOGDEBUG, "zsdb_write_batch_apply: Reloaded DB!\n");
+        }
+
+        ret = zs_active_file_drop_uncommitted(priv);
+        if (ret != ZS_OK)
+                goto done;
+
+        if (zs_active_file_needs_finalise(priv)) {
+                ret = zs_active_file_finalise(priv);
+                if (ret != ZS_OK) goto done;
+
+                ret = zs_active_file_new(priv,
+                                         priv->dotzsdb.curidx + 1);
+                zslog(LOGDEBUG, "New active log file %s created.\n",
+                        priv->dbfiles.factive.fname.buf);
+        }
+
+        if (!priv->dbfiles.factive.mf->compute_crc)
+                crc32_begin(&priv->dbfiles.factive.mf);
+
+        ret = zs_active_file_write_batch(priv, batch);
+        if (ret != ZS_OK) {
+                crc32_end(&priv->dbfiles.factive.mf);
+                goto done;
+        }
+        priv->dbfiles.factive.dirty = 1;
+        priv->dbdirty = 1;
+
+        /* Add them in key order, and only the last record of a key that
+           is in the batch more than once */
+        zs_write_batch_sort(batch, priv->dbcompare);
+        for (i = 0; i < batch->count; i++) {
+                struct zs_batch_entry *e = &batch->entries[i];
+
+                if (e->shadowed)
+                        continue;
+
+                memtable_upsert(priv->memtable, e->key, e->keylen,
+                               e->deleted ? NULL : e->val, e->vallen,
+                               e->deleted);
+                zs_cache_invalidate(&priv->cache, e->key, e->keylen);
+        }
+
+        ret = zsdb_commit(db, NULL);
+
+        zslog(LOGDEBUG, "Applied a batch of %zu records to the DB. %s\n",
+              batch->count, priv->dbfiles.factive.fname.buf);
+done:
+        return ret;
+}
+
 int zsdb_commit(struct zsdb *db, struct zsdb_txn **txn)
 {
         int ret = ZS_OK;
@@ -1026,9 +1276,24 @@ int zsdb_commit(struct zsdb *db, struct zsdb_txn **txn)
                 priv->dbfiles.factive.dirty = 0;
         }
 
+        if (ret == ZS_OK && zs_group_commit_enabled(priv)) {
+                ret = zs_group_commit_add(priv);
+                if (ret == ZS_OK && priv->group.count)
+                        ret = group_commit_wait(db);
+                goto done;
+        }
+
+        /* The commit has to be on disk before .zsdb says it is. It began
+         * where the last one ended. */
+        if (ret == ZS_OK)
+                ret = zs_active_file_sync(priv, priv->dotzsdb.offset);
+
         /* Update the index and offset in the .zsdb file */
-        zs_dotzsdb_update_index_and_offset(priv, priv->dotzsdb.curidx,
-               priv->dbfiles.factive.mf->offset);
+        if (priv->flags & MODE_FASTCOMMIT)
+                zs_dotzsdb_commit(priv, priv->dbfiles.factive.mf->offset);
+        else
+                zs_dotzsdb_update_index_and_offset(priv, priv->dotzsdb.curidx,
+                       priv->dbfiles.factive.mf->offset);
 
 done:
         if (txn) {
@@ -1048,8 +1313,10 @@ int zsdb_fetch(struct zsdb *db,
 {
         int ret = ZS_NOTFOUND;
         struct zsdb_priv *priv;
-        memtree_iter_t iter;
+        struct record *record;
         struct list_head *pos;
+        uint64_t hash;
+        int found = 0;
 
         assert(db);
         assert(db->priv);
@@ -1074,26 +1341,24 @@ int zsdb_fetch(struct zsdb *db,
                 zslog(LOGDEBUG, "zsdb_fetch: has transaction\n");
         }
 
-        /* Look for the key in the active in-memory memtree */
+        /* Look for the key in the active in-memory memtable */
         zslog(LOGDEBUG, "Looking in active records\n");
-        if (memtree_find(priv->memtree, key, keylen, iter)) {
+        record = memtable_find(priv->memtable, key, keylen);
+        if (record && !record->deleted) {
                 /* We found the key in active records */
-                if (iter->record && !iter->record->deleted) {
-                        *vallen = iter->record->vallen;
-                        *value = iter->record->val;
-                        ret = ZS_OK;
-                        goto done;
-                }
+                *vallen = record->vallen;
+                *value = record->val;
+                ret = ZS_OK;
+                goto done;
         }
 
         /* Look for the key in the finalised records */
         zslog(LOGDEBUG, "Looking in finalised file(s)\n");
-        if (memtree_find(priv->fmemtree, key, keylen, iter)) {
+        record = memtable_find(priv->fmemtable, key, keylen);
+        if (record) {
                 /* We found the key in finalised records */
-                if (iter->record) {
-                        *vallen = iter->record->vallen;
-                        *value = iter->record->val;
-                }
+                *vallen = record->vallen;
+                *value = record->val;
 
                 ret = ZS_OK;
                 goto done;
@@ -1102,76 +1367,211 @@ int zsdb_fetch(struct zsdb *db,
         /* The key was not found in either the active file or the finalised
            files, look for it in the packed files */
         zslog(LOGDEBUG, "Looking in the Packed file(s)\n");
+        if (zs_cache_lookup(&priv->cache, key, keylen, value, vallen,
+                            &found)) {
+                zslog(LOGDEBUG, "\tFound in cache\n");
+                ret = found ? ZS_OK : ZS_NOTFOUND;
+                goto done;
+        }
+
+        hash = zs_bloom_hash(key, keylen);
         list_for_each_forward(pos, &priv->dbfiles.pflist) {
                 struct zsdb_file *f;
                 uint64_t location = 0;
-                int cmp_ret;
-                struct zs_key temp_key;
 
                 f = list_entry(pos, struct zsdb_file, list);
 
                 zslog(LOGDEBUG, "Looking in packed file %s\n",
                       f->fname.buf);
-                zslog(LOGDEBUG, "\tTotal records: %d\n",
-                      f->index->count);
 
                 /* If the given key is smaller than the smallest key in the
                  * packedfile or bigger than the the biggest key, we continue
                  * to the next file in the list instead of binary searching
                  * in the current file.
                  */
-                zslog(LOGDEBUG, "\tfirst record at offset: %d\n",
-                      f->index->data[0]);
-                zs_record_read_key_from_file_offset(f, f->index->data[0],
-                                                    &temp_key);
-                if (priv->dbcompare) {
-                        cmp_ret = priv->dbcompare(key, keylen, temp_key.data,
-                                                  (temp_key.base.type == REC_TYPE_KEY ||
-                                                   temp_key.base.type == REC_TYPE_DELETED) ?
-                                                  temp_key.base.slen : temp_key.base.slen);
-                } else {
-                        cmp_ret = memcmp_raw(key, keylen, temp_key.data,
-                                             (temp_key.base.type == REC_TYPE_KEY ||
-                                              temp_key.base.type == REC_TYPE_DELETED) ?
-                                             temp_key.base.slen : temp_key.base.slen);
-                }
-                if (cmp_ret < 0)
+                if (zs_packed_file_cmp_fence_keys(f, key, keylen,
+                                                  priv->dbcompare))
                         continue;
 
-                zslog(LOGDEBUG, "\tlast record at offset: %d\n",
-                      f->index->data[f->index->count - 1]);
-                zs_record_read_key_from_file_offset(f,
-                                                    f->index->data[f->index->count - 1],
-                                                    &temp_key);
-                if (priv->dbcompare) {
-                        cmp_ret = priv->dbcompare(key, keylen, temp_key.data,
-                                                  (temp_key.base.type == REC_TYPE_KEY ||
-                                                   temp_key.base.type == REC_TYPE_DELETED) ?
-                                                  temp_key.base.slen : temp_key.base.slen);
-                } else {
-                        cmp_ret = memcmp_raw(key, keylen, temp_key.data,
-                                             (temp_key.base.type == REC_TYPE_KEY ||
-                                              temp_key.base.type == REC_TYPE_DELETED) ?
-                                             temp_key.base.slen : temp_key.base.slen);
-                }
-                if (cmp_ret > 0)
+                /* Skip the file if its bloom filter says the key
+                 * isn't there. The filter hashes the bytes of the keys,
+                 * so it can't be used when a custom comparator decides
+                 * which keys are the same.
+                 */
+                if (!priv->dbcompare && !zs_bloom_check(&f->bloom, hash)) {
+                        zslog(LOGDEBUG, "\tNot in bloom filter\n");
                         continue;
+                }
+
+                zslog(LOGDEBUG, "\tTotal records: %" PRIu64 "\n",
+                      f->nrecords);
 
                 if (zs_packed_file_bsearch_index(key, keylen, f, &location,
                                                  value, vallen, priv->dbcompare)) {
                         zslog(LOGDEBUG, "Record found at location %ld\n",
                               location);
+                        zs_cache_insert(&priv->cache, key, keylen,
+                                        *value, *vallen, 1);
                         ret = ZS_OK;
                         goto done;
                 }
         }
 
+        zs_cache_insert(&priv->cache, key, keylen, NULL, 0, 0);
         ret = ZS_NOTFOUND;
 
 done:
         return ret;
 }
 
+/* zsdb_fetch_multi():
+ * Look up `n` keys at once. The result for each key is in `rc`, ZS_OK if it
+ * was found, with its value in `values` and `vallens`, and ZS_NOTFOUND
+ * otherwise. The keys are sorted, so that each packed file is searched in
+ * a single forward pass, with every search starting where the previous one
+ * ended.
+ */
+int zsdb_fetch_multi(struct zsdb *db,
+                     const unsigned char **keys,
+                     const size_t *keylens,
+                     size_t n,
+                     const unsigned char **values,
+                     size_t *vallens,
+                     int *rc,
+                     struct zsdb_txn **txn _unused_)
+{
+        struct zsdb_priv *priv;
+        struct multi_key *sorted;
+        struct record *record;
+        struct list_head *pos;
+        size_t i, npacked = 0;
+
+        assert(db);
+        assert(db->priv);
+        assert(keys);
+        assert(keylens);
+
+        priv = db->priv;
+
+        if (!priv->open || !priv->dbfiles.factive.is_open) {
+                zslog(LOGWARNING, "DB `%s` not open!\n", priv->dbdir.buf);
+                return ZS_NOT_OPEN;
+        }
+
+        if (!n)
+                return ZS_OK;
+
+        if (zs_dotzsdb_check_stat(priv) > 0) {
+                zslog(LOGDEBUG, "DB `%s` has been updated!\n", priv->dbdir.buf);
+        }
+
+        sorted = xcalloc(n, sizeof(struct multi_key));
+        for (i = 0; i < n; i++) {
+                sorted[i].key = keys[i];
+                sorted[i].keylen = keylens[i];
+                sorted[i].idx = i;
+                sorted[i].cmpfn = priv->dbcompare;
+
+                values[i] = NULL;
+                vallens[i] = 0;
+                rc[i] = ZS_NOTFOUND;
+        }
+
+        qsort(sorted, n, sizeof(struct multi_key), multi_key_cmp);
+
+        /* Resolve what we can in memory: the active and finalised records,
+         * and then the cache. The keys left over for the packed files are
+         * moved to the front of `sorted`, still in order.
+         */
+        for (i = 0; i < n; i++) {
+                struct multi_key *k = &sorted[i];
+                const unsigned char **value = &values[k->idx];
+                size_t *vallen = &vallens[k->idx];
+                int found = 0;
+
+                record = memtable_find(priv->memtable, k->key, k->keylen);
+                if (record && !record->deleted) {
+                        *vallen = record->vallen;
+                        *value = record->val;
+                        rc[k->idx] = ZS_OK;
+                        continue;
+                }
+
+                record = memtable_find(priv->fmemtable, k->key, k->keylen);
+                if (record) {
+                        *vallen = record->vallen;
+                        *value = record->val;
+                        rc[k->idx] = ZS_OK;
+                        continue;
+                }
+
+                if (zs_cache_lookup(&priv->cache, k->key, k->keylen,
+                                    value, vallen, &found)) {
+                        if (found)
+                                rc[k->idx] = ZS_OK;
+                        continue;
+                }
+
+                k->hash = zs_bloom_hash(k->key, k->keylen);
+                sorted[npacked++] = *k;
+        }
+
+        /* One pass over each packed file, newest first */
+        list_for_each_forward(pos, &priv->dbfiles.pflist) {
+                struct zsdb_file *f;
+                uint64_t from = 0;
+
+                f = list_entry(pos, struct zsdb_file, list);
+
+                for (i = 0; i < npacked; i++) {
+                        struct multi_key *k = &sorted[i];
+                        uint64_t location = 0;
+                        int res;
+
+                        if (rc[k->idx] == ZS_OK)
+                                continue;
+
+                        /* The rest of the keys are all bigger than the
+                         * biggest key in the file */
+                        res = zs_packed_file_cmp_fence_keys(f, k->key,
+                                                            k->keylen,
+                                                            priv->dbcompare);
+                        if (res > 0)
+                                break;
+                        if (res < 0)
+                                continue;
+
+                        /* As in zsdb_fetch(), the filter is only good
+                         * for keys compared as bytes */
+                        if (!priv->dbcompare &&
+                            !zs_bloom_check(&f->bloom, k->hash))
+                                continue;
+
+                        if (zs_packed_file_bsearch_index_from(k->key,
+                                                              k->keylen, f,
+                                                              from, &location,
+                                                              &values[k->idx],
+                                                              &vallens[k->idx],
+                                                              priv->dbcompare))
+                                rc[k->idx] = ZS_OK;
+
+                        from = location;
+                }
+        }
+
+        for (i = 0; i < npacked; i++) {
+                struct multi_key *k = &sorted[i];
+
+                zs_cache_insert(&priv->cache, k->key, k->keylen,
+                                values[k->idx], vallens[k->idx],
+                                rc[k->idx] == ZS_OK);
+        }
+
+        xfree(sorted);
+
+        return ZS_OK;
+}
+
 int zsdb_fetchnext(struct zsdb *db,
                    const unsigned char *key, size_t keylen,
                    const unsigned char **found, size_t *foundlen,
@@ -1229,11 +1629,20 @@ int zsdb_fetchnext(struct zsdb *db,
         case ZSDB_BE_PACKED:
         {
                 struct zsdb_file *f = data->data.f;
-                size_t offset = f->index->data[f->indexpos];
+                const unsigned char *k;
+                uint64_t klen;
+
+                zs_packed_file_read_record(f, f->indexpos, &k, &klen,
+                                           value, vallen, NULL);
 
-                zs_record_read_key_val_from_offset(f, &offset,
-                                                   found, foundlen,
-                                                   value, vallen);
+                /* The key may be in a buffer of the file, that the next
+                 * lookup reuses. Keep a copy, so that it can be passed
+                 * back in to get the record after it.
+                 */
+                cstring_setlen(&priv->fetchnextkey, 0);
+                cstring_add(&priv->fetchnextkey, k, klen);
+                *found = (const unsigned char *)priv->fetchnextkey.buf;
+                *foundlen = klen;
         }
                 break;
         default:
@@ -1314,11 +1723,15 @@ int zsdb_dump(struct zsdb *db, DBDumpLevel level)
                                 case ZSDB_BE_PACKED:
                                 {
                                         struct zsdb_file *f = idata->data.f;
-                                        size_t offset = f->index->data[f->indexpos];
-                                        zs_record_read_from_file(f, &offset,
-                                                                 print_record_cb,
-                                                                 NULL,
-                                                                 NULL);
+                                        const unsigned char *key, *val;
+                                        uint64_t keylen, vallen;
+
+                                        zs_packed_file_read_record(f, f->indexpos,
+                                                                   &key, &keylen,
+                                                                   &val, &vallen,
+                                                                   NULL);
+                                        print_record_cb(NULL, key, keylen,
+                                                        val, vallen);
                                 }
                                 break;
                                 default:
@@ -1330,8 +1743,8 @@ int zsdb_dump(struct zsdb *db, DBDumpLevel level)
                         zs_iterator_end(&iter);
                 } else {
                         /* Dump active records only */
-                        memtree_walk_forward(priv->memtree, print_memtree_rec, NULL);
-                        count = priv->memtree->count;
+                        memtable_walk_forward(priv->memtable, print_memtree_rec, NULL);
+                        count = memtable_count(priv->memtable);
                 }
         } else {
                 zslog(LOGDEBUG, "Invalid DB dump option\n");
@@ -1525,6 +1938,9 @@ int zsdb_repack(struct zsdb *db)
                         list_add_head(&tempf->list, &filelist);
                         printf("\t > %s\n", tempf->fname.buf);
                         i++;
+
+                        /* All of it is read, to be merged */
+                        mfile_willneed(&tempf->mf);
                 }
 
                 /* Find the index range */
@@ -1554,6 +1970,10 @@ int zsdb_repack(struct zsdb *db)
                         priv->dbfiles.pfcount--;
                 }
 
+                /* The cached lookups point into the files that were
+                 * just closed */
+                zs_cache_clear(&priv->cache);
+
                 priv->dbdirty = 1;
 
                 /* Done, for now. */
@@ -1658,6 +2078,10 @@ int zsdb_finalise(struct zsdb *db)
                 zslog(LOGDEBUG, "Reloaded DB!\n");
         }
 
+        ret = zs_active_file_drop_uncommitted(priv);
+        if (ret != ZS_OK)
+                goto done;
+
         zslog(LOGDEBUG, "Finalising %s.\n",
               priv->dbfiles.factive.fname.buf);
         ret = zs_active_file_finalise(priv);
@@ -1678,6 +2102,106 @@ done:
         return ret;
 }
 
+/* zsdb_cache_set_size():
+ * Cache up to `maxsize` bytes worth of lookups in packed files. The cache
+ * is off by default, and a `maxsize` of 0 turns it off.
+ */
+int zsdb_cache_set_size(struct zsdb *db, size_t maxsize)
+{
+        struct zsdb_priv *priv;
+
+        assert(db);
+        assert(db->priv);
+
+        if (!db || !db->priv)
+                return ZS_ERROR;
+
+        priv = db->priv;
+
+        zs_cache_set_size(&priv->cache, maxsize);
+
+        return ZS_OK;
+}
+
+/* zsdb_group_commit_set():
+ * Let commits share a sync. A commit waits up to `window_ms` for another
+ * process to sync it, before it syncs it itself, and is synced straight
+ * away once there are `maxcount` commits waiting, or `maxbytes` worth.
+ * zsdb_commit() still returns once the commit is on disk, but it lets go
+ * of the write lock while it waits, so other processes may have committed
+ * by the time it returns. Group commit is off by default, and turned off
+ * with all zeros.
+ */
+int zsdb_group_commit_set(struct zsdb *db, long window_ms, size_t maxbytes,
+                          size_t maxcount)
+{
+        struct zsdb_priv *priv;
+        int ret = ZS_OK;
+
+        assert(db);
+        assert(db->priv);
+
+        if (!db || !db->priv)
+                return ZS_ERROR;
+
+        priv = db->priv;
+
+        /* Don't leave commits behind that nothing would sync */
+        if (priv->group.count)
+                ret = zs_group_commit_sync(priv);
+
+        priv->group.window = window_ms > 0 ? window_ms : 0;
+        priv->group.maxbytes = maxbytes;
+        priv->group.maxcount = maxcount;
+
+        return ret;
+}
+
+/* zsdb_finalise_threshold_set():
+ * Set when zsdb_add() finalises the active file: once the file is
+ * `maxbytes` long, once its records are `maxrecords` keys in the in-memory
+ * tree, or once they take up `maxmemory` bytes there, whichever comes
+ * first. A zero leaves that limit out, and with all zeros the active file
+ * is only finalised by zsdb_finalise(). The default is 2MB of file.
+ */
+int zsdb_finalise_threshold_set(struct zsdb *db, size_t maxbytes,
+                                size_t maxrecords, size_t maxmemory)
+{
+        struct zsdb_priv *priv;
+
+        assert(db);
+        assert(db->priv);
+
+        if (!db || !db->priv)
+                return ZS_ERROR;
+
+        priv = db->priv;
+
+        priv->finalise.bytes = maxbytes;
+        priv->finalise.records = maxrecords;
+        priv->finalise.memory = maxmemory;
+
+        return ZS_OK;
+}
+
+int zsdb_cache_stats(struct zsdb *db, struct zsdb_cache_stats *stats)
+{
+        struct zsdb_priv *priv;
+
+        assert(db);
+        assert(db->priv);
+        assert(stats);
+
+        if (!db || !db->priv)
+                return ZS_ERROR;
+
+        priv = db->priv;
+
+        zs_cache_get_stats(&priv->cache, stats);
+
+        return ZS_OK;
+}
+
 int zsdb_foreach(struct zsdb *db, const unsigned char *prefix, size_t prefixlen,
                  zsdb_foreach_p *p, zsdb_foreach_cb *cb, void *cbdata,
                  struct zsdb_txn **txn)
@@ -1717,9 +2241,9 @@ int zsdb_foreach(struct zsdb *db, const unsigned char *prefix, size_t prefixlen,
                 zs_iterator_new(db, &tempiter);
 
                 if (prefix)
-                        ret = zs_iterator_begin_at_key(&tempiter,
-                                                       prefix,
-                                                       prefixlen, &found);
+                        ret = zs_iterator_begin_at_prefix(&tempiter,
+                                                          prefix,
+                                                          prefixlen, &found);
                 else
                         zs_iterator_begin(&tempiter);
 
@@ -1753,11 +2277,10 @@ int zsdb_foreach(struct zsdb *db, const unsigned char *prefix, size_t prefixlen,
                 case ZSDB_BE_PACKED:
                 {
                         struct zsdb_file *f = data->data.f;
-                        size_t offset = f->index->data[f->indexpos];
 
-                        zs_record_read_key_val_from_offset(f, &offset,
-                                                           &key, &keylen,
-                                                           &val, &vallen);
+                        zs_packed_file_read_record(f, f->indexpos,
+                                                   &key, &keylen,
+                                                   &val, &vallen, NULL);
                 }
                 break;
                 default:
@@ -1830,10 +2353,8 @@ int zsdb_forone(struct zsdb *db, const unsigned char *key, size_t keylen,
         struct zsdb_priv *priv;
         struct zsdb_iter *tempiter = NULL;
         int found = 0;
-        unsigned char *val = NULL;
+        const unsigned char *val = NULL;
         size_t vallen = 0;
-        struct zs_key krec;
-        struct zs_val vrec;
 
         assert(db);
         assert(db->priv);
@@ -1873,13 +2394,10 @@ int zsdb_forone(struct zsdb *db, const unsigned char *key, size_t keylen,
                 case ZSDB_BE_PACKED:
                 {
                         struct zsdb_file *f = data->data.f;
-                        size_t offset = f->index->data[f->indexpos];
 
-                        zs_read_key_val_record_from_file_offset(f, &offset,
-                                                                &krec, &vrec);
-                        val = vrec.data;
-                        vallen = vrec.base.type == REC_TYPE_VALUE ?
-                                vrec.base.slen : vrec.base.llen;
+                        zs_packed_file_read_record(f, f->indexpos,
+                                                   NULL, NULL,
+                                                   &val, &vallen, NULL);
                 }
                 break;
                 default:
@@ -1942,6 +2460,14 @@ int zsdb_write_lock_release(struct zsdb *db)
 
         priv = db->priv;
         if (!priv) return ZS_INTERNAL;
+
+        /* The next writer appends to where our records end, not to the
+         * end of the space we have grown the active file by */
+        if (priv->dbfiles.factive.is_open && file_lock_is_locked(&priv->wlk) &&
+            mfile_trim(&priv->dbfiles.factive.mf) != 0)
+                zslog(LOGWARNING, "Could not trim %s!\n",
+                      priv->dbfiles.factive.fname.buf);
+
         return (file_lock_release(&priv->wlk)  == 0) ? ZS_OK : ZS_ERROR;
 }
 
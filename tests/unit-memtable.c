@@ -0,0 +1,373 @@
+/*
+ * zeroskip
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+#include <libzeroskip/macros.h>
+#include <libzeroskip/util.h>
+#include <libzeroskip/memtable.h>
+
+#include <check.h>
+#include <stdlib.h>
+
+#if CHECK_MINOR_VERSION < 11
+#include <assert.h>
+#define ck_assert_mem_eq(a,b,c) assert(0 == memcmp(a,b,c))
+#endif
+
+#define MAXKEYS   1024
+#define MAXKEYLEN 64
+
+Suite *memtable_suite(void);
+
+struct testkey {
+        unsigned char key[MAXKEYLEN];
+        size_t keylen;
+};
+
+static struct testkey keys[MAXKEYS];
+static size_t numkeys;
+
+static void add_key(const void *key, size_t keylen)
+{
+        ck_assert(numkeys < MAXKEYS);
+        memcpy(keys[numkeys].key, key, keylen);
+        keys[numkeys].keylen = keylen;
+        numkeys++;
+}
+
+static int testkey_cmp(const void *a, const void *b)
+{
+        const struct testkey *ka = a, *kb = b;
+
+        return memcmp_raw(ka->key, ka->keylen, kb->key, kb->keylen);
+}
+
+/* Mailbox names, which share long prefixes, keys that are prefixes of
+ * others, or have NULs in them, enough keys on the same path for every
+ * size of radix tree node, and long chains of keys that are each a prefix
+ * of the next, sorted. */
+static void make_keys(void)
+{
+        const char *folders[] = {
+                "INBOX", "INBOX.Drafts", "INBOX.Sent", "INBOX.Sent Items",
+                "INBOX.Trash", "INBOX.Archive.2019", "INBOX.Archive.2020",
+        };
+        char buf[MAXKEYLEN];
+        size_t i, j;
+        int len;
+
+        numkeys = 0;
+
+        add_key("", 0);
+        add_key("a", 1);
+        add_key("a\0", 2);
+        add_key("a\0b", 3);
+        add_key("a\0\0", 3);
+        add_key("ab", 2);
+
+        for (i = 0; i < 40; i++) {
+                for (j = 0; j < ARRAY_SIZE(folders); j++) {
+                        len = snprintf(buf, sizeof(buf),
+                                       "example.org!user.u%zu.%s",
+                                       i, folders[j]);
+                        add_key(buf, len);
+                }
+                len = snprintf(buf, sizeof(buf), "example.org!user.u%zu", i);
+                add_key(buf, len);
+        }
+
+        for (i = 0; i < 256; i++) {
+                buf[0] = 'x';
+                buf[1] = i;
+                add_key(buf, 2);
+        }
+
+        for (i = 0; i < 40; i++) {
+                buf[0] = 'y';
+                buf[1] = 255 - i * 3;
+                add_key(buf, 2);
+        }
+
+        for (i = 0; i < 10; i++) {
+                buf[0] = 'z';
+                buf[1] = i * 7;
+                add_key(buf, 2);
+        }
+
+        /* Paths deeper than an iterator keeps the nodes of */
+        for (i = 1; i <= 40; i++) {
+                memset(buf, 'c', i);
+                add_key(buf, i);
+                buf[i] = 'b';
+                add_key(buf, i + 1);
+                memset(buf, 0xff, i);
+                add_key(buf, i);
+        }
+
+        qsort(keys, numkeys, sizeof(struct testkey), testkey_cmp);
+}
+
+/* The first key from `probe` on, or NULL */
+static const struct testkey *lower_bound(const struct testkey *probe)
+{
+        size_t i;
+
+        for (i = 0; i < numkeys; i++)
+                if (testkey_cmp(&keys[i], probe) >= 0)
+                        return &keys[i];
+
+        return NULL;
+}
+
+static size_t make_val(char *buf, size_t i, size_t pad)
+{
+        return snprintf(buf, MAXKEYLEN, "%zu%.*s", i, (int)pad,
+                        "................................");
+}
+
+/* fill_table():
+ * Upserts all the keys, in a jumbled order, each with its index as its
+ * value.
+ */
+static struct memtable *fill_table(enum memtable_type type)
+{
+        struct memtable *table;
+        char val[MAXKEYLEN];
+        size_t i, k, vallen;
+
+        table = memtable_new(type, NULL);
+        ck_assert(table != NULL);
+
+        for (i = 0; i < numkeys; i++) {
+                k = (i * 7919) % numkeys;
+                vallen = make_val(val, k, 0);
+                ck_assert_int_eq(memtable_upsert(table, keys[k].key,
+                                                 keys[k].keylen,
+                                                 (unsigned char *)val,
+                                                 vallen, 0),
+                                 MEMTREE_OK);
+        }
+
+        ck_assert_int_eq(memtable_count(table), numkeys);
+
+        return table;
+}
+
+/* check_table():
+ * Iterates over the table, which has to have all the keys, in order, with
+ * values of their index, padded by `pad` for every `step`th key.
+ */
+static void check_table(struct memtable *table, size_t step, size_t pad)
+{
+        memtable_iter_t iter;
+        char val[MAXKEYLEN];
+        size_t i = 0, vallen;
+
+        memtable_begin(table, iter);
+        while (memtable_next(iter)) {
+                ck_assert(i < numkeys);
+                ck_assert_int_eq(iter->record->keylen, keys[i].keylen);
+                ck_assert_mem_eq(iter->record->key, keys[i].key,
+                                 keys[i].keylen);
+
+                vallen = make_val(val, i, step && i % step == 0 ? pad : 0);
+                ck_assert_int_eq(iter->record->vallen, vallen);
+                ck_assert_mem_eq(iter->record->val, val, vallen);
+                ck_assert_int_eq(iter->record->deleted,
+                                 step && i % step == 0 && pad == 0);
+                i++;
+        }
+
+        ck_assert_int_eq(i, numkeys);
+}
+
+static int count_record(struct record *record _unused_, void *data)
+{
+        (*(size_t *)data)++;
+        return 1;
+}
+
+static void check_order(enum memtable_type type)
+{
+        struct memtable *table;
+        size_t count = 0;
+
+        make_keys();
+        table = fill_table(type);
+
+        check_table(table, 0, 0);
+
+        memtable_walk_forward(table, count_record, &count);
+        ck_assert_int_eq(count, numkeys);
+
+        memtable_free(table);
+}
+
+START_TEST(test_memtable_order)
+{
+        check_order(MEMTABLE_BTREE);
+        check_order(MEMTABLE_ART);
+}
+END_TEST                        /* test_memtable_order */
+
+static void check_find(enum memtable_type type)
+{
+        struct memtable *table;
+        memtable_iter_t iter;
+        struct record *record;
+        struct testkey probe;
+        size_t i, j;
+
+        make_keys();
+        table = fill_table(type);
+
+        for (i = 0; i < numkeys; i++) {
+                record = memtable_find(table, keys[i].key, keys[i].keylen);
+                ck_assert(record != NULL);
+                ck_assert_int_eq(record->keylen, keys[i].keylen);
+                ck_assert_mem_eq(record->key, keys[i].key, keys[i].keylen);
+
+                ck_assert_int_eq(memtable_seek(table, keys[i].key,
+                                               keys[i].keylen, iter), 1);
+                ck_assert(iter->record == record);
+
+                /* Keys that aren't in the table, next to this one */
+                for (j = 0; j < 3; j++) {
+                        const struct testkey *next;
+
+                        probe = keys[i];
+                        if (j == 0) {
+                                probe.key[probe.keylen++] = '\0';
+                        } else if (j == 1 && probe.keylen &&
+                                   probe.key[probe.keylen - 1]) {
+                                probe.key[probe.keylen - 1]--;
+                                probe.key[probe.keylen++] = '\xff';
+                        } else if (j == 2 && probe.keylen) {
+                                probe.keylen--;
+                        } else {
+                                continue;
+                        }
+
+                        if (bsearch(&probe, keys, numkeys,
+                                    sizeof(struct testkey), testkey_cmp))
+                                continue;
+
+                        ck_assert(memtable_find(table, probe.key,
+                                                probe.keylen) == NULL);
+                        ck_assert_int_eq(memtable_seek(table, probe.key,
+                                                       probe.keylen, iter),
+                                         0);
+                        next = lower_bound(&probe);
+                        if (!next) {
+                                ck_assert(iter->record == NULL);
+                                continue;
+                        }
+                        ck_assert(iter->record != NULL);
+                        ck_assert_int_eq(iter->record->keylen, next->keylen);
+                        ck_assert_mem_eq(iter->record->key, next->key,
+                                         next->keylen);
+                }
+        }
+
+        /* Seek, and go on from there */
+        i = numkeys / 3;
+        memtable_seek(table, keys[i].key, keys[i].keylen, iter);
+        while (memtable_next(iter)) {
+                ck_assert_int_eq(iter->record->keylen, keys[i].keylen);
+                ck_assert_mem_eq(iter->record->key, keys[i].key,
+                                 keys[i].keylen);
+                i++;
+        }
+        ck_assert_int_eq(i, numkeys);
+
+        /* Past the end */
+        memset(probe.key, 0xff, 41);
+        ck_assert_int_eq(memtable_seek(table, probe.key, 41, iter), 0);
+        ck_assert(iter->record == NULL);
+        ck_assert_int_eq(memtable_next(iter), 0);
+
+        memtable_free(table);
+}
+
+START_TEST(test_memtable_find)
+{
+        check_find(MEMTABLE_BTREE);
+        check_find(MEMTABLE_ART);
+}
+END_TEST                        /* test_memtable_find */
+
+static void check_upsert(enum memtable_type type)
+{
+        struct memtable *table;
+        char val[MAXKEYLEN];
+        size_t i, vallen, size;
+
+        make_keys();
+        table = fill_table(type);
+        size = memtable_size(table);
+
+        /* Values that don't fit where they were, and then ones that do */
+        for (i = 0; i < numkeys; i += 3) {
+                vallen = make_val(val, i, 32);
+                memtable_upsert(table, keys[i].key, keys[i].keylen,
+                                (unsigned char *)val, vallen, 0);
+        }
+        ck_assert_int_eq(memtable_count(table), numkeys);
+        ck_assert(memtable_size(table) > size);
+        check_table(table, 3, 32);
+
+        for (i = 0; i < numkeys; i += 3) {
+                vallen = make_val(val, i, 0);
+                memtable_upsert(table, keys[i].key, keys[i].keylen,
+                                (unsigned char *)val, vallen, 1);
+        }
+        ck_assert_int_eq(memtable_count(table), numkeys);
+        ck_assert_int_eq(memtable_size(table), size);
+        check_table(table, 3, 0);
+
+        memtable_free(table);
+}
+
+START_TEST(test_memtable_upsert)
+{
+        check_upsert(MEMTABLE_BTREE);
+        check_upsert(MEMTABLE_ART);
+}
+END_TEST                        /* test_memtable_upsert */
+
+START_TEST(test_memtable_art_search)
+{
+        struct memtable *table;
+
+        table = memtable_new(MEMTABLE_ART, memtree_memcmp_natural);
+        ck_assert(table == NULL);
+
+        table = memtable_new(MEMTABLE_ART, memtree_memcmp_raw);
+        ck_assert(table != NULL);
+        ck_assert_int_eq(memtable_count(table), 0);
+        memtable_free(table);
+}
+END_TEST                        /* test_memtable_art_search */
+
+Suite *memtable_suite(void)
+{
+        Suite *s;
+        TCase *tc_core;
+
+        s = suite_create("memtable");
+
+        /* core */
+        tc_core = tcase_create("core");
+
+        tcase_add_test(tc_core, test_memtable_order);
+        tcase_add_test(tc_core, test_memtable_find);
+        tcase_add_test(tc_core, test_memtable_upsert);
+        tcase_add_test(tc_core, test_memtable_art_search);
+
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
@@ -31,6 +31,7 @@ static void teardown(void)
 START_TEST(test_memtree_create)
 {
         ck_assert_int_eq(tree->count, 0);
+        ck_assert_int_eq(tree->size, 0);
 }
 END_TEST                        /* test_memtree_create */
 
@@ -62,6 +63,7 @@ START_TEST(test_memtree_insert_duplicate_record)
         struct record *trec;
         int i, ret;
         memtree_iter_t iter;
+        size_t size;
 
         for (i = 0; i < NUMRECS; i++) {
                 char key[10], val[10];
@@ -89,10 +91,12 @@ START_TEST(test_memtree_insert_duplicate_record)
         ck_assert_int_eq(ret, MEMTREE_DUPLICATE);
 
         /* Replace the record */
+        size = tree->size;
         ret = memtree_replace(tree, trec);
         ck_assert_int_eq(ret, MEMTREE_OK);
 
         ck_assert_int_eq(tree->count, NUMRECS);
+        ck_assert_int_eq(tree->size, size + strlen("newval2") - strlen("val2"));
 
         /* Ensure value is is the new value */
         memset(&iter, 0, sizeof(memtree_iter_t));
@@ -145,6 +149,68 @@ struct mboxkvrec {
 #define ck_assert_mem_eq(a,b,c) assert(0 == memcmp(a,b,c))
 #endif
 
+START_TEST(test_memtree_upsert)
+{
+        struct record *rec;
+        unsigned char bigval[1000];
+        memtree_iter_t iter;
+        size_t size;
+        int i, ret;
+
+        for (i = 0; i < NUMRECS; i++) {
+                char key[10], val[10];
+
+                sprintf(key, "key%d", i);
+                sprintf(val, "val%d", i);
+
+                ret = memtree_upsert(tree, (const unsigned char *)key,
+                                     strlen(key), (const unsigned char *)val,
+                                     strlen(val), 0);
+                ck_assert_int_eq(ret, MEMTREE_OK);
+        }
+        ck_assert_int_eq(tree->count, NUMRECS);
+
+        memset(&iter, 0, sizeof(memtree_iter_t));
+        ret = memtree_find(tree, (const unsigned char *)"key2",
+                           strlen("key2"), iter);
+        ck_assert_int_eq(ret, 1);
+        rec = iter->record;
+
+        /* A value that fits is overwritten in the same record */
+        size = tree->size;
+        ret = memtree_upsert(tree, (const unsigned char *)"key2",
+                             strlen("key2"), (const unsigned char *)"VAL2", 4, 0);
+        ck_assert_int_eq(ret, MEMTREE_OK);
+        ck_assert_int_eq(tree->count, NUMRECS);
+        ck_assert_int_eq(tree->size, size);
+
+        memset(&iter, 0, sizeof(memtree_iter_t));
+        ret = memtree_find(tree, (const unsigned char *)"key2",
+                           strlen("key2"), iter);
+        ck_assert_int_eq(ret, 1);
+        ck_assert(iter->record == rec);
+        ck_assert_int_eq(iter->record->vallen, 4);
+        ck_assert_mem_eq(iter->record->val, "VAL2", 4);
+
+        /* One that doesn't gets a new record */
+        memset(bigval, 'x', sizeof(bigval));
+        size = tree->size;
+        ret = memtree_upsert(tree, (const unsigned char *)"key2",
+                             strlen("key2"), bigval, sizeof(bigval), 1);
+        ck_assert_int_eq(ret, MEMTREE_OK);
+        ck_assert_int_eq(tree->count, NUMRECS);
+        ck_assert_int_eq(tree->size, size + sizeof(bigval) - strlen("VAL2"));
+
+        memset(&iter, 0, sizeof(memtree_iter_t));
+        ret = memtree_find(tree, (const unsigned char *)"key2",
+                           strlen("key2"), iter);
+        ck_assert_int_eq(ret, 1);
+        ck_assert_int_eq(iter->record->vallen, sizeof(bigval));
+        ck_assert_mem_eq(iter->record->val, bigval, sizeof(bigval));
+        ck_assert_int_eq(iter->record->deleted, 1);
+}
+END_TEST                        /* test_memtree_upsert */
+
 START_TEST(test_memtree_mbox_name)
 {
         size_t i;
@@ -210,6 +276,367 @@ START_TEST(test_memtree_iter)
 }
 END_TEST                        /* test_memtree_iter */
 
+START_TEST(test_memtree_arena_records)
+{
+        int i, ret, count = 0;
+        memtree_iter_t iter;
+
+        /* Enough records for the tree to be a few levels deep, with values
+         * of a few size classes, and some too big for the arena's chunks */
+        for (i = 0; i < 5000; i++) {
+                char key[16];
+                unsigned char *val;
+                size_t vallen = (i % 7 == 0) ? 20000 : (size_t)(i % 300);
+                struct record *rec;
+
+                sprintf(key, "key%05d", i);
+                val = xmalloc(vallen + 1);
+                memset(val, 'a' + i % 26, vallen);
+
+                rec = memtree_record_new(tree, (const unsigned char *)key,
+                                         strlen(key), val, vallen, 0);
+                ck_assert_int_eq(rec->inarena, 1);
+                ret = memtree_insert(tree, rec);
+                ck_assert_int_eq(ret, MEMTREE_OK);
+                xfree(val);
+        }
+        ck_assert_int_eq(tree->count, 5000);
+
+        /* Replace every other record with a shorter value */
+        for (i = 0; i < 5000; i += 2) {
+                char key[16];
+                struct record *rec;
+
+                sprintf(key, "key%05d", i);
+                rec = memtree_record_new(tree, (const unsigned char *)key,
+                                         strlen(key),
+                                         (const unsigned char *)"new", 3, 0);
+                ret = memtree_replace(tree, rec);
+                ck_assert_int_eq(ret, MEMTREE_OK);
+        }
+        ck_assert_int_eq(tree->count, 5000);
+
+        /* And remove every fifth */
+        for (i = 0; i < 5000; i += 5) {
+                char key[16];
+
+                sprintf(key, "key%05d", i);
+                ret = memtree_remove(tree, (unsigned char *)key, strlen(key));
+                ck_assert_int_eq(ret, MEMTREE_OK);
+        }
+        ck_assert_int_eq(tree->count, 4000);
+
+        memset(&iter, 0, sizeof(memtree_iter_t));
+        for (memtree_begin(tree, iter); memtree_next(iter);) {
+                char key[16];
+                int n;
+
+                while (count % 5 == 0)
+                        count++;
+                n = count++;
+
+                sprintf(key, "key%05d", n);
+                ck_assert_int_eq(iter->record->keylen, strlen(key));
+                ck_assert_mem_eq(iter->record->key, key, strlen(key));
+                if (n % 2 == 0) {
+                        ck_assert_int_eq(iter->record->vallen, 3);
+                        ck_assert_mem_eq(iter->record->val, "new", 3);
+                } else {
+                        ck_assert_int_eq(iter->record->vallen,
+                                         (n % 7 == 0) ? 20000 : n % 300);
+                }
+        }
+        ck_assert_int_eq(count, 5000);
+}
+END_TEST                        /* test_memtree_arena_records */
+
+/* Keys that only differ after a long shared prefix, and by embedded NULs
+ * and their length, which the search of each node has to get right */
+static size_t prefix_key(unsigned char *key, int i)
+{
+        static const char common[] = "user.shared.mailbox/";
+        size_t len = sizeof(common) - 1;
+
+        memcpy(key, common, len);
+        key[len++] = (i >> 8) & 0xff;
+        key[len++] = i & 0xff;
+        memset(key + len, 0, i % 11);
+        len += i % 11;
+        if (i % 3 == 0)
+                key[len++] = 'x';
+
+        return len;
+}
+
+/* And some shorter than the prefix, or the same as it */
+static const char *shortkeys[] = {
+        "\0", "user", "user.shared.mailbox", "user.shared.mailbox/", "zzz",
+};
+
+/* Checks the tree is in order, and that the keys are found, but for every
+ * `step`th, which was removed */
+static void check_prefix_keys(int step)
+{
+        unsigned char key[64], prev[64];
+        size_t i, len, prevlen = 0;
+        unsigned int count = 0;
+        memtree_iter_t iter;
+        int ret;
+
+        memset(&iter, 0, sizeof(memtree_iter_t));
+        for (memtree_begin(tree, iter); memtree_next(iter);) {
+                if (count)
+                        ck_assert(memcmp_raw(prev, prevlen,
+                                             iter->record->key,
+                                             iter->record->keylen) < 0);
+                memcpy(prev, iter->record->key, iter->record->keylen);
+                prevlen = iter->record->keylen;
+                count++;
+        }
+        ck_assert_int_eq(count, tree->count);
+
+        for (i = 0; i < 3000; i++) {
+                len = prefix_key(key, i);
+                memset(&iter, 0, sizeof(memtree_iter_t));
+                ret = memtree_find(tree, key, len, iter);
+                ck_assert_int_eq(ret, step ? i % step != 0 : 1);
+        }
+
+        for (i = 0; i < ARRAY_SIZE(shortkeys); i++) {
+                len = i ? strlen(shortkeys[i]) : 1;
+                memset(&iter, 0, sizeof(memtree_iter_t));
+                ret = memtree_find(tree, (const unsigned char *)shortkeys[i],
+                                   len, iter);
+                ck_assert_int_eq(ret, 1);
+        }
+
+        /* Keys that aren't there, before and after all of them */
+        memset(&iter, 0, sizeof(memtree_iter_t));
+        ck_assert_int_eq(memtree_find(tree, (const unsigned char *)"user.",
+                                      5, iter), 0);
+        memset(&iter, 0, sizeof(memtree_iter_t));
+        ck_assert_int_eq(memtree_find(tree, (const unsigned char *)"user.zz",
+                                      7, iter), 0);
+}
+
+START_TEST(test_memtree_shared_prefix)
+{
+        unsigned char key[64];
+        size_t i, len;
+        int ret;
+
+        /* Not in order, so that nodes are split all over */
+        for (i = 0; i < 3000; i++) {
+                len = prefix_key(key, (i * 1237) % 3000);
+                ret = memtree_upsert(tree, key, len,
+                                     (const unsigned char *)"v", 1, 0);
+                ck_assert_int_eq(ret, MEMTREE_OK);
+        }
+
+        for (i = 0; i < ARRAY_SIZE(shortkeys); i++) {
+                len = i ? strlen(shortkeys[i]) : 1;
+                ret = memtree_upsert(tree, (const unsigned char *)shortkeys[i],
+                                     len, (const unsigned char *)"v", 1, 0);
+                ck_assert_int_eq(ret, MEMTREE_OK);
+        }
+        ck_assert_int_eq(tree->count, 3000 + ARRAY_SIZE(shortkeys));
+        check_prefix_keys(0);
+
+        /* Taking records out combines and rebalances nodes */
+        for (i = 0; i < 3000; i += 4) {
+                len = prefix_key(key, i);
+                ret = memtree_remove(tree, key, len);
+                ck_assert_int_eq(ret, MEMTREE_OK);
+        }
+        check_prefix_keys(4);
+}
+END_TEST                        /* test_memtree_shared_prefix */
+
+START_TEST(test_memtree_bulk_load)
+{
+        const size_t sizes[] = {
+                1, MEMTREE_MAX_ELEMENTS, MEMTREE_MAX_ELEMENTS + 1,
+                MEMTREE_MAX_ELEMENTS + 2,
+                (MEMTREE_MAX_ELEMENTS + 1) * (MEMTREE_MAX_ELEMENTS + 1) - 1,
+                (MEMTREE_MAX_ELEMENTS + 1) * (MEMTREE_MAX_ELEMENTS + 1),
+        };
+        struct record **recs;
+        memtree_iter_t iter;
+        size_t i, n = 0;
+        int ret, count = 0;
+
+        /* Three runs, each sorted, where the later ones have some of the
+         * keys of the earlier ones again, and the last key is deleted */
+        recs = xmalloc(9000 * sizeof(struct record *));
+        for (i = 0; i < 5000; i++) {
+                char key[16];
+
+                sprintf(key, "key%05zu", i);
+                recs[n++] = memtree_record_new(tree, (const unsigned char *)key,
+                                               strlen(key),
+                                               (const unsigned char *)"old", 3, 0);
+        }
+        for (i = 0; i < 5000; i += 2) {
+                char key[16];
+
+                sprintf(key, "key%05zu", i);
+                recs[n++] = memtree_record_new(tree, (const unsigned char *)key,
+                                               strlen(key),
+                                               (const unsigned char *)"new", 3, 0);
+        }
+        for (i = 4000; i < 5500; i++) {
+                char key[16];
+
+                sprintf(key, "key%05zu", i);
+                recs[n++] = memtree_record_new(tree, (const unsigned char *)key,
+                                               strlen(key),
+                                               (const unsigned char *)"last", 4,
+                                               i == 5499);
+        }
+
+        ret = memtree_bulk_load(tree, recs, n);
+        ck_assert_int_eq(ret, MEMTREE_OK);
+        ck_assert_int_eq(tree->count, 5500);
+        xfree(recs);
+
+        memset(&iter, 0, sizeof(memtree_iter_t));
+        for (memtree_begin(tree, iter); memtree_next(iter); count++) {
+                char key[16];
+                const char *val = count >= 4000 ? "last" :
+                        count % 2 ? "old" : "new";
+
+                sprintf(key, "key%05d", count);
+                ck_assert_int_eq(iter->record->keylen, strlen(key));
+                ck_assert_mem_eq(iter->record->key, key, strlen(key));
+                ck_assert_int_eq(iter->record->vallen, strlen(val));
+                ck_assert_mem_eq(iter->record->val, val, strlen(val));
+                ck_assert_int_eq(iter->record->deleted, count == 5499);
+        }
+        ck_assert_int_eq(count, 5500);
+
+        /* It is a tree like any other after */
+        for (i = 0; i < 5500; i += 3) {
+                char key[16];
+
+                sprintf(key, "key%05zu", i);
+                ret = memtree_remove(tree, (unsigned char *)key, strlen(key));
+                ck_assert_int_eq(ret, MEMTREE_OK);
+        }
+        ret = memtree_upsert(tree, (const unsigned char *)"key00000a", 9,
+                             (const unsigned char *)"v", 1, 0);
+        ck_assert_int_eq(ret, MEMTREE_OK);
+        ck_assert_int_eq(tree->count, 5500 - 1834 + 1);
+
+        for (i = 0; i < 5500; i++) {
+                char key[16];
+
+                sprintf(key, "key%05zu", i);
+                memset(&iter, 0, sizeof(memtree_iter_t));
+                ret = memtree_find(tree, (const unsigned char *)key,
+                                   strlen(key), iter);
+                ck_assert_int_eq(ret, i % 3 != 0);
+        }
+
+        /* Only an empty tree is built */
+        recs = xmalloc(sizeof(struct record *));
+        recs[0] = memtree_record_new(tree, (const unsigned char *)"k", 1,
+                                     (const unsigned char *)"v", 1, 0);
+        ck_assert_int_eq(memtree_bulk_load(tree, recs, 1), MEMTREE_INVALID);
+        xfree(recs);            /* The record goes with the tree's arena */
+
+        /* Around where another node, or level, is needed */
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+                struct memtree *t = memtree_new(NULL, NULL);
+                size_t j;
+
+                recs = xmalloc(sizes[i] * sizeof(struct record *));
+                for (j = 0; j < sizes[i]; j++) {
+                        char key[16];
+
+                        /* In two runs */
+                        sprintf(key, "key%05zu", (j + sizes[i] / 2) % sizes[i]);
+                        recs[j] = memtree_record_new(t,
+                                                     (const unsigned char *)key,
+                                                     strlen(key),
+                                                     (const unsigned char *)"v",
+                                                     1, 0);
+                }
+
+                ret = memtree_bulk_load(t, recs, sizes[i]);
+                ck_assert_int_eq(ret, MEMTREE_OK);
+                xfree(recs);
+
+                count = 0;
+                memset(&iter, 0, sizeof(memtree_iter_t));
+                for (memtree_begin(t, iter); memtree_next(iter); count++) {
+                        char key[16];
+
+                        sprintf(key, "key%05d", count);
+                        ck_assert_mem_eq(iter->record->key, key, strlen(key));
+                }
+                ck_assert_int_eq(count, sizes[i]);
+
+                for (j = 0; j < sizes[i]; j++) {
+                        char key[16];
+
+                        sprintf(key, "key%05zu", j);
+                        ret = memtree_remove(t, (unsigned char *)key,
+                                             strlen(key));
+                        ck_assert_int_eq(ret, MEMTREE_OK);
+                }
+                ck_assert_int_eq(t->count, 0);
+
+                memtree_free(t);
+        }
+}
+END_TEST                        /* test_memtree_bulk_load */
+
+START_TEST(test_memtree_loader)
+{
+        struct memtree_loader loader;
+        memtree_iter_t iter;
+        int i, ret, count = 0;
+
+        /* In order, and then in too many runs to merge, with the keys
+         * coming again, for the later ones to win */
+        memtree_loader_init(&loader, tree);
+        for (i = 0; i < 3000; i++) {
+                char key[16], val[16];
+                int k = i < 1000 ? i : (i * 1237) % 2000;
+
+                sprintf(key, "key%05d", k);
+                sprintf(val, "val%d", i);
+                ret = memtree_loader_add(&loader, (const unsigned char *)key,
+                                         strlen(key),
+                                         (const unsigned char *)val,
+                                         strlen(val), 0);
+                ck_assert_int_eq(ret, MEMTREE_OK);
+        }
+        ck_assert_int_eq(loader.direct, 1);
+        ret = memtree_loader_finish(&loader);
+        ck_assert_int_eq(ret, MEMTREE_OK);
+        ck_assert_int_eq(tree->count, 2000);
+
+        memset(&iter, 0, sizeof(memtree_iter_t));
+        for (memtree_begin(tree, iter); memtree_next(iter); count++) {
+                char key[16], val[16];
+                /* The i from 1000 on, for which (i * 1237) % 2000 is
+                   `count`, as 173 * 1237 % 2000 is 1 */
+                int last = (count * 173) % 2000;
+
+                if (last < 1000)
+                        last += 2000;
+
+                sprintf(key, "key%05d", count);
+                sprintf(val, "val%d", last);
+                ck_assert_mem_eq(iter->record->key, key, strlen(key));
+                ck_assert_int_eq(iter->record->vallen, strlen(val));
+                ck_assert_mem_eq(iter->record->val, val, strlen(val));
+        }
+        ck_assert_int_eq(count, 2000);
+}
+END_TEST                        /* test_memtree_loader */
+
 Suite *memtree_suite(void)
 {
         Suite *s;
@@ -226,6 +653,7 @@ Suite *memtree_suite(void)
         tcase_add_test(tc_core, test_memtree_create);
         tcase_add_test(tc_core, test_memtree_insert_records);
         tcase_add_test(tc_core, test_memtree_insert_duplicate_record);
+        tcase_add_test(tc_core, test_memtree_upsert);
 
         suite_add_tcase(s, tc_core);
 
@@ -242,6 +670,10 @@ Suite *memtree_suite(void)
         tcase_add_checked_fixture(tc_iter, setup, teardown);
 
         tcase_add_test(tc_iter, test_memtree_iter);
+        tcase_add_test(tc_iter, test_memtree_arena_records);
+        tcase_add_test(tc_iter, test_memtree_shared_prefix);
+        tcase_add_test(tc_iter, test_memtree_bulk_load);
+        tcase_add_test(tc_iter, test_memtree_loader);
 
         suite_add_tcase(s, tc_iter);
 
@@ -13,12 +13,16 @@
 #include <libzeroskip/util.h>
 
 #include <assert.h>
+#include <dirent.h>
 #include <error.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <check.h>
 
 #if CHECK_MINOR_VERSION < 11
@@ -96,6 +100,9 @@ static struct kvrecs kvforeachchanges[] = {
 struct zsdb *db = NULL;
 static char *basedir = NULL;
 
+/* Whether reopen_db() opens the db with nocase_cmp() */
+static int reopen_nocase = 0;
+
 static char *get_basedir(void)
 {
         const char *tmpdir;
@@ -139,6 +146,7 @@ static void teardown(void)
         zsdb_final(&db);
         recursive_rm(basedir);
         free(basedir);
+        reopen_nocase = 0;
 }
 
 static int record_count = 0;
@@ -218,8 +226,18 @@ START_TEST(test_abort_transaction)
         ret = zsdb_abort(db, &txn);
         ck_assert_int_eq(ret, ZS_OK);
 
+        /* A transaction after the abort is committed with a CRC32 of only
+         * its own records */
+        zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_add(db, kvrecs2[0].k, kvrecs2[0].klen,
+                       kvrecs2[0].v, kvrecs2[0].vlen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_commit(db, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+
         /* Now close the DB and open again, and the db should contain only
-         * records from `kvrecsgen`.
+         * records from `kvrecsgen`, and the one added after the abort.
          */
         ret = zsdb_close(db);
         ck_assert_int_eq(ret, ZS_OK);
@@ -235,7 +253,7 @@ START_TEST(test_abort_transaction)
         record_count = 0;
         ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
         ck_assert_int_eq(ret, ZS_OK);
-        ck_assert_int_eq(record_count, ARRAY_SIZE(kvrecsgen));
+        ck_assert_int_eq(record_count, ARRAY_SIZE(kvrecsgen) + 1);
 }
 END_TEST
 
@@ -802,6 +820,1676 @@ START_TEST(test_fetchnext_simple)
 }
 END_TEST
 
+/* Keys that only differ in case are the same key */
+static int nocase_cmp(const unsigned char *s1, size_t l1,
+                      const unsigned char *s2, size_t l2)
+{
+        int ret = strncasecmp((const char *)s1, (const char *)s2,
+                              l1 < l2 ? l1 : l2);
+
+        return ret ? ret : (l1 > l2) - (l1 < l2);
+}
+
+static memtree_memcmp_fn(
+        nocase,
+        size_t min = keylen < blen ? keylen : blen,
+        strncasecmp((const char *)k, (const char *)b, min)
+        )
+
+static void reopen_db(int mode)
+{
+        int ret;
+
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db);
+
+        if (reopen_nocase) {
+                ret = zsdb_init(&db, nocase_cmp, memtree_memcmp_nocase);
+                mode |= MODE_CUSTOMSEARCH;
+        } else
+                ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, mode);
+        ck_assert_int_eq(ret, ZS_OK);
+}
+
+/* Add `recs` to the db, in two finalised files, pack them, and reopen the
+ * db with `mode`, so that the records are only in a packed file.
+ */
+static void add_pack_and_reopen(struct kvrecs *recs, size_t nrecs, int mode)
+{
+        struct zsdb_txn *txn = NULL;
+        size_t i;
+        int ret;
+
+        /* Begin transaction */
+        ret = zsdb_transaction_begin(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* Acquire write lock */
+        zsdb_write_lock_acquire(db, 0);
+
+        for (i = 0; i < nrecs; i++) {
+                ret = zsdb_add(db, recs[i].k, recs[i].klen,
+                               recs[i].v, recs[i].vlen, &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                /* Finalise the active file, half way through and at the
+                 * end. A file packed from a single finalised file would
+                 * be read back as a finalised file.
+                 */
+                if (i == nrecs / 2 || i == nrecs - 1) {
+                        ret = zsdb_commit(db, &txn);
+                        ck_assert_int_eq(ret, ZS_OK);
+
+                        ret = zsdb_finalise(db);
+                        ck_assert_int_eq(ret, ZS_OK);
+                }
+        }
+
+        /* Release write lock */
+        zsdb_write_lock_release(db);
+
+        zsdb_transaction_end(&txn);
+
+        /* Pack the finalised files */
+        reopen_db(MODE_CREATE);
+
+        ret = zsdb_pack_lock_acquire(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_repack(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_pack_lock_release(db);
+
+        reopen_db(mode);
+}
+
+static ino_t dotzsdb_ino(void)
+{
+        char path[PATH_MAX];
+        struct stat sb;
+
+        snprintf(path, sizeof(path), "%s/.zsdb", basedir);
+        ck_assert_int_eq(stat(path, &sb), 0);
+
+        return sb.st_ino;
+}
+
+/* Append `len` zeroes to the db files, as a torn write would */
+static void append_zeroes(size_t len)
+{
+        char path[PATH_MAX];
+        struct dirent *de;
+        DIR *dir;
+
+        dir = opendir(basedir);
+        ck_assert(dir != NULL);
+
+        while ((de = readdir(dir)) != NULL) {
+                FILE *fp;
+                size_t i;
+
+                if (strncmp(de->d_name, "zeroskip-", 9) != 0)
+                        continue;
+
+                snprintf(path, sizeof(path), "%s/%s", basedir, de->d_name);
+                fp = fopen(path, "a");
+                ck_assert(fp != NULL);
+                for (i = 0; i < len; i++)
+                        fputc(0, fp);
+                fclose(fp);
+        }
+
+        closedir(dir);
+}
+
+/* The number of db files, and their total size */
+static size_t db_files(off_t *size)
+{
+        char path[PATH_MAX];
+        struct dirent *de;
+        size_t count = 0;
+        DIR *dir;
+
+        dir = opendir(basedir);
+        ck_assert(dir != NULL);
+
+        if (size)
+                *size = 0;
+
+        while ((de = readdir(dir)) != NULL) {
+                struct stat sb;
+
+                if (strncmp(de->d_name, "zeroskip-", 9) != 0)
+                        continue;
+
+                snprintf(path, sizeof(path), "%s/%s", basedir, de->d_name);
+                ck_assert_int_eq(stat(path, &sb), 0);
+                if (size)
+                        *size += sb.st_size;
+                count++;
+        }
+
+        closedir(dir);
+
+        return count;
+}
+
+START_TEST(test_preallocation)
+{
+        struct zsdb_txn *txn = NULL;
+        struct zsdb *db2 = NULL;
+        off_t size, trimmed;
+        int ret;
+
+        zsdb_write_lock_acquire(db, 0);
+
+        ret = zsdb_add(db, kvmultiopen[0].k, kvmultiopen[0].klen,
+                       kvmultiopen[0].v, kvmultiopen[0].vlen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_commit(db, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        db_files(&size);
+
+        /* Another instance doesn't read past the records into the space
+         * the file was grown by */
+        ret = zsdb_init(&db2, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db2, basedir, MODE_RDWR);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        record_count = 0;
+        ret = zsdb_foreach(db2, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, 1);
+
+        ret = zsdb_close(db2);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db2);
+
+        /* Which is given back with the write lock */
+        zsdb_write_lock_release(db);
+        db_files(&trimmed);
+        ck_assert(trimmed < size);
+
+        /* A writer that died before it could, leaves zeroes. Records are
+         * appended over them. */
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        append_zeroes(4096);
+        zsdb_final(&db);
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_RDWR);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_add(db, kvmultiopen[1].k, kvmultiopen[1].klen,
+                       kvmultiopen[1].v, kvmultiopen[1].vlen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_commit(db, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+
+        reopen_db(MODE_RDWR);
+
+        record_count = 0;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, 2);
+
+        /* Nor are the zeroes finalised along with the records */
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        db_files(&size);
+        append_zeroes(4096);
+        zsdb_final(&db);
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_RDWR);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_add(db, kvmultiopen[2].k, kvmultiopen[2].klen,
+                       kvmultiopen[2].v, kvmultiopen[2].vlen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_finalise(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+        db_files(&trimmed);
+        ck_assert(trimmed < size + 4096);
+
+        reopen_db(MODE_RDWR);
+
+        record_count = 0;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, 3);
+
+        /* And a finalised file with zeroes in it is read up to them */
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        append_zeroes(4096);
+        zsdb_final(&db);
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_RDWR);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        record_count = 0;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, 3);
+}
+END_TEST
+
+START_TEST(test_finalise_threshold)
+{
+        struct zsdb_txn *txn = NULL;
+        size_t i;
+        int ret;
+
+        /* Never finalised by zsdb_add() */
+        ret = zsdb_finalise_threshold_set(db, 0, 0, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        zsdb_write_lock_acquire(db, 0);
+        for (i = 0; i < ARRAY_SIZE(kvrecsgen); i++) {
+                ret = zsdb_add(db, kvrecsgen[i].k, kvrecsgen[i].klen,
+                               kvrecsgen[i].v, kvrecsgen[i].vlen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ret = zsdb_commit(db, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
+        zsdb_write_lock_release(db);
+
+        ck_assert_int_eq(db_files(NULL), 1);
+
+        /* Finalised once it has 2 keys, before the third is added */
+        ret = zsdb_finalise_threshold_set(db, 0, 2, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        zsdb_write_lock_acquire(db, 0);
+        for (i = 0; i < ARRAY_SIZE(kvforeachchanges); i++) {
+                ret = zsdb_add(db, kvforeachchanges[i].k,
+                               kvforeachchanges[i].klen,
+                               kvforeachchanges[i].v,
+                               kvforeachchanges[i].vlen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ret = zsdb_commit(db, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
+        zsdb_write_lock_release(db);
+
+        /* The file with kvrecsgen, and then three with two keys each,
+         * the last one still active */
+        ck_assert_int_eq(db_files(NULL), 4);
+
+        reopen_db(MODE_RDWR);
+
+        record_count = 0;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count,
+                         ARRAY_SIZE(kvrecsgen) + ARRAY_SIZE(kvforeachchanges));
+}
+END_TEST
+
+START_TEST(test_write_batch)
+{
+        struct zsdb_write_batch *batch = NULL;
+        struct zsdb_txn *txn = NULL;
+        const unsigned char *value;
+        size_t vallen;
+        size_t i;
+        int ret;
+
+        ret = zsdb_write_batch_new(&batch);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        for (i = 0; i < ARRAY_SIZE(kvrecsgen); i++) {
+                ret = zsdb_write_batch_add(batch, kvrecsgen[i].k,
+                                           kvrecsgen[i].klen,
+                                           kvrecsgen[i].v,
+                                           kvrecsgen[i].vlen);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
+
+        /* The last change to a key wins */
+        ret = zsdb_write_batch_add(batch, (const unsigned char *)"foo", 3,
+                                   (const unsigned char *)"baz", 3);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_write_batch_remove(batch, (const unsigned char *)"abc", 3);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(zsdb_write_batch_count(batch),
+                         ARRAY_SIZE(kvrecsgen) + 2);
+
+        /* Needs the write lock */
+        ret = zsdb_write_batch_apply(db, batch);
+        ck_assert_int_eq(ret, ZS_ERROR);
+
+        zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_write_batch_apply(db, batch);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+
+        ret = zsdb_fetch(db, (const unsigned char *)"foo", 3,
+                         &value, &vallen, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert(memcmp(value, "baz", vallen) == 0);
+
+        /* An emptied batch can be reused */
+        zsdb_write_batch_clear(batch);
+        ck_assert_int_eq(zsdb_write_batch_count(batch), 0);
+        ret = zsdb_write_batch_add(batch, (const unsigned char *)"zzz", 3,
+                                   NULL, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_write_batch_apply(db, batch);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+
+        zsdb_write_batch_free(&batch);
+        ck_assert(batch == NULL);
+
+        /* It's all been committed */
+        reopen_db(MODE_RDWR);
+
+        ret = zsdb_fetch(db, (const unsigned char *)"foo", 3,
+                         &value, &vallen, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(vallen, 3);
+        ck_assert(memcmp(value, "baz", vallen) == 0);
+
+        ret = zsdb_fetch(db, (const unsigned char *)"abc", 3,
+                         &value, &vallen, &txn);
+        ck_assert_int_eq(ret, ZS_NOTFOUND);
+
+        ret = zsdb_fetch(db, (const unsigned char *)"zzz", 3,
+                         &value, &vallen, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(vallen, 0);
+
+        record_count = 0;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, ARRAY_SIZE(kvrecsgen));
+}
+END_TEST
+
+START_TEST(test_write_batch_custom_cmp)
+{
+        struct zsdb_write_batch *batch = NULL;
+        const unsigned char *value;
+        size_t vallen;
+        int ret;
+
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db);
+
+        ret = zsdb_init(&db, nocase_cmp, memtree_memcmp_nocase);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_CUSTOMSEARCH);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* The last change to a key wins, by the DB's idea of a key, even
+         * though "FOO" sorts before "foo" byte for byte */
+        ret = zsdb_write_batch_new(&batch);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_write_batch_add(batch, (const unsigned char *)"foo", 3,
+                                   (const unsigned char *)"bar", 3);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_write_batch_add(batch, (const unsigned char *)"FOO", 3,
+                                   (const unsigned char *)"baz", 3);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_write_batch_apply(db, batch);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+
+        ret = zsdb_fetch(db, (const unsigned char *)"Foo", 3,
+                         &value, &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(vallen, 3);
+        ck_assert(memcmp(value, "baz", vallen) == 0);
+
+        zsdb_write_batch_free(&batch);
+}
+END_TEST
+
+START_TEST(test_fast_commit)
+{
+        struct zsdb_txn *txn = NULL;
+        struct zsdb *db2 = NULL;
+        const unsigned char *value;
+        size_t vallen;
+        ino_t ino;
+        int ret;
+
+        reopen_db(MODE_FASTCOMMIT);
+        ino = dotzsdb_ino();
+
+        /* Two transactions */
+        zsdb_write_lock_acquire(db, 0);
+
+        ret = zsdb_add(db, kvmultiopen[0].k, kvmultiopen[0].klen,
+                       kvmultiopen[0].v, kvmultiopen[0].vlen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_commit(db, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        ret = zsdb_add(db, kvmultiopen[1].k, kvmultiopen[1].klen,
+                       kvmultiopen[1].v, kvmultiopen[1].vlen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_commit(db, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        zsdb_write_lock_release(db);
+
+        /* .zsdb wasn't rewritten */
+        ck_assert(dotzsdb_ino() == ino);
+
+        /* Another instance finds both commits */
+        ret = zsdb_init(&db2, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db2, basedir, MODE_FASTCOMMIT);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        ret = zsdb_fetch(db2, kvmultiopen[1].k, kvmultiopen[1].klen,
+                         &value, &vallen, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(vallen, kvmultiopen[1].vlen);
+        ck_assert_mem_eq(value, kvmultiopen[1].v, vallen);
+
+        ret = zsdb_close(db2);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db2);
+
+        /* Whatever follows the last commit is ignored, and then
+         * overwritten */
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        append_zeroes(64);
+        zsdb_final(&db);
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_FASTCOMMIT);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        record_count = 0;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, 2);
+
+        zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_add(db, kvmultiopen[2].k, kvmultiopen[2].klen,
+                       kvmultiopen[2].v, kvmultiopen[2].vlen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_commit(db, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+
+        reopen_db(MODE_FASTCOMMIT);
+
+        record_count = 0;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, ARRAY_SIZE(kvmultiopen));
+}
+END_TEST
+
+/* Adds kvmultiopen[`i`] to `d` and commits it */
+static void add_commit(struct zsdb *d, size_t i)
+{
+        int ret;
+
+        zsdb_write_lock_acquire(d, 0);
+        ret = zsdb_add(d, kvmultiopen[i].k, kvmultiopen[i].klen,
+                       kvmultiopen[i].v, kvmultiopen[i].vlen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_commit(d, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(d);
+}
+
+START_TEST(test_generation)
+{
+        struct zsdb *db2 = NULL;
+        const unsigned char *value;
+        char path[PATH_MAX];
+        struct stat sb;
+        size_t vallen;
+        ino_t ino;
+        int ret;
+
+        reopen_db(MODE_FASTCOMMIT);
+        ino = dotzsdb_ino();
+
+        snprintf(path, sizeof(path), "%s/.zsdb.gen", basedir);
+        ck_assert_int_eq(stat(path, &sb), 0);
+        ck_assert(sb.st_size < 4096);
+
+        ret = zsdb_init(&db2, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db2, basedir, MODE_FASTCOMMIT);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* .zsdb isn't rewritten, so the generation is all there is to
+         * tell the first handle to reload before it writes */
+        add_commit(db2, 0);
+        ck_assert(dotzsdb_ino() == ino);
+        add_commit(db, 2);
+
+        ret = zsdb_fetch(db, kvmultiopen[0].k, kvmultiopen[0].klen,
+                         &value, &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(vallen, kvmultiopen[0].vlen);
+        ck_assert_mem_eq(value, kvmultiopen[0].v, vallen);
+
+        ret = zsdb_close(db2);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db2);
+
+        /* A writer that can't map .zsdb.gen only rewrites .zsdb, and
+         * that is looked at whenever the write lock is held */
+        ck_assert_int_eq(unlink(path), 0);
+        ck_assert_int_eq(mkdir(path, 0755), 0);
+
+        ret = zsdb_init(&db2, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db2, basedir, MODE_RDWR);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        add_commit(db2, 1);
+        ck_assert(dotzsdb_ino() != ino);
+
+        add_commit(db, 2);
+
+        ret = zsdb_fetch(db, kvmultiopen[1].k, kvmultiopen[1].klen,
+                         &value, &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(vallen, kvmultiopen[1].vlen);
+        ck_assert_mem_eq(value, kvmultiopen[1].v, vallen);
+
+        ret = zsdb_close(db2);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db2);
+
+        ck_assert_int_eq(rmdir(path), 0);
+}
+END_TEST
+
+/* Whether every group commit numbered in .zsdb.gen has been synced. The
+ * control block starts with 4 64-bit words, the last two of them being the
+ * number of the last commit and of the last one synced.
+ */
+static int group_commits_synced(void)
+{
+        char path[PATH_MAX];
+        uint64_t words[4];
+        FILE *fp;
+
+        snprintf(path, sizeof(path), "%s/.zsdb.gen", basedir);
+        fp = fopen(path, "r");
+        ck_assert(fp != NULL);
+        ck_assert_int_eq(fread(words, sizeof(words), 1, fp), 1);
+        fclose(fp);
+
+        ck_assert(words[2] > 0);
+
+        return words[3] >= words[2];
+}
+
+START_TEST(test_group_commit)
+{
+        struct zsdb_txn *txn = NULL;
+        ino_t ino;
+        size_t i;
+        int ret;
+
+        /* Wait up to 10ms for someone else to sync */
+        ret = zsdb_group_commit_set(db, 10, 0, 2);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        ino = dotzsdb_ino();
+
+        zsdb_write_lock_acquire(db, 0);
+
+        for (i = 0; i < ARRAY_SIZE(kvmultiopen); i++) {
+                ret = zsdb_add(db, kvmultiopen[i].k, kvmultiopen[i].klen,
+                               kvmultiopen[i].v, kvmultiopen[i].vlen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ret = zsdb_commit(db, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                /* On disk as soon as the commit returns */
+                ck_assert(group_commits_synced());
+                ck_assert(zsdb_write_lock_is_locked(db));
+        }
+
+        ret = zsdb_write_lock_release(db);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* .zsdb wasn't rewritten for each commit */
+        ck_assert(dotzsdb_ino() == ino);
+
+        reopen_db(MODE_RDWR);
+
+        record_count = 0;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, ARRAY_SIZE(kvmultiopen));
+}
+END_TEST
+
+START_TEST(test_group_commit_shared)
+{
+        const unsigned char *value;
+        long long start;
+        size_t vallen;
+        pid_t pid;
+        int ret, status;
+
+        /* A long window, and a sync once there are two commits waiting */
+        ret = zsdb_group_commit_set(db, 10000, 0, 2);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        pid = fork();
+        ck_assert(pid >= 0);
+
+        if (pid == 0) {
+                struct zsdb *db2 = NULL;
+
+                /* Commits while the parent waits for a sync, and syncs
+                 * both */
+                sleep_ms(100);
+                if (zsdb_init(&db2, NULL, NULL) != ZS_OK ||
+                    zsdb_open(db2, basedir, MODE_RDWR) != ZS_OK ||
+                    zsdb_group_commit_set(db2, 10000, 0, 2) != ZS_OK)
+                        _exit(1);
+
+                zsdb_write_lock_acquire(db2, 0);
+                if (zsdb_add(db2, kvmultiopen[1].k, kvmultiopen[1].klen,
+                             kvmultiopen[1].v, kvmultiopen[1].vlen,
+                             NULL) != ZS_OK ||
+                    zsdb_commit(db2, NULL) != ZS_OK)
+                        _exit(1);
+                zsdb_write_lock_release(db2);
+
+                _exit(zsdb_close(db2) == ZS_OK ? 0 : 1);
+        }
+
+        start = time_in_ms();
+
+        zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_add(db, kvmultiopen[0].k, kvmultiopen[0].klen,
+                       kvmultiopen[0].v, kvmultiopen[0].vlen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_commit(db, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* Synced by the child, well before the window is over */
+        ck_assert(group_commits_synced());
+        ck_assert(time_in_ms() - start < 5000);
+
+        ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+        ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        /* And the child's commit was picked up */
+        ret = zsdb_fetch(db, kvmultiopen[1].k, kvmultiopen[1].klen,
+                         &value, &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(vallen, kvmultiopen[1].vlen);
+        ck_assert_mem_eq(value, kvmultiopen[1].v, vallen);
+
+        zsdb_write_lock_release(db);
+}
+END_TEST
+
+START_TEST(test_sync_levels)
+{
+        int modes[] = { MODE_SYNC_COMMIT, MODE_SYNC_NONE };
+        const unsigned char *value;
+        size_t vallen;
+        size_t i;
+        int ret;
+
+        for (i = 0; i < ARRAY_SIZE(modes); i++) {
+                reopen_db(modes[i]);
+
+                zsdb_write_lock_acquire(db, 0);
+                ret = zsdb_add(db, kvmultiopen[i].k, kvmultiopen[i].klen,
+                               kvmultiopen[i].v, kvmultiopen[i].vlen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ret = zsdb_commit(db, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                zsdb_write_lock_release(db);
+
+                reopen_db(MODE_RDWR);
+
+                ret = zsdb_fetch(db, kvmultiopen[i].k, kvmultiopen[i].klen,
+                                 &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(vallen, kvmultiopen[i].vlen);
+                ck_assert_mem_eq(value, kvmultiopen[i].v, vallen);
+        }
+}
+END_TEST
+
+START_TEST(test_pwrite_writes)
+{
+        int modes[] = { MODE_PWRITE, MODE_DIRECT, MODE_URING,
+                        MODE_URING | MODE_DIRECT };
+        struct zsdb_txn *txn = NULL;
+        struct zsdb *db2 = NULL;
+        const size_t BIGVAL_LEN = 3 * 1024 * 1024 / 2;
+        unsigned char *bigval;
+        const unsigned char *value;
+        size_t vallen;
+        off_t before, size;
+        size_t i, j;
+        int ret;
+
+        bigval = xmalloc(BIGVAL_LEN);
+        memset(bigval, 'x', BIGVAL_LEN);
+
+        for (i = 0; i < ARRAY_SIZE(modes); i++) {
+                reopen_db(modes[i]);
+                db_files(&before);
+
+                /* The big values would have it finalised */
+                ret = zsdb_finalise_threshold_set(db, 0, 0, 0);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                zsdb_write_lock_acquire(db, 0);
+                for (j = 0; j < ARRAY_SIZE(kvrecsgen); j++) {
+                        ret = zsdb_add(db, kvrecsgen[j].k, kvrecsgen[j].klen,
+                                       kvrecsgen[j].v, kvrecsgen[j].vlen,
+                                       NULL);
+                        ck_assert_int_eq(ret, ZS_OK);
+                }
+
+                /* Nothing is written before the commit */
+                db_files(&size);
+                ck_assert_int_eq(size, before);
+
+                ret = zsdb_commit(db, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                /* After which another instance can read it, with the write
+                 * lock still held */
+                ret = zsdb_init(&db2, NULL, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ret = zsdb_open(db2, basedir, MODE_RDWR);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                record_count = 0;
+                ret = zsdb_foreach(db2, NULL, 0, count_fe_p, NULL, NULL,
+                                   &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(record_count,
+                                 ARRAY_SIZE(kvrecsgen) + (i ? 2 : 0));
+
+                ret = zsdb_close(db2);
+                ck_assert_int_eq(ret, ZS_OK);
+                zsdb_final(&db2);
+
+                /* A transaction that doesn't fit in the write buffer */
+                ret = zsdb_add(db, (const unsigned char *)"big.a", 5,
+                               bigval, 8192, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ret = zsdb_add(db, (const unsigned char *)"big.b", 5,
+                               bigval, BIGVAL_LEN, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ret = zsdb_commit(db, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                zsdb_write_lock_release(db);
+
+                reopen_db(MODE_RDWR);
+
+                for (j = 0; j < ARRAY_SIZE(kvrecsgen); j++) {
+                        ret = zsdb_fetch(db, kvrecsgen[j].k,
+                                         kvrecsgen[j].klen,
+                                         &value, &vallen, NULL);
+                        ck_assert_int_eq(ret, ZS_OK);
+                        ck_assert_int_eq(vallen, kvrecsgen[j].vlen);
+                        ck_assert_mem_eq(value, kvrecsgen[j].v, vallen);
+                }
+
+                ret = zsdb_fetch(db, (const unsigned char *)"big.b", 5,
+                                 &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(vallen, BIGVAL_LEN);
+                ck_assert_mem_eq(value, bigval, vallen);
+        }
+
+        xfree(bigval);
+}
+END_TEST
+
+START_TEST(test_fetch_packed)
+{
+        size_t i;
+        int ret;
+        const unsigned char *value;
+        size_t vallen = 0;
+        const char *absent[] = { "0", "1230", "abc.nothing", "cherry", "zzz" };
+
+        add_pack_and_reopen(kvrecsgen, ARRAY_SIZE(kvrecsgen), MODE_CREATE);
+
+        for (i = 0; i < ARRAY_SIZE(kvrecsgen); i++) {
+                ret = zsdb_fetch(db, kvrecsgen[i].k, kvrecsgen[i].klen,
+                                 &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(vallen, kvrecsgen[i].vlen);
+                ck_assert_mem_eq(value, kvrecsgen[i].v, vallen);
+        }
+
+        for (i = 0; i < ARRAY_SIZE(absent); i++) {
+                ret = zsdb_fetch(db, (const unsigned char *)absent[i],
+                                 strlen(absent[i]), &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_NOTFOUND);
+        }
+}
+END_TEST
+
+/* Logs everything to `path`, and nothing once it is NULL */
+static void log_to(const char *path)
+{
+        if (path) {
+                setenv("ZS_LOG_LEVEL", "3", 1);
+                setenv("ZS_LOG_FILE", path, 1);
+        } else {
+                unsetenv("ZS_LOG_LEVEL");
+                unsetenv("ZS_LOG_FILE");
+        }
+}
+
+/* How many lines logged to `path` have `what` in them */
+static size_t log_count(const char *path, const char *what)
+{
+        char line[1024];
+        size_t count = 0;
+        FILE *fp;
+
+        fp = fopen(path, "r");
+        if (!fp)
+                return 0;
+
+        while (fgets(line, sizeof(line), fp))
+                if (strstr(line, what))
+                        count++;
+
+        fclose(fp);
+
+        return count;
+}
+
+START_TEST(test_fetch_packed_bloom)
+{
+        struct kvrecs *recs;
+        const unsigned char *value;
+        char logfile[PATH_MAX];
+        size_t i, NUM_RECS;
+        size_t vallen = 0;
+        int ret;
+
+        /* Not a multiple of 32 keys, so that the bits of the filter have
+         * to be rounded up to a whole number of words */
+        NUM_RECS = 60;
+
+        recs = xcalloc(NUM_RECS, sizeof(struct kvrecs));
+        for (i = 0; i < NUM_RECS; i++) {
+                char buf[32];
+
+                recs[i].klen = snprintf(buf, sizeof(buf), "key%05zu", i * 2);
+                recs[i].k = (unsigned char *)xstrdup(buf);
+                recs[i].vlen = snprintf(buf, sizeof(buf), "val%zu", i);
+                recs[i].v = (unsigned char *)xstrdup(buf);
+        }
+
+        add_pack_and_reopen(recs, NUM_RECS, MODE_CREATE);
+
+        snprintf(logfile, sizeof(logfile), "%s.log", basedir);
+        unlink(logfile);
+        log_to(logfile);
+
+        /* The packed file opens with its filter */
+        reopen_db(MODE_CREATE);
+        ck_assert_int_eq(log_count(logfile, "Invalid bloom filter"), 0);
+        ck_assert_int_eq(log_count(logfile, "No bloom filter"), 0);
+
+        /* Which keeps most of the keys that aren't there away from the
+         * file */
+        for (i = 0; i < NUM_RECS - 1; i++) {
+                char buf[32];
+                size_t len;
+
+                len = snprintf(buf, sizeof(buf), "key%05zu", i * 2 + 1);
+                ret = zsdb_fetch(db, (const unsigned char *)buf, len,
+                                 &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_NOTFOUND);
+        }
+        ck_assert(log_count(logfile, "Not in bloom filter") > NUM_RECS / 2);
+
+        log_to(NULL);
+        unlink(logfile);
+
+        for (i = 0; i < NUM_RECS; i++) {
+                ret = zsdb_fetch(db, recs[i].k, recs[i].klen,
+                                 &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(vallen, recs[i].vlen);
+                ck_assert_mem_eq(value, recs[i].v, vallen);
+
+                free((void *)recs[i].k);
+                free((void *)recs[i].v);
+        }
+        free(recs);
+}
+END_TEST
+
+START_TEST(test_fetch_packed_nocase)
+{
+        struct kvrecs *recs;
+        const unsigned char *value;
+        const unsigned char **keys, **values;
+        size_t *keylens, *vallens;
+        size_t i, NUM_RECS;
+        size_t vallen = 0;
+        int ret, *rc;
+
+        NUM_RECS = 64;
+
+        recs = xcalloc(NUM_RECS, sizeof(struct kvrecs));
+        for (i = 0; i < NUM_RECS; i++) {
+                char buf[32];
+
+                recs[i].klen = snprintf(buf, sizeof(buf), "key%05zu", i * 2);
+                recs[i].k = (unsigned char *)xstrdup(buf);
+                recs[i].vlen = snprintf(buf, sizeof(buf), "val%zu", i);
+                recs[i].v = (unsigned char *)xstrdup(buf);
+        }
+
+        reopen_nocase = 1;
+        reopen_db(MODE_CREATE);
+        add_pack_and_reopen(recs, NUM_RECS, MODE_CREATE);
+
+        /* The keys are found by what the comparator says, even though
+         * they hash differently */
+        for (i = 0; i < NUM_RECS; i++) {
+                char buf[32];
+                size_t len;
+
+                len = snprintf(buf, sizeof(buf), "KEY%05zu", i * 2);
+                ret = zsdb_fetch(db, (const unsigned char *)buf, len,
+                                 &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(vallen, recs[i].vlen);
+                ck_assert_mem_eq(value, recs[i].v, vallen);
+
+                len = snprintf(buf, sizeof(buf), "KEY%05zu", i * 2 + 1);
+                ret = zsdb_fetch(db, (const unsigned char *)buf, len,
+                                 &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_NOTFOUND);
+        }
+
+        /* And all at once */
+        keys = xcalloc(NUM_RECS, sizeof(*keys));
+        keylens = xcalloc(NUM_RECS, sizeof(*keylens));
+        values = xcalloc(NUM_RECS, sizeof(*values));
+        vallens = xcalloc(NUM_RECS, sizeof(*vallens));
+        rc = xcalloc(NUM_RECS, sizeof(*rc));
+        for (i = 0; i < NUM_RECS; i++) {
+                char buf[32];
+
+                keylens[i] = snprintf(buf, sizeof(buf), "KEY%05zu", i * 2);
+                keys[i] = (unsigned char *)xstrdup(buf);
+        }
+
+        ret = zsdb_fetch_multi(db, keys, keylens, NUM_RECS, values, vallens,
+                               rc, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        for (i = 0; i < NUM_RECS; i++) {
+                ck_assert_int_eq(rc[i], ZS_OK);
+                ck_assert_int_eq(vallens[i], recs[i].vlen);
+                ck_assert_mem_eq(values[i], recs[i].v, vallens[i]);
+                free((void *)keys[i]);
+        }
+        free(keys);
+        free(keylens);
+        free(values);
+        free(vallens);
+        free(rc);
+
+        for (i = 0; i < NUM_RECS; i++) {
+                free((void *)recs[i].k);
+                free((void *)recs[i].v);
+        }
+        free(recs);
+}
+END_TEST
+
+START_TEST(test_fetch_packed_fence_index)
+{
+        struct kvrecs *recs;
+        size_t i, NUM_RECS;
+        int ret;
+        const unsigned char *value;
+        size_t vallen = 0;
+
+        NUM_RECS = 2048;
+
+        recs = xcalloc(NUM_RECS, sizeof(struct kvrecs));
+        for (i = 0; i < NUM_RECS; i++) {
+                char buf[32];
+
+                recs[i].klen = snprintf(buf, sizeof(buf), "key%05zu", i * 2);
+                recs[i].k = (unsigned char *)xstrdup(buf);
+                recs[i].vlen = snprintf(buf, sizeof(buf), "val%zu", i);
+                recs[i].v = (unsigned char *)xstrdup(buf);
+        }
+
+        add_pack_and_reopen(recs, NUM_RECS, MODE_CREATE | MODE_FENCEINDEX);
+
+        for (i = 0; i < NUM_RECS; i++) {
+                char buf[32];
+                size_t len;
+
+                ret = zsdb_fetch(db, recs[i].k, recs[i].klen,
+                                 &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(vallen, recs[i].vlen);
+                ck_assert_mem_eq(value, recs[i].v, vallen);
+
+                /* The keys in between aren't there */
+                len = snprintf(buf, sizeof(buf), "key%05zu", i * 2 + 1);
+                ret = zsdb_fetch(db, (const unsigned char *)buf, len,
+                                 &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_NOTFOUND);
+        }
+
+        record_count = 0;
+        ret = zsdb_foreach(db, (const unsigned char *)"key010", 6,
+                           NULL, count_fe_p, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, 50);
+
+        for (i = 0; i < NUM_RECS; i++) {
+                free((void *)recs[i].k);
+                free((void *)recs[i].v);
+        }
+        free(recs);
+}
+END_TEST
+
+/* Pack the even numbered keys made with `fmt`, reopen the db with `mode`,
+ * and look up all the keys.
+ */
+static void fetch_packed_with_mode(const char *fmt, int mode)
+{
+        struct kvrecs *recs;
+        size_t i, NUM_RECS;
+        int ret;
+        const unsigned char *value;
+        size_t vallen = 0;
+        const char *absent[] = { "a", "key", "key99999", "zzz" };
+
+        NUM_RECS = 10000;
+
+        recs = xcalloc(NUM_RECS, sizeof(struct kvrecs));
+        for (i = 0; i < NUM_RECS; i++) {
+                char buf[32];
+
+                recs[i].klen = snprintf(buf, sizeof(buf), fmt, i * 2);
+                recs[i].k = (unsigned char *)xstrdup(buf);
+                recs[i].vlen = snprintf(buf, sizeof(buf), "val%zu", i);
+                recs[i].v = (unsigned char *)xstrdup(buf);
+        }
+
+        add_pack_and_reopen(recs, NUM_RECS, mode);
+
+        for (i = 0; i < NUM_RECS; i++) {
+                char buf[32];
+                size_t len;
+
+                ret = zsdb_fetch(db, recs[i].k, recs[i].klen,
+                                 &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(vallen, recs[i].vlen);
+                ck_assert_mem_eq(value, recs[i].v, vallen);
+
+                /* The keys in between aren't there */
+                len = snprintf(buf, sizeof(buf), fmt, i * 2 + 1);
+                ret = zsdb_fetch(db, (const unsigned char *)buf, len,
+                                 &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_NOTFOUND);
+        }
+
+        for (i = 0; i < ARRAY_SIZE(absent); i++) {
+                ret = zsdb_fetch(db, (const unsigned char *)absent[i],
+                                 strlen(absent[i]), &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_NOTFOUND);
+        }
+
+        for (i = 0; i < NUM_RECS; i++) {
+                free((void *)recs[i].k);
+                free((void *)recs[i].v);
+        }
+        free(recs);
+}
+
+START_TEST(test_fetch_packed_eytzinger)
+{
+        fetch_packed_with_mode("key%05zu", MODE_CREATE | MODE_EYTZINGER);
+}
+END_TEST
+
+/* Keys of different lengths, some shorter than the prefix, and some with
+ * the same prefix */
+START_TEST(test_fetch_packed_keyprefix)
+{
+        fetch_packed_with_mode("user.%zu", MODE_CREATE | MODE_KEYPREFIX);
+}
+END_TEST
+
+START_TEST(test_fetchnext_packed)
+{
+        struct kvrecs *recs;
+        size_t i, NUM_RECS;
+        int ret;
+        const unsigned char *key, *found, *value;
+        size_t keylen, foundlen = 0, vallen = 0;
+
+        NUM_RECS = 1000;
+
+        recs = xcalloc(NUM_RECS, sizeof(struct kvrecs));
+        for (i = 0; i < NUM_RECS; i++) {
+                char buf[64];
+
+                recs[i].klen = snprintf(buf, sizeof(buf),
+                                        "user.folder.%05zu", i);
+                recs[i].k = (unsigned char *)xstrdup(buf);
+                recs[i].vlen = snprintf(buf, sizeof(buf), "val%zu", i);
+                recs[i].v = (unsigned char *)xstrdup(buf);
+        }
+
+        add_pack_and_reopen(recs, NUM_RECS, MODE_CREATE);
+
+        /* Walk all the records, passing the key that was found back in */
+        key = (const unsigned char *)"user";
+        keylen = strlen("user");
+        for (i = 0; i < NUM_RECS; i++) {
+                ret = zsdb_fetchnext(db, key, keylen, &found, &foundlen,
+                                     &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(foundlen, recs[i].klen);
+                ck_assert_mem_eq(found, recs[i].k, foundlen);
+                ck_assert_int_eq(vallen, recs[i].vlen);
+                ck_assert_mem_eq(value, recs[i].v, vallen);
+
+                key = found;
+                keylen = foundlen;
+        }
+
+        for (i = 0; i < NUM_RECS; i++) {
+                free((void *)recs[i].k);
+                free((void *)recs[i].v);
+        }
+        free(recs);
+}
+END_TEST
+
+#ifndef ZS_TESTDATA
+#define ZS_TESTDATA "data"
+#endif
+
+/* open_fixture():
+ * Replaces the db with a copy of the one in the test data directory
+ * `name`, and opens it with `mode`.
+ */
+static void open_fixture(const char *name, int mode)
+{
+        char dir[PATH_MAX], src[PATH_MAX], dst[PATH_MAX];
+        struct dirent *de;
+        DIR *d;
+        int ret;
+
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db);
+        recursive_rm(basedir);
+        ck_assert_int_eq(xmkdir(basedir, 0700), 0);
+
+        snprintf(dir, sizeof(dir), "%s/%s", ZS_TESTDATA, name);
+        d = opendir(dir);
+        ck_assert(d != NULL);
+
+        while ((de = readdir(d)) != NULL) {
+                char buf[4096];
+                FILE *in, *out;
+                size_t n;
+
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                        continue;
+
+                snprintf(src, sizeof(src), "%s/%s", dir, de->d_name);
+                snprintf(dst, sizeof(dst), "%s/%s", basedir, de->d_name);
+                in = fopen(src, "r");
+                ck_assert(in != NULL);
+                out = fopen(dst, "w");
+                ck_assert(out != NULL);
+                while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+                        ck_assert_int_eq(fwrite(buf, 1, n, out), n);
+                fclose(in);
+                fclose(out);
+        }
+
+        closedir(d);
+
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, mode);
+        ck_assert_int_eq(ret, ZS_OK);
+}
+
+/* tests/data/packed-v1 was written by a version of zeroskip that packed
+ * files in version 1 format, with pointers to the records. It has the keys
+ * "v1key0000", "v1key0002", ... "v1key0398", with the values "value of
+ * <key>", all in one packed file.
+ */
+START_TEST(test_fetch_packed_v1)
+{
+        const int modes[] = { MODE_RDWR, MODE_FENCEINDEX, MODE_EYTZINGER };
+        const char *absent[] = { "v1", "v1key0001", "v1key0199",
+                                 "v1key03980", "v1key0399", "w" };
+        const unsigned char *key, *found, *value;
+        size_t keylen, foundlen = 0, vallen = 0;
+        struct zsdb_txn *txn = NULL;
+        char buf[64], val[64];
+        size_t i, m;
+        int ret;
+
+        for (m = 0; m < ARRAY_SIZE(modes); m++) {
+                open_fixture("packed-v1", modes[m]);
+
+                for (i = 0; i < 400; i += 2) {
+                        keylen = snprintf(buf, sizeof(buf), "v1key%04zu", i);
+                        snprintf(val, sizeof(val), "value of %s", buf);
+                        ret = zsdb_fetch(db, (const unsigned char *)buf,
+                                         keylen, &value, &vallen, NULL);
+                        ck_assert_int_eq(ret, ZS_OK);
+                        ck_assert_int_eq(vallen, strlen(val));
+                        ck_assert_mem_eq(value, val, vallen);
+                }
+
+                for (i = 0; i < ARRAY_SIZE(absent); i++) {
+                        ret = zsdb_fetch(db, (const unsigned char *)absent[i],
+                                         strlen(absent[i]), &value, &vallen,
+                                         NULL);
+                        ck_assert_int_eq(ret, ZS_NOTFOUND);
+                }
+
+                /* Walk all the records, passing the key that was found
+                   back in */
+                key = (const unsigned char *)"v1";
+                keylen = 2;
+                for (i = 0; i < 400; i += 2) {
+                        ret = zsdb_fetchnext(db, key, keylen, &found,
+                                             &foundlen, &value, &vallen,
+                                             NULL);
+                        ck_assert_int_eq(ret, ZS_OK);
+                        snprintf(buf, sizeof(buf), "v1key%04zu", i);
+                        ck_assert_int_eq(foundlen, strlen(buf));
+                        ck_assert_mem_eq(found, buf, foundlen);
+
+                        key = found;
+                        keylen = foundlen;
+                }
+                ret = zsdb_fetchnext(db, key, keylen, &found, &foundlen,
+                                     &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_NOTFOUND);
+
+                /* From a key that isn't there */
+                ret = zsdb_fetchnext(db, (const unsigned char *)"v1key0199",
+                                     9, &found, &foundlen, &value, &vallen,
+                                     NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(foundlen, 9);
+                ck_assert_mem_eq(found, "v1key0200", foundlen);
+
+                record_count = 0;
+                ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL,
+                                   &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(record_count, 200);
+
+                record_count = 0;
+                ret = zsdb_foreach(db, (const unsigned char *)"v1key01", 7,
+                                   count_fe_p, NULL, NULL, &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(record_count, 50);
+        }
+}
+END_TEST
+
+START_TEST(test_fetch_multi)
+{
+        struct kvrecs *recs;
+        size_t i, NUM_RECS, NUM_KEYS;
+        int ret;
+        const unsigned char **keys, **values;
+        size_t *keylens, *vallens;
+        int *rc;
+        struct zsdb_txn *txn = NULL;
+
+        NUM_RECS = 1000;
+        NUM_KEYS = 1500;
+
+        recs = xcalloc(NUM_RECS, sizeof(struct kvrecs));
+        for (i = 0; i < NUM_RECS; i++) {
+                char buf[64];
+
+                recs[i].klen = snprintf(buf, sizeof(buf),
+                                        "user.folder.%05zu", i);
+                recs[i].k = (unsigned char *)xstrdup(buf);
+                recs[i].vlen = snprintf(buf, sizeof(buf), "val%zu", i);
+                recs[i].v = (unsigned char *)xstrdup(buf);
+        }
+
+        add_pack_and_reopen(recs, NUM_RECS, MODE_CREATE);
+
+        /* Some of the keys are in the active records */
+        ret = zsdb_transaction_begin(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_acquire(db, 0);
+
+        ret = zsdb_add(db, recs[500].k, recs[500].klen,
+                       (const unsigned char *)"new", 3, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_add(db, (const unsigned char *)"user.folder.zzz", 15,
+                       (const unsigned char *)"zzz", 3, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        zsdb_commit(db, &txn);
+        zsdb_write_lock_release(db);
+        zsdb_transaction_end(&txn);
+
+        /* Look up the packed keys out of order, along with keys that
+         * aren't there, and a few that are asked for twice */
+        keys = xcalloc(NUM_KEYS + 2, sizeof(unsigned char *));
+        keylens = xcalloc(NUM_KEYS + 2, sizeof(size_t));
+        values = xcalloc(NUM_KEYS + 2, sizeof(unsigned char *));
+        vallens = xcalloc(NUM_KEYS + 2, sizeof(size_t));
+        rc = xcalloc(NUM_KEYS + 2, sizeof(int));
+        for (i = 0; i < NUM_KEYS; i++) {
+                size_t j = (i * 7919) % NUM_KEYS;
+                char buf[64];
+
+                if (j < NUM_RECS)
+                        keylens[i] = snprintf(buf, sizeof(buf),
+                                              "user.folder.%05zu", j);
+                else
+                        keylens[i] = snprintf(buf, sizeof(buf),
+                                              "user.folder.%05zu.none",
+                                              (j - NUM_RECS) * 2);
+                keys[i] = (unsigned char *)xstrdup(buf);
+        }
+        keys[NUM_KEYS] = (unsigned char *)xstrdup("user.folder.zzz");
+        keylens[NUM_KEYS] = 15;
+        keys[NUM_KEYS + 1] = (unsigned char *)xstrdup((char *)keys[0]);
+        keylens[NUM_KEYS + 1] = keylens[0];
+
+        ret = zsdb_fetch_multi(db, keys, keylens, NUM_KEYS + 2,
+                               values, vallens, rc, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* The results are the same as looking up the keys one by one */
+        for (i = 0; i < NUM_KEYS + 2; i++) {
+                const unsigned char *value = NULL;
+                size_t vallen = 0;
+
+                ret = zsdb_fetch(db, keys[i], keylens[i], &value, &vallen,
+                                 NULL);
+                ck_assert_int_eq(rc[i], ret);
+                if (ret == ZS_OK) {
+                        ck_assert_int_eq(vallens[i], vallen);
+                        ck_assert_mem_eq(values[i], value, vallen);
+                }
+        }
+
+        ck_assert_int_eq(rc[NUM_KEYS], ZS_OK);
+        ck_assert_mem_eq(values[NUM_KEYS], "zzz", 3);
+
+        for (i = 0; i < NUM_KEYS + 2; i++)
+                free((void *)keys[i]);
+        free(keys);
+        free(keylens);
+        free(values);
+        free(vallens);
+        free(rc);
+
+        for (i = 0; i < NUM_RECS; i++) {
+                free((void *)recs[i].k);
+                free((void *)recs[i].v);
+        }
+        free(recs);
+}
+END_TEST
+
+START_TEST(test_fetch_packed_cache)
+{
+        size_t i;
+        int ret;
+        const unsigned char *value;
+        size_t vallen = 0;
+        struct zsdb_cache_stats stats;
+        struct zsdb_txn *txn = NULL;
+
+        add_pack_and_reopen(kvrecsgen, ARRAY_SIZE(kvrecsgen), MODE_CREATE);
+
+        ret = zsdb_cache_set_size(db, 64 * 1024);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* The first round fills the cache, the second one hits it */
+        for (i = 0; i < 2 * ARRAY_SIZE(kvrecsgen); i++) {
+                size_t j = i % ARRAY_SIZE(kvrecsgen);
+
+                ret = zsdb_fetch(db, kvrecsgen[j].k, kvrecsgen[j].klen,
+                                 &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(vallen, kvrecsgen[j].vlen);
+                ck_assert_mem_eq(value, kvrecsgen[j].v, vallen);
+        }
+
+        for (i = 0; i < 2; i++) {
+                ret = zsdb_fetch(db, (const unsigned char *)"cherry", 6,
+                                 &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_NOTFOUND);
+        }
+
+        ret = zsdb_cache_stats(db, &stats);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(stats.misses, ARRAY_SIZE(kvrecsgen) + 1);
+        ck_assert_int_eq(stats.hits, ARRAY_SIZE(kvrecsgen) + 1);
+        ck_assert_int_eq(stats.entries, ARRAY_SIZE(kvrecsgen) + 1);
+
+        /* Changes to a key drop it from the cache */
+        ret = zsdb_transaction_begin(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_acquire(db, 0);
+
+        ret = zsdb_add(db, (const unsigned char *)"cherry", 6,
+                       (const unsigned char *)"red", 3, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_remove(db, kvrecsgen[0].k, kvrecsgen[0].klen, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        zsdb_commit(db, &txn);
+        zsdb_write_lock_release(db);
+        zsdb_transaction_end(&txn);
+
+        ret = zsdb_fetch(db, (const unsigned char *)"cherry", 6,
+                         &value, &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_mem_eq(value, "red", vallen);
+
+        /* Both the keys were dropped from the cache */
+        ret = zsdb_cache_stats(db, &stats);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(stats.entries, ARRAY_SIZE(kvrecsgen) - 1);
+
+        /* Shrinking the cache drops entries */
+        ret = zsdb_cache_set_size(db, stats.size / 2);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_cache_stats(db, &stats);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert(stats.size <= stats.maxsize);
+        ck_assert(stats.entries < ARRAY_SIZE(kvrecsgen) - 1);
+}
+END_TEST
+
+START_TEST(test_foreach_packed_prefix)
+{
+        int ret;
+
+        add_pack_and_reopen(kvrecsgen, ARRAY_SIZE(kvrecsgen), MODE_CREATE);
+
+        /* Prefix within the range of keys in the packed file */
+        record_count = 0;
+        ret = zsdb_foreach(db, (const unsigned char *)"abc", 3,
+                           NULL, count_fe_p, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, 5);
+
+        /* Prefixes before and after all the keys in the packed file */
+        record_count = 0;
+        ret = zsdb_foreach(db, (const unsigned char *)"0", 1,
+                           NULL, count_fe_p, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, 0);
+
+        record_count = 0;
+        ret = zsdb_foreach(db, (const unsigned char *)"zzz", 3,
+                           NULL, count_fe_p, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, 0);
+}
+END_TEST
+
+/* Reopens the db with its records in memory in an adaptive radix tree */
+static void reopen_db_art(int mode)
+{
+        int ret;
+
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db);
+
+        ret = zsdb_init_opt(&db, NULL, NULL, MEMTABLE_ART);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, mode);
+        ck_assert_int_eq(ret, ZS_OK);
+}
+
+START_TEST(test_art_memtable)
+{
+        struct zsdb *db2 = NULL;
+        struct kvrecs *recs;
+        size_t i, k, NUM_RECS, pass;
+        int ret;
+        const unsigned char *key, *found, *value;
+        size_t keylen, foundlen = 0, vallen = 0;
+
+        /* It only has the raw order */
+        ret = zsdb_init_opt(&db2, NULL, memtree_memcmp_natural, MEMTABLE_ART);
+        ck_assert_int_eq(ret, ZS_INVALID_MODE);
+        ck_assert(db2 == NULL);
+
+        reopen_db_art(MODE_RDWR);
+
+        NUM_RECS = 500;
+
+        recs = xcalloc(NUM_RECS, sizeof(struct kvrecs));
+        for (i = 0; i < NUM_RECS; i++) {
+                char buf[64];
+
+                recs[i].klen = snprintf(buf, sizeof(buf),
+                                        "example.org!user.u%02zu.INBOX.%03zu",
+                                        i / 10, i % 10 * 37);
+                recs[i].k = (unsigned char *)xstrdup(buf);
+                recs[i].vlen = snprintf(buf, sizeof(buf), "val%zu", i);
+                recs[i].v = (unsigned char *)xstrdup(buf);
+        }
+
+        /* Half of the records in a finalised file, and half active */
+        zsdb_write_lock_acquire(db, 0);
+        for (i = 0; i < NUM_RECS; i++) {
+                k = (i * 7919) % NUM_RECS;
+                ret = zsdb_add(db, recs[k].k, recs[k].klen,
+                               recs[k].v, recs[k].vlen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                if (i == NUM_RECS / 2) {
+                        ret = zsdb_commit(db, NULL);
+                        ck_assert_int_eq(ret, ZS_OK);
+                        ret = zsdb_finalise(db);
+                        ck_assert_int_eq(ret, ZS_OK);
+                }
+        }
+        ret = zsdb_commit(db, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+
+        /* Before and after they are read back in */
+        for (pass = 0; pass < 2; pass++) {
+                for (i = 0; i < NUM_RECS; i++) {
+                        ret = zsdb_fetch(db, recs[i].k, recs[i].klen,
+                                         &value, &vallen, NULL);
+                        ck_assert_int_eq(ret, ZS_OK);
+                        ck_assert_int_eq(vallen, recs[i].vlen);
+                        ck_assert_mem_eq(value, recs[i].v, vallen);
+                }
+
+                key = (const unsigned char *)"example.org";
+                keylen = strlen("example.org");
+                for (i = 0; i < NUM_RECS; i++) {
+                        ret = zsdb_fetchnext(db, key, keylen, &found,
+                                             &foundlen, &value, &vallen,
+                                             NULL);
+                        ck_assert_int_eq(ret, ZS_OK);
+                        ck_assert_int_eq(foundlen, recs[i].klen);
+                        ck_assert_mem_eq(found, recs[i].k, foundlen);
+
+                        key = found;
+                        keylen = foundlen;
+                }
+
+                record_count = 0;
+                ret = zsdb_foreach(db, (const unsigned char *)
+                                   "example.org!user.u1", 19,
+                                   NULL, count_fe_p, NULL, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(record_count, 100);
+
+                reopen_db_art(MODE_RDWR);
+        }
+
+        for (i = 0; i < NUM_RECS; i++) {
+                free((void *)recs[i].k);
+                free((void *)recs[i].v);
+        }
+        free(recs);
+}
+END_TEST
+
 Suite *zsdb_suite(void)
 {
         Suite *s;
@@ -819,6 +2507,17 @@ Suite *zsdb_suite(void)
         tcase_add_test(tc_core, test_abort_transaction);
         tcase_add_test(tc_core, test_delete);
         tcase_add_test(tc_core, test_multiopen);
+        tcase_add_test(tc_core, test_preallocation);
+        tcase_add_test(tc_core, test_finalise_threshold);
+        tcase_add_test(tc_core, test_write_batch);
+        tcase_add_test(tc_core, test_write_batch_custom_cmp);
+        tcase_add_test(tc_core, test_fast_commit);
+        tcase_add_test(tc_core, test_generation);
+        tcase_add_test(tc_core, test_group_commit);
+        tcase_add_test(tc_core, test_group_commit_shared);
+        tcase_add_test(tc_core, test_sync_levels);
+        tcase_add_test(tc_core, test_pwrite_writes);
+        tcase_add_test(tc_core, test_art_memtable);
         suite_add_tcase(s, tc_core);
 
         /* foreach */
@@ -828,6 +2527,7 @@ Suite *zsdb_suite(void)
         tcase_add_test(tc_foreach, test_foreach_changes);
         tcase_add_test(tc_foreach, test_foreach_count);
         tcase_add_test(tc_foreach, test_foreach_heirarchy);
+        tcase_add_test(tc_foreach, test_foreach_packed_prefix);
         suite_add_tcase(s, tc_foreach);
 
         /* fetch */
@@ -835,6 +2535,16 @@ Suite *zsdb_suite(void)
         tcase_add_checked_fixture(tc_fetch, setup, teardown);
 
         tcase_add_test(tc_fetch, test_fetchnext_simple);
+        tcase_add_test(tc_fetch, test_fetch_packed);
+        tcase_add_test(tc_fetch, test_fetch_packed_bloom);
+        tcase_add_test(tc_fetch, test_fetch_packed_nocase);
+        tcase_add_test(tc_fetch, test_fetch_packed_fence_index);
+        tcase_add_test(tc_fetch, test_fetch_packed_eytzinger);
+        tcase_add_test(tc_fetch, test_fetch_packed_keyprefix);
+        tcase_add_test(tc_fetch, test_fetchnext_packed);
+        tcase_add_test(tc_fetch, test_fetch_packed_v1);
+        tcase_add_test(tc_fetch, test_fetch_packed_cache);
+        tcase_add_test(tc_fetch, test_fetch_multi);
         suite_add_tcase(s, tc_fetch);
 
         /* many records */
@@ -11,6 +11,7 @@
 #define _UNIT_H_
 
 extern Suite *memtree_suite(void);
+extern Suite *memtable_suite(void);
 extern Suite *vecu64_suite(void);
 extern Suite *zsdb_suite(void);
 extern Suite *strarr_suite(void);